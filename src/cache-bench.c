@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Hit rate of the answer cache against its size, on a replayed query
+ * trace (a name and optionally a query type per line) or on a synthetic
+ * one: names drawn from a Zipf distribution, mixed with names that are
+ * asked for only once.  With -t, the lookup rate on the filled cache of
+ * the last size is measured for 1, 2, 4, ... up to the given number of
+ * threads, each replaying the trace.  Build with "make cache-bench".
+ */
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_STUBBY_THREADS
+#include <pthread.h>
+#endif
+
+#include "cache.h"
+#include "memory.h"
+
+#define DEFAULT_QUERIES   1000000
+#define DEFAULT_NAMES     100000
+#define DEFAULT_ZIPF      0.9
+#define DEFAULT_ONCE      0.3
+#define DEFAULT_SIZES     "256,1024,4096,16384"
+#define MAX_NAME          255
+
+typedef struct query {
+	uint16_t qtype;
+	uint8_t  qname_len;
+	uint8_t  qname[MAX_NAME];
+} query;
+
+static query *queries = NULL;
+static size_t n_queries = 0;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* Text name to wire format.  Returns the length, or 0 when invalid */
+static size_t name2wire(uint8_t *wire, const char *name, size_t len)
+{
+	size_t pos = 0, label;
+
+	while (len && name[len - 1] == '.')
+		len--;
+	while (len) {
+		for (label = 0; label < len && name[label] != '.'; label++)
+			; /* pass */
+		if (!label || label > 63 || pos + label + 2 > MAX_NAME)
+			return 0;
+		wire[pos++] = (uint8_t)label;
+		(void) memcpy(wire + pos, name, label);
+		pos += label;
+		name += label;
+		len -= label;
+		if (len) {
+			name++;
+			len--;
+		}
+	}
+	wire[pos++] = 0;
+	return pos;
+}
+
+static void synthetic_name(query *q, uint64_t n, const char *domain)
+{
+	char name[64];
+	int len = snprintf(name, sizeof(name), "n%"PRIx64".%s", n, domain);
+
+	q->qname_len = (uint8_t)name2wire(q->qname, name, (size_t)len);
+	q->qtype = n & 1 ? GETDNS_RRTYPE_AAAA : GETDNS_RRTYPE_A;
+}
+
+static query *read_trace(const char *fn, size_t *n_queries)
+{
+	char line[1024];
+	size_t n = 0, size = 0, len;
+	query *queries = NULL, *q;
+	FILE *fh;
+	char *pos;
+
+	if (!(fh = fopen(fn, "r"))) {
+		perror(fn);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fh)) {
+		if ((pos = strchr(line, '#')))
+			*pos = 0;
+		pos = line + strspn(line, " \t\r\n");
+		if (!(len = strcspn(pos, " \t\r\n")))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 65536;
+			if (!(q = realloc(queries, size * sizeof(query)))) {
+				free(queries);
+				fclose(fh);
+				return NULL;
+			}
+			queries = q;
+		}
+		q = &queries[n];
+		if (!(q->qname_len = (uint8_t)name2wire(q->qname, pos, len)))
+			continue;
+		pos += len;
+		pos += strspn(pos, " \t");
+		q->qtype = !strncmp(pos, "AAAA", 4) ? GETDNS_RRTYPE_AAAA
+		         : *pos >= '0' && *pos <= '9' ? (uint16_t)atoi(pos)
+		         : GETDNS_RRTYPE_A;
+		n++;
+	}
+	fclose(fh);
+	*n_queries = n;
+	return queries;
+}
+
+static query *synthetic_trace(size_t n, size_t n_names, double s,
+    double once)
+{
+	double *cdf, sum = 0;
+	query *queries;
+	size_t i, lo, hi;
+	uint64_t next_once = 0;
+
+	if (!(queries = malloc(n * sizeof(query)))
+	||  !(cdf = malloc(n_names * sizeof(double)))) {
+		free(queries);
+		return NULL;
+	}
+	for (i = 0; i < n_names; i++)
+		cdf[i] = (sum += 1.0 / pow((double)(i + 1), s));
+	for (i = 0; i < n; i++) {
+		double u = (double)(rng() >> 11) / 9007199254740992.0;
+
+		if (u < once) {
+			synthetic_name(&queries[i], next_once++, "once.example");
+			continue;
+		}
+		u = (double)(rng() >> 11) / 9007199254740992.0 * sum;
+		for (lo = 0, hi = n_names - 1; lo < hi; ) {
+			size_t mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		synthetic_name(&queries[i], lo, "zipf.example");
+	}
+	free(cdf);
+	return queries;
+}
+
+/* An answer with a single address record */
+static size_t make_response(uint8_t *wire, const query *q)
+{
+	size_t pos = 12, rdlen = q->qtype == GETDNS_RRTYPE_AAAA ? 16 : 4;
+
+	(void) memset(wire, 0, 12);
+	wire[2] = 0x81;
+	wire[3] = 0x80;
+	wire[5] = 1;
+	wire[7] = 1;
+	(void) memcpy(wire + pos, q->qname, q->qname_len);
+	pos += q->qname_len;
+	gldns_write_uint16(wire + pos, q->qtype);
+	gldns_write_uint16(wire + pos + 2, GETDNS_RRCLASS_IN);
+	pos += 4;
+	wire[pos++] = 0xC0;
+	wire[pos++] = 12;
+	gldns_write_uint16(wire + pos, q->qtype);
+	gldns_write_uint16(wire + pos + 2, GETDNS_RRCLASS_IN);
+	gldns_write_uint32(wire + pos + 4, 86400);
+	gldns_write_uint16(wire + pos + 8, (uint16_t)rdlen);
+	pos += 10;
+	(void) memset(wire + pos, 0x2A, rdlen);
+	return pos + rdlen;
+}
+
+#ifdef HAVE_STUBBY_THREADS
+static void *lookup_thread(void *arg)
+{
+	uint8_t wire[65535];
+	size_t i, hits = 0;
+
+	for (i = 0; i < n_queries; i++)
+		if (stubby_cache_lookup(queries[i].qname, queries[i].qname_len,
+		    queries[i].qtype, GETDNS_RRCLASS_IN, 0, wire, sizeof(wire)))
+			hits++;
+	*(size_t *)arg = hits;
+	return NULL;
+}
+
+static void lookup_rates(size_t max_threads)
+{
+	pthread_t *threads;
+	size_t *hits, n, i, started;
+	struct timespec start, stop;
+	double elapsed, rate, single = 0;
+
+	if (!(threads = calloc(max_threads, sizeof(pthread_t)))
+	||  !(hits = calloc(max_threads, sizeof(size_t)))) {
+		free(threads);
+		return;
+	}
+	printf("\n%12s %14s %8s\n", "threads", "lookups/s", "speedup");
+	for (n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		(void) clock_gettime(CLOCK_MONOTONIC, &start);
+		for (started = 0; started < n; started++)
+			if (pthread_create(&threads[started], NULL,
+			    lookup_thread, &hits[started]))
+				break;
+		for (i = 0; i < started; i++)
+			(void) pthread_join(threads[i], NULL);
+		(void) clock_gettime(CLOCK_MONOTONIC, &stop);
+		if (started < n) {
+			fprintf(stderr, "Could not start %u threads\n",
+			    (unsigned)n);
+			break;
+		}
+		elapsed = (double)(stop.tv_sec - start.tv_sec)
+		        + (double)(stop.tv_nsec - start.tv_nsec) / 1e9;
+		rate = (double)(n * n_queries) / elapsed;
+		if (n == 1)
+			single = rate;
+		printf("%12u %14.0f %7.2fx\n", (unsigned)n, rate,
+		    single ? rate / single : 0.0);
+		if (n == max_threads)
+			break;
+	}
+	free(hits);
+	free(threads);
+}
+#endif
+
+static void print_usage(FILE *out, const char *progname)
+{
+	fprintf(out, "usage: %s [<option> ...] [<trace file>]\n", progname);
+	fprintf(out, "\t-n <queries>\tsynthetic trace length (default %d)\n",
+	    DEFAULT_QUERIES);
+	fprintf(out, "\t-u <names>\tnames in the Zipf distribution "
+	    "(default %d)\n", DEFAULT_NAMES);
+	fprintf(out, "\t-z <exponent>\tZipf exponent (default %.1f)\n",
+	    DEFAULT_ZIPF);
+	fprintf(out, "\t-o <fraction>\tfraction of names asked for once "
+	    "(default %.1f)\n", DEFAULT_ONCE);
+	fprintf(out, "\t-s <KiB,...>\tcache sizes (default %s)\n",
+	    DEFAULT_SIZES);
+	fprintf(out, "\t-c <shards>\tcache shards\n");
+#ifdef HAVE_STUBBY_THREADS
+	fprintf(out, "\t-t <threads>\tmeasure the lookup rate with up to "
+	    "<threads> threads\n");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = DEFAULT_QUERIES, n_names = DEFAULT_NAMES, i, len;
+	size_t max_threads = 0, n_shards = 0;
+	double zipf = DEFAULT_ZIPF, once = DEFAULT_ONCE;
+	const char *sizes = DEFAULT_SIZES;
+	uint8_t wire[65535], response[MAX_NAME + 64];
+	getdns_dict *config;
+	uint64_t hits;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:u:z:o:s:c:t:h")) != -1) {
+		switch (opt) {
+		case 'n': n = strtoul(optarg, NULL, 10); break;
+		case 'u': n_names = strtoul(optarg, NULL, 10); break;
+		case 'z': zipf = atof(optarg); break;
+		case 'o': once = atof(optarg); break;
+		case 's': sizes = optarg; break;
+		case 'c': n_shards = strtoul(optarg, NULL, 10); break;
+		case 't': max_threads = strtoul(optarg, NULL, 10); break;
+		case 'h': print_usage(stdout, argv[0]);
+		          return EXIT_SUCCESS;
+		default : print_usage(stderr, argv[0]);
+		          return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		queries = read_trace(argv[optind], &n);
+	else if (n && n_names)
+		queries = synthetic_trace(n, n_names, zipf, once);
+	else {
+		print_usage(stderr, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!queries || !(config = getdns_dict_create())
+	||  (n_shards && getdns_dict_set_int(config, "shards",
+	    (uint32_t)n_shards)))
+		return EXIT_FAILURE;
+	n_queries = n;
+
+	printf("%12s %10s %10s %8s\n", "max_bytes", "entries", "hits",
+	    "hit rate");
+	for (end = (char *)sizes; *end; ) {
+		uint32_t kib = (uint32_t)strtoul(end, &end, 10);
+
+		if (*end == ',')
+			end++;
+		if (getdns_dict_set_int(config, "max_bytes", kib * 1024)
+		||  stubby_cache_config(config))
+			return EXIT_FAILURE;
+		for (i = 0, hits = 0; i < n; i++) {
+			const query *q = &queries[i];
+
+			if (stubby_cache_lookup(q->qname, q->qname_len,
+			    q->qtype, GETDNS_RRCLASS_IN, 0, wire, sizeof(wire))) {
+				hits++;
+				continue;
+			}
+			len = make_response(response, q);
+			stubby_cache_store(q->qname, q->qname_len, q->qtype,
+			    GETDNS_RRCLASS_IN, 0, response, len);
+		}
+		printf("%12u %10u %10"PRIu64" %7.2f%%\n", kib * 1024,
+		    (unsigned)stubby_cache_entries(), hits,
+		    n ? 100.0 * (double)hits / (double)n : 0.0);
+	}
+#ifdef HAVE_STUBBY_THREADS
+	if (max_threads)
+		lookup_rates(max_threads);
+#endif
+	getdns_dict_destroy(config);
+	free(queries);
+	return EXIT_SUCCESS;
+}
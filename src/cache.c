@@ -0,0 +1,1716 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "cache.h"
+#include "log.h"
+#include "memory.h"
+#include "qname.h"
+#include "shmcache.h"
+#include "snapshot.h"
+
+#define CACHE_HEADER_LEN        32
+#define CACHE_RECORD_LEN        24
+#define CACHE_MAX_QNAME         255
+#define CACHE_DEFAULT_BYTES     (8 * 1024 * 1024)
+#define CACHE_MIN_BYTES         (64 * 1024)
+#define CACHE_DEFAULT_SHARDS    8
+#define CACHE_MAX_SHARDS        256
+#define CACHE_DEFAULT_INTERVAL  300
+#define CACHE_DEFAULT_MAX_TTL   86400
+#define CACHE_MAX_TTL_NAME      1024  /* Of names in cache_ttl_overrides */
+#define CACHE_LINE              64
+#define CACHE_MAX_TTLS          ((65535 - 12) / 11) /* Records in a message */
+
+/* The hash tables and the frequency sketches are sized for answers of
+ * this size, which is about the smallest an answer takes.
+ */
+#define CACHE_ENTRY_ESTIMATE    256
+#define CACHE_WINDOW_PERCENT    1
+#define SKETCH_DEPTH            4
+#define SKETCH_SAMPLE_FACTOR    10
+#define SKETCH_HIT_SAMPLE       4
+
+#define CACHE_WINDOW            1
+#define CACHE_MAIN              2
+
+struct cache_entry;
+
+/* Lookups do not lock: they walk the hash chains, which are only changed
+ * with release stores under the lock of the shard, and entries removed
+ * from the chains are only freed when no lookup can still see them
+ * (epoch based reclamation).  Without threads all this reduces to plain
+ * memory accesses.
+ */
+#ifdef HAVE_STUBBY_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+typedef _Atomic(struct cache_entry *) cache_ptr;
+typedef atomic_uint_fast64_t cache_count;
+typedef atomic_uchar cache_flag;
+#define CACHE_LOAD(p)         atomic_load_explicit(p, memory_order_acquire)
+#define CACHE_STORE(p, v)     atomic_store_explicit(p, v, memory_order_release)
+#define CACHE_GET(p)          atomic_load_explicit(p, memory_order_relaxed)
+#define CACHE_SET(p, v)       atomic_store_explicit(p, v, memory_order_relaxed)
+#define CACHE_INC(p)          atomic_fetch_add_explicit( \
+                              p, 1, memory_order_relaxed)
+#define CACHE_ADD(p, n)       atomic_fetch_add_explicit( \
+                              p, n, memory_order_relaxed)
+#define CACHE_SUB(p, n)       atomic_fetch_sub_explicit( \
+                              p, n, memory_order_relaxed)
+#define CACHE_CAS(p, e, v)    atomic_compare_exchange_weak_explicit(p, e, v, \
+                              memory_order_relaxed, memory_order_relaxed)
+typedef pthread_mutex_t cache_lock;
+#define CACHE_LOCK_INIT(l)    (void) pthread_mutex_init(l, NULL)
+#define CACHE_LOCK_DESTROY(l) (void) pthread_mutex_destroy(l)
+#define CACHE_LOCK(l)         (void) pthread_mutex_lock(l)
+#define CACHE_UNLOCK(l)       (void) pthread_mutex_unlock(l)
+#else
+typedef struct cache_entry *cache_ptr;
+typedef uint64_t cache_count;
+typedef uint8_t cache_flag;
+#define CACHE_LOAD(p)         (*(p))
+#define CACHE_STORE(p, v)     (*(p) = (v))
+#define CACHE_GET(p)          (*(p))
+#define CACHE_SET(p, v)       (*(p) = (v))
+#define CACHE_INC(p)          ((*(p))++)
+#define CACHE_ADD(p, n)       (((*(p)) += (n)) - (n))
+#define CACHE_SUB(p, n)       ((*(p)) -= (n))
+#define CACHE_CAS(p, e, v)    (*(p) = (v), 1)
+typedef int cache_lock;
+#define CACHE_LOCK_INIT(l)    ((void)(l))
+#define CACHE_LOCK_DESTROY(l) ((void)(l))
+#define CACHE_LOCK(l)         ((void)(l))
+#define CACHE_UNLOCK(l)       ((void)(l))
+#endif
+/* For counters only changed by one thread: no read-modify-write needed */
+#define CACHE_OWN_INC(p)      CACHE_SET(p, CACHE_GET(p) + 1)
+
+typedef struct cache_entry {
+	cache_ptr           next;      /* In the hash bucket */
+	struct cache_entry *q_prev;    /* In the queue of its region */
+	struct cache_entry *q_next;    /* or in the list of retired entries */
+	uint64_t            hash;
+	int64_t             stored;    /* UNIX time */
+	int64_t             expires;
+#ifdef HAVE_STUBBY_THREADS
+	uint64_t            retired;   /* The epoch it was removed in */
+#endif
+	uint16_t            qtype;
+	uint16_t            qclass;
+	uint8_t             flags;
+	uint8_t             qname_len;
+	uint16_t            response_len;
+	uint16_t            n_ttls;
+	uint8_t             region;    /* CACHE_WINDOW, CACHE_MAIN or 0 */
+	cache_flag          referenced;
+	uint8_t             data[];    /* Lower case qname, the response, and
+	                                * the offsets of its TTLs (n_ttls)
+	                                */
+} cache_entry;
+
+/* A circular queue, from the oldest entry at hand */
+typedef struct cache_queue {
+	cache_entry *hand;
+	size_t       bytes;
+	size_t       max_bytes;
+} cache_queue;
+
+/* The cache is divided over shards by key hash.  Each has its own hash
+ * table, regions, sketch and counters, and a lock for changing them.
+ * The hit and miss counters are kept per thread, with the reader slots.
+ */
+typedef struct cache_shard {
+	cache_lock   lock;
+	cache_ptr   *buckets;
+	size_t       n_buckets;    /* A power of two */
+	size_t       n_entries;
+	cache_queue  window_q;     /* New answers, first in first out */
+	cache_queue  main_q;       /* Admitted answers, swept by CLOCK */
+	cache_entry *retired;      /* Waiting for lookups to finish */
+	/* Count-min sketch of SKETCH_DEPTH rows of 4 bit counters */
+	cache_count *sketch;
+	size_t       sketch_mask;  /* Counters per row - 1 */
+	size_t       sketch_sample;
+	uint64_t     evictions;
+	uint64_t     rejections;
+	/* Changed by lookups, so not on the line with what they only read */
+	_Alignas(CACHE_LINE) cache_count sketch_added;
+} cache_shard;
+
+static int enabled = 0;
+static size_t max_bytes = CACHE_DEFAULT_BYTES;
+static size_t n_shards = CACHE_DEFAULT_SHARDS;
+static char *snapshot_file = NULL;
+static uint32_t snapshot_interval = CACHE_DEFAULT_INTERVAL;
+
+/* Shards start on a cache line of their own, shard_stride bytes apart */
+static uint8_t *shards = NULL;
+static size_t shard_stride = 0;
+static int filled = 0;
+static int shared = 0;  /* In shared memory instead of the shards */
+
+/* The TTL bounds of the answers for name and the names below it */
+typedef struct cache_ttl_bounds {
+	uint8_t  name[CACHE_MAX_QNAME];  /* Lower case */
+	size_t   name_len;
+	uint32_t min_ttl;
+	uint32_t max_ttl;
+} cache_ttl_bounds;
+
+static uint32_t min_ttl = 0;
+static uint32_t max_ttl = CACHE_DEFAULT_MAX_TTL;
+static cache_ttl_bounds *ttl_overrides = NULL;
+static size_t n_ttl_overrides = 0;
+static int ttl_clamped = 0;  /* Also in the answers that are served */
+
+static getdns_eventloop *loop = NULL;
+static getdns_eventloop_event snapshot_event;
+
+static inline cache_shard *shard_at(size_t i)
+{
+	return (cache_shard *)(shards + i * shard_stride);
+}
+
+static inline cache_shard *shard_of(uint64_t hash)
+{
+	return shard_at((size_t)(hash >> 32) & (n_shards - 1));
+}
+
+/* Memory starting on a cache line of its own, so that a lookup setting
+ * the referenced bit of one entry does not invalidate the line holding
+ * another.  The offset to the allocation is in the byte before.
+ */
+static void *cache_line_alloc(size_t size)
+{
+	uint8_t *raw, *ptr;
+
+	if (!(raw = stubby_mem_malloc(STUBBY_MEM_CACHE, size + CACHE_LINE)))
+		return NULL;
+	ptr = (uint8_t *)(((uintptr_t)raw + CACHE_LINE)
+	    & ~(uintptr_t)(CACHE_LINE - 1));
+	ptr[-1] = (uint8_t)(ptr - raw);
+	return ptr;
+}
+
+static void cache_line_free(void *ptr)
+{
+	if (ptr)
+		stubby_mem_free(STUBBY_MEM_CACHE,
+		    (uint8_t *)ptr - ((uint8_t *)ptr)[-1]);
+}
+
+#ifdef HAVE_STUBBY_THREADS
+#define CACHE_MAX_READERS 128
+
+/* A thread doing lookups takes a reader slot for its lifetime, which
+ * also holds its hit and miss counters.  The slot is given back when the
+ * thread exits, and the counters stay for the next thread taking it.
+ */
+typedef struct cache_reader {
+	_Alignas(CACHE_LINE) atomic_uint_fast64_t epoch; /* 0 when idle */
+	atomic_int  in_use;
+	unsigned    hit_sample;
+	cache_count hits;
+	cache_count misses;
+} cache_reader;
+
+static cache_reader readers[CACHE_MAX_READERS];
+static cache_reader no_reader;  /* Counters of lookups without a slot */
+static atomic_uint_fast64_t global_epoch = 1;
+static _Thread_local cache_reader *reader = NULL;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static int reader_key_ok = 0;
+
+static void reader_release(void *arg)
+{
+	cache_reader *r = arg;
+
+	atomic_store(&r->epoch, 0);
+	atomic_store(&r->in_use, 0);
+}
+
+static void reader_key_create(void)
+{
+	reader_key_ok = !pthread_key_create(&reader_key, reader_release);
+}
+
+/* NULL when all slots are taken, in which case lookups lock the shard */
+static cache_reader *reader_slot(void)
+{
+	size_t i;
+	int unused;
+
+	if (reader)
+		return reader;
+	(void) pthread_once(&reader_once, reader_key_create);
+	for (i = 0; !reader && i < CACHE_MAX_READERS; i++) {
+		unused = 0;
+		if (atomic_compare_exchange_strong(
+		    &readers[i].in_use, &unused, 1))
+			reader = &readers[i];
+	}
+	if (reader && reader_key_ok)
+		(void) pthread_setspecific(reader_key, reader);
+	return reader;
+}
+
+static void reader_count(cache_reader *r, int hit)
+{
+	if (r)
+		CACHE_OWN_INC(hit ? &r->hits : &r->misses);
+	else
+		(void) CACHE_INC(hit ? &no_reader.hits : &no_reader.misses);
+}
+
+static void reader_counters(uint64_t *hits, uint64_t *misses)
+{
+	size_t i;
+
+	*hits = CACHE_GET(&no_reader.hits);
+	*misses = CACHE_GET(&no_reader.misses);
+	for (i = 0; i < CACHE_MAX_READERS; i++) {
+		*hits += CACHE_GET(&readers[i].hits);
+		*misses += CACHE_GET(&readers[i].misses);
+	}
+}
+
+static void reader_enter(cache_reader *r)
+{
+	atomic_store(&r->epoch, atomic_load(&global_epoch));
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void reader_exit(cache_reader *r)
+{
+	atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+/* Start a new epoch, and return the oldest one a lookup may still be in */
+static uint64_t oldest_epoch(void)
+{
+	uint64_t oldest = atomic_fetch_add(&global_epoch, 1) + 1, epoch;
+	size_t i;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	for (i = 0; i < CACHE_MAX_READERS; i++)
+		if ((epoch = atomic_load(&readers[i].epoch)) && epoch < oldest)
+			oldest = epoch;
+	return oldest;
+}
+
+static void entry_retire(cache_shard *s, cache_entry *e)
+{
+	e->retired = atomic_load(&global_epoch);
+	e->q_next = s->retired;
+	s->retired = e;
+}
+
+/* Free the retired entries no lookup can see anymore */
+static void shard_reclaim(cache_shard *s)
+{
+	cache_entry **p, *e;
+	uint64_t oldest;
+
+	if (!s->retired)
+		return;
+	oldest = oldest_epoch();
+	for (p = &s->retired; (e = *p); ) {
+		if (e->retired < oldest) {
+			*p = e->q_next;
+			cache_line_free(e);
+		} else
+			p = &e->q_next;
+	}
+}
+#else
+typedef struct cache_reader {
+	unsigned    hit_sample;
+	cache_count hits;
+	cache_count misses;
+} cache_reader;
+
+static cache_reader only_reader;
+
+static cache_reader *reader_slot(void)
+{
+	return &only_reader;
+}
+
+static void reader_count(cache_reader *r, int hit)
+{
+	CACHE_OWN_INC(hit ? &r->hits : &r->misses);
+}
+
+static void reader_counters(uint64_t *hits, uint64_t *misses)
+{
+	*hits = only_reader.hits;
+	*misses = only_reader.misses;
+}
+#define reader_enter(r)       ((void)(r))
+#define reader_exit(r)        ((void)(r))
+#define entry_retire(s, e)    cache_line_free(e)
+#define shard_reclaim(s)      ((void)(s))
+#endif
+
+static void shard_free(cache_shard *s);
+static int shard_alloc(cache_shard *s, size_t bytes);
+
+/* Allocate the shards, and divide max_bytes over them */
+static int cache_alloc(void)
+{
+	size_t i, bytes;
+
+	shard_stride = (sizeof(cache_shard) + CACHE_LINE - 1)
+	             & ~(size_t)(CACHE_LINE - 1);
+	bytes = n_shards * shard_stride + CACHE_LINE;
+	if (!(shards = cache_line_alloc(n_shards * shard_stride)))
+		return -1;
+	(void) memset(shards, 0, n_shards * shard_stride);
+	bytes = bytes < max_bytes ? (max_bytes - bytes) / n_shards : 0;
+	for (i = 0; i < n_shards; i++) {
+		CACHE_LOCK_INIT(&shard_at(i)->lock);
+		if (shard_alloc(shard_at(i), bytes)) {
+			while (i--)
+				shard_free(shard_at(i));
+			cache_line_free(shards);
+			shards = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void cache_free(void)
+{
+	size_t i;
+
+	if (!shards)
+		return;
+	for (i = 0; i < n_shards; i++)
+		shard_free(shard_at(i));
+	cache_line_free(shards);
+	shards = NULL;
+}
+
+getdns_return_t stubby_cache_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+	uint32_t n;
+
+	if (!getdns_dict_get_int(config, "max_bytes", &n)) {
+		if (n < CACHE_MIN_BYTES) {
+			fprintf(stderr, "cache max_bytes must be at least %d\n",
+			        CACHE_MIN_BYTES);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		max_bytes = n;
+	}
+	if (!getdns_dict_get_int(config, "shards", &n)) {
+		if (n == 0 || n > CACHE_MAX_SHARDS || (n & (n - 1))) {
+			fprintf(stderr, "cache shards must be a power of two "
+			        "between 1 and %d\n", CACHE_MAX_SHARDS);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		n_shards = n;
+	}
+	if (!getdns_dict_get_int(config, "snapshot_interval", &n))
+		snapshot_interval = n;
+
+	if (!getdns_dict_get_bindata(config, "snapshot_file", &bindata)) {
+		free(snapshot_file);
+		if (!(snapshot_file = malloc(bindata->size + 1)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		(void) memcpy(snapshot_file, bindata->data, bindata->size);
+		snapshot_file[bindata->size] = 0;
+	}
+	/* Configured again: start empty, with tables for the new size */
+	cache_free();
+	stubby_qname_init();
+	if (cache_alloc())
+		return GETDNS_RETURN_MEMORY_ERROR;
+	enabled = 1;
+	return GETDNS_RETURN_GOOD;
+}
+
+int stubby_cache_enabled(void)
+{
+	return enabled;
+}
+
+getdns_return_t stubby_cache_share(void)
+{
+	if (!enabled || shared)
+		return GETDNS_RETURN_GOOD;
+	if (stubby_shmcache_create(max_bytes))
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+	/* Before there are workers, so nothing was cached yet, and they all
+	 * hash with the seed chosen here.
+	 */
+	stubby_qname_init();
+	cache_free();
+	shared = 1;
+	return GETDNS_RETURN_GOOD;
+}
+
+/* Whether name is sub (in wire format), or below it */
+static int name_below(const uint8_t *name, size_t len,
+    const uint8_t *sub, size_t sub_len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		if (len - pos == sub_len && !memcmp(name + pos, sub, sub_len))
+			return 1;
+		if (!name[pos])
+			break;
+		pos += name[pos] + 1;
+	}
+	return 0;
+}
+
+/* Parse an entry of cache_ttl_overrides into o */
+static getdns_return_t ttl_override_config(cache_ttl_bounds *o,
+    const getdns_dict *dict)
+{
+	char name_str[CACHE_MAX_TTL_NAME + 1];
+	getdns_bindata *bindata, *name = NULL;
+	uint64_t hash;
+
+	if (getdns_dict_get_bindata(dict, "name", &bindata)
+	||  bindata->size > CACHE_MAX_TTL_NAME) {
+		fprintf(stderr, "cache_ttl_overrides entries need a name\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	(void) memcpy(name_str, bindata->data, bindata->size);
+	name_str[bindata->size] = 0;
+	if (getdns_convert_fqdn_to_dns_name(name_str, &name)
+	||  !(o->name_len = stubby_qname_key(
+	    o->name, name->data, name->size, 0, &hash))) {
+		fprintf(stderr, "Invalid name in cache_ttl_overrides: %s\n",
+		        name_str);
+		if (name) {
+			free(name->data);
+			free(name);
+		}
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	free(name->data);
+	free(name);
+	o->min_ttl = min_ttl;
+	o->max_ttl = max_ttl;
+	(void) getdns_dict_get_int(dict, "min_ttl", &o->min_ttl);
+	(void) getdns_dict_get_int(dict, "max_ttl", &o->max_ttl);
+	if (o->min_ttl > o->max_ttl) {
+		fprintf(stderr, "min_ttl of %s in cache_ttl_overrides is "
+		        "larger than its max_ttl\n", name_str);
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t stubby_cache_ttl_config(const getdns_dict *config)
+{
+	cache_ttl_bounds *overrides = NULL;
+	getdns_return_t r;
+	getdns_list *list;
+	getdns_dict *dict;
+	size_t i, n = 0;
+	int clamped = 0;
+
+	min_ttl = 0;
+	max_ttl = CACHE_DEFAULT_MAX_TTL;
+	if (!getdns_dict_get_int(config, "min_cache_ttl", &min_ttl))
+		clamped = 1;
+	if (!getdns_dict_get_int(config, "max_cache_ttl", &max_ttl))
+		clamped = 1;
+	if (min_ttl > max_ttl) {
+		fprintf(stderr, "min_cache_ttl is larger than max_cache_ttl\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	if (!getdns_dict_get_list(config, "cache_ttl_overrides", &list)
+	&&  !getdns_list_get_length(list, &n) && n) {
+		if (!(overrides = calloc(n, sizeof(cache_ttl_bounds))))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		for (i = 0; i < n; i++) {
+			if ((r = getdns_list_get_dict(list, i, &dict))
+			||  (r = ttl_override_config(&overrides[i], dict))) {
+				free(overrides);
+				return r;
+			}
+		}
+		clamped = 1;
+	}
+	free(ttl_overrides);
+	ttl_overrides = overrides;
+	n_ttl_overrides = n;
+	ttl_clamped = clamped;
+	return GETDNS_RETURN_GOOD;
+}
+
+int stubby_cache_ttl_clamped(void)
+{
+	return ttl_clamped;
+}
+
+/* The bounds of the longest override that key is (below), or else the
+ * global ones.
+ */
+static void ttl_bounds(const uint8_t *key, size_t len,
+    uint32_t *min, uint32_t *max)
+{
+	const cache_ttl_bounds *o, *best = NULL;
+	size_t i;
+
+	for (i = 0; i < n_ttl_overrides; i++) {
+		o = &ttl_overrides[i];
+		if ((!best || o->name_len > best->name_len)
+		&&  name_below(key, len, o->name, o->name_len))
+			best = o;
+	}
+	*min = best ? best->min_ttl : min_ttl;
+	*max = best ? best->max_ttl : max_ttl;
+}
+
+void stubby_cache_ttl_bounds(const uint8_t *qname, size_t qname_len,
+    uint32_t *min, uint32_t *max)
+{
+	uint8_t key[CACHE_MAX_QNAME];
+	uint64_t hash;
+
+	*min = min_ttl;
+	*max = max_ttl;
+	if (n_ttl_overrides
+	&&  stubby_qname_key(key, qname, qname_len, 0, &hash))
+		ttl_bounds(key, qname_len, min, max);
+}
+
+/* Names are cached case insensitive.  Returns 0 for invalid names. */
+static size_t cache_key(uint8_t *key, const uint8_t *qname, size_t qname_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags, uint64_t *hash)
+{
+	return stubby_qname_key(key, qname, qname_len,
+	    (uint64_t)qtype << 24 | (uint64_t)qclass << 8 | flags, hash);
+}
+
+/* Skip the name at pos.  Returns the position after it, or 0 when the
+ * name runs past len.
+ */
+static size_t skip_name(const uint8_t *wire, size_t len, size_t pos)
+{
+	while (pos < len) {
+		if ((wire[pos] & 0xC0) == 0xC0)
+			return pos + 2 <= len ? pos + 2 : 0;
+		if (wire[pos] & 0xC0)
+			return 0;
+		if (!wire[pos])
+			return pos + 1;
+		pos += wire[pos] + 1;
+	}
+	return 0;
+}
+
+/* Find the smallest TTL in a response.  Negative answers are cached for
+ * no longer than the SOA minimum (RFC 2308).  When aged is given, the
+ * TTLs counted down by elapsed seconds are written to aged, which is a
+ * copy of (or the same as) wire.  When offsets is given, it receives the
+ * offsets of the TTLs, and must have room for CACHE_MAX_TTLS.  Returns the
+ * number of TTLs, or -1 when the response is malformed.
+ */
+static int response_ttls(const uint8_t *wire, size_t len, uint32_t *min_ttl,
+    uint8_t *aged, uint32_t elapsed, uint16_t *offsets)
+{
+	size_t pos = 12, rdlen;
+	uint32_t i, n_rrs, n_answers, n_authority, ttl, min = 0xFFFFFFFF;
+	uint16_t type;
+	int n_ttls = 0;
+
+	if (len < 12 || len > 65535)
+		return -1;
+	for (i = gldns_read_uint16(wire + 4); i > 0; i--)
+		if (!(pos = skip_name(wire, len, pos)) || (pos += 4) > len)
+			return -1;
+
+	n_answers = gldns_read_uint16(wire + 6);
+	n_authority = gldns_read_uint16(wire + 8);
+	n_rrs = n_answers + n_authority + gldns_read_uint16(wire + 10);
+	for (i = 0; i < n_rrs; i++) {
+		if (!(pos = skip_name(wire, len, pos)) || pos + 10 > len)
+			return -1;
+		type = gldns_read_uint16(wire + pos);
+		ttl = gldns_read_uint32(wire + pos + 4);
+		rdlen = gldns_read_uint16(wire + pos + 8);
+		if (pos + 10 + rdlen > len)
+			return -1;
+		if (type != GETDNS_RRTYPE_OPT) {
+			if (ttl < min)
+				min = ttl;
+			if (aged)
+				gldns_write_uint32(aged + pos + 4,
+				    ttl > elapsed ? ttl - elapsed : 0);
+			if (offsets)
+				offsets[n_ttls] = (uint16_t)(pos + 4);
+			n_ttls++;
+			if (type == GETDNS_RRTYPE_SOA && !n_answers
+			&&  i < n_authority && rdlen >= 22
+			&&  (ttl = gldns_read_uint32(wire + pos + 6 + rdlen))
+			    < min)
+				min = ttl;
+		}
+		pos += 10 + rdlen;
+	}
+	if (min_ttl)
+		*min_ttl = min == 0xFFFFFFFF ? 0 : min;
+	return n_ttls;
+}
+
+/* Count down the TTLs of a response copied from an entry, at the offsets
+ * that were found when it was stored, so that hits need not walk it.
+ */
+static void entry_age(const cache_entry *e, uint8_t *buf, uint32_t elapsed)
+{
+	const uint8_t *offsets = e->data + e->qname_len + e->response_len;
+	uint32_t ttl;
+	uint16_t off;
+	size_t i;
+
+	if (!elapsed)
+		return;
+	for (i = 0; i < e->n_ttls; i++) {
+		(void) memcpy(&off, offsets + 2 * i, sizeof(off));
+		ttl = gldns_read_uint32(buf + off);
+		gldns_write_uint32(buf + off, ttl > elapsed ? ttl - elapsed : 0);
+	}
+}
+
+static size_t entry_size(const cache_entry *e)
+{
+	/* As allocated, with the alignment to the cache line */
+	return sizeof(cache_entry) + e->qname_len + e->response_len
+	     + 2 * e->n_ttls + CACHE_LINE;
+}
+
+static void queue_insert(cache_queue *q, cache_entry *e)
+{
+	/* Before the hand, which makes it the newest */
+	if (!q->hand) {
+		e->q_prev = e->q_next = e;
+		q->hand = e;
+	} else {
+		e->q_next = q->hand;
+		e->q_prev = q->hand->q_prev;
+		e->q_prev->q_next = e;
+		q->hand->q_prev = e;
+	}
+	q->bytes += entry_size(e);
+}
+
+static void queue_unlink(cache_queue *q, cache_entry *e)
+{
+	if (e->q_next == e)
+		q->hand = NULL;
+	else {
+		e->q_prev->q_next = e->q_next;
+		e->q_next->q_prev = e->q_prev;
+		if (q->hand == e)
+			q->hand = e->q_next;
+	}
+	q->bytes -= entry_size(e);
+}
+
+/* With the shard locked */
+static void entry_remove(cache_shard *s, cache_entry *e)
+{
+	cache_ptr *p;
+	cache_entry *cur;
+
+	/* Lookups walking the chain may still be at e, which keeps its
+	 * next pointer until it is freed.
+	 */
+	for ( p = &s->buckets[e->hash & (s->n_buckets - 1)]
+	    ; (cur = CACHE_GET(p)) && cur != e; p = &cur->next)
+		; /* pass */
+	if (cur)
+		CACHE_STORE(p, CACHE_GET(&e->next));
+	if (e->region == CACHE_WINDOW)
+		queue_unlink(&s->window_q, e);
+	else if (e->region == CACHE_MAIN)
+		queue_unlink(&s->main_q, e);
+	s->n_entries--;
+	entry_retire(s, e);
+}
+
+/* With the shard locked, or between reader_enter() and reader_exit() */
+static cache_entry *entry_find(cache_shard *s, uint64_t hash,
+    const uint8_t *key, size_t key_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags)
+{
+	cache_entry *e;
+
+	for ( e = CACHE_LOAD(&s->buckets[hash & (s->n_buckets - 1)])
+	    ; e; e = CACHE_LOAD(&e->next))
+		if (e->hash == hash && e->qtype == qtype
+		&&  e->qclass == qclass && e->flags == flags
+		&&  e->qname_len == key_len && !memcmp(e->data, key, key_len))
+			return e;
+	return NULL;
+}
+
+/* The sketch estimates how often answers were asked for recently, with
+ * counters that are halved every sketch_sample additions.  It is updated
+ * without locking, by compare and swap on the words holding the counters.
+ * Saturated counters are left alone, and do not count as additions.
+ */
+static inline cache_count *sketch_word(cache_shard *s, uint64_t hash,
+    unsigned row, unsigned *shift)
+{
+	size_t idx = (size_t)(hash + row * ((hash >> 32) | 1))
+	           & s->sketch_mask;
+
+	*shift = (unsigned)(idx & 15) << 2;
+	return &s->sketch[row * ((s->sketch_mask + 1) >> 4) + (idx >> 4)];
+}
+
+static unsigned sketch_estimate(cache_shard *s, uint64_t hash)
+{
+	unsigned row, shift, count, min = 15;
+	cache_count *word;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		word = sketch_word(s, hash, row, &shift);
+		count = (unsigned)(CACHE_GET(word) >> shift) & 0x0F;
+		if (count < min)
+			min = count;
+	}
+	return min;
+}
+
+/* Add n (up to 15) to the counters of hash */
+static void sketch_increment(cache_shard *s, uint64_t hash, unsigned n)
+{
+	unsigned row, shift, count, inc;
+	cache_count *word;
+	uint64_t old, added;
+	size_t i, n_words;
+	int changed = 0;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		word = sketch_word(s, hash, row, &shift);
+		for (old = CACHE_GET(word); ; ) {
+			if ((count = (unsigned)(old >> shift) & 0x0F) == 15)
+				break;
+			inc = count + n > 15 ? 15 - count : n;
+			if (CACHE_CAS(word, &old,
+			    old + ((uint64_t)inc << shift))) {
+				changed = 1;
+				break;
+			}
+		}
+	}
+	if (!changed)
+		return;
+	/* Only the increment reaching the sample size halves */
+	added = CACHE_ADD(&s->sketch_added, n);
+	if (added >= s->sketch_sample || added + n < s->sketch_sample)
+		return;
+	n_words = SKETCH_DEPTH * ((s->sketch_mask + 1) >> 4);
+	for (i = 0; i < n_words; i++) {
+		old = CACHE_GET(&s->sketch[i]);
+		while (!CACHE_CAS(&s->sketch[i], &old,
+		    (old >> 1) & 0x7777777777777777ULL))
+			; /* pass */
+	}
+	(void) CACHE_SUB(&s->sketch_added, s->sketch_sample / 2);
+}
+
+/* Allocate the hash table and the sketch of a shard, and divide what
+ * remains of its bytes over the window and the main region.
+ */
+static int shard_alloc(cache_shard *s, size_t bytes)
+{
+	size_t estimate = bytes / CACHE_ENTRY_ESTIMATE, n_counters, fixed;
+
+	for (s->n_buckets = 1; s->n_buckets < estimate; s->n_buckets <<= 1)
+		; /* pass */
+	for (n_counters = 64; n_counters < estimate; n_counters <<= 1)
+		; /* pass */
+	if (!(s->buckets = stubby_mem_calloc(STUBBY_MEM_CACHE,
+	    s->n_buckets, sizeof(cache_ptr))))
+		return -1;
+	if (!(s->sketch = cache_line_alloc(
+	    SKETCH_DEPTH * n_counters / 16 * sizeof(cache_count)))) {
+		stubby_mem_free(STUBBY_MEM_CACHE, s->buckets);
+		s->buckets = NULL;
+		return -1;
+	}
+	(void) memset(s->sketch, 0,
+	    SKETCH_DEPTH * n_counters / 16 * sizeof(cache_count));
+	s->sketch_mask = n_counters - 1;
+	s->sketch_sample = SKETCH_SAMPLE_FACTOR * n_counters;
+
+	fixed = s->n_buckets * sizeof(cache_ptr)
+	      + SKETCH_DEPTH * n_counters / 16 * sizeof(cache_count)
+	      + CACHE_LINE;
+	fixed = fixed < bytes ? bytes - fixed : 0;
+	s->window_q.max_bytes = fixed * CACHE_WINDOW_PERCENT / 100;
+	s->main_q.max_bytes = fixed - s->window_q.max_bytes;
+	return 0;
+}
+
+/* When there are no lookups anymore */
+static void shard_free(cache_shard *s)
+{
+	cache_queue *queues[2] = { &s->main_q, &s->window_q };
+	cache_entry *e, *next;
+	size_t i;
+
+	for (i = 0; i < 2; i++) {
+		if (!(e = queues[i]->hand))
+			continue;
+		e->q_prev->q_next = NULL;
+		for (; e; e = next) {
+			next = e->q_next;
+			cache_line_free(e);
+		}
+	}
+	for (e = s->retired; e; e = next) {
+		next = e->q_next;
+		cache_line_free(e);
+	}
+	stubby_mem_free(STUBBY_MEM_CACHE, s->buckets);
+	cache_line_free(s->sketch);
+	CACHE_LOCK_DESTROY(&s->lock);
+	(void) memset(s, 0, sizeof(*s));
+}
+
+/* CLOCK: the first entry from the hand that was not referenced since the
+ * hand passed it last, or that expired.
+ */
+static cache_entry *main_victim(cache_shard *s, int64_t now)
+{
+	cache_entry *e;
+
+	while ((e = s->main_q.hand)) {
+		if (!CACHE_GET(&e->referenced) || e->expires <= now)
+			return e;
+		CACHE_SET(&e->referenced, 0);
+		s->main_q.hand = e->q_next;
+	}
+	return NULL;
+}
+
+/* The oldest answer in the window moves to the main region when it was
+ * asked for more often than the answers it would evict (TinyLFU).
+ */
+static void window_evict(cache_shard *s, int64_t now)
+{
+	cache_entry *candidate = s->window_q.hand, *victim;
+	size_t size = entry_size(candidate);
+	unsigned frequency = sketch_estimate(s, candidate->hash);
+
+	while (s->main_q.bytes + size > s->main_q.max_bytes
+	&&    (victim = main_victim(s, now))) {
+		if (victim->expires > now
+		&&  sketch_estimate(s, victim->hash) >= frequency) {
+			entry_remove(s, candidate);
+			s->rejections++;
+			return;
+		}
+		entry_remove(s, victim);
+		s->evictions++;
+	}
+	if (s->main_q.bytes + size > s->main_q.max_bytes) {
+		entry_remove(s, candidate);
+		s->evictions++;
+		return;
+	}
+	queue_unlink(&s->window_q, candidate);
+	candidate->region = CACHE_MAIN;
+	CACHE_SET(&candidate->referenced, 0);
+	queue_insert(&s->main_q, candidate);
+}
+
+/* Add (or replace) an answer with a lower case key, into the window, or
+ * into the main region while there is room (for answers from snapshots).
+ * With the shard locked.
+ */
+static int entry_insert(cache_shard *s, uint64_t hash,
+    const uint8_t *key, size_t key_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags,
+    const uint8_t *response, size_t response_len,
+    const uint16_t *ttls, size_t n_ttls,
+    int64_t stored, int64_t expires, int region)
+{
+	size_t size = sizeof(cache_entry) + key_len + response_len + 2 * n_ttls;
+	cache_entry *e;
+	cache_ptr *bucket;
+
+	if ((e = entry_find(s, hash, key, key_len, qtype, qclass, flags)))
+		entry_remove(s, e);
+	if (region == CACHE_MAIN
+	&&  s->main_q.bytes + size + CACHE_LINE > s->main_q.max_bytes)
+		return -1;
+	if (!(e = cache_line_alloc(size)))
+		return -1;
+
+	e->hash = hash;
+	e->stored = stored;
+	e->expires = expires;
+	e->qtype = qtype;
+	e->qclass = qclass;
+	e->flags = flags;
+	e->qname_len = (uint8_t)key_len;
+	e->response_len = (uint16_t)response_len;
+	e->n_ttls = (uint16_t)n_ttls;
+	e->region = (uint8_t)region;
+	CACHE_SET(&e->referenced, 0);
+	(void) memcpy(e->data, key, key_len);
+	(void) memcpy(e->data + key_len, response, response_len);
+	(void) memcpy(e->data + key_len + response_len, ttls, 2 * n_ttls);
+
+	/* Published by the release store of the bucket head */
+	bucket = &s->buckets[hash & (s->n_buckets - 1)];
+	CACHE_SET(&e->next, CACHE_GET(bucket));
+	CACHE_STORE(bucket, e);
+	s->n_entries++;
+	if (region == CACHE_MAIN)
+		queue_insert(&s->main_q, e);
+	else {
+		queue_insert(&s->window_q, e);
+		while (s->window_q.bytes > s->window_q.max_bytes)
+			window_evict(s, stored);
+	}
+	return 0;
+}
+
+/* Look up an answer in its shard, and count its TTLs down.  Returns its
+ * length, or 0 on a miss.
+ */
+static size_t shard_lookup(uint64_t hash, const uint8_t *key, size_t key_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags, int64_t now,
+    uint8_t *buf, size_t buf_len)
+{
+	cache_shard *s = shard_of(hash);
+	cache_reader *r;
+	cache_entry *e;
+	size_t len = 0;
+	int expired = 0;
+
+	if ((r = reader_slot()))
+		reader_enter(r);
+	else
+		CACHE_LOCK(&s->lock);
+	if ((e = entry_find(s, hash, key, key_len, qtype, qclass, flags))) {
+		if (e->expires <= now)
+			expired = 1;
+		else if (e->response_len <= buf_len) {
+			len = e->response_len;
+			(void) memcpy(buf, e->data + e->qname_len, len);
+			entry_age(e, buf, now > e->stored
+			    ? (uint32_t)(now - e->stored) : 0);
+			if (!CACHE_GET(&e->referenced))
+				CACHE_SET(&e->referenced, 1);
+		}
+	}
+	if (r)
+		reader_exit(r);
+	else
+		CACHE_UNLOCK(&s->lock);
+
+	if (expired) {
+		CACHE_LOCK(&s->lock);
+		if ((e = entry_find(s, hash, key, key_len,
+		    qtype, qclass, flags)) && e->expires <= now)
+			entry_remove(s, e);
+		shard_reclaim(s);
+		CACHE_UNLOCK(&s->lock);
+	}
+	/* Every miss counts, as new answers are only admitted when asked
+	 * for again.  Hits are sampled, counting SKETCH_HIT_SAMPLE at a time,
+	 * so that lookups of popular answers do not all contend on the
+	 * words of the sketch.
+	 */
+	if (!len)
+		sketch_increment(s, hash, 1);
+	else if (!r || ++r->hit_sample % SKETCH_HIT_SAMPLE == 0)
+		sketch_increment(s, hash, SKETCH_HIT_SAMPLE);
+	reader_count(r, len > 0);
+	return len;
+}
+
+size_t stubby_cache_lookup(const uint8_t *qname, size_t qname_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags,
+    uint8_t *buf, size_t buf_len)
+{
+	uint8_t key[CACHE_MAX_QNAME];
+	int64_t now, stored = 0;
+	uint64_t hash;
+	size_t len;
+
+	if (!enabled || qname_len > CACHE_MAX_QNAME)
+		return 0;
+	if (!cache_key(key, qname, qname_len, qtype, qclass, flags, &hash))
+		return 0;
+	now = (int64_t)time(NULL);
+	if (!shared) {
+		if (!(len = shard_lookup(hash, key, qname_len, qtype, qclass,
+		    flags, now, buf, buf_len)))
+			return 0;
+	} else {
+		/* Slots have no room for the TTL offsets */
+		if (!(len = stubby_shmcache_lookup(hash, key, qname_len,
+		    qtype, qclass, flags, now, buf, buf_len, &stored)))
+			return 0;
+		(void) response_ttls(buf, len, NULL, buf,
+		    now > stored ? (uint32_t)(now - stored) : 0, NULL);
+	}
+	/* The question as it was asked */
+	(void) memcpy(buf + 12, qname, qname_len);
+	return len;
+}
+
+void stubby_cache_store(const uint8_t *qname, size_t qname_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags,
+    const uint8_t *response, size_t response_len)
+{
+	uint8_t key[CACHE_MAX_QNAME], question[CACHE_MAX_QNAME];
+	uint16_t ttls[CACHE_MAX_TTLS];
+	stubby_shmcache_answer answer;
+	cache_shard *s;
+	uint64_t hash, h;
+	uint8_t rcode;
+	uint32_t ttl, lo, hi;
+	int64_t now;
+	int n_ttls;
+
+	if (!enabled || qname_len > CACHE_MAX_QNAME
+	||  response_len < 12 + qname_len + 4 || response_len > 65535)
+		return;
+
+	/* Only complete answers to the question that was asked */
+	rcode = response[3] & 0x0F;
+	if ((response[2] & 0x02) /* TC */
+	||  (rcode != GETDNS_RCODE_NOERROR && rcode != GETDNS_RCODE_NXDOMAIN)
+	||  gldns_read_uint16(response + 4) != 1)
+		return;
+	if (!cache_key(key, qname, qname_len, qtype, qclass, flags, &hash)
+	||  !stubby_qname_key(question, response + 12, qname_len, 0, &h)
+	||  memcmp(key, question, qname_len)
+	||  gldns_read_uint16(response + 12 + qname_len) != qtype
+	||  gldns_read_uint16(response + 14 + qname_len) != qclass)
+		return;
+
+	if ((n_ttls = response_ttls(response, response_len,
+	    &ttl, NULL, 0, ttls)) < 0 || !ttl)
+		return;
+	ttl_bounds(key, qname_len, &lo, &hi);
+	if (!(ttl = ttl < lo ? lo : ttl > hi ? hi : ttl))
+		return;
+	now = (int64_t)time(NULL);
+	if (shared) {
+		answer.hash = hash;
+		answer.stored = now;
+		answer.expires = now + ttl;
+		answer.qtype = qtype;
+		answer.qclass = qclass;
+		answer.flags = flags;
+		answer.qname_len = (uint8_t)qname_len;
+		answer.response_len = (uint16_t)response_len;
+		answer.qname = key;
+		answer.response = response;
+		(void) stubby_shmcache_store(&answer, now);
+		return;
+	}
+	s = shard_of(hash);
+	CACHE_LOCK(&s->lock);
+	(void) entry_insert(s, hash, key, qname_len, qtype, qclass, flags,
+	    response, response_len, ttls, (size_t)n_ttls,
+	    now, now + ttl, CACHE_WINDOW);
+	shard_reclaim(s);
+	CACHE_UNLOCK(&s->lock);
+}
+
+/* The answers to remove: all when name is NULL */
+typedef struct cache_flush_spec {
+	const uint8_t *name;
+	size_t         name_len;
+	int            subdomains;
+} cache_flush_spec;
+
+static int flush_match(const cache_flush_spec *f,
+    const uint8_t *qname, size_t qname_len)
+{
+	return !f->name
+	    || (qname_len == f->name_len
+	        && !memcmp(qname, f->name, f->name_len))
+	    || (f->subdomains
+	        && name_below(qname, qname_len, f->name, f->name_len));
+}
+
+static int shm_flush_cb(const stubby_shmcache_answer *answer, void *arg)
+{
+	return flush_match(arg, answer->qname, answer->qname_len);
+}
+
+size_t stubby_cache_flush(const uint8_t *name, size_t name_len,
+    int subdomains)
+{
+	uint8_t key[CACHE_MAX_QNAME];
+	cache_flush_spec f = { NULL, name_len, subdomains };
+	cache_entry *e, *next, *last;
+	cache_queue *queues[2];
+	cache_shard *s;
+	size_t i, j, n = 0;
+	uint64_t hash;
+
+	if (!enabled)
+		return 0;
+	if (name) {
+		if (name_len > CACHE_MAX_QNAME)
+			return 0;
+		if (!stubby_qname_key(key, name, name_len, 0, &hash))
+			return 0;
+		f.name = key;
+	}
+	if (shared)
+		return stubby_shmcache_walk(shm_flush_cb, &f);
+	for (i = 0; i < n_shards; i++) {
+		s = shard_at(i);
+		queues[0] = &s->main_q;
+		queues[1] = &s->window_q;
+		CACHE_LOCK(&s->lock);
+		for (j = 0; j < 2; j++) {
+			if (!(e = queues[j]->hand))
+				continue;
+			for (last = e->q_prev; ; e = next) {
+				next = e->q_next;
+				if (flush_match(&f, e->data, e->qname_len)) {
+					entry_remove(s, e);
+					n++;
+				}
+				if (e == last)
+					break;
+			}
+		}
+		shard_reclaim(s);
+		CACHE_UNLOCK(&s->lock);
+	}
+	return n;
+}
+
+static uint64_t cache_checksum(const uint8_t *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= *data++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int record_encode(gldns_buffer *buf, const stubby_shmcache_answer *a)
+{
+	if (!gldns_buffer_reserve(buf, CACHE_RECORD_LEN
+	    + a->qname_len + a->response_len))
+		return -1;
+	gldns_buffer_write_u32(buf, (uint32_t)(a->expires >> 32));
+	gldns_buffer_write_u32(buf, (uint32_t)a->expires);
+	gldns_buffer_write_u32(buf, (uint32_t)(a->stored >> 32));
+	gldns_buffer_write_u32(buf, (uint32_t)a->stored);
+	gldns_buffer_write_u16(buf, a->qtype);
+	gldns_buffer_write_u16(buf, a->qclass);
+	gldns_buffer_write_u8(buf, a->flags);
+	gldns_buffer_write_u8(buf, a->qname_len);
+	gldns_buffer_write_u16(buf, a->response_len);
+	gldns_buffer_write(buf, a->qname, a->qname_len);
+	gldns_buffer_write(buf, a->response, a->response_len);
+	return 0;
+}
+
+/* Append the records of the answers in queue q that did not expire */
+static int queue_encode(gldns_buffer *buf, cache_queue *q, int64_t now,
+    uint32_t *count)
+{
+	stubby_shmcache_answer a;
+	cache_entry *e;
+
+	if (!(e = q->hand))
+		return 0;
+	do {
+		if (e->expires <= now)
+			continue;
+		a.stored = e->stored;
+		a.expires = e->expires;
+		a.qtype = e->qtype;
+		a.qclass = e->qclass;
+		a.flags = e->flags;
+		a.qname_len = e->qname_len;
+		a.response_len = e->response_len;
+		a.qname = e->data;
+		a.response = e->data + e->qname_len;
+		if (record_encode(buf, &a))
+			return -1;
+		(*count)++;
+	} while ((e = e->q_next) != q->hand);
+	return 0;
+}
+
+typedef struct cache_shm_encode {
+	gldns_buffer *buf;
+	int64_t       now;
+	uint32_t      count;
+	int           failed;
+} cache_shm_encode;
+
+static int shm_encode_cb(const stubby_shmcache_answer *answer, void *arg)
+{
+	cache_shm_encode *enc = arg;
+
+	if (!enc->failed && answer->expires > enc->now) {
+		if (record_encode(enc->buf, answer))
+			enc->failed = 1;
+		else
+			enc->count++;
+	}
+	return 0;
+}
+
+getdns_return_t stubby_cache_encode(gldns_buffer *buf)
+{
+	int64_t now = (int64_t)time(NULL);
+	size_t start = gldns_buffer_position(buf), len, i;
+	uint32_t count = 0;
+	uint64_t checksum;
+	cache_shard *s;
+	int r = 0;
+
+	if (!gldns_buffer_reserve(buf, CACHE_HEADER_LEN))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	gldns_buffer_write(buf, STUBBY_CACHE_MAGIC, STUBBY_CACHE_MAGIC_LEN);
+	gldns_buffer_write_u32(buf, STUBBY_CACHE_VERSION);
+	gldns_buffer_write_u32(buf, 0); /* Filled in below */
+	gldns_buffer_write_u32(buf, 0);
+	gldns_buffer_write_u32(buf, 0);
+	gldns_buffer_write_u32(buf, 0);
+	gldns_buffer_write_u32(buf, 0);
+
+	if (shared) {
+		cache_shm_encode enc = { buf, now, 0, 0 };
+
+		(void) stubby_shmcache_walk(shm_encode_cb, &enc);
+		count = enc.count;
+		r = enc.failed;
+	}
+	/* Per shard the main region and then the window, each from the
+	 * oldest, so that reading preserves the order.
+	 */
+	for (i = 0; enabled && !shared && !r && i < n_shards; i++) {
+		s = shard_at(i);
+		CACHE_LOCK(&s->lock);
+		r = queue_encode(buf, &s->main_q, now, &count)
+		 || queue_encode(buf, &s->window_q, now, &count);
+		CACHE_UNLOCK(&s->lock);
+	}
+	if (r)
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	len = gldns_buffer_position(buf) - start - CACHE_HEADER_LEN;
+	checksum = cache_checksum(
+	    gldns_buffer_at(buf, start + CACHE_HEADER_LEN), len);
+	gldns_buffer_write_u32_at(buf, start + 12, count);
+	gldns_buffer_write_u32_at(buf, start + 16, (uint32_t)(len >> 32));
+	gldns_buffer_write_u32_at(buf, start + 20, (uint32_t)len);
+	gldns_buffer_write_u32_at(buf, start + 24, (uint32_t)(checksum >> 32));
+	gldns_buffer_write_u32_at(buf, start + 28, (uint32_t)checksum);
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t stubby_cache_decode(const uint8_t *data, size_t len)
+{
+	int64_t now = (int64_t)time(NULL);
+	uint64_t payload_len, checksum;
+	uint8_t key[CACHE_MAX_QNAME];
+	uint16_t ttls[CACHE_MAX_TTLS];
+	const uint8_t *pos, *end;
+	stubby_shmcache_answer a;
+	uint32_t count, total;
+	cache_shard *s;
+	int n_ttls;
+
+	if (len < CACHE_HEADER_LEN
+	||  memcmp(data, STUBBY_CACHE_MAGIC, STUBBY_CACHE_MAGIC_LEN)
+	||  gldns_read_uint32(data + 8) != STUBBY_CACHE_VERSION)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	total = count = gldns_read_uint32(data + 12);
+	payload_len = (uint64_t)gldns_read_uint32(data + 16) << 32
+	            | gldns_read_uint32(data + 20);
+	checksum = (uint64_t)gldns_read_uint32(data + 24) << 32
+	         | gldns_read_uint32(data + 28);
+	if (payload_len != len - CACHE_HEADER_LEN
+	||  checksum != cache_checksum(
+	    data + CACHE_HEADER_LEN, (size_t)payload_len))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	if (!enabled)
+		return GETDNS_RETURN_GOOD;
+	for ( pos = data + CACHE_HEADER_LEN, end = data + len
+	    ; count > 0 && pos + CACHE_RECORD_LEN <= end; count--) {
+		a.expires = (int64_t)((uint64_t)gldns_read_uint32(pos) << 32
+		                     | gldns_read_uint32(pos + 4));
+		a.stored  = (int64_t)((uint64_t)gldns_read_uint32(pos + 8) << 32
+		                     | gldns_read_uint32(pos + 12));
+		a.qtype = gldns_read_uint16(pos + 16);
+		a.qclass = gldns_read_uint16(pos + 18);
+		a.flags = pos[20];
+		a.qname_len = pos[21];
+		a.response_len = gldns_read_uint16(pos + 22);
+		a.qname = pos + CACHE_RECORD_LEN;
+		a.response = a.qname + a.qname_len;
+		if (a.response + a.response_len > end)
+			break;
+		pos = a.response + a.response_len;
+		if (a.expires <= now || a.response_len < 12)
+			continue;
+		if (!cache_key(key, a.qname, a.qname_len,
+		    a.qtype, a.qclass, a.flags, &a.hash))
+			continue;
+		a.qname = key;
+		if (shared) {
+			(void) stubby_shmcache_store(&a, now);
+			continue;
+		}
+		if ((n_ttls = response_ttls(a.response, a.response_len,
+		    NULL, NULL, 0, ttls)) < 0)
+			continue;
+		s = shard_of(a.hash);
+		CACHE_LOCK(&s->lock);
+		(void) entry_insert(s, a.hash, a.qname, a.qname_len,
+		    a.qtype, a.qclass, a.flags, a.response, a.response_len,
+		    ttls, (size_t)n_ttls, a.stored, a.expires, CACHE_MAIN);
+		CACHE_UNLOCK(&s->lock);
+	}
+	filled = 1;
+	/* Keep what could be read from a snapshot that ends early */
+	if (count)
+		stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+		    "Cache snapshot ended after %u of %u answers\n",
+		    (unsigned)(total - count), (unsigned)total);
+	return GETDNS_RETURN_GOOD;
+}
+
+typedef struct cache_shm_count {
+	int64_t now;
+	size_t  n;
+} cache_shm_count;
+
+static int shm_count_cb(const stubby_shmcache_answer *answer, void *arg)
+{
+	cache_shm_count *count = arg;
+
+	if (answer->expires > count->now)
+		count->n++;
+	return 0;
+}
+
+size_t stubby_cache_entries(void)
+{
+	cache_shm_count count = { (int64_t)time(NULL), 0 };
+	size_t i, n = 0;
+
+	if (shared) {
+		(void) stubby_shmcache_walk(shm_count_cb, &count);
+		n = count.n;
+	}
+	for (i = 0; enabled && !shared && i < n_shards; i++) {
+		CACHE_LOCK(&shard_at(i)->lock);
+		n += shard_at(i)->n_entries;
+		CACHE_UNLOCK(&shard_at(i)->lock);
+	}
+	return n;
+}
+
+static void cache_write_log(const char *fn, getdns_return_t r)
+{
+	stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+	    "Could not write cache snapshot \"%s\": %s\n",
+	    fn, r == GETDNS_RETURN_IO_ERROR
+	    ? strerror(errno) : getdns_get_errorstr_by_id(r));
+}
+
+static void cache_write_file(void)
+{
+	gldns_buffer *buf;
+	getdns_return_t r;
+
+	if (!(buf = gldns_buffer_new(65536)))
+		return;
+	if ((r = stubby_cache_encode(buf))
+	||  (r = stubby_snapshot_write(snapshot_file, buf)))
+		cache_write_log(snapshot_file, r);
+	gldns_buffer_free(buf);
+}
+
+#ifdef HAVE_STUBBY_THREADS
+/* Periodic snapshots are encoded on the event loop, but written (and
+ * synced) to disk by a thread of their own.  One at a time: a snapshot
+ * that is due while the previous one is still being written is skipped.
+ */
+static pthread_t snapshot_thread;
+static int snapshot_started = 0;
+static atomic_int snapshot_busy = 0;
+
+/* The file name is copied, as a config reload may replace it meanwhile */
+typedef struct snapshot_job {
+	gldns_buffer *buf;
+	char          fn[];
+} snapshot_job;
+
+static void *snapshot_writer(void *arg)
+{
+	snapshot_job *job = arg;
+	getdns_return_t r;
+
+	if ((r = stubby_snapshot_write(job->fn, job->buf)))
+		cache_write_log(job->fn, r);
+	gldns_buffer_free(job->buf);
+	free(job);
+	atomic_store(&snapshot_busy, 0);
+	return NULL;
+}
+
+static void snapshot_wait(void)
+{
+	if (snapshot_started) {
+		(void) pthread_join(snapshot_thread, NULL);
+		snapshot_started = 0;
+	}
+}
+
+static void cache_write_file_async(void)
+{
+	size_t fn_len = strlen(snapshot_file) + 1;
+	snapshot_job *job;
+	getdns_return_t r;
+
+	if (atomic_load(&snapshot_busy)) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+		    "Skipping cache snapshot: the previous one is still "
+		    "being written\n");
+		return;
+	}
+	snapshot_wait();
+	if (!(job = malloc(sizeof(snapshot_job) + fn_len)))
+		return;
+	(void) memcpy(job->fn, snapshot_file, fn_len);
+	if (!(job->buf = gldns_buffer_new(65536))) {
+		free(job);
+		return;
+	}
+	if ((r = stubby_cache_encode(job->buf))) {
+		cache_write_log(job->fn, r);
+		gldns_buffer_free(job->buf);
+		free(job);
+		return;
+	}
+	atomic_store(&snapshot_busy, 1);
+	if (pthread_create(&snapshot_thread, NULL, snapshot_writer, job)) {
+		/* Write it here then */
+		(void) snapshot_writer(job);
+		return;
+	}
+	snapshot_started = 1;
+}
+#else
+#define snapshot_wait()          ((void)0)
+#define cache_write_file_async() cache_write_file()
+#endif
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+static getdns_return_t cache_read_file(void)
+{
+	struct stat st;
+	getdns_return_t r;
+	void *data;
+	int fd;
+
+	if ((fd = open(snapshot_file, O_RDONLY)) < 0)
+		return GETDNS_RETURN_IO_ERROR;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		(void) close(fd);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (data == MAP_FAILED)
+		return GETDNS_RETURN_IO_ERROR;
+
+	r = stubby_cache_decode(data, (size_t)st.st_size);
+	(void) munmap(data, (size_t)st.st_size);
+	return r;
+}
+#else
+static getdns_return_t cache_read_file(void)
+{
+	getdns_return_t r;
+	uint8_t *data;
+	long len;
+	FILE *fh;
+
+	if (!(fh = fopen(snapshot_file, "rb")))
+		return GETDNS_RETURN_IO_ERROR;
+	if (fseek(fh, 0, SEEK_END) == -1 || (len = ftell(fh)) <= 0
+	||  !(data = malloc(len))) {
+		fclose(fh);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	rewind(fh);
+	if (fread(data, 1, len, fh) != (size_t)len) {
+		free(data);
+		fclose(fh);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	fclose(fh);
+	r = stubby_cache_decode(data, (size_t)len);
+	free(data);
+	return r;
+}
+#endif
+
+static void snapshot_timeout_cb(void *userarg)
+{
+	(void)userarg;
+	(void) loop->vmt->clear(loop, &snapshot_event);
+	cache_write_file_async();
+	(void) loop->vmt->schedule(loop, -1,
+	    (uint64_t)snapshot_interval * 1000, &snapshot_event);
+}
+
+void stubby_cache_start(getdns_context *context)
+{
+	getdns_return_t r;
+
+	if (!enabled || !snapshot_file || loop)
+		return;
+
+	/* A cache handed over on upgrade is newer than the file */
+	if (!filled) {
+		if ((r = cache_read_file()) == GETDNS_RETURN_GOOD)
+			stubby_local_log(NULL, 0, GETDNS_LOG_INFO,
+			    "Read %d answers from cache snapshot \"%s\"\n",
+			    (int)stubby_cache_entries(), snapshot_file);
+		else if (r != GETDNS_RETURN_IO_ERROR)
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Ignoring invalid cache snapshot \"%s\"\n",
+			    snapshot_file);
+	}
+	if (getdns_context_get_eventloop(context, &loop)) {
+		loop = NULL;
+		return;
+	}
+	(void) memset(&snapshot_event, 0, sizeof(snapshot_event));
+	snapshot_event.timeout_cb = snapshot_timeout_cb;
+	if (snapshot_interval)
+		(void) loop->vmt->schedule(loop, -1,
+		    (uint64_t)snapshot_interval * 1000, &snapshot_event);
+}
+
+void stubby_cache_stop(void)
+{
+	if (!loop)
+		return;
+	(void) loop->vmt->clear(loop, &snapshot_event);
+	loop = NULL;
+	snapshot_wait();
+	cache_write_file();
+}
+
+void stubby_cache_metrics(gldns_buffer *buf)
+{
+	uint64_t hits = 0, misses = 0, evictions = 0, rejections = 0;
+	size_t i, n_entries = 0, bytes = 0;
+	cache_shard *s;
+
+	if (!enabled)
+		return;
+	if (shared) {
+		stubby_shmcache_counters(&hits, &misses, &evictions);
+		n_entries = stubby_cache_entries();
+		bytes = n_entries * STUBBY_SHMCACHE_SLOT;
+	} else
+		reader_counters(&hits, &misses);
+	for (i = 0; !shared && i < n_shards; i++) {
+		s = shard_at(i);
+		CACHE_LOCK(&s->lock);
+		evictions += s->evictions;
+		rejections += s->rejections;
+		n_entries += s->n_entries;
+		bytes += s->window_q.bytes + s->main_q.bytes;
+		CACHE_UNLOCK(&s->lock);
+	}
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_cache_hits counter\n"
+	    "# HELP stubby_cache_hits Queries answered from the cache.\n"
+	    "stubby_cache_hits_total %"PRIu64"\n"
+	    "# TYPE stubby_cache_misses counter\n"
+	    "# HELP stubby_cache_misses Queries not answered from the "
+	    "cache.\n"
+	    "stubby_cache_misses_total %"PRIu64"\n"
+	    "# TYPE stubby_cache_evictions counter\n"
+	    "# HELP stubby_cache_evictions Answers evicted to make room for "
+	    "new ones.\n"
+	    "stubby_cache_evictions_total %"PRIu64"\n"
+	    "# TYPE stubby_cache_rejections counter\n"
+	    "# HELP stubby_cache_rejections New answers not admitted because "
+	    "older ones were asked for more often.\n"
+	    "stubby_cache_rejections_total %"PRIu64"\n"
+	    "# TYPE stubby_cache_entries gauge\n"
+	    "# HELP stubby_cache_entries Answers in the cache.\n"
+	    "stubby_cache_entries %d\n"
+	    "# TYPE stubby_cache_bytes gauge\n"
+	    "# HELP stubby_cache_bytes Bytes taken by the cached answers.\n"
+	    "stubby_cache_bytes %"PRIu64"\n",
+	    hits, misses, evictions, rejections, (int)n_entries,
+	    (uint64_t)bytes);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_CACHE_H
+#define _STUBBY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Answer cache.
+ *
+ * Responses are cached in wire format, for the smallest TTL of their
+ * records (for negative answers bounded by the SOA minimum), and are
+ * answered with the TTLs counted down.  That TTL is kept within
+ * min_cache_ttl and max_cache_ttl (by default 0 and 86400), or within the
+ * min_ttl and max_ttl of the longest name in cache_ttl_overrides that the
+ * query name is or is below.  The TTLs of the records in the answers that
+ * stubby serves are kept within the same bounds when any of these is
+ * configured, before they are cached.
+ *
+ * The offsets of the TTLs in an answer are found when it is stored, and
+ * kept with it, so that a hit only copies the answer and counts the TTLs
+ * down at those offsets.  Queries that are answered from the cache are
+ * answered as they are received, from their wire format (see
+ * stubby_server_set_fast_path()), without dicts for the query or the
+ * answer.
+ *
+ * The cache is divided by key hash over a power of two of shards (8 by
+ * default), each with its own hash table, regions, sketch and lock, so
+ * that it can be used from several threads.  Lookups take no lock: they
+ * walk the hash chains, which are changed under the lock of the shard,
+ * and removed answers are freed only when no lookup can still see them
+ * (epoch based reclamation).  Answers start on a cache line of their own.
+ *
+ * With worker processes the cache is in shared memory instead, as a table
+ * of fixed size slots that all workers look up and store into (see
+ * shmcache.h), and the snapshots are read and written by the first worker.
+ *
+ * The cache takes at most max_bytes, including its hash table and
+ * frequency sketch.  It follows W-TinyLFU: new answers enter a small
+ * window (1% of the memory), and the oldest answer leaving the window is
+ * only admitted to the main region when it was asked for more often,
+ * according to a count-min sketch of recent queries, than the answers it
+ * would evict there.  Names asked for once, such as random subdomains,
+ * so do not push out the answers that are asked for often.  The main
+ * region is swept by CLOCK: a hit only sets a referenced bit, and the
+ * sweep evicts the first answer that was not referenced (or expired)
+ * since it passed it last.
+ *
+ *   cache:
+ *     max_bytes: 8388608
+ *     shards: 8
+ *     snapshot_file: "/var/cache/stubby/cache.snapshot"
+ *     snapshot_interval: 300
+ *
+ * With snapshot_file the cache is written to the file every
+ * snapshot_interval seconds (0 for only at shutdown) and when stubby
+ * stops, and read back when stubby starts, so that it starts warm.  A
+ * cache snapshot is a 32 byte header
+ *
+ *   magic "STUBBYCC" | version (4) | count (4) | length (8) | checksum (8)
+ *
+ * with the 64 bit FNV-1a checksum of the length bytes that follow, which
+ * are count records of
+ *
+ *   expires (8) | stored (8) | qtype (2) | qclass (2) | flags (1) |
+ *   qname length (1) | response length (2) | qname | response
+ *
+ * with absolute (UNIX) times, per shard of the main region and then the
+ * window, each from the oldest.  Snapshots are read into the main region.
+ * All integers are in network byte order.  Expired records are skipped
+ * when a snapshot is read, and the TTLs of the others are counted down by
+ * the time since they were stored.
+ */
+#define STUBBY_CACHE_MAGIC     "STUBBYCC"
+#define STUBBY_CACHE_MAGIC_LEN 8
+#define STUBBY_CACHE_VERSION   1
+
+getdns_return_t stubby_cache_config(const getdns_dict *config);
+int stubby_cache_enabled(void);
+
+/* min_cache_ttl, max_cache_ttl and cache_ttl_overrides from the stubby
+ * configuration (also without a cache)
+ */
+getdns_return_t stubby_cache_ttl_config(const getdns_dict *config);
+
+/* Whether the TTLs in the answers that are served must be clamped */
+int stubby_cache_ttl_clamped(void);
+
+/* The TTL bounds for the answers to qname */
+void stubby_cache_ttl_bounds(const uint8_t *qname, size_t qname_len,
+    uint32_t *min_ttl, uint32_t *max_ttl);
+
+/* Move the (empty) cache into shared memory, for worker processes that are
+ * forked after this.  Fails when shared memory is not available.
+ */
+getdns_return_t stubby_cache_share(void);
+
+/* The bits of a request that its response depends on */
+#define STUBBY_CACHE_DO    0x01
+#define STUBBY_CACHE_CD    0x02
+#define STUBBY_CACHE_AD    0x04
+#define STUBBY_CACHE_EDNS0 0x08
+
+/**
+ * Look up the answer for a query.  qname is the name as it was asked (in
+ * wire format); it is copied into the answer's question.
+ * @param buf  receives the answer, with the TTLs counted down
+ * @return the length of the answer, or 0 when none was cached
+ */
+size_t stubby_cache_lookup(const uint8_t *qname, size_t qname_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags,
+    uint8_t *buf, size_t buf_len);
+
+/* Cache the wire format response to a query, when it can be cached */
+void stubby_cache_store(const uint8_t *qname, size_t qname_len,
+    uint16_t qtype, uint16_t qclass, uint8_t flags,
+    const uint8_t *response, size_t response_len);
+
+/**
+ * Remove answers from the cache.
+ * @param name        wire format name, or NULL to remove everything
+ * @param subdomains  also remove the answers for names below name
+ * @return the number of answers removed
+ */
+size_t stubby_cache_flush(const uint8_t *name, size_t name_len,
+    int subdomains);
+
+/* The number of answers in the cache */
+size_t stubby_cache_entries(void);
+
+/* Encode the cache as a snapshot into buf */
+getdns_return_t stubby_cache_encode(gldns_buffer *buf);
+
+/* Add the answers in the snapshot of len bytes at data to the cache */
+getdns_return_t stubby_cache_decode(const uint8_t *data, size_t len);
+
+/* Read the snapshot file (unless the cache was filled already) and write
+ * it periodically.
+ */
+void stubby_cache_start(getdns_context *context);
+
+/* Write the snapshot file for the last time */
+void stubby_cache_stop(void);
+
+/* Append the cache counters in OpenMetrics text format */
+void stubby_cache_metrics(gldns_buffer *buf);
+
+#endif /* _STUBBY_CACHE_H */
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "control.h"
+#include "log.h"
+#include "stats.h"
+#include "metrics.h"
+#include "trace.h"
+#include "hitters.h"
+#include "cache.h"
+#include "upgrade.h"
+#include "prefork.h"
+#include "memory.h"
+#include "sldns/sbuffer.h"
+
+#define CONTROL_MAX_LINE     1024
+#define CONTROL_IDLE_TIMEOUT 60000
+#define CONTROL_TIMEOUT_FOREVER ((uint64_t)0xFFFFFFFFFFFFFFFF)
+
+static char *socket_path = NULL;
+static stubby_control_reload_func reload_func = NULL;
+
+int stubby_control_enabled(void)
+{
+	return socket_path != NULL;
+}
+
+void stubby_control_set_reload(stubby_control_reload_func func)
+{
+	reload_func = func;
+}
+
+getdns_return_t stubby_control_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+
+	if (getdns_dict_get_bindata(config, "control_socket", &bindata))
+		return GETDNS_RETURN_GOOD;
+
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+	fprintf(stderr, "The control socket is not supported "
+	        "on this platform\n");
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+#else
+	if (bindata->size == 0
+	||  bindata->size >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		fprintf(stderr, "Invalid control_socket path\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	free(socket_path);
+	if (!(socket_path = malloc(bindata->size + 1)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	(void) memcpy(socket_path, bindata->data, bindata->size);
+	socket_path[bindata->size] = 0;
+	return GETDNS_RETURN_GOOD;
+#endif
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+
+static getdns_eventloop      *loop = NULL;
+static int                    listen_fd = -1;
+static getdns_eventloop_event listen_event;
+static struct stat            listen_st;   /* of socket_path, once bound */
+
+typedef struct control_conn {
+	int                    fd;
+	getdns_eventloop_event event;
+	char                   line[CONTROL_MAX_LINE];
+	size_t                 line_len;
+	gldns_buffer          *out;
+	size_t                 written;
+	int                    quit;
+	struct control_conn   *next;
+} control_conn;
+
+static control_conn *conns = NULL;
+
+/* Command handlers append their output to out and return NULL, or return
+ * an error message.
+ */
+typedef const char *(*control_cmd_func)(const char *arg, gldns_buffer *out);
+
+static const char *cmd_help(const char *arg, gldns_buffer *out);
+
+/* The counters cost a little on every query, so unless the metrics or
+ * statistics are configured they are only kept from the first command
+ * that shows them.
+ */
+static const char *cmd_stats(const char *arg, gldns_buffer *out)
+{
+	(void)arg;
+	if (!stubby_metrics_enabled()) {
+		stubby_metrics_enable();
+		stubby_trace_enable();
+		(void) gldns_buffer_printf(out, "# Counting starts now\n");
+	}
+	stubby_metrics_render(out);
+	return NULL;
+}
+
+static const char *cmd_upstreams(const char *arg, gldns_buffer *out)
+{
+	(void)arg;
+	stubby_stats_enable();
+	stubby_stats_upstreams_json(out);
+	return NULL;
+}
+
+static const char *cmd_top(const char *arg, gldns_buffer *out)
+{
+	(void)arg;
+	if (!stubby_hitters_enabled())
+		return "heavy_hitters are not configured";
+	stubby_hitters_json(out);
+	return NULL;
+}
+
+void stubby_control_log_level(getdns_loglevel_type level)
+{
+	/* Raising the level is for seeing the upstream and TLS messages
+	 * from getdns too, even without -l.
+	 */
+	if (level > stubby_get_log_level())
+		stubby_set_getdns_logging(1);
+	stubby_set_log_level(level);
+	stubby_stats_set_log_level(level);
+}
+
+static const char *cmd_loglevel(const char *arg, gldns_buffer *out)
+{
+	char *ep;
+	long level;
+
+	if (*arg) {
+		level = strtol(arg, &ep, 10);
+		if (level < 0 || level > 7 || *ep)
+			return "log level must be 0-7";
+		stubby_control_log_level((getdns_loglevel_type)level);
+		if (stubby_prefork_worker() >= 0
+		&&  stubby_prefork_set_log_level((int)level))
+			return "could not pass the log level on to the other "
+			       "workers";
+	}
+	(void) gldns_buffer_printf(out, "%d\n", (int)stubby_get_log_level());
+	return NULL;
+}
+
+static const char *cmd_flush(const char *arg, gldns_buffer *out)
+{
+	getdns_bindata *name = NULL;
+	int subdomains = *arg == '.' && arg[1];
+	size_t n;
+
+	if (!stubby_cache_enabled())
+		return "the cache is not configured";
+	if (*arg && getdns_convert_fqdn_to_dns_name(arg + subdomains, &name))
+		return "invalid name";
+	n = name ? stubby_cache_flush(name->data, name->size, subdomains)
+	         : stubby_cache_flush(NULL, 0, 0);
+	if (name) {
+		free(name->data);
+		free(name);
+	}
+	(void) gldns_buffer_printf(out, "%d\n", (int)n);
+	return NULL;
+}
+
+static const char *cmd_reload(const char *arg, gldns_buffer *out)
+{
+	(void)arg;
+	if (!reload_func)
+		return "reloading the configuration is not supported";
+	/* Every worker reloads, and logs how that went */
+	if (stubby_prefork_worker() >= 0) {
+		if (stubby_prefork_reload())
+			return "could not pass the reload on to the workers";
+		(void) gldns_buffer_printf(out, "reloading all workers, "
+		    "see the log for the changes\n");
+		return NULL;
+	}
+	if (reload_func(out))
+		return "reload failed, the configuration was not changed";
+	return NULL;
+}
+
+static const char *cmd_upgrade(const char *arg, gldns_buffer *out)
+{
+	(void)arg;
+	if (stubby_upgrade_request())
+		return "could not start the new stubby";
+	(void) gldns_buffer_printf(out, "upgrading, the new stubby takes "
+	    "over when it is ready\n");
+	return NULL;
+}
+
+static const struct {
+	const char       *name;
+	control_cmd_func  func;
+	const char       *usage;
+} commands[] = {
+	{ "help"     , cmd_help     , "help" },
+	{ "stats"    , cmd_stats    , "stats" },
+	{ "upstreams", cmd_upstreams, "upstreams" },
+	{ "top"      , cmd_top      , "top" },
+	{ "loglevel" , cmd_loglevel , "loglevel [0-7]" },
+	{ "flush"    , cmd_flush    , "flush [<name>|.<suffix>]" },
+	{ "reload"   , cmd_reload   , "reload" },
+	{ "upgrade"  , cmd_upgrade  , "upgrade" },
+	{ "quit"     , NULL         , "quit" }
+};
+#define N_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static const char *cmd_help(const char *arg, gldns_buffer *out)
+{
+	size_t i;
+
+	(void)arg;
+	for (i = 0; i < N_COMMANDS; i++)
+		(void) gldns_buffer_printf(out, "%s\n", commands[i].usage);
+	return NULL;
+}
+
+/* Execute the command on line and append the reply to conn->out */
+static void control_execute(control_conn *conn, char *line)
+{
+	gldns_buffer *output;
+	const char *err = "unknown command";
+	char *arg;
+	size_t i;
+
+	while (isspace((unsigned char)*line))
+		line++;
+	for (arg = line; *arg && !isspace((unsigned char)*arg); arg++)
+		; /* pass */
+	if (*arg)
+		*arg++ = 0;
+	while (isspace((unsigned char)*arg))
+		arg++;
+	for (i = strlen(arg); i > 0 && isspace((unsigned char)arg[i - 1]); i--)
+		arg[i - 1] = 0;
+
+	if (!*line)
+		return;
+	if (!(output = gldns_buffer_new(1024))) {
+		(void) gldns_buffer_printf(conn->out, "ERR out of memory\n");
+		return;
+	}
+	for (i = 0; i < N_COMMANDS; i++) {
+		if (strcmp(line, commands[i].name))
+			continue;
+		if (!commands[i].func) {
+			conn->quit = 1;
+			err = NULL;
+		} else if (!(err = commands[i].func(arg, output))
+		       && !gldns_buffer_status_ok(output))
+			err = "out of memory";
+		break;
+	}
+	if (err)
+		(void) gldns_buffer_printf(conn->out, "ERR %s\n", err);
+	else {
+		(void) gldns_buffer_printf(conn->out, "OK %d\n",
+		    (int)gldns_buffer_position(output));
+		if (gldns_buffer_reserve(conn->out,
+		    gldns_buffer_position(output)))
+			gldns_buffer_write(conn->out, gldns_buffer_begin(output),
+			    gldns_buffer_position(output));
+	}
+	gldns_buffer_free(output);
+}
+
+static void conn_close(control_conn *conn)
+{
+	control_conn **p;
+
+	(void) loop->vmt->clear(loop, &conn->event);
+	(void) close(conn->fd);
+	for (p = &conns; *p; p = &(*p)->next)
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	gldns_buffer_free(conn->out);
+	stubby_mem_free(STUBBY_MEM_STATS, conn);
+}
+
+static void conn_read_cb(void *userarg);
+static void conn_write_cb(void *userarg);
+
+static void conn_timeout_cb(void *userarg)
+{
+	conn_close((control_conn *)userarg);
+}
+
+static void conn_schedule(control_conn *conn, int writing)
+{
+	(void) loop->vmt->clear(loop, &conn->event);
+	conn->event.read_cb  = writing ? NULL : conn_read_cb;
+	conn->event.write_cb = writing ? conn_write_cb : NULL;
+	(void) loop->vmt->schedule(loop, conn->fd,
+	    CONTROL_IDLE_TIMEOUT, &conn->event);
+}
+
+static void conn_write_cb(void *userarg)
+{
+	control_conn *conn = (control_conn *)userarg;
+	size_t len = gldns_buffer_position(conn->out);
+	ssize_t n;
+
+	n = write(conn->fd, gldns_buffer_begin(conn->out) + conn->written,
+	    len - conn->written);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		conn_close(conn);
+		return;
+	}
+	if ((conn->written += n) < len)
+		return;
+
+	if (conn->quit) {
+		conn_close(conn);
+		return;
+	}
+	gldns_buffer_clear(conn->out);
+	conn->written = 0;
+	conn_schedule(conn, 0);
+}
+
+static void conn_read_cb(void *userarg)
+{
+	control_conn *conn = (control_conn *)userarg;
+	char *nl, *line;
+	ssize_t n;
+
+	n = read(conn->fd, conn->line + conn->line_len,
+	    sizeof(conn->line) - 1 - conn->line_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		conn_close(conn);
+		return;
+	}
+	conn->line_len += n;
+	conn->line[conn->line_len] = 0;
+
+	for ( line = conn->line
+	    ; !conn->quit && (nl = strchr(line, '\n'))
+	    ; line = nl + 1) {
+		*nl = 0;
+		control_execute(conn, line);
+	}
+	conn->line_len -= line - conn->line;
+	(void) memmove(conn->line, line, conn->line_len);
+
+	if (conn->line_len >= sizeof(conn->line) - 1)
+		conn_close(conn); /* Line too long */
+
+	else if (!gldns_buffer_status_ok(conn->out))
+		conn_close(conn);
+
+	else if (gldns_buffer_position(conn->out) > 0)
+		conn_schedule(conn, 1);
+
+	else if (conn->quit)
+		conn_close(conn);
+}
+
+static void listen_read_cb(void *userarg)
+{
+	control_conn *conn;
+	int fd;
+
+	(void)userarg;
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+		return;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+	||  !(conn = stubby_mem_calloc(STUBBY_MEM_STATS,
+	                               1, sizeof(control_conn)))) {
+		(void) close(fd);
+		return;
+	}
+	if (!(conn->out = gldns_buffer_new(4096))) {
+		stubby_mem_free(STUBBY_MEM_STATS, conn);
+		(void) close(fd);
+		return;
+	}
+	gldns_buffer_clear(conn->out);
+	conn->fd = fd;
+	conn->event.userarg = conn;
+	conn->event.read_cb = conn_read_cb;
+	conn->event.timeout_cb = conn_timeout_cb;
+	conn->next = conns;
+	conns = conn;
+	(void) loop->vmt->schedule(loop, fd, CONTROL_IDLE_TIMEOUT, &conn->event);
+}
+
+static int control_listen(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	(void) memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void) strcpy(sun.sun_path, socket_path);
+	(void) unlink(socket_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+	||  stat(socket_path, &listen_st) < 0
+	||  chmod(socket_path, 0660) < 0
+	||  listen(fd, 8) < 0
+	||  fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+getdns_return_t stubby_control_start(getdns_context *context)
+{
+	getdns_return_t r;
+
+	if (!socket_path || loop)
+		return GETDNS_RETURN_GOOD;
+
+	if ((r = getdns_context_get_eventloop(context, &loop)))
+		return r;
+
+	if ((listen_fd = control_listen()) < 0) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not open control socket \"%s\": %s\n",
+		    socket_path, strerror(errno));
+		loop = NULL;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	(void) memset(&listen_event, 0, sizeof(listen_event));
+	listen_event.read_cb = listen_read_cb;
+	(void) loop->vmt->schedule(loop, listen_fd,
+	    CONTROL_TIMEOUT_FOREVER, &listen_event);
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_control_stop(void)
+{
+	struct stat st;
+
+	if (!loop)
+		return;
+	while (conns)
+		conn_close(conns);
+	(void) loop->vmt->clear(loop, &listen_event);
+	(void) close(listen_fd);
+	listen_fd = -1;
+	/* Unless a stubby we upgraded to bound it again (after it gave up
+	 * waiting for us to stop)
+	 */
+	if (!stat(socket_path, &st) && st.st_dev == listen_st.st_dev
+	&&  st.st_ino == listen_st.st_ino)
+		(void) unlink(socket_path);
+	loop = NULL;
+}
+
+#else /* STUBBY_ON_WINDOWS */
+
+getdns_return_t stubby_control_start(getdns_context *context)
+{
+	(void)context;
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_control_stop(void)
+{
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_CONTROL_H
+#define _STUBBY_CONTROL_H
+
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Runtime control over a unix socket:
+ *
+ *   control_socket: "/run/stubby/control.sock"
+ *
+ * Clients send one command per line and may send several commands over a
+ * single connection.  Every command is answered either with
+ *
+ *   OK <length>\n<length bytes of output>
+ *
+ * or with a single line
+ *
+ *   ERR <message>\n
+ *
+ * Commands are read and answered on the event loop, without blocking, in
+ * between queries.  Nothing is done on the query path for them.
+ */
+getdns_return_t stubby_control_config(const getdns_dict *config);
+int stubby_control_enabled(void);
+
+/* Function for the reload command.  It appends a report of the changes to
+ * out and returns GETDNS_RETURN_GOOD, or leaves the configuration as it was
+ * and returns an error.
+ */
+typedef getdns_return_t (*stubby_control_reload_func)(gldns_buffer *out);
+void stubby_control_set_reload(stubby_control_reload_func func);
+
+/* Log at level from now on, as the loglevel command does.  With workers,
+ * for those that get the level from the worker with the control socket.
+ */
+void stubby_control_log_level(getdns_loglevel_type level);
+
+/* Open the control socket and schedule it on the context's event loop */
+getdns_return_t stubby_control_start(getdns_context *context);
+void stubby_control_stop(void);
+
+#endif /* _STUBBY_CONTROL_H */
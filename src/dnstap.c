@@ -0,0 +1,832 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * dnstap (https://dnstap.info) output of client queries and responses.
+ *
+ * Events are encoded to DNS wireformat on the thread that handles the
+ * query and queued on a ring buffer owned by that thread.  A single writer
+ * thread drains all rings, wraps the events in the dnstap protobuf
+ * encoding and writes them as Frame Streams data frames to a file or a
+ * unix socket.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <fcntl.h>
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+#include <io.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+#ifdef HAVE_STUBBY_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#include "dnstap.h"
+#include "log.h"
+#include "ring.h"
+#include "memory.h"
+#include "prefork.h"
+
+/* Events larger than this (i.e. very large TCP responses) are dropped */
+#define DNSTAP_MAX_WIRE     4096
+#define DNSTAP_RING_SLOTS   1024
+#define DNSTAP_MAX_QTYPES     32
+#define DNSTAP_MAX_IDENTITY  255
+#define DNSTAP_OUT_BUF     65536
+
+/* Seconds between attempts to (re)open the output */
+#define DNSTAP_REOPEN_INTERVAL 5
+
+#define DNSTAP_CONTENT_TYPE "protobuf:dnstap.Dnstap"
+
+/* dnstap.proto Message.Type */
+#define DNSTAP_CLIENT_QUERY     5
+#define DNSTAP_CLIENT_RESPONSE  6
+
+/* dnstap.proto SocketFamily and SocketProtocol */
+#define DNSTAP_INET             1
+#define DNSTAP_INET6            2
+#define DNSTAP_UDP              1
+#define DNSTAP_TCP              2
+
+/* Frame Streams control frame types and fields */
+#define FSTRM_CONTROL_ACCEPT  0x01
+#define FSTRM_CONTROL_START   0x02
+#define FSTRM_CONTROL_STOP    0x03
+#define FSTRM_CONTROL_READY   0x04
+#define FSTRM_CONTROL_FINISH  0x05
+#define FSTRM_CONTROL_FIELD_CONTENT_TYPE 0x01
+
+typedef struct dnstap_event {
+	uint8_t  type;
+	uint8_t  has_response_time;
+	uint16_t wire_len;
+	uint8_t  family;      /* 0 when the client is not known */
+	uint8_t  protocol;
+	uint16_t port;
+	uint8_t  address[16];
+	uint32_t query_nsec;
+	uint32_t response_nsec;
+	uint64_t query_sec;
+	uint64_t response_sec;
+	/* DNS message in wireformat follows */
+} dnstap_event;
+
+#define DNSTAP_SLOT_SIZE (sizeof(dnstap_event) + DNSTAP_MAX_WIRE)
+
+static struct {
+	char     *socket_path;
+	char     *file;
+	char     *identity;
+	uint32_t  sample_rate;
+	uint32_t  sample_count;
+	uint32_t  qtypes[DNSTAP_MAX_QTYPES];
+	size_t    n_qtypes;
+	int       log_queries;
+	int       log_responses;
+} dnstap = { NULL, NULL, NULL, 1, 0, { 0 }, 0, 1, 1 };
+
+#ifdef HAVE_STUBBY_THREADS
+typedef struct dnstap_ring_ref {
+	stubby_ring            *ring;
+	struct dnstap_ring_ref *next;
+} dnstap_ring_ref;
+
+static _Atomic(dnstap_ring_ref *) dnstap_rings = NULL;
+static STUBBY_THREAD_LOCAL stubby_ring *dnstap_ring = NULL;
+
+static pthread_t            dnstap_thread;
+static atomic_int           dnstap_running = 0;
+static atomic_uint_fast64_t dnstap_dropped = 0;
+#endif
+
+static char *dnstap_bindata_str(const getdns_bindata *bindata)
+{
+	char *str;
+
+	if (!(str = malloc(bindata->size + 1)))
+		return NULL;
+	(void) memcpy(str, bindata->data, bindata->size);
+	str[bindata->size] = 0;
+	return str;
+}
+
+getdns_return_t stubby_dnstap_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+	getdns_list *qtypes;
+	uint32_t n;
+	size_t i;
+
+	free(dnstap.socket_path);
+	free(dnstap.file);
+	free(dnstap.identity);
+	dnstap.socket_path = dnstap.file = dnstap.identity = NULL;
+
+	if (!getdns_dict_get_bindata(config, "socket_path", &bindata)
+	&&  !(dnstap.socket_path = dnstap_bindata_str(bindata)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	if (!getdns_dict_get_bindata(config, "file", &bindata)
+	&&  !(dnstap.file = dnstap_bindata_str(bindata)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	if (!getdns_dict_get_bindata(config, "identity", &bindata)) {
+		if (bindata->size > DNSTAP_MAX_IDENTITY) {
+			fprintf(stderr, "dnstap: identity can be at most %d "
+			        "bytes\n", DNSTAP_MAX_IDENTITY);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		if (!(dnstap.identity = dnstap_bindata_str(bindata)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+	}
+
+	if (dnstap.socket_path && dnstap.file) {
+		fprintf(stderr, "dnstap: only one of socket_path or file "
+		        "can be given\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	if (!dnstap.socket_path && !dnstap.file) {
+		fprintf(stderr, "dnstap: either socket_path or file "
+		        "is needed\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+	if (dnstap.socket_path) {
+		fprintf(stderr, "dnstap: socket_path is not supported "
+		        "on this platform\n");
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+	}
+#endif
+	dnstap.sample_rate = 1;
+	if (!getdns_dict_get_int(config, "sample_rate", &n))
+		dnstap.sample_rate = n ? n : 1;
+
+	if (!getdns_dict_get_int(config, "log_queries", &n))
+		dnstap.log_queries = n ? 1 : 0;
+
+	if (!getdns_dict_get_int(config, "log_responses", &n))
+		dnstap.log_responses = n ? 1 : 0;
+
+	dnstap.n_qtypes = 0;
+	if (!getdns_dict_get_list(config, "qtypes", &qtypes)) {
+		for ( i = 0
+		    ; !getdns_list_get_int(qtypes, i, &n)
+		    ; i++) {
+			if (dnstap.n_qtypes >= DNSTAP_MAX_QTYPES) {
+				fprintf(stderr, "dnstap: no more than %d qtypes "
+				        "can be filtered on\n", DNSTAP_MAX_QTYPES);
+				return GETDNS_RETURN_INVALID_PARAMETER;
+			}
+			dnstap.qtypes[dnstap.n_qtypes++] = n;
+		}
+	}
+#ifndef HAVE_STUBBY_THREADS
+	fprintf(stderr, "dnstap is not supported without thread support\n");
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+#else
+	return GETDNS_RETURN_GOOD;
+#endif
+}
+
+#ifdef HAVE_STUBBY_THREADS
+
+/* Protocol buffer encoding, only what is needed for dnstap */
+
+static size_t pb_varint_len(uint64_t v)
+{
+	size_t len = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+	return len;
+}
+
+static uint8_t *pb_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/* All dnstap field numbers are below 16, so tags always fit in a byte */
+#define PB_TAG(field, wire_type) ((uint8_t)(((field) << 3) | (wire_type)))
+#define PB_VARINT  0
+#define PB_BYTES   2
+#define PB_FIXED32 5
+
+static size_t pb_bytes_len(size_t len)
+{
+	return 1 + pb_varint_len(len) + len;
+}
+
+static uint8_t *pb_bytes(uint8_t *p, int field, const void *data, size_t len)
+{
+	*p++ = PB_TAG(field, PB_BYTES);
+	p = pb_varint(p, len);
+	(void) memcpy(p, data, len);
+	return p + len;
+}
+
+static uint8_t *pb_fixed32(uint8_t *p, int field, uint32_t v)
+{
+	*p++ = PB_TAG(field, PB_FIXED32);
+	*p++ = (uint8_t)(v);
+	*p++ = (uint8_t)(v >> 8);
+	*p++ = (uint8_t)(v >> 16);
+	*p++ = (uint8_t)(v >> 24);
+	return p;
+}
+
+static uint8_t *pb_uint(uint8_t *p, int field, uint64_t v)
+{
+	*p++ = PB_TAG(field, PB_VARINT);
+	return pb_varint(p, v);
+}
+
+static uint8_t *write_u32(uint8_t *p, uint32_t v)
+{
+	*p++ = (uint8_t)(v >> 24);
+	*p++ = (uint8_t)(v >> 16);
+	*p++ = (uint8_t)(v >> 8);
+	*p++ = (uint8_t)(v);
+	return p;
+}
+
+/* Encode ev as a Frame Streams data frame containing a Dnstap message */
+static size_t dnstap_encode(uint8_t *buf, const dnstap_event *ev)
+{
+	static const char *version = STUBBY_PACKAGE_STRING;
+	const uint8_t *wire = (const uint8_t *)(ev + 1);
+	int is_query = ev->type == DNSTAP_CLIENT_QUERY;
+	size_t msg_len, frame_len;
+	uint8_t *p;
+
+	size_t addr_len = ev->family == DNSTAP_INET ? 4 : 16;
+
+	/* Message */
+	msg_len = 2                                           /* type */
+	        + 1 + pb_varint_len(ev->query_sec) + 5        /* query_time */
+	        + pb_bytes_len(ev->wire_len);      /* query or response msg */
+	if (ev->family)
+		msg_len += 2 + 2                  /* socket family, protocol */
+		         + pb_bytes_len(addr_len)             /* query_address */
+		         + 1 + pb_varint_len(ev->port);       /* query_port */
+	if (ev->has_response_time)
+		msg_len += 1 + pb_varint_len(ev->response_sec) + 5;
+
+	/* Dnstap */
+	frame_len = pb_bytes_len(strlen(version))
+	          + pb_bytes_len(msg_len)
+	          + 2;                                        /* type */
+	if (dnstap.identity)
+		frame_len += pb_bytes_len(strlen(dnstap.identity));
+
+	p = write_u32(buf, (uint32_t)frame_len);
+	if (dnstap.identity)
+		p = pb_bytes(p, 1, dnstap.identity, strlen(dnstap.identity));
+	p = pb_bytes(p, 2, version, strlen(version));
+
+	*p++ = PB_TAG(14, PB_BYTES);
+	p = pb_varint(p, msg_len);
+	p = pb_uint(p, 1, ev->type);
+	if (ev->family) {
+		p = pb_uint(p, 2, ev->family);
+		p = pb_uint(p, 3, ev->protocol);
+		p = pb_bytes(p, 4, ev->address, addr_len);
+		p = pb_uint(p, 6, ev->port);
+	}
+	p = pb_uint(p, 8, ev->query_sec);
+	p = pb_fixed32(p, 9, ev->query_nsec);
+	p = pb_bytes(p, is_query ? 10 : 14, wire, ev->wire_len);
+	if (ev->has_response_time) {
+		p = pb_uint(p, 12, ev->response_sec);
+		p = pb_fixed32(p, 13, ev->response_nsec);
+	}
+	p = pb_uint(p, 15, 1);                           /* Dnstap.MESSAGE */
+
+	assert((size_t)(p - buf) == frame_len + 4);
+	return frame_len + 4;
+}
+
+static size_t fstrm_control(uint8_t *buf, uint32_t type)
+{
+	size_t ct_len = sizeof(DNSTAP_CONTENT_TYPE) - 1;
+	int with_ct = type == FSTRM_CONTROL_READY
+	           || type == FSTRM_CONTROL_START;
+	uint8_t *p = buf;
+
+	p = write_u32(p, 0);                                   /* escape */
+	p = write_u32(p, (uint32_t)(4 + (with_ct ? 8 + ct_len : 0)));
+	p = write_u32(p, type);
+	if (with_ct) {
+		p = write_u32(p, FSTRM_CONTROL_FIELD_CONTENT_TYPE);
+		p = write_u32(p, (uint32_t)ct_len);
+		(void) memcpy(p, DNSTAP_CONTENT_TYPE, ct_len);
+		p += ct_len;
+	}
+	return (size_t)(p - buf);
+}
+
+/* Writer thread state */
+static char   *out_file = NULL; /* With workers, one for each */
+static int     out_fd = -1;
+static uint8_t out_buf[DNSTAP_OUT_BUF];
+static size_t  out_len = 0;
+static int     out_opened = 0; /* The file was truncated already */
+static off_t   out_end = 0;    /* The file up to the last whole write */
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+static dev_t   out_dev;
+static ino_t   out_ino;
+#endif
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void dnstap_close(void)
+{
+	if (out_fd >= 0)
+		(void) close(out_fd);
+	out_fd = -1;
+	out_len = 0;
+}
+
+static int dnstap_flush(void)
+{
+	if (out_fd < 0 || !out_len)
+		return 0;
+	if (write_all(out_fd, out_buf, out_len)) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "dnstap: write failed: %s\n", strerror(errno));
+		dnstap_close();
+		return -1;
+	}
+	if (!dnstap.socket_path)
+		out_end += (off_t)out_len;
+	out_len = 0;
+	return 0;
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+/* Read a control frame of the given type from a bidirectional stream */
+static int fstrm_read_control(int fd, uint32_t type)
+{
+	uint8_t buf[512];
+	uint32_t len;
+	size_t have = 0;
+	ssize_t n;
+
+	while (have < 8) {
+		if ((n = read(fd, buf + have, 8 - have)) <= 0)
+			return -1;
+		have += n;
+	}
+	len = ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16)
+	    | ((uint32_t)buf[6] <<  8) |  (uint32_t)buf[7];
+	if (buf[0] || buf[1] || buf[2] || buf[3] || len < 4
+	||  len > sizeof(buf))
+		return -1;
+	have = 0;
+	while (have < len) {
+		if ((n = read(fd, buf + have, len - have)) <= 0)
+			return -1;
+		have += n;
+	}
+	return ((uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16
+	      | (uint32_t)buf[2] <<  8 | (uint32_t)buf[3]) == type ? 0 : -1;
+}
+
+static int dnstap_connect(void)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { 1, 0 };
+	uint8_t buf[64];
+	int fd;
+
+	if (strlen(dnstap.socket_path) >= sizeof(addr.sun_path))
+		return -1;
+	(void) memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	(void) strcpy(addr.sun_path, dnstap.socket_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	||  write_all(fd, buf, fstrm_control(buf, FSTRM_CONTROL_READY))
+	||  fstrm_read_control(fd, FSTRM_CONTROL_ACCEPT)) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+/* Only the first open starts the file anew.  Opens after a write error
+ * append a new stream (with its own START frame) to what was captured,
+ * after cutting off a frame that was written in part.
+ */
+static int dnstap_open_file(void)
+{
+	int fd;
+	off_t len;
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	struct stat st;
+#endif
+
+	if ((fd = open(out_file, O_WRONLY | O_CREAT
+	    | (out_opened ? O_APPEND : O_TRUNC), 0640)) < 0)
+		return -1;
+	if ((len = lseek(fd, 0, SEEK_END)) < 0)
+		len = 0;
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	/* Not when the file was replaced (i.e. rotated) since */
+	if (!fstat(fd, &st)) {
+		if (out_opened && st.st_dev == out_dev && st.st_ino == out_ino
+		&&  len > out_end && !ftruncate(fd, out_end))
+			len = out_end;
+		out_dev = st.st_dev;
+		out_ino = st.st_ino;
+	}
+#endif
+	out_opened = 1;
+	out_end = len;
+	return fd;
+}
+
+static int dnstap_open(void)
+{
+	uint8_t buf[64];
+	size_t len = fstrm_control(buf, FSTRM_CONTROL_START);
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	if (dnstap.socket_path)
+		out_fd = dnstap_connect();
+	else
+#endif
+		out_fd = dnstap_open_file();
+
+	if (out_fd < 0 || write_all(out_fd, buf, len)) {
+		dnstap_close();
+		return -1;
+	}
+	if (!dnstap.socket_path)
+		out_end += (off_t)len;
+	stubby_local_log(NULL, 0, GETDNS_LOG_INFO, "dnstap: writing to %s\n",
+	    dnstap.socket_path ? dnstap.socket_path : out_file);
+	return 0;
+}
+
+static void dnstap_finish(void)
+{
+	uint8_t buf[64];
+
+	if (out_fd < 0 || dnstap_flush())
+		return;
+	(void) write_all(out_fd, buf, fstrm_control(buf, FSTRM_CONTROL_STOP));
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	if (dnstap.socket_path)
+		(void) fstrm_read_control(out_fd, FSTRM_CONTROL_FINISH);
+#endif
+	dnstap_close();
+}
+
+static uint64_t dnstap_total_dropped(void)
+{
+	uint64_t dropped = atomic_load(&dnstap_dropped);
+	dnstap_ring_ref *ref;
+
+	for (ref = atomic_load(&dnstap_rings); ref; ref = ref->next)
+		dropped += stubby_ring_dropped(ref->ring);
+	return dropped;
+}
+
+/* Drain at most max events from every ring, returns the number written */
+static size_t dnstap_drain(uint8_t *ev_buf, size_t max)
+{
+	dnstap_ring_ref *ref;
+	size_t n = 0, i;
+
+	for (ref = atomic_load(&dnstap_rings); ref; ref = ref->next) {
+		for (i = 0; i < max; i++) {
+			if (!stubby_ring_pop(ref->ring, ev_buf))
+				break;
+			/* Room for the event, the identity and the
+			 * protobuf framing around them
+			 */
+			if (out_fd < 0 || (out_len + DNSTAP_SLOT_SIZE
+			    + DNSTAP_MAX_IDENTITY + 256 > sizeof(out_buf)
+			    && dnstap_flush())) {
+				/* Not connected, or no longer */
+				atomic_fetch_add(&dnstap_dropped, 1);
+				continue;
+			}
+			out_len += dnstap_encode(out_buf + out_len,
+			    (dnstap_event *)ev_buf);
+			n++;
+		}
+	}
+	return n;
+}
+
+static void *dnstap_writer(void *arg)
+{
+	uint8_t *ev_buf = stubby_mem_malloc(STUBBY_MEM_RINGS,
+	    DNSTAP_SLOT_SIZE);
+	time_t last_open = 0, now;
+	uint64_t reported = 0, dropped;
+	long idle_usec = 0;
+
+	(void)arg;
+	if (!ev_buf)
+		return NULL;
+
+	for (;;) {
+		if (out_fd < 0
+		&&  (now = time(NULL)) - last_open >= DNSTAP_REOPEN_INTERVAL) {
+			last_open = now;
+			if (dnstap_open())
+				stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+				    "dnstap: could not open %s\n",
+				    dnstap.socket_path ? dnstap.socket_path
+				                       : out_file);
+		}
+		if (dnstap_drain(ev_buf, 256)) {
+			idle_usec = 0;
+			continue;
+		}
+		(void) dnstap_flush();
+
+		if ((dropped = dnstap_total_dropped()) != reported) {
+			stubby_local_log(NULL, 0, GETDNS_LOG_NOTICE,
+			    "dnstap: %"PRIu64" events dropped\n",
+			    dropped - reported);
+			reported = dropped;
+		}
+		if (!atomic_load(&dnstap_running)) {
+			while (dnstap_drain(ev_buf, 256))
+				; /* pass */
+			dnstap_finish();
+			break;
+		}
+		idle_usec = idle_usec ? idle_usec * 2 : 1000;
+		if (idle_usec > 100000)
+			idle_usec = 100000;
+		{
+			struct timespec ts = { 0, idle_usec * 1000 };
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+	stubby_mem_free(STUBBY_MEM_RINGS, ev_buf);
+	return NULL;
+}
+
+static stubby_ring *dnstap_thread_ring(void)
+{
+	dnstap_ring_ref *ref;
+
+	if (dnstap_ring)
+		return dnstap_ring;
+
+	if (!(ref = stubby_mem_malloc(STUBBY_MEM_RINGS,
+	    sizeof(dnstap_ring_ref))))
+		return NULL;
+	if (!(ref->ring = stubby_ring_create(
+	    DNSTAP_RING_SLOTS, DNSTAP_SLOT_SIZE))) {
+		stubby_mem_free(STUBBY_MEM_RINGS, ref);
+		return NULL;
+	}
+	ref->next = atomic_load(&dnstap_rings);
+	while (!atomic_compare_exchange_weak(&dnstap_rings, &ref->next, ref))
+		; /* pass */
+	return (dnstap_ring = ref->ring);
+}
+
+/* The client in ev, when it is an IPv4 or IPv6 address */
+static void dnstap_client(dnstap_event *ev,
+    const struct sockaddr *client, size_t client_len, int tcp)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)client;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)client;
+
+	ev->family = 0;
+	if (!client)
+		return;
+	if (client->sa_family == AF_INET && client_len >= sizeof(*sin)) {
+		ev->family = DNSTAP_INET;
+		ev->port = ntohs(sin->sin_port);
+		(void) memcpy(ev->address, &sin->sin_addr, 4);
+	} else if (client->sa_family == AF_INET6
+	&&  client_len >= sizeof(*sin6)) {
+		ev->family = DNSTAP_INET6;
+		ev->port = ntohs(sin6->sin6_port);
+		(void) memcpy(ev->address, &sin6->sin6_addr, 16);
+	}
+	ev->protocol = tcp ? DNSTAP_TCP : DNSTAP_UDP;
+}
+
+static void dnstap_queue(uint8_t type, const getdns_dict *msg,
+    const struct sockaddr *client, size_t client_len, int tcp,
+    const struct timespec *query_time, const struct timespec *response_time)
+{
+	uint8_t buf[DNSTAP_SLOT_SIZE];
+	dnstap_event *ev = (dnstap_event *)buf;
+	size_t wire_len = DNSTAP_MAX_WIRE;
+	stubby_ring *ring;
+
+	if (!(ring = dnstap_thread_ring())
+	||  getdns_msg_dict2wire_buf(msg, (uint8_t *)(ev + 1), &wire_len)) {
+		atomic_fetch_add(&dnstap_dropped, 1);
+		return;
+	}
+	ev->type = type;
+	ev->wire_len = (uint16_t)wire_len;
+	dnstap_client(ev, client, client_len, tcp);
+	ev->query_sec = (uint64_t)query_time->tv_sec;
+	ev->query_nsec = (uint32_t)query_time->tv_nsec;
+	if ((ev->has_response_time = response_time ? 1 : 0)) {
+		ev->response_sec = (uint64_t)response_time->tv_sec;
+		ev->response_nsec = (uint32_t)response_time->tv_nsec;
+	}
+	(void) stubby_ring_push(ring, buf, sizeof(dnstap_event) + wire_len);
+}
+#endif /* HAVE_STUBBY_THREADS */
+
+void stubby_dnstap_start(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	if ((!dnstap.socket_path && !dnstap.file)
+	||  atomic_load(&dnstap_running))
+		return;
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	if (!dnstap.identity) {
+		char hostname[256];
+
+		if (!gethostname(hostname, sizeof(hostname))) {
+			hostname[DNSTAP_MAX_IDENTITY] = 0;
+			dnstap.identity = strdup(hostname);
+		}
+	}
+#endif
+	/* Workers each connect to the socket, or write a file of their own
+	 * named after the configured one with ".<worker number>" appended.
+	 */
+	free(out_file);
+	out_file = NULL;
+	if (dnstap.file) {
+		size_t len = strlen(dnstap.file) + 16;
+
+		if (!(out_file = malloc(len)))
+			return;
+		if (stubby_prefork_worker() >= 0)
+			(void) snprintf(out_file, len, "%s.%d", dnstap.file,
+			    stubby_prefork_worker());
+		else
+			(void) memcpy(out_file, dnstap.file,
+			    strlen(dnstap.file) + 1);
+	}
+	atomic_store(&dnstap_running, 1);
+	if (pthread_create(&dnstap_thread, NULL, dnstap_writer, NULL)) {
+		atomic_store(&dnstap_running, 0);
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "dnstap: could not start writer thread\n");
+	}
+#endif
+}
+
+void stubby_dnstap_stop(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	if (!atomic_load(&dnstap_running))
+		return;
+	atomic_store(&dnstap_running, 0);
+	(void) pthread_join(dnstap_thread, NULL);
+#endif
+}
+
+int stubby_dnstap_running(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	return atomic_load_explicit(&dnstap_running, memory_order_relaxed);
+#else
+	return 0;
+#endif
+}
+
+int stubby_dnstap_sample(uint32_t qtype)
+{
+#ifdef HAVE_STUBBY_THREADS
+	size_t i;
+
+	if (!atomic_load_explicit(&dnstap_running, memory_order_relaxed))
+		return 0;
+
+	if (dnstap.n_qtypes) {
+		for (i = 0; i < dnstap.n_qtypes; i++)
+			if (dnstap.qtypes[i] == qtype)
+				break;
+		if (i == dnstap.n_qtypes)
+			return 0;
+	}
+	if (++dnstap.sample_count < dnstap.sample_rate)
+		return 0;
+	dnstap.sample_count = 0;
+	return 1;
+#else
+	(void)qtype;
+	return 0;
+#endif
+}
+
+void stubby_dnstap_client_query(const getdns_dict *request,
+    const struct sockaddr *client, size_t client_len, int tcp,
+    struct timespec *query_time)
+{
+	(void) clock_gettime(CLOCK_REALTIME, query_time);
+#ifdef HAVE_STUBBY_THREADS
+	if (dnstap.log_queries)
+		dnstap_queue(DNSTAP_CLIENT_QUERY, request,
+		    client, client_len, tcp, query_time, NULL);
+#else
+	(void)request; (void)client; (void)client_len; (void)tcp;
+#endif
+}
+
+void stubby_dnstap_client_response(const getdns_dict *response,
+    const struct sockaddr *client, size_t client_len, int tcp,
+    const struct timespec *query_time)
+{
+#ifdef HAVE_STUBBY_THREADS
+	struct timespec response_time;
+	getdns_dict *reply;
+
+	if (!dnstap.log_responses)
+		return;
+	/* Responses from getdns carry the message in the replies_tree,
+	 * but the ones made up by stubby (i.e. SERVFAIL) are the message.
+	 */
+	if (getdns_dict_get_dict(response, "/replies_tree/0", &reply))
+		reply = (getdns_dict *)response;
+
+	(void) clock_gettime(CLOCK_REALTIME, &response_time);
+	dnstap_queue(DNSTAP_CLIENT_RESPONSE, reply, client, client_len, tcp,
+	    query_time, &response_time);
+#else
+	(void)response; (void)client; (void)client_len; (void)tcp;
+	(void)query_time;
+#endif
+}
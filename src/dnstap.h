@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_DNSTAP_H
+#define _STUBBY_DNSTAP_H
+
+#include <stddef.h>
+#include <time.h>
+#include <getdns/getdns.h>
+
+struct sockaddr;
+
+/**
+ * Configure dnstap output from the "dnstap" mapping in the configuration:
+ *
+ *   dnstap:
+ *     socket_path: "/run/stubby/dnstap.sock"  # Frame Streams unix socket
+ *     file: "/var/log/stubby/stubby.dnstap"   # or a Frame Streams file
+ *     identity: "resolver1"                   # defaults to the hostname
+ *     sample_rate: 10                         # log 1 in every 10 queries
+ *     qtypes: [ GETDNS_RRTYPE_A, GETDNS_RRTYPE_AAAA ]
+ *     log_queries: 1
+ *     log_responses: 1
+ */
+getdns_return_t stubby_dnstap_config(const getdns_dict *config);
+
+/**
+ * Start the dnstap writer thread.  Like the log writer, it must be started
+ * after daemonizing.  Does nothing when dnstap was not configured.
+ */
+void stubby_dnstap_start(void);
+
+/* Write out queued events, close the output and stop the writer thread */
+void stubby_dnstap_stop(void);
+
+/* Whether the writer is running, so that queries may be logged */
+int stubby_dnstap_running(void);
+
+/**
+ * Whether a query with the given qtype should be logged.  Applies the
+ * qtype filter and the sample rate, so it must be called only once per
+ * query.  Always 0 when dnstap is not running.
+ */
+int stubby_dnstap_sample(uint32_t qtype);
+
+/**
+ * Queue a CLIENT_QUERY message.
+ * @param request     the request as received from the client
+ * @param client      the address of the client, or NULL when not known,
+ *                    recorded as query_address and query_port
+ * @param tcp         whether the query came over TCP
+ * @param query_time  set to the (realtime) time of the query, for use with
+ *                    the matching stubby_dnstap_client_response()
+ */
+void stubby_dnstap_client_query(const getdns_dict *request,
+    const struct sockaddr *client, size_t client_len, int tcp,
+    struct timespec *query_time);
+
+/* Queue a CLIENT_RESPONSE message */
+void stubby_dnstap_client_response(const getdns_dict *response,
+    const struct sockaddr *client, size_t client_len, int tcp,
+    const struct timespec *query_time);
+
+#endif /* _STUBBY_DNSTAP_H */
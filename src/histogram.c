@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "histogram.h"
+
+void stubby_histogram_observe(stubby_histogram *h, uint64_t ns)
+{
+	uint64_t bound_ns = STUBBY_HISTOGRAM_MIN_US * 1000;
+	size_t bucket = 0;
+
+	while (bucket < STUBBY_HISTOGRAM_BUCKETS - 1 && ns > bound_ns) {
+		bound_ns <<= 1;
+		bucket++;
+	}
+	h->buckets[bucket]++;
+	h->sum_ns += ns;
+}
+
+void stubby_histogram_add(stubby_histogram *total, const stubby_histogram *h)
+{
+	size_t i;
+
+	for (i = 0; i < STUBBY_HISTOGRAM_BUCKETS; i++)
+		total->buckets[i] += h->buckets[i];
+	total->sum_ns += h->sum_ns;
+}
+
+void stubby_histogram_openmetrics(gldns_buffer *buf, const char *name,
+    const char *labels, const stubby_histogram *h)
+{
+	const char *sep = labels ? "," : "";
+	uint64_t cumulative = 0;
+	size_t i;
+
+	if (!labels)
+		labels = "";
+	for (i = 0; i < STUBBY_HISTOGRAM_BUCKETS - 1; i++) {
+		cumulative += h->buckets[i];
+		(void) gldns_buffer_printf(buf,
+		    "%s_bucket{%s%sle=\"%.9g\"} %"PRIu64"\n", name, labels, sep,
+		    (double)((uint64_t)STUBBY_HISTOGRAM_MIN_US << i) / 1e6,
+		    cumulative);
+	}
+	cumulative += h->buckets[i];
+	(void) gldns_buffer_printf(buf,
+	    "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, labels, sep,
+	    cumulative);
+	if (*labels)
+		(void) gldns_buffer_printf(buf, "%s_count{%s} %"PRIu64"\n"
+		    "%s_sum{%s} %.9g\n", name, labels, cumulative,
+		    name, labels, (double)h->sum_ns / 1e9);
+	else
+		(void) gldns_buffer_printf(buf, "%s_count %"PRIu64"\n"
+		    "%s_sum %.9g\n", name, cumulative,
+		    name, (double)h->sum_ns / 1e9);
+}
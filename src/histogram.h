@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_HISTOGRAM_H
+#define _STUBBY_HISTOGRAM_H
+
+#include <stdint.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Latency histogram with buckets that have upper bounds of 16us, 32us,
+ * ... 8.4s plus one for everything above.  Not thread safe; every
+ * histogram is updated and read from the event loop only.
+ */
+#define STUBBY_HISTOGRAM_BUCKETS   21
+#define STUBBY_HISTOGRAM_MIN_US    16
+
+typedef struct stubby_histogram {
+	uint64_t buckets[STUBBY_HISTOGRAM_BUCKETS];
+	uint64_t sum_ns;
+} stubby_histogram;
+
+void stubby_histogram_observe(stubby_histogram *h, uint64_t ns);
+
+/* Add the observations of h to total */
+void stubby_histogram_add(stubby_histogram *total, const stubby_histogram *h);
+
+/**
+ * Append the _bucket, _count and _sum samples of a histogram in
+ * OpenMetrics text format.  The "# TYPE" line is up to the caller.
+ * @param name    the metric family name, in seconds
+ * @param labels  labels for the samples, i.e. 'stage="wait"', or NULL
+ */
+void stubby_histogram_openmetrics(gldns_buffer *buf, const char *name,
+    const char *labels, const stubby_histogram *h);
+
+#endif /* _STUBBY_HISTOGRAM_H */
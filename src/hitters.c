@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <math.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include "hitters.h"
+#include "memory.h"
+#include "qname.h"
+
+#define HITTERS_DEFAULT_TOP   20
+#define HITTERS_MAX_TOP     1000
+#define HITTERS_MAX_KEY      255
+
+/* Count-min sketch dimensions */
+#define CM_DEPTH       4
+#define CM_WIDTH    2048
+
+/* HyperLogLog with 2^12 registers, standard error 1.04/sqrt(4096) = 1.6% */
+#define HLL_BITS      12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+typedef struct hitter {
+	uint64_t hash;
+	uint64_t count;
+	uint64_t error;   /* count may be overestimated by at most this */
+	uint8_t  key_len;
+	uint8_t  key[HITTERS_MAX_KEY];
+} hitter;
+
+typedef struct tracker {
+	const char *name;
+	uint64_t    total;
+	size_t      capacity;
+	size_t      n;
+	hitter     *heap;        /* Min-heap on count                      */
+	uint32_t   *index;       /* Open addressing: heap position + 1     */
+	size_t      index_mask;
+	uint32_t    cm[CM_DEPTH][CM_WIDTH];
+} tracker;
+
+static int      enabled = 0;
+static size_t   report_top = HITTERS_DEFAULT_TOP;
+static tracker *names = NULL;
+static tracker *nxdomains = NULL;
+static tracker *clients = NULL;
+static uint8_t  names_hll[HLL_REGISTERS];
+static uint8_t  clients_hll[HLL_REGISTERS];
+
+static void hll_add(uint8_t *registers, uint64_t hash)
+{
+	size_t i = hash >> (64 - HLL_BITS);
+	uint64_t rest = hash << HLL_BITS;
+	uint8_t rank = 1;
+
+	while (rank <= 64 - HLL_BITS && !(rest & 0x8000000000000000ULL)) {
+		rest <<= 1;
+		rank++;
+	}
+	if (rank > registers[i])
+		registers[i] = rank;
+}
+
+static uint64_t hll_estimate(const uint8_t *registers)
+{
+	const double m = HLL_REGISTERS;
+	double sum = 0.0, estimate;
+	size_t i, zeros = 0;
+
+	for (i = 0; i < HLL_REGISTERS; i++) {
+		sum += ldexp(1.0, -(int)registers[i]);
+		if (!registers[i])
+			zeros++;
+	}
+	estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros)
+		/* Small range correction: linear counting */
+		estimate = m * log(m / (double)zeros);
+	return (uint64_t)(estimate + 0.5);
+}
+
+static void cm_add(tracker *t, uint64_t hash)
+{
+	uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+	size_t d;
+
+	for (d = 0; d < CM_DEPTH; d++) {
+		uint32_t *counter = &t->cm[d][(h1 + d * h2) & (CM_WIDTH - 1)];
+
+		if (*counter < UINT32_MAX)
+			(*counter)++;
+	}
+}
+
+static uint64_t cm_estimate(const tracker *t, uint64_t hash)
+{
+	uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+	uint32_t estimate = UINT32_MAX;
+	size_t d;
+
+	for (d = 0; d < CM_DEPTH; d++) {
+		uint32_t counter = t->cm[d][(h1 + d * h2) & (CM_WIDTH - 1)];
+
+		if (counter < estimate)
+			estimate = counter;
+	}
+	return estimate;
+}
+
+static tracker *tracker_create(const char *name, size_t capacity)
+{
+	tracker *t;
+	size_t index_sz = 1;
+
+	while (index_sz < capacity * 2)
+		index_sz <<= 1;
+
+	if (!(t = stubby_mem_calloc(STUBBY_MEM_HITTERS, 1, sizeof(tracker))))
+		return NULL;
+	if (!(t->heap = stubby_mem_calloc(STUBBY_MEM_HITTERS,
+	    capacity, sizeof(hitter)))
+	||  !(t->index = stubby_mem_calloc(STUBBY_MEM_HITTERS,
+	    index_sz, sizeof(uint32_t)))) {
+		stubby_mem_free(STUBBY_MEM_HITTERS, t->heap);
+		stubby_mem_free(STUBBY_MEM_HITTERS, t);
+		return NULL;
+	}
+	t->name = name;
+	t->capacity = capacity;
+	t->index_mask = index_sz - 1;
+	return t;
+}
+
+static void tracker_destroy(tracker *t)
+{
+	if (!t)
+		return;
+	stubby_mem_free(STUBBY_MEM_HITTERS, t->index);
+	stubby_mem_free(STUBBY_MEM_HITTERS, t->heap);
+	stubby_mem_free(STUBBY_MEM_HITTERS, t);
+}
+
+/* Slot with the key, or the empty slot where it would go */
+static size_t index_find(const tracker *t,
+    uint64_t hash, const uint8_t *key, size_t len)
+{
+	size_t i = hash & t->index_mask;
+	uint32_t pos;
+
+	while ((pos = t->index[i])) {
+		const hitter *h = &t->heap[pos - 1];
+
+		if (h->hash == hash && h->key_len == len
+		&&  !memcmp(h->key, key, len))
+			return i;
+		i = (i + 1) & t->index_mask;
+	}
+	return i;
+}
+
+/* Slot referring to the heap position */
+static size_t index_slot(const tracker *t, size_t pos)
+{
+	size_t i = t->heap[pos].hash & t->index_mask;
+
+	while (t->index[i] != pos + 1)
+		i = (i + 1) & t->index_mask;
+	return i;
+}
+
+/* Linear probing deletion, shifting back entries that probed past i */
+static void index_remove(tracker *t, size_t i)
+{
+	size_t j = i, k;
+
+	for (;;) {
+		t->index[i] = 0;
+		for (;;) {
+			j = (j + 1) & t->index_mask;
+			if (!t->index[j])
+				return;
+			k = t->heap[t->index[j] - 1].hash & t->index_mask;
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		t->index[i] = t->index[j];
+		i = j;
+	}
+}
+
+static void heap_swap(tracker *t, size_t a, size_t b)
+{
+	size_t slot_a = index_slot(t, a), slot_b = index_slot(t, b);
+	hitter tmp;
+
+	tmp = t->heap[a];
+	t->heap[a] = t->heap[b];
+	t->heap[b] = tmp;
+	t->index[slot_a] = (uint32_t)(b + 1);
+	t->index[slot_b] = (uint32_t)(a + 1);
+}
+
+static void heap_down(tracker *t, size_t pos)
+{
+	size_t child;
+
+	while ((child = pos * 2 + 1) < t->n) {
+		if (child + 1 < t->n
+		&&  t->heap[child + 1].count < t->heap[child].count)
+			child++;
+		if (t->heap[pos].count <= t->heap[child].count)
+			break;
+		heap_swap(t, pos, child);
+		pos = child;
+	}
+}
+
+static void heap_up(tracker *t, size_t pos)
+{
+	size_t parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (t->heap[parent].count <= t->heap[pos].count)
+			break;
+		heap_swap(t, pos, parent);
+		pos = parent;
+	}
+}
+
+static void hitter_set(hitter *h, uint64_t hash,
+    const uint8_t *key, size_t len, uint64_t count, uint64_t error)
+{
+	h->hash = hash;
+	h->count = count;
+	h->error = error;
+	h->key_len = (uint8_t)len;
+	(void) memcpy(h->key, key, len);
+}
+
+static void tracker_add(tracker *t, uint64_t hash,
+    const uint8_t *key, size_t len)
+{
+	size_t slot, pos;
+	uint64_t min;
+
+	t->total++;
+	cm_add(t, hash);
+
+	slot = index_find(t, hash, key, len);
+	if (t->index[slot]) {
+		pos = t->index[slot] - 1;
+		t->heap[pos].count++;
+		heap_down(t, pos);
+
+	} else if (t->n < t->capacity) {
+		pos = t->n++;
+		hitter_set(&t->heap[pos], hash, key, len, 1, 0);
+		t->index[slot] = (uint32_t)(pos + 1);
+		heap_up(t, pos);
+	} else {
+		/* Space-saving: the new key replaces the least counted one
+		 * and inherits its count as possible overestimation.
+		 */
+		index_remove(t, index_slot(t, 0));
+		min = t->heap[0].count;
+		hitter_set(&t->heap[0], hash, key, len, min + 1, min);
+		t->index[index_find(t, hash, key, len)] = 1;
+		heap_down(t, 0);
+	}
+}
+
+getdns_return_t stubby_hitters_config(const getdns_dict *config)
+{
+	uint32_t n;
+
+	if (!getdns_dict_get_int(config, "top", &n)) {
+		if (n == 0 || n > HITTERS_MAX_TOP) {
+			fprintf(stderr, "heavy_hitters top must be between "
+			        "1 and %d\n", HITTERS_MAX_TOP);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		report_top = n;
+	}
+	tracker_destroy(names);
+	tracker_destroy(nxdomains);
+	tracker_destroy(clients);
+	names = tracker_create("names", report_top * 4);
+	nxdomains = tracker_create("nxdomain_names", report_top * 4);
+	clients = tracker_create("clients", report_top * 4);
+	if (!names || !nxdomains || !clients) {
+		tracker_destroy(names);
+		tracker_destroy(nxdomains);
+		tracker_destroy(clients);
+		names = nxdomains = clients = NULL;
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	(void) memset(names_hll, 0, sizeof(names_hll));
+	(void) memset(clients_hll, 0, sizeof(clients_hll));
+	stubby_qname_init();
+	enabled = 1;
+	return GETDNS_RETURN_GOOD;
+}
+
+int stubby_hitters_enabled(void)
+{
+	return enabled;
+}
+
+void stubby_hitters_query(const uint8_t *qname, size_t qname_len)
+{
+	uint8_t key[HITTERS_MAX_KEY];
+	uint64_t hash;
+
+	/* Names are counted case insensitive */
+	if (!enabled
+	||  !stubby_qname_key(key, qname, qname_len, 0, &hash))
+		return;
+	hll_add(names_hll, hash);
+	tracker_add(names, hash, key, qname_len);
+}
+
+void stubby_hitters_nxdomain(const uint8_t *qname, size_t qname_len)
+{
+	uint8_t key[HITTERS_MAX_KEY];
+	uint64_t hash;
+
+	if (!enabled
+	||  !stubby_qname_key(key, qname, qname_len, 0, &hash))
+		return;
+	tracker_add(nxdomains, hash, key, qname_len);
+}
+
+/* Clients are keyed on their address family and address (not the port) */
+void stubby_hitters_client(const struct sockaddr *addr, size_t addr_len)
+{
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	uint8_t key[1 + 16];
+	uint64_t hash = 0xCBF29CE484222325ULL; /* FNV-1a */
+	size_t len, i;
+
+	if (!enabled || !addr)
+		return;
+	if (addr->sa_family == AF_INET
+	&&  addr_len >= sizeof(struct sockaddr_in)) {
+		key[0] = 4;
+		(void) memcpy(key + 1,
+		    &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		len = 1 + 4;
+	} else if (addr->sa_family == AF_INET6
+	&&  addr_len >= sizeof(struct sockaddr_in6)) {
+		key[0] = 6;
+		(void) memcpy(key + 1,
+		    &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+		len = 1 + 16;
+	} else
+		return;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ key[i]) * 0x100000001B3ULL;
+	/* Finalize, so that the high bits (for HyperLogLog) are mixed too */
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hll_add(clients_hll, hash);
+	tracker_add(clients, hash, key, len);
+#else
+	(void)addr; (void)addr_len;
+#endif
+}
+
+/* The client in key, as text */
+static int client_str(const hitter *h, char *str, size_t len)
+{
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	return inet_ntop(h->key[0] == 4 ? AF_INET : AF_INET6, h->key + 1,
+	    str, (socklen_t)len) ? 0 : -1;
+#else
+	(void)h; (void)str; (void)len;
+	return -1;
+#endif
+}
+
+static int hitter_cmp(const void *a, const void *b)
+{
+	const hitter *x = *(const hitter * const *)a;
+	const hitter *y = *(const hitter * const *)b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void tracker_json(gldns_buffer *buf, const tracker *t)
+{
+	const hitter **sorted;
+	getdns_bindata qname;
+	char *qname_str, client[64];
+	uint64_t count, cm;
+	size_t i, j, n;
+
+	(void) gldns_buffer_printf(buf, ",\n  \"%s_total\": %"PRIu64
+	    ",\n  \"top_%s\":\n  [", t->name, t->total, t->name);
+	if (!(sorted = malloc((t->n ? t->n : 1) * sizeof(hitter *)))) {
+		(void) gldns_buffer_printf(buf, "]");
+		return;
+	}
+	for (i = 0; i < t->n; i++)
+		sorted[i] = &t->heap[i];
+	qsort(sorted, t->n, sizeof(hitter *), hitter_cmp);
+
+	n = t->n < report_top ? t->n : report_top;
+	for (i = 0; i < n; i++) {
+		count = sorted[i]->count;
+		if ((cm = cm_estimate(t, sorted[i]->hash)) < count)
+			count = cm;
+		if (t == clients) {
+			if (client_str(sorted[i], client, sizeof(client)))
+				(void) strcpy(client, "?");
+			(void) gldns_buffer_printf(buf, "%s\n    { \"client\": "
+			    "\"%s\", \"count\": %"PRIu64", \"min_count\": "
+			    "%"PRIu64" }", i ? "," : "", client, count,
+			    sorted[i]->count - sorted[i]->error);
+			continue;
+		}
+		qname.size = sorted[i]->key_len;
+		qname.data = (uint8_t *)sorted[i]->key;
+		if (getdns_convert_dns_name_to_fqdn(&qname, &qname_str))
+			qname_str = NULL;
+		else for (j = 0; qname_str[j]; j++) {
+			if (qname_str[j] == '"' || qname_str[j] == '\\'
+			||  (unsigned char)qname_str[j] < 0x20)
+				qname_str[j] = '?';
+		}
+		(void) gldns_buffer_printf(buf, "%s\n    { \"name\": \"%s\", "
+		    "\"count\": %"PRIu64", \"min_count\": %"PRIu64" }",
+		    i ? "," : "", qname_str ? qname_str : "?", count,
+		    sorted[i]->count - sorted[i]->error);
+		free(qname_str);
+	}
+	(void) gldns_buffer_printf(buf, "%s]", n ? "\n  " : "");
+	free(sorted);
+}
+
+void stubby_hitters_json(gldns_buffer *buf)
+{
+	if (!enabled) {
+		(void) gldns_buffer_printf(buf, "{}\n");
+		return;
+	}
+	(void) gldns_buffer_printf(buf, "{ \"unique_names\": %"PRIu64
+	    ",\n  \"unique_clients\": %"PRIu64,
+	    hll_estimate(names_hll), hll_estimate(clients_hll));
+	tracker_json(buf, names);
+	tracker_json(buf, nxdomains);
+	tracker_json(buf, clients);
+	(void) gldns_buffer_printf(buf, "\n}\n");
+}
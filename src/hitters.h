@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_HITTERS_H
+#define _STUBBY_HITTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+struct sockaddr;
+
+/**
+ * Heavy hitters: the most queried names, the names most answered with
+ * NXDOMAIN and the clients sending the most queries, and the number of
+ * unique names and clients, in constant memory.
+ *
+ * The top names and clients are kept with the space-saving algorithm
+ * (capacity four times the number reported), their counts are bounded
+ * further by a count-min sketch and unique names and clients are counted
+ * with HyperLogLog.  Clients are known for the queries on the sockets
+ * that stubby serves itself (see server.h).
+ * Everything is updated from the event loop only.
+ *
+ *   heavy_hitters:
+ *     top: 20
+ *
+ * The report is available on demand as JSON, from the metrics endpoint
+ * (GET /top).
+ */
+getdns_return_t stubby_hitters_config(const getdns_dict *config);
+int stubby_hitters_enabled(void);
+
+/* A query for the (wire format) qname was received */
+void stubby_hitters_query(const uint8_t *qname, size_t qname_len);
+
+/* A query was received from the client with address addr */
+void stubby_hitters_client(const struct sockaddr *addr, size_t addr_len);
+
+/* A query for the qname was answered with NXDOMAIN */
+void stubby_hitters_nxdomain(const uint8_t *qname, size_t qname_len);
+
+/* Append the report as JSON */
+void stubby_hitters_json(gldns_buffer *buf);
+
+#endif /* _STUBBY_HITTERS_H */
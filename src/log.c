@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <sys/time.h>
+#include <time.h>
+#ifdef HAVE_STUBBY_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#include "log.h"
+#include "ring.h"
+
+/* Largest message that fits in a single ring slot, longer messages are
+ * truncated.  The number of slots bounds the memory used for logging to
+ * LOG_RING_SLOTS * LOG_SLOT_SIZE bytes.
+ */
+#define LOG_SLOT_SIZE   512
+#define LOG_RING_SLOTS 4096
+
+/* Longest the writer sleeps when there is nothing to write (in usec) */
+#define LOG_MAX_IDLE_USEC 50000
+
+static getdns_loglevel_type stubby_log_level = GETDNS_LOG_DEBUG;
+static int                  stubby_log_getdns = 0;
+
+/* The "HH:MM:SS" part of the timestamp only changes once a second */
+static STUBBY_THREAD_LOCAL time_t log_time_sec = -1;
+static STUBBY_THREAD_LOCAL char   log_time_str[10];
+
+#ifdef HAVE_STUBBY_THREADS
+static stubby_ring *log_ring = NULL;
+static pthread_t    log_thread;
+static atomic_int   log_async = 0;
+static atomic_int   log_running = 0;
+#endif
+
+void stubby_set_log_level(getdns_loglevel_type level)
+{
+	stubby_log_level = level;
+}
+
+getdns_loglevel_type stubby_get_log_level(void)
+{
+	return stubby_log_level;
+}
+
+void stubby_set_getdns_logging(int enabled)
+{
+	stubby_log_getdns = enabled;
+}
+
+static size_t log_format(char *buf, const char *fmt, va_list ap)
+{
+	struct timeval tv;
+	int n, m;
+
+	gettimeofday(&tv, NULL);
+	if ((time_t)tv.tv_sec != log_time_sec) {
+		struct tm tm;
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+		time_t tsec = (time_t) tv.tv_sec;
+
+		gmtime_s(&tm, (const time_t *) &tsec);
+#else
+		gmtime_r(&tv.tv_sec, &tm);
+#endif
+		strftime(log_time_str, sizeof(log_time_str), "%H:%M:%S", &tm);
+		log_time_sec = (time_t)tv.tv_sec;
+	}
+	n = snprintf(buf, LOG_SLOT_SIZE, "[%s.%.6d] STUBBY: ",
+	    log_time_str, (int)tv.tv_usec);
+	m = vsnprintf(buf + n, LOG_SLOT_SIZE - n, fmt, ap);
+	if (m < 0)
+		return (size_t)n;
+	if (m >= LOG_SLOT_SIZE - n) {
+		/* Truncated, but keep one message per line */
+		(void) memcpy(buf + LOG_SLOT_SIZE - 5, "...\n", 5);
+		return LOG_SLOT_SIZE - 1;
+	}
+	return (size_t)(n + m);
+}
+
+static void stubby_vlog(const char *fmt, va_list ap)
+{
+	char buf[LOG_SLOT_SIZE];
+	size_t len;
+
+	len = log_format(buf, fmt, ap);
+#ifdef HAVE_STUBBY_THREADS
+	if (atomic_load_explicit(&log_async, memory_order_acquire)) {
+		(void) stubby_ring_push(log_ring, buf, len);
+		return;
+	}
+#endif
+	(void) fwrite(buf, 1, len, stderr);
+}
+
+void stubby_log(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, va_list ap)
+{
+	(void)userarg; (void)system;
+	if (!stubby_log_getdns || level > stubby_log_level)
+		return;
+
+	stubby_vlog(fmt, ap);
+}
+
+void stubby_local_log(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, ...)
+{
+	va_list args;
+
+	(void)userarg; (void)system;
+	if (level > stubby_log_level)
+		return;
+
+	va_start(args, fmt);
+	stubby_vlog(fmt, args);
+	va_end(args);
+}
+
+void stubby_log_always(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	stubby_vlog(fmt, args);
+	va_end(args);
+}
+
+#ifdef HAVE_STUBBY_THREADS
+static size_t log_printf(char *buf, const char *fmt, ...)
+{
+	va_list args;
+	size_t len;
+
+	va_start(args, fmt);
+	len = log_format(buf, fmt, args);
+	va_end(args);
+	return len;
+}
+
+static void log_report_dropped(uint64_t *reported)
+{
+	uint64_t dropped = stubby_ring_dropped(log_ring);
+	char buf[LOG_SLOT_SIZE];
+	size_t len;
+
+	if (dropped == *reported)
+		return;
+	len = log_printf(buf, "%"PRIu64" log messages dropped\n",
+	    dropped - *reported);
+	(void) fwrite(buf, 1, len, stderr);
+	*reported = dropped;
+}
+
+static void *log_writer(void *arg)
+{
+	char buf[LOG_SLOT_SIZE];
+	uint64_t reported = 0;
+	long idle_usec = 0;
+	size_t len;
+
+	(void)arg;
+	for (;;) {
+		if ((len = stubby_ring_pop(log_ring, buf))) {
+			(void) fwrite(buf, 1, len, stderr);
+			idle_usec = 0;
+			continue;
+		}
+		log_report_dropped(&reported);
+		(void) fflush(stderr);
+
+		if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+			/* Pick up anything queued while stopping */
+			while ((len = stubby_ring_pop(log_ring, buf)))
+				(void) fwrite(buf, 1, len, stderr);
+			log_report_dropped(&reported);
+			(void) fflush(stderr);
+			break;
+		}
+		/* Back off gradually, so bursts are written out promptly
+		 * while an idle stubby does not keep waking up.
+		 */
+		idle_usec = idle_usec ? idle_usec * 2 : 1000;
+		if (idle_usec > LOG_MAX_IDLE_USEC)
+			idle_usec = LOG_MAX_IDLE_USEC;
+		{
+			struct timespec ts = { 0, idle_usec * 1000 };
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+#endif
+
+void stubby_log_start(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	if (atomic_load(&log_running))
+		return;
+	if (!log_ring && !(log_ring = stubby_ring_create(
+	    LOG_RING_SLOTS, LOG_SLOT_SIZE))) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+		    "Could not allocate log ring, logging synchronously\n");
+		return;
+	}
+	atomic_store(&log_running, 1);
+	if (pthread_create(&log_thread, NULL, log_writer, NULL)) {
+		atomic_store(&log_running, 0);
+		stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+		    "Could not start log writer, logging synchronously\n");
+		return;
+	}
+	atomic_store_explicit(&log_async, 1, memory_order_release);
+#endif
+}
+
+void stubby_log_stop(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	if (!atomic_load(&log_running))
+		return;
+	atomic_store_explicit(&log_async, 0, memory_order_release);
+	atomic_store_explicit(&log_running, 0, memory_order_release);
+	(void) pthread_join(log_thread, NULL);
+#endif
+}
+
+uint64_t stubby_log_dropped(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	return log_ring ? stubby_ring_dropped(log_ring) : 0;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_LOG_H
+#define _STUBBY_LOG_H
+
+#include <stdarg.h>
+#include <getdns/getdns_extra.h>
+
+/**
+ * stubby_log is the log function handed to getdns, stubby_local_log is
+ * used for stubby's own messages.
+ * Messages above the current log level are discarded before anything is
+ * formatted.  Once stubby_log_start() has been called, formatted messages
+ * are queued on a ring buffer and written out by a background thread, so
+ * logging never blocks on stderr.  When the ring is full messages are
+ * dropped and counted instead.
+ */
+void stubby_log(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, va_list ap);
+
+void stubby_local_log(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, ...) ATTR_FORMAT(printf, 4, 5);
+
+/* Log whatever the log level, for messages that are enabled by a setting
+ * of their own (i.e. slow_query_threshold).
+ */
+void stubby_log_always(const char *fmt, ...) ATTR_FORMAT(printf, 1, 2);
+
+void stubby_set_log_level(getdns_loglevel_type level);
+getdns_loglevel_type stubby_get_log_level(void);
+
+/**
+ * Whether messages from getdns (passed to stubby_log) are written.
+ * getdns may be asked for messages for other purposes (i.e. statistics),
+ * without them being logged.  Messages from stubby itself are always
+ * subject to the log level only.
+ */
+void stubby_set_getdns_logging(int enabled);
+
+/**
+ * Start the background log writer.  Must be called after daemonizing,
+ * because threads do not survive fork().  Until it is started (and
+ * after it is stopped) messages are written synchronously.
+ */
+void stubby_log_start(void);
+
+/* Flush all queued messages and stop the background writer */
+void stubby_log_stop(void);
+
+/* Number of messages dropped because the log ring was full */
+uint64_t stubby_log_dropped(void);
+
+#endif /* _STUBBY_LOG_H */
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* For dladdr() */
+#endif
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#ifdef HAVE_DLADDR
+#include <dlfcn.h>
+#endif
+
+#include "loopmon.h"
+#include "histogram.h"
+#include "trace.h"
+#include "log.h"
+#include "memory.h"
+
+#define LOOPMON_DEFAULT_STALL_MS 100
+#define LOOPMON_TIMEOUT_FOREVER ((uint64_t)0xFFFFFFFFFFFFFFFF)
+
+/* Wraps an event scheduled by getdns or stubby.  The wrapper is what is
+ * scheduled with the real event loop, the original event's ev member
+ * points to the wrapper.
+ */
+typedef struct monitored_event {
+	getdns_eventloop_event  event;
+	getdns_eventloop_event *orig;
+	uint64_t                deadline_ns; /* 0 without timeout */
+	struct monitored_event *next_free;
+} monitored_event;
+
+static int                  enabled = 0;
+static uint64_t             stall_threshold_ns =
+                                LOOPMON_DEFAULT_STALL_MS * 1000000ULL;
+static getdns_eventloop    *loop = NULL;
+static getdns_eventloop_vmt loop_vmt;       /* The real functions */
+static getdns_eventloop_vmt monitor_vmt;
+static monitored_event     *free_events = NULL;
+static size_t               n_scheduled = 0;
+static uint64_t             busy_ns = 0;
+static uint64_t             stalls = 0;
+
+static stubby_histogram     callback_histogram;
+static stubby_histogram     iteration_histogram;
+static stubby_histogram     lateness_histogram;
+
+void stubby_loopmon_enable(void)
+{
+	enabled = 1;
+}
+
+int stubby_loopmon_enabled(void)
+{
+	return enabled;
+}
+
+getdns_return_t stubby_loopmon_config(const getdns_dict *config)
+{
+	uint32_t n;
+
+	if (!getdns_dict_get_int(config, "stall_threshold", &n)) {
+		if (n == 0) {
+			fprintf(stderr, "stall_threshold must be at least "
+			        "1 millisecond\n");
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		stall_threshold_ns = (uint64_t)n * 1000000;
+	}
+	stubby_loopmon_enable();
+	return GETDNS_RETURN_GOOD;
+}
+
+static void log_stall(const char *kind, getdns_eventloop_callback cb,
+    uint64_t ns)
+{
+	void *addr = *(void **)&cb;
+#ifdef HAVE_DLADDR
+	Dl_info info;
+
+	if (dladdr(addr, &info) && info.dli_fname) {
+		const char *fname = strrchr(info.dli_fname, '/');
+
+		fname = fname ? fname + 1 : info.dli_fname;
+		if (info.dli_sname && info.dli_saddr == addr)
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Event loop stalled %.1fms in %s callback %s(%s)\n",
+			    (double)ns / 1e6, kind, fname, info.dli_sname);
+		else
+			/* For use with addr2line */
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Event loop stalled %.1fms in %s callback "
+			    "%s(+0x%lx)\n", (double)ns / 1e6, kind, fname,
+			    (unsigned long)((char *)addr
+			                  - (char *)info.dli_fbase));
+		return;
+	}
+#endif
+	stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+	    "Event loop stalled %.1fms in %s callback %p\n",
+	    (double)ns / 1e6, kind, addr);
+}
+
+static void monitor_call(const char *kind, getdns_eventloop_callback cb,
+    void *userarg)
+{
+	uint64_t start = stubby_trace_now(), ns;
+
+	/* The event may be cleared (and the wrapper reused) by cb */
+	cb(userarg);
+	ns = stubby_trace_now() - start;
+	busy_ns += ns;
+	stubby_histogram_observe(&callback_histogram, ns);
+	if (ns >= stall_threshold_ns) {
+		stalls++;
+		log_stall(kind, cb, ns);
+	}
+}
+
+static void monitor_read_cb(void *userarg)
+{
+	getdns_eventloop_event *orig = ((monitored_event *)userarg)->orig;
+
+	monitor_call("read", orig->read_cb, orig->userarg);
+}
+
+static void monitor_write_cb(void *userarg)
+{
+	getdns_eventloop_event *orig = ((monitored_event *)userarg)->orig;
+
+	monitor_call("write", orig->write_cb, orig->userarg);
+}
+
+static void monitor_timeout_cb(void *userarg)
+{
+	monitored_event *mev = (monitored_event *)userarg;
+	getdns_eventloop_event *orig = mev->orig;
+	uint64_t now;
+
+	if (mev->deadline_ns) {
+		now = stubby_trace_now();
+		stubby_histogram_observe(&lateness_histogram,
+		    now > mev->deadline_ns ? now - mev->deadline_ns : 0);
+	}
+	monitor_call("timeout", orig->timeout_cb, orig->userarg);
+}
+
+static getdns_return_t monitor_schedule(getdns_eventloop *l,
+    int fd, uint64_t timeout, getdns_eventloop_event *ev)
+{
+	monitored_event *mev;
+	getdns_return_t r;
+
+	if ((mev = free_events))
+		free_events = mev->next_free;
+	else if (!(mev = stubby_mem_malloc(STUBBY_MEM_STATS,
+	    sizeof(monitored_event))))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	(void) memset(&mev->event, 0, sizeof(mev->event));
+	mev->event.userarg    = mev;
+	mev->event.read_cb    = ev->read_cb    ? monitor_read_cb    : NULL;
+	mev->event.write_cb   = ev->write_cb   ? monitor_write_cb   : NULL;
+	mev->event.timeout_cb = ev->timeout_cb ? monitor_timeout_cb : NULL;
+	mev->orig = ev;
+	mev->deadline_ns = ev->timeout_cb && timeout != LOOPMON_TIMEOUT_FOREVER
+	                 ? stubby_trace_now() + timeout * 1000000 : 0;
+
+	if ((r = loop_vmt.schedule(l, fd, timeout, &mev->event))) {
+		mev->next_free = free_events;
+		free_events = mev;
+		return r;
+	}
+	ev->ev = mev;
+	n_scheduled++;
+	return GETDNS_RETURN_GOOD;
+}
+
+static getdns_return_t monitor_clear(
+    getdns_eventloop *l, getdns_eventloop_event *ev)
+{
+	monitored_event *mev = (monitored_event *)ev->ev;
+	getdns_return_t r;
+
+	if (!mev)
+		return GETDNS_RETURN_GOOD;
+	r = loop_vmt.clear(l, &mev->event);
+	ev->ev = NULL;
+	mev->next_free = free_events;
+	free_events = mev;
+	n_scheduled--;
+	return r;
+}
+
+getdns_return_t stubby_loopmon_start(getdns_context *context)
+{
+	getdns_return_t r;
+
+	if (!enabled || loop)
+		return GETDNS_RETURN_GOOD;
+	if ((r = getdns_context_get_eventloop(context, &loop)))
+		return r;
+
+	loop_vmt = *loop->vmt;
+	monitor_vmt = loop_vmt;
+	monitor_vmt.schedule = monitor_schedule;
+	monitor_vmt.clear = monitor_clear;
+	loop->vmt = &monitor_vmt;
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_loopmon_run(getdns_context *context)
+{
+	if (!loop) {
+		getdns_context_run(context);
+		return;
+	}
+	/* Like getdns' default event loop: until nothing is scheduled */
+	while (n_scheduled > 0) {
+		busy_ns = 0;
+		loop->vmt->run_once(loop, 1);
+		stubby_histogram_observe(&iteration_histogram, busy_ns);
+	}
+}
+
+void stubby_loopmon_metrics(gldns_buffer *buf)
+{
+	if (!loop)
+		return;
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_event_loop_callback_seconds histogram\n"
+	    "# HELP stubby_event_loop_callback_seconds "
+	    "Time spent in a single event loop callback.\n");
+	stubby_histogram_openmetrics(buf,
+	    "stubby_event_loop_callback_seconds", NULL, &callback_histogram);
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_event_loop_iteration_seconds histogram\n"
+	    "# HELP stubby_event_loop_iteration_seconds "
+	    "Time spent in callbacks per event loop iteration.\n");
+	stubby_histogram_openmetrics(buf,
+	    "stubby_event_loop_iteration_seconds", NULL, &iteration_histogram);
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_event_loop_timer_lateness_seconds histogram\n"
+	    "# HELP stubby_event_loop_timer_lateness_seconds "
+	    "How late timers fired.\n");
+	stubby_histogram_openmetrics(buf,
+	    "stubby_event_loop_timer_lateness_seconds", NULL,
+	    &lateness_histogram);
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_event_loop_stalls counter\n"
+	    "# HELP stubby_event_loop_stalls "
+	    "Callbacks that ran longer than the stall threshold.\n"
+	    "stubby_event_loop_stalls_total %"PRIu64"\n", stalls);
+}
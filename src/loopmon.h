@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_LOOPMON_H
+#define _STUBBY_LOOPMON_H
+
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Event loop monitor.
+ *
+ * Everything runs from the getdns event loop, so one slow callback delays
+ * every client.  The monitor interposes on the schedule and clear
+ * functions of the context's event loop, so that every callback (getdns'
+ * own as well as stubby's) is timed.  With the metrics it exports
+ * histograms of the callback durations, the busy time per loop iteration
+ * and how late timers fire.  Callbacks that run longer than
+ * stall_threshold milliseconds are logged with their address, and their
+ * symbol when it is known:
+ *
+ *   event_loop_monitor:
+ *     stall_threshold: 100
+ */
+getdns_return_t stubby_loopmon_config(const getdns_dict *config);
+void stubby_loopmon_enable(void);
+int stubby_loopmon_enabled(void);
+
+/**
+ * Start monitoring the context's event loop.  Must be called before
+ * anything is scheduled on it, i.e. before the listen addresses are set.
+ */
+getdns_return_t stubby_loopmon_start(getdns_context *context);
+
+/* Run the event loop like getdns_context_run(), accounting iterations */
+void stubby_loopmon_run(getdns_context *context);
+
+/* Append the histograms in OpenMetrics text format */
+void stubby_loopmon_metrics(gldns_buffer *buf);
+
+#endif /* _STUBBY_LOOPMON_H */
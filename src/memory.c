@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef HAVE_STUBBY_THREADS
+#include <stdatomic.h>
+#endif
+
+#include "memory.h"
+
+/* The size prefix, padded to keep the returned memory suitably aligned */
+typedef union mem_header {
+	size_t      size;
+	long double ld;
+	void       *ptr;
+	uint64_t    u64;
+} mem_header;
+
+#ifdef HAVE_STUBBY_THREADS
+typedef atomic_uint_fast64_t mem_counter;
+#define MEM_GET(c)    atomic_load_explicit(&(c), memory_order_relaxed)
+#define MEM_ADD(c, n) atomic_fetch_add_explicit(&(c), (n), memory_order_relaxed)
+#define MEM_SUB(c, n) atomic_fetch_sub_explicit(&(c), (n), memory_order_relaxed)
+#else
+typedef uint64_t mem_counter;
+#define MEM_GET(c)    (c)
+#define MEM_ADD(c, n) (((c) += (n)) - (n))
+#define MEM_SUB(c, n) (((c) -= (n)) + (n))
+#endif
+
+static struct {
+	mem_counter bytes;
+	mem_counter max_bytes;
+} mem_stats[STUBBY_MEM_SUBSYSTEMS];
+
+static const char *subsystem_names[STUBBY_MEM_SUBSYSTEMS] = {
+	"queries", "getdns", "rings", "stats", "hitters", "cache"
+};
+
+static void mem_account(stubby_mem_subsystem subsystem, size_t size)
+{
+	uint64_t bytes = MEM_ADD(mem_stats[subsystem].bytes, size) + size;
+#ifdef HAVE_STUBBY_THREADS
+	uint_fast64_t max = MEM_GET(mem_stats[subsystem].max_bytes);
+
+	while (bytes > max && !atomic_compare_exchange_weak_explicit(
+	    &mem_stats[subsystem].max_bytes, &max, bytes,
+	    memory_order_relaxed, memory_order_relaxed))
+		; /* pass */
+#else
+	if (bytes > mem_stats[subsystem].max_bytes)
+		mem_stats[subsystem].max_bytes = bytes;
+#endif
+}
+
+void *stubby_mem_malloc(stubby_mem_subsystem subsystem, size_t size)
+{
+	mem_header *h;
+
+	if (size > SIZE_MAX - sizeof(mem_header)
+	||  !(h = malloc(sizeof(mem_header) + size)))
+		return NULL;
+	h->size = size;
+	mem_account(subsystem, size);
+	return h + 1;
+}
+
+void *stubby_mem_calloc(stubby_mem_subsystem subsystem,
+    size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+	if ((ptr = stubby_mem_malloc(subsystem, nmemb * size)))
+		(void) memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+void *stubby_mem_realloc(stubby_mem_subsystem subsystem,
+    void *ptr, size_t size)
+{
+	mem_header *h;
+	size_t old_size;
+
+	if (!ptr)
+		return stubby_mem_malloc(subsystem, size);
+	h = (mem_header *)ptr - 1;
+	old_size = h->size;
+	if (size > SIZE_MAX - sizeof(mem_header)
+	||  !(h = realloc(h, sizeof(mem_header) + size)))
+		return NULL;
+	h->size = size;
+	if (size > old_size)
+		mem_account(subsystem, size - old_size);
+	else
+		(void) MEM_SUB(mem_stats[subsystem].bytes, old_size - size);
+	return h + 1;
+}
+
+void stubby_mem_free(stubby_mem_subsystem subsystem, void *ptr)
+{
+	mem_header *h;
+
+	if (!ptr)
+		return;
+	h = (mem_header *)ptr - 1;
+	(void) MEM_SUB(mem_stats[subsystem].bytes, h->size);
+	free(h);
+}
+
+void *stubby_mem_getdns_malloc(void *userarg, size_t size)
+{
+	return stubby_mem_malloc((stubby_mem_subsystem)(intptr_t)userarg, size);
+}
+
+void *stubby_mem_getdns_realloc(void *userarg, void *ptr, size_t size)
+{
+	return stubby_mem_realloc(
+	    (stubby_mem_subsystem)(intptr_t)userarg, ptr, size);
+}
+
+void stubby_mem_getdns_free(void *userarg, void *ptr)
+{
+	stubby_mem_free((stubby_mem_subsystem)(intptr_t)userarg, ptr);
+}
+
+uint64_t stubby_mem_bytes(stubby_mem_subsystem subsystem)
+{
+	return MEM_GET(mem_stats[subsystem].bytes);
+}
+
+uint64_t stubby_mem_max_bytes(stubby_mem_subsystem subsystem)
+{
+	return MEM_GET(mem_stats[subsystem].max_bytes);
+}
+
+void stubby_mem_metrics(gldns_buffer *buf)
+{
+	size_t i;
+
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_memory_bytes gauge\n"
+	    "# HELP stubby_memory_bytes Bytes allocated, by subsystem.\n");
+	for (i = 0; i < STUBBY_MEM_SUBSYSTEMS; i++)
+		(void) gldns_buffer_printf(buf,
+		    "stubby_memory_bytes{subsystem=\"%s\"} %"PRIu64"\n",
+		    subsystem_names[i], stubby_mem_bytes(i));
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_memory_max_bytes gauge\n"
+	    "# HELP stubby_memory_max_bytes Most bytes ever allocated at "
+	    "once, by subsystem.\n");
+	for (i = 0; i < STUBBY_MEM_SUBSYSTEMS; i++)
+		(void) gldns_buffer_printf(buf,
+		    "stubby_memory_max_bytes{subsystem=\"%s\"} %"PRIu64"\n",
+		    subsystem_names[i], stubby_mem_max_bytes(i));
+}
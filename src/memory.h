@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_MEMORY_H
+#define _STUBBY_MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Memory accounting per subsystem.
+ *
+ * Allocations made with the functions below are prefixed with their size,
+ * so that the live bytes and the high-water mark of each subsystem can be
+ * kept without a lookup on free.  Memory allocated with these functions
+ * must be freed with stubby_mem_free() of the same subsystem.
+ *
+ * getdns is given these functions as the context's memory functions, so
+ * everything getdns allocates for the context (the request and response
+ * dicts, the upstreams with their (TLS) read and write buffers, and the
+ * network requests) is accounted to STUBBY_MEM_GETDNS.  Memory allocated
+ * by the TLS library itself is not included.
+ */
+typedef enum stubby_mem_subsystem {
+	STUBBY_MEM_QUERIES = 0, /* Queries waiting for an answer and the
+	                         * TCP connections they came on */
+	STUBBY_MEM_GETDNS,      /* The getdns context */
+	STUBBY_MEM_RINGS,       /* Log, dnstap and trace rings */
+	STUBBY_MEM_STATS,       /* Statistics, metrics and the loop monitor,
+	                         * with their metrics and control socket
+	                         * connections */
+	STUBBY_MEM_HITTERS,     /* Heavy hitter sketches */
+	STUBBY_MEM_CACHE,       /* Cached answers */
+	STUBBY_MEM_SUBSYSTEMS
+} stubby_mem_subsystem;
+
+void *stubby_mem_malloc(stubby_mem_subsystem subsystem, size_t size);
+void *stubby_mem_calloc(stubby_mem_subsystem subsystem,
+    size_t nmemb, size_t size);
+void *stubby_mem_realloc(stubby_mem_subsystem subsystem,
+    void *ptr, size_t size);
+void stubby_mem_free(stubby_mem_subsystem subsystem, void *ptr);
+
+/* Memory functions for getdns_context_create_with_extended_memory_functions
+ * with the subsystem cast to (void *) as userarg.
+ */
+void *stubby_mem_getdns_malloc(void *userarg, size_t size);
+void *stubby_mem_getdns_realloc(void *userarg, void *ptr, size_t size);
+void stubby_mem_getdns_free(void *userarg, void *ptr);
+
+/* Live bytes and high-water mark of a subsystem */
+uint64_t stubby_mem_bytes(stubby_mem_subsystem subsystem);
+uint64_t stubby_mem_max_bytes(stubby_mem_subsystem subsystem);
+
+/* Append the memory gauges in OpenMetrics text format to buf */
+void stubby_mem_metrics(gldns_buffer *buf);
+
+#endif /* _STUBBY_MEMORY_H */
@@ -0,0 +1,726 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_STUBBY_THREADS
+#include <stdatomic.h>
+#endif
+
+#include "metrics.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "loopmon.h"
+#include "hitters.h"
+#include "cache.h"
+#include "memory.h"
+#include "prefork.h"
+#include "sldns/sbuffer.h"
+
+#define METRICS_DEFAULT_PORT  9153
+#define METRICS_MAX_REQUEST   4096
+#define METRICS_CONN_TIMEOUT  5000
+#define METRICS_TIMEOUT_FOREVER ((uint64_t)0xFFFFFFFFFFFFFFFF)
+
+#define METRICS_N_QTYPES      257 /* The last one counts all qtypes > 255 */
+#define METRICS_N_RCODES       16
+#define METRICS_WORKER_THREADS  4 /* Shared counters per worker */
+
+/* Counters are only ever written by the thread owning them.  With threads
+ * they are atomic to make reading them from another thread well defined,
+ * but updates are plain loads and stores, not (locked) read-modify-writes.
+ */
+#ifdef HAVE_STUBBY_THREADS
+typedef atomic_uint_fast64_t metrics_counter;
+typedef atomic_int_fast64_t  metrics_gauge;
+#define METRICS_GET(c)     atomic_load_explicit(&(c), memory_order_relaxed)
+#define METRICS_SET(c, v)  atomic_store_explicit(&(c), v, memory_order_relaxed)
+#define METRICS_ADD(c, n)  METRICS_SET(c, METRICS_GET(c) + (n))
+#define METRICS_TAKE(c)    atomic_fetch_add(&(c), 1)
+typedef atomic_size_t metrics_index;
+#else
+typedef uint64_t metrics_counter;
+typedef int64_t  metrics_gauge;
+#define METRICS_GET(c)     (c)
+#define METRICS_SET(c, v)  ((c) = (v))
+#define METRICS_ADD(c, n)  ((c) += (n))
+#define METRICS_TAKE(c)    ((c)++)
+typedef size_t metrics_index;
+#endif
+
+typedef struct metrics_counters {
+	metrics_counter          queries[METRICS_N_QTYPES];
+	metrics_counter          responses[METRICS_N_RCODES];
+	metrics_counter          servfails[STUBBY_SERVFAIL_REASONS];
+	metrics_counter          fast_answers;
+	metrics_gauge            in_flight;
+	struct metrics_counters *next;
+} metrics_counters;
+
+static const char *servfail_reasons[STUBBY_SERVFAIL_REASONS] = {
+	"request_error", "callback_not_complete", "missing_response",
+	"copy_qid", "no_reply", "dnssec_bogus", "upstream_servfail",
+	"handle_edns0", "set_ad_bit", "copy_cd_bit", "get_ra_bit",
+	"recursion_not_available"
+};
+
+static const char *rcode_names[METRICS_N_RCODES] = {
+	"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+	"YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11",
+	"RCODE12", "RCODE13", "RCODE14", "RCODE15"
+};
+
+static const struct { uint16_t qtype; const char *name; } qtype_names[] = {
+	{   1, "A"      }, {   2, "NS"     }, {   5, "CNAME"  },
+	{   6, "SOA"    }, {  12, "PTR"    }, {  13, "HINFO"  },
+	{  15, "MX"     }, {  16, "TXT"    }, {  28, "AAAA"   },
+	{  33, "SRV"    }, {  35, "NAPTR"  }, {  43, "DS"     },
+	{  46, "RRSIG"  }, {  47, "NSEC"   }, {  48, "DNSKEY" },
+	{  50, "NSEC3"  }, {  52, "TLSA"   }, {  64, "SVCB"   },
+	{  65, "HTTPS"  }, { 255, "ANY"    }, { 257, "CAA"    }
+};
+
+static int enabled = 0; /* Counting */
+static int serving = 0; /* The HTTP endpoint */
+static STUBBY_THREAD_LOCAL metrics_counters *local_counters = NULL;
+#ifdef HAVE_STUBBY_THREADS
+static _Atomic(metrics_counters *) all_counters = NULL;
+#else
+static metrics_counters *all_counters = NULL;
+#endif
+
+/* With workers, the counters of their first METRICS_WORKER_THREADS
+ * threads are in memory shared by all workers, so that the one serving
+ * the metrics shows the totals.  Whether counting was enabled is shared
+ * too, as the control socket enables it in one worker only.
+ */
+typedef struct metrics_shared {
+	metrics_counter  enabled;
+	metrics_counters counters[];
+} metrics_shared;
+
+static metrics_shared *shared = NULL;
+static size_t          n_shared = 0;
+static metrics_index   shared_taken = 0; /* By the threads of this worker */
+
+getdns_return_t stubby_metrics_share(void)
+{
+	n_shared = (size_t)stubby_prefork_workers() * METRICS_WORKER_THREADS;
+	if (!(shared = stubby_prefork_share(sizeof(metrics_shared)
+	    + n_shared * sizeof(metrics_counters)))) {
+		n_shared = 0;
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	METRICS_SET(shared->enabled, enabled);
+	return GETDNS_RETURN_GOOD;
+}
+
+/* Counting was enabled by another worker */
+static int metrics_follow(void)
+{
+	enabled = 1;
+	stubby_trace_enable();
+	return 1;
+}
+
+static metrics_counters *metrics_thread_counters(void)
+{
+	metrics_counters *counters;
+	size_t i;
+
+	if (local_counters)
+		return local_counters;
+	/* A worker started again counts on with the counters of the one
+	 * it replaces, but has no queries in flight yet.
+	 */
+	if (shared && stubby_prefork_worker() >= 0
+	&&  (i = METRICS_TAKE(shared_taken)) < METRICS_WORKER_THREADS) {
+		counters = &shared->counters[stubby_prefork_worker()
+		    * METRICS_WORKER_THREADS + i];
+		METRICS_SET(counters->in_flight, 0);
+		return (local_counters = counters);
+	}
+	if (!(counters = stubby_mem_calloc(STUBBY_MEM_STATS,
+	    1, sizeof(metrics_counters))))
+		return NULL;
+#ifdef HAVE_STUBBY_THREADS
+	counters->next = atomic_load(&all_counters);
+	while (!atomic_compare_exchange_weak(
+	    &all_counters, &counters->next, counters))
+		; /* pass */
+#else
+	counters->next = all_counters;
+	all_counters = counters;
+#endif
+	return (local_counters = counters);
+}
+
+#define METRICS_COUNTERS(c) \
+	if (!(enabled || (shared && METRICS_GET(shared->enabled) \
+	                  && metrics_follow())) \
+	||  !((c) = local_counters ? local_counters \
+	                           : metrics_thread_counters())) \
+		return
+
+void stubby_metrics_query(uint32_t qtype)
+{
+	metrics_counters *c;
+
+	METRICS_COUNTERS(c);
+	METRICS_ADD(c->queries[qtype < 256 ? qtype : 256], 1);
+}
+
+void stubby_metrics_response(uint32_t rcode)
+{
+	metrics_counters *c;
+
+	METRICS_COUNTERS(c);
+	METRICS_ADD(c->responses[rcode & 0xF], 1);
+}
+
+void stubby_metrics_servfail(stubby_servfail_reason reason)
+{
+	metrics_counters *c;
+
+	METRICS_COUNTERS(c);
+	METRICS_ADD(c->servfails[reason], 1);
+}
+
+void stubby_metrics_in_flight(int delta)
+{
+	metrics_counters *c;
+
+	METRICS_COUNTERS(c);
+	METRICS_ADD(c->in_flight, delta);
+}
+
+void stubby_metrics_fast_answer(void)
+{
+	metrics_counters *c;
+
+	METRICS_COUNTERS(c);
+	METRICS_ADD(c->fast_answers, 1);
+}
+
+static struct {
+	char            *socket_path;
+	uint8_t          addr[16];
+	size_t           addr_len;
+	uint32_t         port;
+} listen_config = { NULL, { 0 }, 0, METRICS_DEFAULT_PORT };
+
+int stubby_metrics_enabled(void)
+{
+	return enabled;
+}
+
+void stubby_metrics_enable(void)
+{
+	enabled = 1;
+	if (shared)
+		METRICS_SET(shared->enabled, 1);
+}
+
+getdns_return_t stubby_metrics_config(const getdns_dict *config)
+{
+	static const uint8_t loopback6[16] = { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 };
+	getdns_bindata *bindata;
+
+	free(listen_config.socket_path);
+	listen_config.socket_path = NULL;
+	listen_config.addr_len = 0;
+	listen_config.port = METRICS_DEFAULT_PORT;
+
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+	(void)config; (void)bindata; (void)loopback6;
+	fprintf(stderr, "The metrics endpoint is not supported "
+	        "on this platform\n");
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+#else
+	if (!getdns_dict_get_bindata(config, "socket_path", &bindata)) {
+		if (!(listen_config.socket_path = malloc(bindata->size + 1)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		(void) memcpy(listen_config.socket_path,
+		    bindata->data, bindata->size);
+		listen_config.socket_path[bindata->size] = 0;
+
+	} else if (!getdns_dict_get_bindata(config,
+	    "/listen_address/address_data", &bindata)) {
+		if (!(bindata->size == 4 && bindata->data[0] == 127)
+		&&  !(bindata->size == 16
+		     && !memcmp(bindata->data, loopback6, 16))) {
+			fprintf(stderr, "The metrics listen_address must be "
+			        "a loopback address\n");
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		(void) memcpy(listen_config.addr, bindata->data, bindata->size);
+		listen_config.addr_len = bindata->size;
+		(void) getdns_dict_get_int(config, "/listen_address/port",
+		    &listen_config.port);
+	} else {
+		fprintf(stderr, "metrics needs a listen_address "
+		        "or a socket_path\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	enabled = serving = 1;
+	/* For the per upstream, per stage and event loop metrics */
+	stubby_trace_enable();
+	stubby_loopmon_enable();
+	return GETDNS_RETURN_GOOD;
+#endif
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+
+static getdns_eventloop      *loop = NULL;
+static int                    listen_fd = -1;
+static getdns_eventloop_event listen_event;
+static struct stat            listen_st;   /* of the socket_path, if any */
+
+typedef struct metrics_conn {
+	int                    fd;
+	getdns_eventloop_event event;
+	char                   request[METRICS_MAX_REQUEST];
+	size_t                 request_len;
+	gldns_buffer          *response;
+	size_t                 written;
+	struct metrics_conn   *next;
+} metrics_conn;
+
+static metrics_conn *conns = NULL;
+
+static const char *qtype_name(size_t qtype, char *buf, size_t buf_len)
+{
+	size_t i;
+
+	if (qtype == 256)
+		return "other";
+	for (i = 0; i < sizeof(qtype_names) / sizeof(qtype_names[0]); i++)
+		if (qtype_names[i].qtype == qtype)
+			return qtype_names[i].name;
+	(void) snprintf(buf, buf_len, "TYPE%d", (int)qtype);
+	return buf;
+}
+
+#define FAMILY(buf, name, type, help) (void) gldns_buffer_printf(buf, \
+	"# TYPE " name " " type "\n# HELP " name " " help "\n")
+
+/* Counters that are not known (see stubby_stats_known()) are left out */
+static void metrics_upstream_counter(gldns_buffer *buf, const char *name,
+    const char *help, size_t offset, int known)
+{
+	const stubby_upstream_stats *upstream;
+	size_t i;
+
+	if (!known)
+		return;
+	(void) gldns_buffer_printf(buf, "# TYPE %s counter\n# HELP %s %s\n",
+	    name, name, help);
+	for (i = 0; (upstream = stubby_stats_upstream(i)); i++)
+		(void) gldns_buffer_printf(buf,
+		    "%s_total{upstream=\"%s\"} %"PRIu64"\n", name,
+		    upstream->name,
+		    *(const uint64_t *)((const uint8_t *)upstream + offset));
+}
+
+/* Add the counters of one thread to total */
+static void metrics_sum(metrics_counters *total, const metrics_counters *c)
+{
+	size_t i;
+
+	for (i = 0; i < METRICS_N_QTYPES; i++)
+		METRICS_ADD(total->queries[i], METRICS_GET(c->queries[i]));
+	for (i = 0; i < METRICS_N_RCODES; i++)
+		METRICS_ADD(total->responses[i], METRICS_GET(c->responses[i]));
+	for (i = 0; i < STUBBY_SERVFAIL_REASONS; i++)
+		METRICS_ADD(total->servfails[i], METRICS_GET(c->servfails[i]));
+	METRICS_ADD(total->fast_answers, METRICS_GET(c->fast_answers));
+	METRICS_ADD(total->in_flight, METRICS_GET(c->in_flight));
+}
+
+void stubby_metrics_render(gldns_buffer *buf)
+{
+	metrics_counters total;
+	const stubby_upstream_stats *upstream;
+	metrics_counters *c;
+	uint64_t cumulative;
+	char name_buf[16];
+	size_t i, j;
+
+	(void) memset(&total, 0, sizeof(total));
+
+	/* Sum the counters of all threads, and of all workers */
+	for (i = 0; i < n_shared; i++)
+		metrics_sum(&total, &shared->counters[i]);
+	for (c = all_counters; c; c = c->next)
+		metrics_sum(&total, c);
+
+	FAMILY(buf, "stubby_queries", "counter", "Queries received, by qtype.");
+	for (i = 0; i < METRICS_N_QTYPES; i++)
+		if (METRICS_GET(total.queries[i]))
+			(void) gldns_buffer_printf(buf,
+			    "stubby_queries_total{qtype=\"%s\"} %"PRIu64"\n",
+			    qtype_name(i, name_buf, sizeof(name_buf)),
+			    (uint64_t)METRICS_GET(total.queries[i]));
+
+	FAMILY(buf, "stubby_responses", "counter", "Responses sent, by rcode.");
+	for (i = 0; i < METRICS_N_RCODES; i++)
+		if (METRICS_GET(total.responses[i]))
+			(void) gldns_buffer_printf(buf,
+			    "stubby_responses_total{rcode=\"%s\"} %"PRIu64"\n",
+			    rcode_names[i], (uint64_t)METRICS_GET(total.responses[i]));
+
+	FAMILY(buf, "stubby_servfails", "counter",
+	    "SERVFAIL responses, by the reason they were given.");
+	for (i = 0; i < STUBBY_SERVFAIL_REASONS; i++)
+		(void) gldns_buffer_printf(buf,
+		    "stubby_servfails_total{reason=\"%s\"} %"PRIu64"\n",
+		    servfail_reasons[i], (uint64_t)METRICS_GET(total.servfails[i]));
+
+	FAMILY(buf, "stubby_fast_answers", "counter",
+	    "Queries answered from the cache on the receive path.");
+	(void) gldns_buffer_printf(buf,
+	    "stubby_fast_answers_total %"PRIu64"\n",
+	    (uint64_t)METRICS_GET(total.fast_answers));
+
+	FAMILY(buf, "stubby_in_flight_queries", "gauge",
+	    "Queries waiting for an answer.");
+	(void) gldns_buffer_printf(buf,
+	    "stubby_in_flight_queries %"PRId64"\n",
+	    (int64_t)METRICS_GET(total.in_flight));
+
+	stubby_stats_collect();
+	metrics_upstream_counter(buf, "stubby_upstream_queries",
+	    "Queries sent to the upstream.",
+	    offsetof(stubby_upstream_stats, queries),
+	    1);
+	metrics_upstream_counter(buf, "stubby_upstream_responses",
+	    "Responses received from the upstream.",
+	    offsetof(stubby_upstream_stats, responses),
+	    1);
+	metrics_upstream_counter(buf, "stubby_upstream_timeouts",
+	    "Queries to the upstream that timed out.",
+	    offsetof(stubby_upstream_stats, timeouts),
+	    1);
+	metrics_upstream_counter(buf, "stubby_upstream_connections",
+	    "Connections opened to the upstream.",
+	    offsetof(stubby_upstream_stats, conns_opened),
+	    stubby_stats_known(STUBBY_STATS_CONNS));
+	metrics_upstream_counter(buf, "stubby_upstream_tls_handshakes",
+	    "TLS handshakes with the upstream.",
+	    offsetof(stubby_upstream_stats, tls_handshakes),
+	    stubby_stats_known(STUBBY_STATS_CONNS));
+	metrics_upstream_counter(buf, "stubby_upstream_tls_resumed",
+	    "TLS sessions with the upstream that were resumed.",
+	    offsetof(stubby_upstream_stats, tls_resumed),
+	    stubby_stats_known(STUBBY_STATS_TLS_RESUMED));
+
+	FAMILY(buf, "stubby_upstream_rtt_seconds", "histogram",
+	    "Round trip time of queries answered by the upstream.");
+	for (i = 0; (upstream = stubby_stats_upstream(i)); i++) {
+		cumulative = 0;
+		for (j = 0; j < STUBBY_RTT_BUCKETS; j++) {
+			cumulative += upstream->rtt_buckets[j];
+			if (j < STUBBY_RTT_BUCKETS - 1)
+				(void) gldns_buffer_printf(buf,
+				    "stubby_upstream_rtt_seconds_bucket"
+				    "{upstream=\"%s\",le=\"%g\"} %"PRIu64"\n",
+				    upstream->name, (double)(1 << j) / 1000.0,
+				    cumulative);
+			else
+				(void) gldns_buffer_printf(buf,
+				    "stubby_upstream_rtt_seconds_bucket"
+				    "{upstream=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+				    upstream->name, cumulative);
+		}
+		(void) gldns_buffer_printf(buf,
+		    "stubby_upstream_rtt_seconds_count{upstream=\"%s\"} %"PRIu64
+		    "\nstubby_upstream_rtt_seconds_sum{upstream=\"%s\"} %g\n",
+		    upstream->name, cumulative, upstream->name,
+		    (double)upstream->rtt_sum_ms / 1000.0);
+	}
+
+	stubby_trace_metrics(buf);
+
+	stubby_loopmon_metrics(buf);
+
+	stubby_cache_metrics(buf);
+
+	stubby_mem_metrics(buf);
+
+	FAMILY(buf, "stubby_log_dropped_messages", "counter",
+	    "Log messages dropped because the log ring was full.");
+	(void) gldns_buffer_printf(buf,
+	    "stubby_log_dropped_messages_total %"PRIu64"\n",
+	    stubby_log_dropped());
+
+	(void) gldns_buffer_printf(buf, "# EOF\n");
+}
+
+static void conn_close(metrics_conn *conn)
+{
+	metrics_conn **p;
+
+	(void) loop->vmt->clear(loop, &conn->event);
+	(void) close(conn->fd);
+	for (p = &conns; *p; p = &(*p)->next)
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	gldns_buffer_free(conn->response);
+	stubby_mem_free(STUBBY_MEM_STATS, conn);
+}
+
+static void conn_timeout_cb(void *userarg)
+{
+	conn_close((metrics_conn *)userarg);
+}
+
+static void conn_write_cb(void *userarg)
+{
+	metrics_conn *conn = (metrics_conn *)userarg;
+	size_t len = gldns_buffer_position(conn->response);
+	ssize_t n;
+
+	n = write(conn->fd, gldns_buffer_begin(conn->response) + conn->written,
+	    len - conn->written);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0 || (conn->written += n) >= len)
+		conn_close(conn);
+}
+
+static void conn_respond(metrics_conn *conn)
+{
+	gldns_buffer *body = NULL;
+	const char *status = "200 OK";
+	const char *content_type = "text/plain";
+
+	if (!(conn->response = gldns_buffer_new(1024))
+	||  !(body = gldns_buffer_new(8192))) {
+		gldns_buffer_free(body);
+		conn_close(conn);
+		return;
+	}
+	if (!strncmp(conn->request, "GET /metrics ", 13)
+	||  !strncmp(conn->request, "GET / ", 6)) {
+		content_type = "application/openmetrics-text; "
+		               "version=1.0.0; charset=utf-8";
+		stubby_metrics_render(body);
+
+	} else if (!strncmp(conn->request, "GET /top ", 9)) {
+		content_type = "application/json";
+		stubby_hitters_json(body);
+	} else {
+		status = "404 Not Found";
+		(void) gldns_buffer_printf(body, "Not Found\n");
+	}
+	if (!gldns_buffer_status_ok(body)) {
+		gldns_buffer_free(body);
+		conn_close(conn);
+		return;
+	}
+	(void) gldns_buffer_printf(conn->response, "HTTP/1.1 %s\r\n"
+	    "Content-Type: %s\r\nContent-Length: %d\r\n"
+	    "Connection: close\r\n\r\n", status, content_type,
+	    (int)gldns_buffer_position(body));
+	if (gldns_buffer_reserve(conn->response, gldns_buffer_position(body)))
+		gldns_buffer_write(conn->response, gldns_buffer_begin(body),
+		    gldns_buffer_position(body));
+	gldns_buffer_free(body);
+	if (!gldns_buffer_status_ok(conn->response)) {
+		conn_close(conn);
+		return;
+	}
+
+	(void) loop->vmt->clear(loop, &conn->event);
+	conn->event.read_cb = NULL;
+	conn->event.write_cb = conn_write_cb;
+	(void) loop->vmt->schedule(loop, conn->fd,
+	    METRICS_CONN_TIMEOUT, &conn->event);
+}
+
+static void conn_read_cb(void *userarg)
+{
+	metrics_conn *conn = (metrics_conn *)userarg;
+	ssize_t n;
+
+	n = read(conn->fd, conn->request + conn->request_len,
+	    sizeof(conn->request) - 1 - conn->request_len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		conn_close(conn);
+		return;
+	}
+	conn->request_len += n;
+	conn->request[conn->request_len] = 0;
+	if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n"))
+		conn_respond(conn);
+
+	else if (conn->request_len >= sizeof(conn->request) - 1)
+		conn_close(conn); /* Request too large */
+}
+
+static void listen_read_cb(void *userarg)
+{
+	metrics_conn *conn;
+	int fd;
+
+	(void)userarg;
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+		return;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+	||  !(conn = stubby_mem_calloc(STUBBY_MEM_STATS,
+	                               1, sizeof(metrics_conn)))) {
+		(void) close(fd);
+		return;
+	}
+	conn->fd = fd;
+	conn->event.userarg = conn;
+	conn->event.read_cb = conn_read_cb;
+	conn->event.timeout_cb = conn_timeout_cb;
+	conn->next = conns;
+	conns = conn;
+	(void) loop->vmt->schedule(loop, fd, METRICS_CONN_TIMEOUT, &conn->event);
+}
+
+static int metrics_listen(void)
+{
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	int fd, on = 1;
+
+	(void) memset(&ss, 0, sizeof(ss));
+	if (listen_config.socket_path) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+
+		if (strlen(listen_config.socket_path) >= sizeof(sun->sun_path))
+			return -1;
+		sun->sun_family = AF_UNIX;
+		(void) strcpy(sun->sun_path, listen_config.socket_path);
+		(void) unlink(listen_config.socket_path);
+		ss_len = sizeof(struct sockaddr_un);
+
+	} else if (listen_config.addr_len == 4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons((uint16_t)listen_config.port);
+		(void) memcpy(&sin->sin_addr, listen_config.addr, 4);
+		ss_len = sizeof(struct sockaddr_in);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons((uint16_t)listen_config.port);
+		(void) memcpy(&sin6->sin6_addr, listen_config.addr, 16);
+		ss_len = sizeof(struct sockaddr_in6);
+	}
+	if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (ss.ss_family != AF_UNIX)
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&ss, ss_len) < 0
+	||  (listen_config.socket_path
+	    && stat(listen_config.socket_path, &listen_st) < 0)
+	||  listen(fd, 16) < 0
+	||  fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+getdns_return_t stubby_metrics_start(getdns_context *context)
+{
+	getdns_return_t r;
+
+	if (!serving || loop)
+		return GETDNS_RETURN_GOOD;
+
+	if ((r = getdns_context_get_eventloop(context, &loop)))
+		return r;
+
+	if ((listen_fd = metrics_listen()) < 0) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not open metrics listener: %s\n", strerror(errno));
+		loop = NULL;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	(void) memset(&listen_event, 0, sizeof(listen_event));
+	listen_event.read_cb = listen_read_cb;
+	(void) loop->vmt->schedule(loop, listen_fd,
+	    METRICS_TIMEOUT_FOREVER, &listen_event);
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_metrics_stop(void)
+{
+	struct stat st;
+
+	if (!loop)
+		return;
+	while (conns)
+		conn_close(conns);
+	(void) loop->vmt->clear(loop, &listen_event);
+	(void) close(listen_fd);
+	listen_fd = -1;
+	/* Unless a stubby we upgraded to bound it again */
+	if (listen_config.socket_path
+	&&  !stat(listen_config.socket_path, &st)
+	&&  st.st_dev == listen_st.st_dev && st.st_ino == listen_st.st_ino)
+		(void) unlink(listen_config.socket_path);
+	loop = NULL;
+}
+
+#else /* STUBBY_ON_WINDOWS */
+
+getdns_return_t stubby_metrics_start(getdns_context *context)
+{
+	(void)context;
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_metrics_stop(void)
+{
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_METRICS_H
+#define _STUBBY_METRICS_H
+
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * OpenMetrics (Prometheus) endpoint.
+ *
+ * Counters are kept per thread, without locks or atomic read-modify-write
+ * operations, and are only summed when the endpoint is scraped.  The
+ * endpoint is served over HTTP on the getdns event loop from a listener
+ * on a loopback address or a unix socket:
+ *
+ *   metrics:
+ *     listen_address: 127.0.0.1@9153
+ *     socket_path: "/run/stubby/metrics.sock"
+ */
+
+/* The SERVFAIL call sites, exported as the "reason" label */
+typedef enum stubby_servfail_reason {
+	STUBBY_SERVFAIL_REQUEST_ERROR = 0,
+	STUBBY_SERVFAIL_NOT_COMPLETE,
+	STUBBY_SERVFAIL_MISSING_RESPONSE,
+	STUBBY_SERVFAIL_COPY_QID,
+	STUBBY_SERVFAIL_NO_REPLY,
+	STUBBY_SERVFAIL_DNSSEC_BOGUS,
+	STUBBY_SERVFAIL_UPSTREAM,
+	STUBBY_SERVFAIL_HANDLE_EDNS0,
+	STUBBY_SERVFAIL_SET_AD_BIT,
+	STUBBY_SERVFAIL_COPY_CD_BIT,
+	STUBBY_SERVFAIL_GET_RA_BIT,
+	STUBBY_SERVFAIL_NO_RECURSION,
+	STUBBY_SERVFAIL_REASONS
+} stubby_servfail_reason;
+
+getdns_return_t stubby_metrics_config(const getdns_dict *config);
+int stubby_metrics_enabled(void);
+
+/* Keep the counters without serving them (i.e. for the control socket) */
+void stubby_metrics_enable(void);
+
+/* Before the workers are forked: keep the counters of all workers in
+ * shared memory, so that the totals are shown.
+ */
+getdns_return_t stubby_metrics_share(void);
+
+/* Append all metrics in the OpenMetrics text format to buf */
+void stubby_metrics_render(gldns_buffer *buf);
+
+/* Open the listener and schedule it on the context's event loop */
+getdns_return_t stubby_metrics_start(getdns_context *context);
+void stubby_metrics_stop(void);
+
+/* Query path accounting */
+void stubby_metrics_query(uint32_t qtype);
+void stubby_metrics_response(uint32_t rcode);
+void stubby_metrics_servfail(stubby_servfail_reason reason);
+void stubby_metrics_in_flight(int delta);
+/* A query answered from the cache on the receive path (see server.h) */
+void stubby_metrics_fast_answer(void);
+
+#endif /* _STUBBY_METRICS_H */
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+#endif
+
+#include "prefork.h"
+#include "log.h"
+#include "server.h"
+#include "shmcache.h"
+
+static uint32_t n_workers = 1;
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define PREFORK_READY_TIMEOUT  10  /* Seconds to wait for workers to listen */
+#define PREFORK_RESTART_DELAY  1   /* For workers that died right away */
+#define PREFORK_POLL_INTERVAL  1000
+
+typedef struct prefork_worker {
+	pid_t  pid;      /* 0 when not running */
+	time_t started;
+	time_t restart;  /* When to start it again */
+} prefork_worker;
+
+static prefork_worker *workers = NULL;
+static pid_t master_pid = 0;
+static int worker = -1;
+static int reloaded = 0;
+static int ready_pipe[2] = { -1, -1 };
+
+/* What the workers pass on to each other through the master */
+typedef struct prefork_state {
+	volatile sig_atomic_t log_level;  /* -1 when not set */
+} prefork_state;
+
+static prefork_state *state = NULL;
+
+static volatile sig_atomic_t got_chld = 0;
+static volatile sig_atomic_t got_hup = 0;
+static volatile sig_atomic_t got_usr1 = 0;
+static volatile sig_atomic_t got_usr2 = 0;
+static volatile sig_atomic_t got_stop = 0;
+
+static const int master_signals[] = {
+	SIGCHLD, SIGHUP, SIGUSR1, SIGUSR2, SIGTERM, SIGINT, 0
+};
+
+getdns_return_t stubby_prefork_config(uint32_t n)
+{
+	if (n == 0 || n > STUBBY_PREFORK_MAX_WORKERS) {
+		fprintf(stderr, "workers must be between 1 and %d\n",
+		        STUBBY_PREFORK_MAX_WORKERS);
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	n_workers = n;
+	return GETDNS_RETURN_GOOD;
+}
+
+int stubby_prefork_worker(void)
+{
+	return worker;
+}
+
+int stubby_prefork_reloaded(void)
+{
+	return reloaded;
+}
+
+void *stubby_prefork_share(size_t size)
+{
+	void *mem;
+
+	if (n_workers <= 1 || worker >= 0)
+		return NULL;
+	if ((mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	return mem;
+}
+
+int stubby_prefork_reload(void)
+{
+	if (worker < 0 || getppid() != master_pid)
+		return -1;
+	return kill(master_pid, SIGHUP);
+}
+
+int stubby_prefork_set_log_level(int level)
+{
+	if (worker < 0 || !state || getppid() != master_pid)
+		return -1;
+	state->log_level = level;
+	return kill(master_pid, SIGUSR1);
+}
+
+int stubby_prefork_log_level(void)
+{
+	return state ? (int)state->log_level : -1;
+}
+
+void stubby_prefork_ready(void)
+{
+	char c = 'R';
+
+	if (worker < 0 || ready_pipe[1] < 0)
+		return;
+	if (write(ready_pipe[1], &c, 1) != 1) {
+		/* The master stops waiting after PREFORK_READY_TIMEOUT */
+	}
+	(void) close(ready_pipe[1]);
+	ready_pipe[1] = -1;
+}
+
+static void master_signal_handler(int sig)
+{
+	switch (sig) {
+	case SIGCHLD: got_chld = 1;
+	              break;
+	case SIGHUP : got_hup = 1;
+	              break;
+	case SIGUSR1: got_usr1 = 1;
+	              break;
+	case SIGUSR2: got_usr2 = 1;
+	              break;
+	default     : got_stop = 1;
+	              break;
+	}
+}
+
+static void worker_start(size_t i, stubby_prefork_run_func run)
+{
+	const int *sig;
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not start worker %d: %s\n", (int)i, strerror(errno));
+		workers[i].restart = time(NULL) + PREFORK_RESTART_DELAY;
+		return;
+	}
+	if (pid) {
+		workers[i].pid = pid;
+		workers[i].started = time(NULL);
+		return;
+	}
+	worker = (int)i;
+	(void) close(ready_pipe[0]);
+	ready_pipe[0] = -1;
+	for (sig = master_signals; *sig; sig++)
+		(void) signal(*sig, SIG_DFL);
+	/* Until the worker handles it itself */
+	(void) signal(SIGHUP, SIG_IGN);
+	(void) signal(SIGUSR1, SIG_IGN);
+	(void) signal(SIGUSR2, SIG_IGN);
+	/* Only the master talks to the service manager */
+	(void) unsetenv("NOTIFY_SOCKET");
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_PDEATHSIG)
+	(void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	if (getppid() != master_pid)
+		_exit(EXIT_FAILURE); /* The master is gone already */
+	run();
+	exit(EXIT_SUCCESS);
+}
+
+static void workers_reap(void)
+{
+	time_t now = time(NULL);
+	int status;
+	pid_t pid;
+	size_t i;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < n_workers && workers[i].pid != pid; i++)
+			; /* pass */
+		if (i == n_workers)
+			continue;
+		workers[i].pid = 0;
+		/* Answers it was writing when it died */
+		stubby_shmcache_release((int)pid);
+		if (got_stop)
+			continue;
+		if (WIFSIGNALED(status))
+			stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+			    "Worker %d (pid %d) died of signal %d, "
+			    "restarting it\n", (int)i, (int)pid,
+			    WTERMSIG(status));
+		else
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Worker %d (pid %d) exited with status %d, "
+			    "restarting it\n", (int)i, (int)pid,
+			    WEXITSTATUS(status));
+		workers[i].restart = now - workers[i].started
+		    < PREFORK_RESTART_DELAY ? now + PREFORK_RESTART_DELAY : now;
+	}
+}
+
+/* All workers listen (or some never told so) */
+static void workers_listening(void)
+{
+	/* The workers have sockets of their own, and the master's would
+	 * get a share of the queries.
+	 */
+	if (stubby_server_reuseport())
+		(void) stubby_server_listen(NULL);
+	stubby_server_notify("READY=1");
+}
+
+getdns_return_t stubby_prefork_run(stubby_prefork_run_func run)
+{
+	time_t now, ready_deadline;
+	size_t i, n_ready = 0;
+	struct sigaction sa;
+	struct pollfd pfd;
+	const int *sig;
+	char buf[64];
+	ssize_t n;
+	int listening = 0;
+
+	if (!(workers = calloc(n_workers, sizeof(prefork_worker))))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	if (pipe(ready_pipe) < 0) {
+		fprintf(stderr, "Could not create pipe for workers: %s\n",
+		        strerror(errno));
+		free(workers);
+		workers = NULL;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	(void) fcntl(ready_pipe[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(ready_pipe[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(ready_pipe[1], F_SETFD, FD_CLOEXEC);
+	master_pid = getpid();
+	if ((state = stubby_prefork_share(sizeof(prefork_state))))
+		state->log_level = -1;
+
+	/* Without SA_RESTART, so that poll() returns on signals */
+	(void) memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = master_signal_handler;
+	(void) sigemptyset(&sa.sa_mask);
+	for (sig = master_signals; *sig; sig++)
+		(void) sigaction(*sig, &sa, NULL);
+
+	stubby_local_log(NULL, 0, GETDNS_LOG_NOTICE,
+	    "Starting %d workers\n", (int)n_workers);
+	for (i = 0; i < n_workers; i++)
+		worker_start(i, run);
+	ready_deadline = time(NULL) + PREFORK_READY_TIMEOUT;
+
+	while (!got_stop) {
+		if (got_chld) {
+			got_chld = 0;
+			workers_reap();
+		}
+		if (got_hup) {
+			got_hup = 0;
+			reloaded = 1;
+			for (i = 0; i < n_workers; i++)
+				if (workers[i].pid)
+					(void) kill(workers[i].pid, SIGHUP);
+		}
+		if (got_usr1) {
+			got_usr1 = 0;
+			for (i = 0; i < n_workers; i++)
+				if (workers[i].pid)
+					(void) kill(workers[i].pid, SIGUSR1);
+		}
+		if (got_usr2) {
+			got_usr2 = 0;
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Upgrades are not done with workers, "
+			    "restart stubby instead\n");
+		}
+		now = time(NULL);
+		for (i = 0; !got_stop && i < n_workers; i++)
+			if (!workers[i].pid && now >= workers[i].restart)
+				worker_start(i, run);
+		if (!listening && (n_ready >= n_workers
+		    || now >= ready_deadline)) {
+			if (n_ready < n_workers)
+				stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+				    "Only %d of %d workers listen\n",
+				    (int)n_ready, (int)n_workers);
+			workers_listening();
+			listening = 1;
+		}
+
+		pfd.fd = ready_pipe[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, PREFORK_POLL_INTERVAL) > 0)
+			while ((n = read(ready_pipe[0], buf, sizeof(buf))) > 0)
+				n_ready += (size_t)n;
+	}
+
+	stubby_local_log(NULL, 0, GETDNS_LOG_NOTICE, "Stopping workers\n");
+	for (i = 0; i < n_workers; i++)
+		if (workers[i].pid)
+			(void) kill(workers[i].pid, SIGTERM);
+	for (i = 0; i < n_workers; i++)
+		if (workers[i].pid)
+			(void) waitpid(workers[i].pid, NULL, 0);
+	for (sig = master_signals; *sig; sig++)
+		(void) signal(*sig, SIG_DFL);
+	(void) close(ready_pipe[0]);
+	(void) close(ready_pipe[1]);
+	ready_pipe[0] = ready_pipe[1] = -1;
+	free(workers);
+	workers = NULL;
+	return GETDNS_RETURN_GOOD;
+}
+
+#else /* STUBBY_ON_WINDOWS */
+
+getdns_return_t stubby_prefork_config(uint32_t n)
+{
+	if (n > 1) {
+		fprintf(stderr, "workers are not supported on this platform\n");
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+int stubby_prefork_worker(void)
+{
+	return -1;
+}
+
+int stubby_prefork_reloaded(void)
+{
+	return 0;
+}
+
+void *stubby_prefork_share(size_t size)
+{
+	(void)size;
+	return NULL;
+}
+
+int stubby_prefork_reload(void)
+{
+	return -1;
+}
+
+int stubby_prefork_set_log_level(int level)
+{
+	(void)level;
+	return -1;
+}
+
+int stubby_prefork_log_level(void)
+{
+	return -1;
+}
+
+void stubby_prefork_ready(void)
+{
+}
+
+getdns_return_t stubby_prefork_run(stubby_prefork_run_func run)
+{
+	(void)run;
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+}
+
+#endif
+
+int stubby_prefork_enabled(void)
+{
+	return n_workers > 1;
+}
+
+uint32_t stubby_prefork_workers(void)
+{
+	return n_workers;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_PREFORK_H
+#define _STUBBY_PREFORK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <getdns/getdns.h>
+
+/**
+ * Serving with several worker processes.
+ *
+ *   workers: 4
+ *
+ * stubby binds listen_addresses, moves the cache into shared memory (see
+ * shmcache.h) and forks the workers, each with its own getdns context and
+ * event loop.  The workers bind sockets of their own to listen_addresses
+ * with SO_REUSEPORT, so that the kernel spreads the queries over them;
+ * sockets passed by the service manager are shared by the workers instead.
+ *
+ * The first process stays as the master and does not serve queries.  It
+ * restarts workers that die, passes SIGHUP on to the workers (workers
+ * restarted after that read the configuration again when they start) and
+ * stops them on SIGTERM or SIGINT.  Services with a single socket or file
+ * (metrics, control socket, cache snapshots and warm-up, the upstream
+ * statistics file and query traces) are run by the first worker only.
+ * The counters they show are kept by all workers in shared memory (see
+ * stubby_prefork_share()), so they are the totals of all workers.  Every
+ * worker writes dnstap messages of its own.  The reload and loglevel
+ * commands of the control socket are passed on to all workers by the
+ * master.  Upgrades (SIGUSR2) are not done with workers.
+ */
+#define STUBBY_PREFORK_MAX_WORKERS 256
+
+getdns_return_t stubby_prefork_config(uint32_t n_workers);
+int stubby_prefork_enabled(void);
+
+/* The number of this worker, from 0, or -1 when not a worker */
+int stubby_prefork_worker(void);
+
+/* The number of workers, 1 without them */
+uint32_t stubby_prefork_workers(void);
+
+/* Whether the master passed on a SIGHUP before this worker started */
+int stubby_prefork_reloaded(void);
+
+/* Before the workers are forked: size bytes of zeroed memory that is
+ * shared by the master and all workers, for as long as stubby runs.
+ * NULL without workers, or when it could not be mapped.
+ */
+void *stubby_prefork_share(size_t size);
+
+/* In a worker: have the master pass a SIGHUP on to all workers.
+ * Returns 0 when it was passed to the master.
+ */
+int stubby_prefork_reload(void);
+
+/* In a worker: have the master pass SIGUSR1 on to all workers, for them
+ * to log at level from then on (see stubby_prefork_log_level()).
+ * Returns 0 when it was passed to the master.
+ */
+int stubby_prefork_set_log_level(int level);
+
+/* The level of the last stubby_prefork_set_log_level(), or -1 */
+int stubby_prefork_log_level(void);
+
+typedef void (*stubby_prefork_run_func)(void);
+
+/* In the master: fork the workers, which call run and exit, and look
+ * after them until stubby is stopped.  Returns once the workers exited.
+ */
+getdns_return_t stubby_prefork_run(stubby_prefork_run_func run);
+
+/* In a worker: tell the master that it listens */
+void stubby_prefork_ready(void);
+
+#endif /* _STUBBY_PREFORK_H */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_PROBES_H
+#define _STUBBY_PROBES_H
+
+/**
+ * USDT (statically defined tracing) probes, for use with bpftrace, perf,
+ * SystemTap, etc.  For example:
+ *
+ *   bpftrace -e 'usdt:/usr/local/bin/stubby:stubby:query__reply
+ *                { @[str(arg1)] = hist(arg4); }'
+ *
+ * Probes (all with the dns_msg pointer of the query as arg0):
+ *
+ *   query__receive     (msg, qname, qtype)
+ *   upstream__schedule (msg, qname, qtype, transaction_id)
+ *   query__reply       (msg, qname, qtype, rcode, latency in usec)
+ *   query__servfail    (msg, reason, getdns_return_t)
+ *
+ * Each probe has a semaphore, which is non-zero only while a tracer is
+ * attached, so arguments that need work to be produced are only produced
+ * then.  Without sys/sdt.h (or with --disable-usdt) the probes compile to
+ * nothing.
+ */
+#ifdef HAVE_STUBBY_USDT
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# define STUBBY_PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short stubby_ ## name ## _semaphore \
+	    __attribute__((unused)) __attribute__((section(".probes")))
+# define STUBBY_PROBE_ENABLED(name) \
+	__builtin_expect(stubby_ ## name ## _semaphore, 0)
+
+# define STUBBY_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(stubby, name, a1, a2, a3)
+# define STUBBY_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(stubby, name, a1, a2, a3, a4)
+# define STUBBY_PROBE5(name, a1, a2, a3, a4, a5) \
+	DTRACE_PROBE5(stubby, name, a1, a2, a3, a4, a5)
+#else
+# define STUBBY_PROBE_SEMAPHORE(name) \
+	typedef int stubby_ ## name ## _no_semaphore
+# define STUBBY_PROBE_ENABLED(name) 0
+
+# define STUBBY_PROBE3(name, a1, a2, a3)             /* nothing */
+# define STUBBY_PROBE4(name, a1, a2, a3, a4)         /* nothing */
+# define STUBBY_PROBE5(name, a1, a2, a3, a4, a5)     /* nothing */
+#endif
+
+#endif /* _STUBBY_PROBES_H */
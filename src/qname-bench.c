@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Time of making the lookup keys of query names, per kernel, against lower
+ * casing byte by byte and hashing with FNV-1a (as stubby did before), for
+ * names of several lengths with random case.  Checks that all kernels
+ * make the same keys and hashes.  Build with "make qname-bench".
+ */
+#include "config.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qname.h"
+
+#define DEFAULT_NAMES  4096
+#define DEFAULT_ROUNDS 500
+#define MAX_NAME       STUBBY_QNAME_MAX
+
+typedef struct name {
+	size_t  len;
+	uint8_t wire[MAX_NAME];
+} name;
+
+static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+#define N_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+static const size_t lengths[] = { 16, 32, 64, 128, 255 };
+#define N_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/* A name of about len bytes, of labels of 1 to 20 mixed case letters */
+static void random_name(name *n, size_t len)
+{
+	static const char chars[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-";
+	size_t pos = 0, label, i;
+
+	while (pos + 2 < len) {
+		label = 1 + rng() % 20;
+		if (pos + 1 + label + 1 > len)
+			label = len - pos - 2;
+		n->wire[pos++] = (uint8_t)label;
+		for (i = 0; i < label; i++)
+			n->wire[pos++] = chars[rng() % (sizeof(chars) - 1)];
+	}
+	n->wire[pos++] = 0;
+	n->len = pos;
+}
+
+/* Lower case byte by byte and FNV-1a */
+static size_t reference_key(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t tweak, uint64_t *hash)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		key[i] = name[i] >= 'A' && name[i] <= 'Z'
+		       ? name[i] + ('a' - 'A') : name[i];
+		h ^= key[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= tweak;
+	h *= 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	*hash = h;
+	return len;
+}
+
+typedef size_t (*key_func)(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t tweak, uint64_t *hash);
+
+/* Nanoseconds per name */
+static double time_keys(key_func f, const name *names, size_t n,
+    size_t rounds)
+{
+	struct timespec start, stop;
+	uint8_t key[MAX_NAME];
+	uint64_t hash, sum = 0;
+	size_t r, i;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++) {
+			(void) f(key, names[i].wire, names[i].len, i, &hash);
+			sum += hash + key[0];
+		}
+	(void) clock_gettime(CLOCK_MONOTONIC, &stop);
+	if (sum == 42)
+		printf(" "); /* Use the result */
+	return ((double)(stop.tv_sec - start.tv_sec) * 1e9
+	      + (double)(stop.tv_nsec - start.tv_nsec)) / (double)(rounds * n);
+}
+
+/* The keys and hashes of every kernel are those of the first */
+static int check_kernels(const name *names, size_t n)
+{
+	uint8_t key[MAX_NAME], first_key[MAX_NAME];
+	uint64_t hash, first_hash;
+	size_t i, k;
+
+	for (i = 0; i < n; i++) {
+		(void) stubby_qname_set_kernel(kernel_names[0]);
+		if (!stubby_qname_key(first_key, names[i].wire, names[i].len,
+		    i, &first_hash)) {
+			fprintf(stderr, "Name %u is not valid\n", (unsigned)i);
+			return -1;
+		}
+		for (k = 1; k < N_KERNELS; k++) {
+			if (stubby_qname_set_kernel(kernel_names[k]))
+				continue;
+			(void) stubby_qname_key(key, names[i].wire,
+			    names[i].len, i, &hash);
+			if (hash != first_hash
+			||  memcmp(key, first_key, names[i].len)) {
+				fprintf(stderr, "%s and %s differ for name %u\n",
+				    kernel_names[0], kernel_names[k], (unsigned)i);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void print_usage(FILE *out, const char *progname)
+{
+	fprintf(out, "usage: %s [<option> ...]\n", progname);
+	fprintf(out, "\t-n <names>\tnames per length (default %d)\n",
+	    DEFAULT_NAMES);
+	fprintf(out, "\t-r <rounds>\ttimes every name is keyed "
+	    "(default %d)\n", DEFAULT_ROUNDS);
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = DEFAULT_NAMES, rounds = DEFAULT_ROUNDS, i, j, k;
+	const char *selected;
+	name *names;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+		switch (opt) {
+		case 'n': n = strtoul(optarg, NULL, 10); break;
+		case 'r': rounds = strtoul(optarg, NULL, 10); break;
+		case 'h': print_usage(stdout, argv[0]);
+		          return EXIT_SUCCESS;
+		default : print_usage(stderr, argv[0]);
+		          return EXIT_FAILURE;
+		}
+	}
+	if (!n || !rounds || !(names = calloc(n, sizeof(name)))) {
+		print_usage(stderr, argv[0]);
+		return EXIT_FAILURE;
+	}
+	selected = stubby_qname_kernel();
+	printf("kernel selected at runtime: %s\n\n", selected);
+	printf("%8s %10s", "length", "reference");
+	for (k = 0; k < N_KERNELS; k++)
+		printf(" %10s", kernel_names[k]);
+	printf("   (ns per name)\n");
+
+	for (j = 0; j < N_LENGTHS; j++) {
+		for (i = 0; i < n; i++)
+			random_name(&names[i], lengths[j]);
+		if (check_kernels(names, n)) {
+			free(names);
+			return EXIT_FAILURE;
+		}
+		printf("%8u %10.2f", (unsigned)lengths[j],
+		    time_keys(reference_key, names, n, rounds));
+		for (k = 0; k < N_KERNELS; k++) {
+			if (stubby_qname_set_kernel(kernel_names[k]))
+				printf(" %10s", "-");
+			else
+				printf(" %10.2f", time_keys(stubby_qname_key,
+				    names, n, rounds));
+		}
+		printf("\n");
+	}
+	free(names);
+	return EXIT_SUCCESS;
+}
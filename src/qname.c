@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+#ifdef HAVE_STUBBY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "qname.h"
+
+typedef uint64_t (*qname_kernel)(uint8_t *key, const uint8_t *name,
+    size_t len, uint64_t h);
+
+static uint64_t secret[4];
+static qname_kernel kernel = NULL;
+static const char *kernel_name = "scalar";
+
+/* The 128 bit product of a and b, folded to 64 bits */
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)a * b;
+
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a;
+	uint64_t hb = b >> 32, lb = (uint32_t)b;
+	uint64_t hi = ha * hb, m0 = ha * lb, m1 = hb * la, lo = la * lb;
+	uint64_t t = lo + (m0 << 32), c = t < lo;
+
+	lo = t + (m1 << 32);
+	c += lo < t;
+	hi += (m0 >> 32) + (m1 >> 32) + c;
+	return lo ^ hi;
+#endif
+}
+
+static inline uint64_t block_hash(uint64_t h, uint64_t w0, uint64_t w1)
+{
+	return mum(w0 ^ secret[1], w1 ^ h);
+}
+
+/* Lower case the eight bytes in w at once */
+static inline uint64_t word_lower(uint64_t w)
+{
+	uint64_t ascii = w & 0x7F7F7F7F7F7F7F7FULL;
+	uint64_t ge_a = ascii + 0x3F3F3F3F3F3F3F3FULL; /* High bit: >= 'A' */
+	uint64_t gt_z = ascii + 0x2525252525252525ULL; /* High bit: >  'Z' */
+
+	return w | (((ge_a ^ gt_z) & ~w & 0x8080808080808080ULL) >> 2);
+}
+
+/* The last len % 16 bytes, padded with zeros */
+static uint64_t tail_scalar(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t h)
+{
+	uint64_t w[2] = { 0, 0 };
+
+	(void) memcpy(w, name, len);
+	w[0] = word_lower(w[0]);
+	w[1] = word_lower(w[1]);
+	(void) memcpy(key, w, len);
+	return block_hash(h, w[0], w[1]);
+}
+
+static uint64_t kernel_scalar(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t h)
+{
+	uint64_t w[2];
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		(void) memcpy(w, name + i, 16);
+		w[0] = word_lower(w[0]);
+		w[1] = word_lower(w[1]);
+		(void) memcpy(key + i, w, 16);
+		h = block_hash(h, w[0], w[1]);
+	}
+	return i < len ? tail_scalar(key + i, name + i, len - i, h) : h;
+}
+
+#ifdef HAVE_STUBBY_X86_SIMD
+
+__attribute__((target("sse2")))
+static inline __m128i lower_sse2(__m128i v)
+{
+	/* Signed compares: bytes from 0x80 are below 'A' */
+	__m128i upper = _mm_and_si128(
+	    _mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+/* The last r (< 16) bytes, from the 16 bytes that end with them, without
+ * reading past the name.  x86 is little endian, so the bytes before them
+ * are shifted out at the bottom.
+ */
+__attribute__((target("sse2")))
+static inline uint64_t tail_sse2(uint8_t *key, const uint8_t *name,
+    size_t r, uint64_t h)
+{
+	uint64_t w[2];
+	size_t s = (16 - r) * 8;
+
+	_mm_storeu_si128((__m128i *)(void *)w, lower_sse2(
+	    _mm_loadu_si128((const __m128i *)(const void *)(name + r - 16))));
+	(void) memcpy(key + r - 16, w, 16);
+	if (s >= 64) {
+		w[0] = w[1] >> (s - 64);
+		w[1] = 0;
+	} else {
+		w[0] = w[0] >> s | w[1] << (64 - s);
+		w[1] >>= s;
+	}
+	return block_hash(h, w[0], w[1]);
+}
+
+__attribute__((target("sse2")))
+static uint64_t kernel_sse2(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t h)
+{
+	uint64_t w[2];
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(void *)w, lower_sse2(
+		    _mm_loadu_si128((const __m128i *)(const void *)(name + i))));
+		(void) memcpy(key + i, w, 16);
+		h = block_hash(h, w[0], w[1]);
+	}
+	if (i == len)
+		return h;
+	return i ? tail_sse2(key + i, name + i, len - i, h)
+	         : tail_scalar(key, name, len, h);
+}
+
+__attribute__((target("avx2")))
+static uint64_t kernel_avx2(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t h)
+{
+	uint64_t w[4];
+	__m256i v, upper;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)(name + i));
+		upper = _mm256_and_si256(
+		    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+		    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+		v = _mm256_or_si256(v,
+		    _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+		_mm256_storeu_si256((__m256i *)(void *)w, v);
+		(void) memcpy(key + i, w, 32);
+		h = block_hash(h, w[0], w[1]);
+		h = block_hash(h, w[2], w[3]);
+	}
+	if (i + 16 <= len) {
+		_mm_storeu_si128((__m128i *)(void *)w, lower_sse2(
+		    _mm_loadu_si128((const __m128i *)(const void *)(name + i))));
+		(void) memcpy(key + i, w, 16);
+		h = block_hash(h, w[0], w[1]);
+		i += 16;
+	}
+	if (i == len)
+		return h;
+	return i ? tail_sse2(key + i, name + i, len - i, h)
+	         : tail_scalar(key, name, len, h);
+}
+
+static int has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static int has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+#endif /* HAVE_STUBBY_X86_SIMD */
+
+static int has_scalar(void)
+{
+	return 1;
+}
+
+/* From the most to the least preferred */
+static const struct {
+	const char   *name;
+	qname_kernel  func;
+	int         (*supported)(void);
+} kernels[] = {
+#ifdef HAVE_STUBBY_X86_SIMD
+	{ "avx2"  , kernel_avx2  , has_avx2   },
+	{ "sse2"  , kernel_sse2  , has_sse2   },
+#endif
+	{ "scalar", kernel_scalar, has_scalar }
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static void seed_random(uint8_t *seed, size_t len)
+{
+#ifdef HAVE_ARC4RANDOM_BUF
+	arc4random_buf(seed, len);
+#else
+	uint64_t x = 0;
+	size_t i;
+# if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	ssize_t n;
+	int fd;
+# endif
+
+# ifdef HAVE_GETENTROPY
+	if (!getentropy(seed, len))
+		return;
+# endif
+# if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+		n = read(fd, seed, len);
+		(void) close(fd);
+		if (n == (ssize_t)len)
+			return;
+	}
+	x = (uint64_t)getpid() << 32;
+# endif
+	/* Not secret, but still different for every process */
+	x ^= (uint64_t)time(NULL) ^ (uint64_t)clock()
+	   ^ (uint64_t)(uintptr_t)&x;
+	for (i = 0; i < len; i++) {
+		x += 0x9E3779B97F4A7C15ULL;
+		seed[i] = (uint8_t)(mum(x, 0xBF58476D1CE4E5B9ULL) >> 24);
+	}
+#endif
+}
+
+void stubby_qname_init(void)
+{
+	size_t i;
+
+	if (kernel)
+		return;
+	seed_random((uint8_t *)secret, sizeof(secret));
+	for (i = 0; i < N_KERNELS && !kernels[i].supported(); i++)
+		; /* pass */
+	kernel_name = kernels[i].name;
+	kernel = kernels[i].func;
+}
+
+/* An uncompressed name that ends exactly at len */
+static int name_valid(const uint8_t *name, size_t len)
+{
+	size_t pos = 0;
+
+	if (!len || len > STUBBY_QNAME_MAX)
+		return 0;
+	while (name[pos]) {
+		if (name[pos] > 63 || (pos += name[pos] + 1) >= len)
+			return 0;
+	}
+	return pos == len - 1;
+}
+
+size_t stubby_qname_key(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t tweak, uint64_t *hash)
+{
+	uint64_t h;
+
+	if (!kernel)
+		stubby_qname_init();
+	if (!name_valid(name, len))
+		return 0;
+	h = kernel(key, name, len, secret[0] ^ len);
+	*hash = mum(h ^ secret[2], tweak ^ secret[3]);
+	return len;
+}
+
+const char *stubby_qname_kernel(void)
+{
+	if (!kernel)
+		stubby_qname_init();
+	return kernel_name;
+}
+
+int stubby_qname_set_kernel(const char *name)
+{
+	size_t i;
+
+	stubby_qname_init();
+	for (i = 0; i < N_KERNELS; i++) {
+		if (strcmp(kernels[i].name, name))
+			continue;
+		if (!kernels[i].supported())
+			return -1;
+		kernel_name = kernels[i].name;
+		kernel = kernels[i].func;
+		return 0;
+	}
+	return -1;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _STUBBY_QNAME_H
+#define _STUBBY_QNAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Lookup keys of query names, for the cache and the heavy hitters.
+ *
+ * A key is the lower case form of a wire format name and a 64 bit hash of
+ * it.  After the label lengths are checked, the name is lower cased and
+ * hashed together, in blocks of 16 bytes, so that it is read once.  The
+ * hash multiplies each block with a secret (as wyhash does) and is keyed
+ * with a seed that is chosen at random per process, so that clients
+ * cannot pick names that collide.  Hashes are therefore never stored
+ * outside the process, except in memory that is shared with the worker
+ * processes it forks.
+ *
+ * The blocks are lower cased with AVX2 or SSE2 where the CPU has them,
+ * and else eight bytes at a time in 64 bit words.  All kernels make the
+ * same keys and hashes.  Build "make qname-bench" to compare them with
+ * lower casing byte by byte and FNV-1a.
+ */
+#define STUBBY_QNAME_MAX 255
+
+/* Choose the seed and the kernel, when this was not done yet.  Before
+ * threads or worker processes are started, so that they share the seed.
+ */
+void stubby_qname_init(void);
+
+/**
+ * Make the key of a name.
+ * @param key    receives the len bytes of the lower case name
+ * @param name   wire format name, without compression
+ * @param tweak  mixed into the hash, for things other than the name
+ *               that belong to the key (query type and class)
+ * @param hash   receives the hash
+ * @return len, or 0 when name is not a valid name of len bytes
+ */
+size_t stubby_qname_key(uint8_t *key, const uint8_t *name, size_t len,
+    uint64_t tweak, uint64_t *hash);
+
+/* The kernel in use: "avx2", "sse2" or "scalar" */
+const char *stubby_qname_kernel(void);
+
+/* Use the named kernel.  Returns -1 when the CPU does not have it. */
+int stubby_qname_set_kernel(const char *name);
+
+#endif /* _STUBBY_QNAME_H */
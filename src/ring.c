@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "ring.h"
+#include "memory.h"
+
+#ifdef HAVE_STUBBY_THREADS
+#include <stdatomic.h>
+typedef atomic_size_t ring_pos_t;
+typedef atomic_uint_fast64_t ring_count_t;
+#define RING_LOAD(p)           atomic_load_explicit(p, memory_order_acquire)
+#define RING_LOAD_RELAXED(p)   atomic_load_explicit(p, memory_order_relaxed)
+#define RING_STORE(p, v)       atomic_store_explicit(p, v, memory_order_release)
+#define RING_CAS(p, e, v)      atomic_compare_exchange_weak_explicit( \
+                               p, e, v, memory_order_relaxed, memory_order_relaxed)
+#define RING_INC(p)            atomic_fetch_add_explicit(p, 1, memory_order_relaxed)
+#else
+typedef size_t ring_pos_t;
+typedef uint64_t ring_count_t;
+#define RING_LOAD(p)           (*(p))
+#define RING_LOAD_RELAXED(p)   (*(p))
+#define RING_STORE(p, v)       (*(p) = (v))
+#define RING_CAS(p, e, v)      (*(p) = (v), 1)
+#define RING_INC(p)            ((*(p))++)
+#endif
+
+/* Records are aligned to cache lines so that a producer writing one slot
+ * does not bounce the line the consumer is reading.
+ */
+#define RING_ALIGN 64
+
+typedef struct ring_slot {
+	ring_pos_t seq;
+	size_t     len;
+	/* record data follows */
+} ring_slot;
+
+struct stubby_ring {
+	uint8_t      *slots;
+	size_t        mask;
+	size_t        slot_size;
+	size_t        stride;
+	ring_count_t  dropped;
+	ring_pos_t    enqueue_pos;
+	/* Only touched by the consumer, so keep it on its own line */
+	uint8_t       pad[RING_ALIGN];
+	size_t        dequeue_pos;
+};
+
+static inline ring_slot *ring_slot_at(stubby_ring *ring, size_t pos)
+{
+	return (ring_slot *)(ring->slots + (pos & ring->mask) * ring->stride);
+}
+
+stubby_ring *stubby_ring_create(size_t n_slots, size_t slot_size)
+{
+	stubby_ring *ring;
+	size_t n = 2, i;
+
+	while (n < n_slots)
+		n <<= 1;
+
+	if (!(ring = stubby_mem_calloc(STUBBY_MEM_RINGS, 1, sizeof(stubby_ring))))
+		return NULL;
+
+	ring->mask = n - 1;
+	ring->slot_size = slot_size;
+	ring->stride = (sizeof(ring_slot) + slot_size + RING_ALIGN - 1)
+	             & ~((size_t)RING_ALIGN - 1);
+	if (!(ring->slots = stubby_mem_calloc(STUBBY_MEM_RINGS, n, ring->stride))) {
+		stubby_mem_free(STUBBY_MEM_RINGS, ring);
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		RING_STORE(&ring_slot_at(ring, i)->seq, i);
+
+	RING_STORE(&ring->enqueue_pos, 0);
+	RING_STORE(&ring->dropped, 0);
+	ring->dequeue_pos = 0;
+	return ring;
+}
+
+void stubby_ring_destroy(stubby_ring *ring)
+{
+	if (!ring)
+		return;
+	stubby_mem_free(STUBBY_MEM_RINGS, ring->slots);
+	stubby_mem_free(STUBBY_MEM_RINGS, ring);
+}
+
+int stubby_ring_push(stubby_ring *ring, const void *data, size_t len)
+{
+	size_t pos, seq;
+	ring_slot *slot;
+
+	if (len > ring->slot_size) {
+		RING_INC(&ring->dropped);
+		return -1;
+	}
+	pos = RING_LOAD_RELAXED(&ring->enqueue_pos);
+	for (;;) {
+		slot = ring_slot_at(ring, pos);
+		seq = RING_LOAD(&slot->seq);
+
+		if (seq == pos) {
+			if (RING_CAS(&ring->enqueue_pos, &pos, pos + 1))
+				break;
+
+		} else if ((intptr_t)(seq - pos) < 0) {
+			/* Full, the consumer has not caught up with us */
+			RING_INC(&ring->dropped);
+			return -1;
+		} else
+			pos = RING_LOAD_RELAXED(&ring->enqueue_pos);
+	}
+	slot->len = len;
+	memcpy((uint8_t *)(slot + 1), data, len);
+	RING_STORE(&slot->seq, pos + 1);
+	return 0;
+}
+
+size_t stubby_ring_pop(stubby_ring *ring, void *buf)
+{
+	size_t pos = ring->dequeue_pos, len;
+	ring_slot *slot = ring_slot_at(ring, pos);
+
+	if (RING_LOAD(&slot->seq) != pos + 1)
+		return 0;
+
+	len = slot->len;
+	memcpy(buf, (uint8_t *)(slot + 1), len);
+	RING_STORE(&slot->seq, pos + ring->mask + 1);
+	ring->dequeue_pos = pos + 1;
+	return len;
+}
+
+uint64_t stubby_ring_dropped(stubby_ring *ring)
+{
+	return RING_LOAD_RELAXED(&ring->dropped);
+}
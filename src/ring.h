@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_RING_H
+#define _STUBBY_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounded multi-producer, single-consumer ring of fixed size records.
+ *
+ * Producers never block: when the ring is full the record is dropped and
+ * counted.  Only a single thread may pop records from the ring.
+ */
+typedef struct stubby_ring stubby_ring;
+
+/**
+ * Create a ring
+ * @param n_slots    number of records the ring can hold (rounded up to a
+ *                   power of two)
+ * @param slot_size  maximum size of a single record
+ * @return the ring, or NULL on memory error
+ */
+stubby_ring *stubby_ring_create(size_t n_slots, size_t slot_size);
+
+void stubby_ring_destroy(stubby_ring *ring);
+
+/**
+ * Copy a record into the ring.
+ * @return 0 on success, -1 when the ring was full or len was too large.
+ *         In both cases the record is counted as dropped.
+ */
+int stubby_ring_push(stubby_ring *ring, const void *data, size_t len);
+
+/**
+ * Copy the oldest record out of the ring.  Must only be called from the
+ * single consumer thread.
+ * @param buf  buffer of at least the ring's slot_size bytes
+ * @return the length of the record, or 0 when the ring was empty
+ */
+size_t stubby_ring_pop(stubby_ring *ring, void *buf);
+
+/* Number of records dropped since the ring was created */
+uint64_t stubby_ring_dropped(stubby_ring *ring);
+
+#endif /* _STUBBY_RING_H */
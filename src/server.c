@@ -0,0 +1,1024 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#endif
+
+#include "server.h"
+#include "log.h"
+#include "memory.h"
+#include "sldns/sbuffer.h"
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+
+#define SD_LISTEN_FDS_START     3
+#define SERVER_MAX_MSG          65535
+#define SERVER_MIN_UDP          512
+#define SERVER_UDP_BURST        32 /* datagrams read per callback */
+#define SERVER_TCP_BACKLOG      16
+#define SERVER_TCP_IDLE_TIMEOUT 10000
+#define SERVER_TCP_MAX_CONNS    256
+#define SERVER_TCP_MAX_PENDING  64     /* queries in flight per connection */
+#define SERVER_TCP_MAX_OUT      262144 /* unsent bytes per connection */
+#define SERVER_TIMEOUT_FOREVER  ((uint64_t)0xFFFFFFFFFFFFFFFF)
+
+/* Listeners and connections that are closed stay allocated until the
+ * queries that came in on them are answered.
+ */
+typedef struct server_listener {
+	int                     fd;
+	int                     tcp;
+	int                     keep;
+	int                     closed;
+	size_t                  n_pending;
+	struct sockaddr_storage addr;
+	socklen_t               addr_len;
+	getdns_eventloop_event  event;
+	struct server_listener *next;
+} server_listener;
+
+typedef struct server_conn {
+	int                    fd;
+	struct sockaddr_storage addr;
+	socklen_t              addr_len;
+	getdns_eventloop_event event;
+	uint8_t                len_buf[2];
+	uint8_t               *in;
+	size_t                 in_len;
+	size_t                 in_pos;
+	gldns_buffer          *out;
+	size_t                 written;
+	size_t                 n_pending;
+	int                    reading;
+	int                    closed;
+	struct server_conn    *next;
+} server_conn;
+
+/* A request handed to the handler, until it is answered */
+typedef struct server_query {
+	server_listener        *listener; /* NULL for TCP */
+	server_conn            *conn;     /* NULL for UDP */
+	struct sockaddr_storage addr;
+	socklen_t               addr_len;
+	size_t                  max_udp;
+} server_query;
+
+static server_listener *listeners = NULL;
+static server_conn *conns = NULL;
+static size_t n_conns = 0;
+static int accepting = 1; /* 0 while there are SERVER_TCP_MAX_CONNS */
+static int activated = 0;
+static int reuseport = 0;
+static int draining = 0;
+static size_t n_pending = 0;
+static getdns_eventloop *loop = NULL;
+static getdns_context *server_context = NULL;
+static getdns_request_handler_t server_handler = NULL;
+static stubby_server_fast_func fast_path = NULL;
+static uint8_t wire[SERVER_MAX_MSG + 2];
+static uint8_t fast_wire[SERVER_MAX_MSG + 2];
+
+static void listener_schedule(server_listener *l);
+
+/* Add an already bound socket */
+static server_listener *listener_add(int fd)
+{
+	server_listener *l, **p;
+	int sock_type;
+	socklen_t len = sizeof(sock_type);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &len) < 0
+	||  (sock_type != SOCK_DGRAM && sock_type != SOCK_STREAM)
+	||  !(l = stubby_mem_calloc(STUBBY_MEM_QUERIES,
+	                            1, sizeof(server_listener))))
+		return NULL;
+
+	l->addr_len = sizeof(l->addr);
+	if (getsockname(fd, (struct sockaddr *)&l->addr, &l->addr_len) < 0) {
+		stubby_mem_free(STUBBY_MEM_QUERIES, l);
+		return NULL;
+	}
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	l->fd = fd;
+	l->tcp = sock_type == SOCK_STREAM;
+	for (p = &listeners; *p; p = &(*p)->next)
+		; /* pass */
+	*p = l;
+	if (loop)
+		listener_schedule(l);
+	return l;
+}
+
+/* Stop listening.  UDP answers to queries in flight are still sent. */
+static void listener_close(server_listener *l)
+{
+	server_listener **p;
+
+	for (p = &listeners; *p; p = &(*p)->next)
+		if (*p == l) {
+			*p = l->next;
+			break;
+		}
+	if (loop)
+		(void) loop->vmt->clear(loop, &l->event);
+	l->closed = 1;
+	if (!l->n_pending) {
+		(void) close(l->fd);
+		stubby_mem_free(STUBBY_MEM_QUERIES, l);
+	}
+}
+
+int stubby_server_socket_activation(void)
+{
+	const char *e;
+	char *ep;
+	long pid, n_fds, i;
+	int n = 0;
+
+	if (activated)
+		return 1;
+
+	if (!(e = getenv("LISTEN_PID")))
+		return 0;
+	pid = strtol(e, &ep, 10);
+	if (*ep || pid != (long)getpid())
+		return 0; /* Meant for another process */
+
+	if (!(e = getenv("LISTEN_FDS")))
+		return 0;
+	n_fds = strtol(e, &ep, 10);
+	if (*ep || n_fds <= 0 || n_fds > 1024)
+		return 0;
+
+	/* Not for the processes we start */
+	(void) unsetenv("LISTEN_PID");
+	(void) unsetenv("LISTEN_FDS");
+	(void) unsetenv("LISTEN_FDNAMES");
+
+	for (i = 0; i < n_fds; i++) {
+		if (listener_add(SD_LISTEN_FDS_START + (int)i))
+			n++;
+		else
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "Ignoring passed file descriptor %d, which is not "
+			    "a datagram or stream socket\n",
+			    SD_LISTEN_FDS_START + (int)i);
+	}
+	activated = n > 0;
+	return n;
+}
+
+int stubby_server_socket_activated(void)
+{
+	return activated;
+}
+
+void stubby_server_notify(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun;
+	socklen_t len;
+	int fd;
+
+	if (!path || (*path != '/' && *path != '@')
+	||  strlen(path) >= sizeof(sun.sun_path))
+		return;
+
+	(void) memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void) memcpy(sun.sun_path, path, strlen(path));
+	if (*path == '@')
+		sun.sun_path[0] = 0; /* Abstract namespace */
+	len = (socklen_t)(offsetof(struct sockaddr_un, sun_path)
+	    + strlen(path));
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+		return;
+	(void) sendto(fd, state, strlen(state), 0,
+	    (struct sockaddr *)&sun, len);
+	(void) close(fd);
+}
+
+int stubby_server_adopt(const int *fds, size_t n, int was_activated)
+{
+	size_t i;
+	int adopted = 0;
+
+	for (i = 0; i < n; i++) {
+		if (listener_add(fds[i]))
+			adopted++;
+		else
+			(void) close(fds[i]);
+	}
+	if (adopted && was_activated)
+		activated = 1;
+	return adopted;
+}
+
+size_t stubby_server_listen_fds(int *fds, size_t max)
+{
+	server_listener *l;
+	size_t n = 0;
+
+	for (l = listeners; l && n < max; l = l->next)
+		fds[n++] = l->fd;
+	return n;
+}
+
+static int same_address(const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+	const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+	const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return a4->sin_port == b4->sin_port
+		    && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return a6->sin6_port == b6->sin6_port
+		    && !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+		               sizeof(a6->sin6_addr));
+	return 0;
+}
+
+/* A listen_addresses item is an address dict, as made of "127.0.0.1@53",
+ * or just the address.
+ */
+static int listen_address(const getdns_list *list, size_t i,
+    struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	struct sockaddr_in *a4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)addr;
+	getdns_bindata *address_data;
+	getdns_dict *dict;
+	uint32_t port = 53;
+
+	if (!getdns_list_get_dict(list, i, &dict)) {
+		if (getdns_dict_get_bindata(dict, "address_data",
+		    &address_data))
+			return -1;
+		(void) getdns_dict_get_int(dict, "port", &port);
+	} else if (getdns_list_get_bindata(list, i, &address_data))
+		return -1;
+
+	(void) memset(addr, 0, sizeof(*addr));
+	if (address_data->size == 4) {
+		a4->sin_family = AF_INET;
+		a4->sin_port = htons((uint16_t)port);
+		(void) memcpy(&a4->sin_addr, address_data->data, 4);
+		*addr_len = sizeof(*a4);
+	} else if (address_data->size == 16) {
+		a6->sin6_family = AF_INET6;
+		a6->sin6_port = htons((uint16_t)port);
+		(void) memcpy(&a6->sin6_addr, address_data->data, 16);
+		*addr_len = sizeof(*a6);
+	} else
+		return -1;
+	return 0;
+}
+
+static int listen_bind(const struct sockaddr_storage *addr,
+    socklen_t addr_len, int tcp)
+{
+	int fd, on = 1;
+
+	if ((fd = socket(addr->ss_family,
+	    tcp ? SOCK_STREAM : SOCK_DGRAM, 0)) < 0)
+		return -1;
+	(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	if (reuseport
+	&&  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		int saved_errno = errno;
+
+		(void) close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+#endif
+#ifdef IPV6_V6ONLY
+	if (addr->ss_family == AF_INET6)
+		(void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		    &on, sizeof(on));
+#endif
+	if (bind(fd, (const struct sockaddr *)addr, addr_len) < 0
+	||  (tcp && listen(fd, SERVER_TCP_BACKLOG) < 0)) {
+		int saved_errno = errno;
+
+		(void) close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+int stubby_server_set_reuseport(int on)
+{
+#ifdef SO_REUSEPORT
+	reuseport = on;
+	return 1;
+#else
+	(void)on;
+	return 0;
+#endif
+}
+
+int stubby_server_reuseport(void)
+{
+	return reuseport;
+}
+
+getdns_return_t stubby_server_listen(const getdns_list *listen_list)
+{
+	server_listener *l, *next, *keep_last;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	size_t i, n = 0;
+	char addr_str[INET6_ADDRSTRLEN];
+	int tcp, fd;
+
+	if (activated)
+		return GETDNS_RETURN_GOOD; /* The service manager's */
+
+	for (l = listeners; l; l = l->next)
+		l->keep = 0;
+	/* Existing listeners are kept, so new ones are added after them */
+	for (keep_last = listeners; keep_last && keep_last->next; )
+		keep_last = keep_last->next;
+
+	if (listen_list)
+		(void) getdns_list_get_length(listen_list, &n);
+	for (i = 0; i < n; i++) {
+		if (listen_address(listen_list, i, &addr, &addr_len)) {
+			fprintf(stderr, "Could not parse listen address "
+			    "%d\n", (int)i);
+			goto error;
+		}
+		for (tcp = 0; tcp < 2; tcp++) {
+			for (l = listeners; l; l = l->next)
+				if (l->tcp == tcp
+				&&  same_address(&l->addr, &addr))
+					break;
+			if (l) {
+				l->keep = 1;
+				continue;
+			}
+			if ((fd = listen_bind(&addr, addr_len, tcp)) < 0
+			||  !(l = listener_add(fd))) {
+				fprintf(stderr, "Could not bind on %s port %d: "
+				    "%s\n", inet_ntop(addr.ss_family,
+				    addr.ss_family == AF_INET
+				    ? (void *)&((struct sockaddr_in *)&addr)->sin_addr
+				    : (void *)&((struct sockaddr_in6 *)&addr)->sin6_addr,
+				    addr_str, sizeof(addr_str)),
+				    (int)ntohs(((struct sockaddr_in *)&addr)->sin_port),
+				    strerror(errno));
+				if (fd >= 0)
+					(void) close(fd);
+				goto error;
+			}
+			l->keep = 1;
+		}
+	}
+	for (l = listeners; l; l = next) {
+		next = l->next;
+		if (!l->keep)
+			listener_close(l);
+	}
+	return GETDNS_RETURN_GOOD;
+
+error:
+	/* Back to the listeners there were */
+	for (l = keep_last ? keep_last->next : listeners; l; l = next) {
+		next = l->next;
+		listener_close(l);
+	}
+	return GETDNS_RETURN_IO_ERROR;
+}
+
+size_t stubby_server_pending(void)
+{
+	return n_pending;
+}
+
+static void query_free(server_query *q);
+
+/* Stop or resume accepting connections on the TCP listeners */
+static void tcp_accepting(int on)
+{
+	server_listener *l;
+
+	if (accepting == on)
+		return;
+	accepting = on;
+	for (l = listeners; l && loop; l = l->next) {
+		if (!l->tcp)
+			continue;
+		if (on)
+			listener_schedule(l);
+		else
+			(void) loop->vmt->clear(loop, &l->event);
+	}
+}
+
+static void conn_free(server_conn *conn)
+{
+	server_conn **p;
+
+	for (p = &conns; *p; p = &(*p)->next)
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	gldns_buffer_free(conn->out);
+	stubby_mem_free(STUBBY_MEM_QUERIES, conn->in);
+	stubby_mem_free(STUBBY_MEM_QUERIES, conn);
+	if (--n_conns < SERVER_TCP_MAX_CONNS && !draining)
+		tcp_accepting(1);
+}
+
+/* Queries in flight keep the connection around until they are answered */
+static void conn_close(server_conn *conn)
+{
+	if (!conn->closed) {
+		conn->closed = 1;
+		(void) loop->vmt->clear(loop, &conn->event);
+		(void) close(conn->fd);
+		conn->fd = -1;
+	}
+	if (!conn->n_pending)
+		conn_free(conn);
+}
+
+static void tcp_read_cb(void *userarg);
+static void tcp_write_cb(void *userarg);
+
+static void tcp_timeout_cb(void *userarg)
+{
+	server_conn *conn = (server_conn *)userarg;
+
+	if (!conn->n_pending)
+		conn_close(conn);
+}
+
+/* Whether to read more queries: not while a client has many queries in
+ * flight or does not read its answers.
+ */
+static int conn_readable(server_conn *conn)
+{
+	return !draining && conn->n_pending < SERVER_TCP_MAX_PENDING
+	    && gldns_buffer_position(conn->out) - conn->written
+	       < SERVER_TCP_MAX_OUT;
+}
+
+static void conn_schedule(server_conn *conn)
+{
+	int writing = gldns_buffer_position(conn->out) > conn->written;
+
+	if (draining && !writing && !conn->n_pending) {
+		conn_close(conn);
+		return;
+	}
+	(void) loop->vmt->clear(loop, &conn->event);
+	conn->reading = conn_readable(conn);
+	conn->event.read_cb  = conn->reading ? tcp_read_cb : NULL;
+	conn->event.write_cb = writing  ? tcp_write_cb : NULL;
+	(void) loop->vmt->schedule(loop, conn->fd,
+	    SERVER_TCP_IDLE_TIMEOUT, &conn->event);
+}
+
+static void tcp_write_cb(void *userarg)
+{
+	server_conn *conn = (server_conn *)userarg;
+	size_t len = gldns_buffer_position(conn->out);
+	ssize_t n;
+
+	n = write(conn->fd, gldns_buffer_begin(conn->out) + conn->written,
+	    len - conn->written);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		conn_close(conn);
+		return;
+	}
+	if ((conn->written += n) < len)
+		return;
+
+	gldns_buffer_clear(conn->out);
+	conn->written = 0;
+	conn_schedule(conn);
+}
+
+static size_t truncate_response(uint8_t *msg, size_t len, size_t max);
+
+/* Answer the query in buf on the fast path, into fast_wire + 2.  Returns
+ * the length of the response, or 0 when it is not answered there.
+ */
+static size_t server_fast(const uint8_t *buf, size_t len, int tcp,
+    const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	size_t n, max_udp = SERVER_MIN_UDP;
+
+	if (!fast_path || len < 12 || (buf[2] & 0x80)
+	||  (n = fast_path(buf, len, (const struct sockaddr *)addr, addr_len,
+	                   fast_wire + 2, SERVER_MAX_MSG, &max_udp)) < 12)
+		return 0;
+	if (!tcp && n > max_udp)
+		n = truncate_response(fast_wire + 2, n, max_udp);
+	return n;
+}
+
+/* Hand the query in buf to the handler, which owns it from then on */
+static void server_handle(server_query *q, const uint8_t *buf, size_t len)
+{
+	getdns_dict *request;
+	uint32_t udp_size;
+
+	/* Not a query, or not parseable */
+	if (len < 12 || (buf[2] & 0x80)
+	||  getdns_wire2msg_dict(buf, len, &request)) {
+		query_free(q);
+		return;
+	}
+	if (!q->conn) {
+		if (getdns_dict_get_int(request,
+		    "/additional/0/udp_payload_size", &udp_size)
+		||  udp_size < SERVER_MIN_UDP)
+			udp_size = SERVER_MIN_UDP;
+		q->max_udp = udp_size;
+	}
+	server_handler(server_context, GETDNS_CALLBACK_COMPLETE, request,
+	    q, (getdns_transaction_t)(intptr_t)q);
+}
+
+static void tcp_read_cb(void *userarg)
+{
+	server_conn *conn = (server_conn *)userarg;
+	server_query *q;
+	ssize_t n;
+	size_t len;
+
+	for (;;) {
+		if (conn->in_pos < 2)
+			n = read(conn->fd, conn->len_buf + conn->in_pos,
+			    2 - conn->in_pos);
+		else
+			n = read(conn->fd, conn->in + conn->in_pos - 2,
+			    conn->in_len - (conn->in_pos - 2));
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (n <= 0) {
+			conn_close(conn);
+			return;
+		}
+		if ((conn->in_pos += n) == 2) {
+			conn->in_len = ((size_t)conn->len_buf[0] << 8)
+			             | conn->len_buf[1];
+			if (!conn->in_len || !(conn->in = stubby_mem_malloc(
+			    STUBBY_MEM_QUERIES, conn->in_len))) {
+				conn_close(conn);
+				return;
+			}
+		}
+		if (conn->in_pos < 2 || conn->in_pos - 2 < conn->in_len)
+			continue;
+
+		/* A complete message */
+		if ((len = server_fast(conn->in, conn->in_len, 1,
+		    &conn->addr, conn->addr_len))) {
+			fast_wire[0] = (uint8_t)(len >> 8);
+			fast_wire[1] = (uint8_t)len;
+			if (gldns_buffer_reserve(conn->out, len + 2))
+				gldns_buffer_write(conn->out, fast_wire,
+				    len + 2);
+
+		} else if ((q = stubby_mem_calloc(STUBBY_MEM_QUERIES,
+		    1, sizeof(server_query)))) {
+			q->conn = conn;
+			(void) memcpy(&q->addr, &conn->addr, conn->addr_len);
+			q->addr_len = conn->addr_len;
+			conn->n_pending++;
+			n_pending++;
+			server_handle(q, conn->in, conn->in_len);
+		}
+		stubby_mem_free(STUBBY_MEM_QUERIES, conn->in);
+		conn->in = NULL;
+		conn->in_pos = conn->in_len = 0;
+		if (!conn_readable(conn))
+			break;
+	}
+	conn_schedule(conn);
+}
+
+static void tcp_accept_cb(void *userarg)
+{
+	server_listener *l = (server_listener *)userarg;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	server_conn *conn;
+	int fd;
+
+	if ((fd = accept(l->fd, (struct sockaddr *)&addr, &addr_len)) < 0)
+		return;
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+	||  fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+	||  !(conn = stubby_mem_calloc(STUBBY_MEM_QUERIES,
+	                               1, sizeof(server_conn)))) {
+		(void) close(fd);
+		return;
+	}
+	if (!(conn->out = gldns_buffer_new(1024))) {
+		stubby_mem_free(STUBBY_MEM_QUERIES, conn);
+		(void) close(fd);
+		return;
+	}
+	gldns_buffer_clear(conn->out);
+	conn->fd = fd;
+	(void) memcpy(&conn->addr, &addr, addr_len);
+	conn->addr_len = addr_len;
+	conn->event.userarg = conn;
+	conn->event.timeout_cb = tcp_timeout_cb;
+	conn->next = conns;
+	conns = conn;
+	if (++n_conns >= SERVER_TCP_MAX_CONNS)
+		tcp_accepting(0);
+	conn_schedule(conn);
+}
+
+static void udp_read_cb(void *userarg)
+{
+	server_listener *l = (server_listener *)userarg;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	server_query *q;
+	ssize_t n;
+	size_t len;
+	int i;
+
+	for (i = 0; i < SERVER_UDP_BURST; i++) {
+		addr_len = sizeof(addr);
+		if ((n = recvfrom(l->fd, wire, SERVER_MAX_MSG, 0,
+		    (struct sockaddr *)&addr, &addr_len)) < 0)
+			return;
+		if ((len = server_fast(wire, (size_t)n, 0, &addr, addr_len))) {
+			(void) sendto(l->fd, fast_wire + 2, len, 0,
+			    (struct sockaddr *)&addr, addr_len);
+			continue;
+		}
+		if (!(q = stubby_mem_malloc(STUBBY_MEM_QUERIES,
+		    sizeof(server_query))))
+			return;
+		q->listener = l;
+		q->conn = NULL;
+		(void) memcpy(&q->addr, &addr, addr_len);
+		q->addr_len = addr_len;
+		l->n_pending++;
+		n_pending++;
+		server_handle(q, wire, (size_t)n);
+	}
+}
+
+static void query_free(server_query *q)
+{
+	server_listener *l = q->listener;
+	server_conn *conn = q->conn;
+
+	stubby_mem_free(STUBBY_MEM_QUERIES, q);
+	n_pending--;
+	if (conn && !--conn->n_pending && conn->closed)
+		conn_free(conn);
+	else if (conn && !conn->closed
+	     && (draining ? !conn->n_pending
+	                  : !conn->reading && conn_readable(conn)))
+		conn_schedule(conn);
+	if (l && !--l->n_pending && l->closed) {
+		(void) close(l->fd);
+		stubby_mem_free(STUBBY_MEM_QUERIES, l);
+	}
+}
+
+/* Skip the name at pos.  Returns the position after it, or 0 when the
+ * name runs past len.
+ */
+static size_t skip_name(const uint8_t *msg, size_t len, size_t pos)
+{
+	while (pos < len) {
+		if ((msg[pos] & 0xC0) == 0xC0)
+			return pos + 2 <= len ? pos + 2 : 0;
+		if (msg[pos] & 0xC0)
+			return 0;
+		if (!msg[pos])
+			return pos + 1;
+		pos += msg[pos] + 1;
+	}
+	return 0;
+}
+
+/* The position of the OPT record in the records from pos, or 0 */
+static size_t find_opt(const uint8_t *msg, size_t len, size_t pos,
+    size_t *opt_len)
+{
+	unsigned n_rrs = gldns_read_uint16(msg + 6) + gldns_read_uint16(msg + 8)
+	               + gldns_read_uint16(msg + 10);
+	size_t rr, rdlen;
+
+	for (; n_rrs > 0; n_rrs--) {
+		rr = pos;
+		if (!(pos = skip_name(msg, len, pos)) || pos + 10 > len
+		||  pos + 10 + (rdlen = gldns_read_uint16(msg + pos + 8)) > len)
+			return 0;
+		if (gldns_read_uint16(msg + pos) == GETDNS_RRTYPE_OPT
+		&&  pos == rr + 1) {
+			*opt_len = 11 + rdlen;
+			return rr;
+		}
+		pos += 10 + rdlen;
+	}
+	return 0;
+}
+
+/* Cut a response that does not fit in max down to its header, question and
+ * OPT record (RFC 6891, section 7), the latter without its options when
+ * they do not fit either.
+ */
+static size_t truncate_response(uint8_t *msg, size_t len, size_t max)
+{
+	size_t pos = 12, opt = 0, opt_len = 0;
+
+	if (!msg[4] && !msg[5])
+		opt = find_opt(msg, len, pos, &opt_len);
+
+	else if ((pos = skip_name(msg, len, pos)) && (pos += 4) <= len) {
+		opt = find_opt(msg, len, pos, &opt_len);
+		msg[4] = 0;
+		msg[5] = 1;
+	} else {
+		pos = 12;
+		msg[4] = msg[5] = 0;
+	}
+	msg[2] |= 0x02; /* TC */
+	(void) memset(msg + 6, 0, 6);
+	if (opt) {
+		if (pos + opt_len > max) {
+			msg[opt + 9] = msg[opt + 10] = 0;
+			opt_len = 11;
+		}
+		(void) memmove(msg + pos, msg + opt, opt_len);
+		msg[11] = 1;
+		pos += opt_len;
+	}
+	return pos;
+}
+
+getdns_return_t stubby_server_reply(void *userarg,
+    getdns_transaction_t request_id, const getdns_dict *response)
+{
+	server_query *q = (server_query *)(intptr_t)request_id;
+	server_conn *conn = q->conn;
+	getdns_dict *reply;
+	size_t len = SERVER_MAX_MSG;
+	getdns_return_t r;
+
+	(void)userarg;
+	if (!response) {
+		query_free(q);
+		return GETDNS_RETURN_GOOD;
+	}
+	if (getdns_dict_get_dict(response, "/replies_tree/0", &reply))
+		reply = (getdns_dict *)response;
+	if ((r = getdns_msg_dict2wire_buf(reply, wire + 2, &len)))
+		return r;
+	if (len < 12)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	if (!conn) {
+		if (len > q->max_udp)
+			len = truncate_response(wire + 2, len, q->max_udp);
+		(void) sendto(q->listener->fd, wire + 2, len, 0,
+		    (struct sockaddr *)&q->addr, q->addr_len);
+
+	} else if (!conn->closed && loop) {
+		wire[0] = (uint8_t)(len >> 8);
+		wire[1] = (uint8_t)len;
+		if (gldns_buffer_reserve(conn->out, len + 2)) {
+			gldns_buffer_write(conn->out, wire, len + 2);
+			conn_schedule(conn);
+		}
+	}
+	query_free(q);
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_server_set_fast_path(stubby_server_fast_func func)
+{
+	fast_path = func;
+}
+
+const struct sockaddr *stubby_server_client_addr(const void *userarg,
+    size_t *addr_len, int *tcp)
+{
+	const server_query *q = (const server_query *)userarg;
+
+	if (!q || !q->addr_len)
+		return NULL;
+	*addr_len = q->addr_len;
+	if (tcp)
+		*tcp = q->conn != NULL;
+	return (const struct sockaddr *)&q->addr;
+}
+
+static void listener_schedule(server_listener *l)
+{
+	(void) memset(&l->event, 0, sizeof(l->event));
+	l->event.userarg = l;
+	l->event.read_cb = l->tcp ? tcp_accept_cb : udp_read_cb;
+	(void) loop->vmt->schedule(loop, l->fd,
+	    SERVER_TIMEOUT_FOREVER, &l->event);
+}
+
+getdns_return_t stubby_server_start(getdns_context *context,
+    getdns_request_handler_t handler)
+{
+	server_listener *l;
+	getdns_return_t r;
+
+	if (loop)
+		return GETDNS_RETURN_GOOD;
+
+	if ((r = getdns_context_get_eventloop(context, &loop)))
+		return r;
+
+	server_context = context;
+	server_handler = handler;
+	for (l = listeners; l; l = l->next)
+		listener_schedule(l);
+	if (activated)
+		stubby_local_log(NULL, 0, GETDNS_LOG_INFO,
+		    "Serving socket(s) passed by the service manager\n");
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_server_drain(void)
+{
+	server_conn *conn, *next;
+
+	if (!loop)
+		return;
+	draining = 1;
+	while (listeners)
+		listener_close(listeners);
+	for (conn = conns; conn; conn = next) {
+		next = conn->next;
+		if (!conn->closed)
+			conn_schedule(conn);
+	}
+}
+
+/* Queries still in flight may be answered (or cancelled) after this, so
+ * the connections they came in on are freed once they are answered.
+ */
+void stubby_server_stop(void)
+{
+	server_conn *conn, *next;
+
+	if (!loop)
+		return;
+	for (conn = conns; conn; conn = next) {
+		next = conn->next;
+		conn_close(conn);
+	}
+	while (listeners)
+		listener_close(listeners);
+	loop = NULL;
+}
+
+#else /* STUBBY_ON_WINDOWS */
+
+int stubby_server_socket_activation(void)
+{
+	return 0;
+}
+
+int stubby_server_socket_activated(void)
+{
+	return 0;
+}
+
+void stubby_server_notify(const char *state)
+{
+	(void)state;
+}
+
+int stubby_server_set_reuseport(int on)
+{
+	(void)on;
+	return 0;
+}
+
+int stubby_server_reuseport(void)
+{
+	return 0;
+}
+
+getdns_return_t stubby_server_listen(const getdns_list *listen_list)
+{
+	(void)listen_list;
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+}
+
+int stubby_server_adopt(const int *fds, size_t n, int activated)
+{
+	(void)fds; (void)n; (void)activated;
+	return 0;
+}
+
+size_t stubby_server_listen_fds(int *fds, size_t max)
+{
+	(void)fds; (void)max;
+	return 0;
+}
+
+void stubby_server_drain(void)
+{
+}
+
+size_t stubby_server_pending(void)
+{
+	return 0;
+}
+
+void stubby_server_set_fast_path(stubby_server_fast_func func)
+{
+	(void)func;
+}
+
+const struct sockaddr *stubby_server_client_addr(const void *userarg,
+    size_t *addr_len, int *tcp)
+{
+	(void)userarg; (void)addr_len; (void)tcp;
+	return NULL;
+}
+
+getdns_return_t stubby_server_start(getdns_context *context,
+    getdns_request_handler_t handler)
+{
+	(void)context; (void)handler;
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_server_stop(void)
+{
+}
+
+getdns_return_t stubby_server_reply(void *userarg,
+    getdns_transaction_t request_id, const getdns_dict *response)
+{
+	(void)userarg; (void)request_id; (void)response;
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_SERVER_H
+#define _STUBBY_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+
+struct sockaddr;
+
+/**
+ * DNS service on stubby's own listening sockets.
+ *
+ * stubby binds the UDP and TCP sockets for listen_addresses itself, so
+ * that they can be handed over to a new stubby on upgrade (see upgrade.h).
+ * With systemd socket activation the sockets are bound by systemd instead
+ * and handed to stubby with the LISTEN_PID and LISTEN_FDS environment
+ * variables (see sd_listen_fds(3)).  Queries that arrive before stubby is
+ * ready wait in the socket buffers.  Requests are given to the same request
+ * handler as the one given to getdns.
+ *
+ * At most 256 TCP connections are served at a time; more wait in the
+ * listen backlog.  A connection is not read from while 64 of its queries
+ * are in flight or 256 KiB of its answers are not sent yet.  UDP answers
+ * that do not fit are truncated to the question and the OPT record.
+ */
+
+/* Take over the sockets passed by the service manager, if any.  Returns
+ * the number of sockets, which are then used instead of listen_addresses.
+ */
+int stubby_server_socket_activation(void);
+int stubby_server_socket_activated(void);
+
+/* Listen on the addresses in listen_list.  Sockets for addresses that were
+ * listened on already are kept, the others are closed.  On failure the
+ * listeners are left as they were.  Does nothing with sockets passed by
+ * the service manager.
+ */
+getdns_return_t stubby_server_listen(const getdns_list *listen_list);
+
+/* Bind the listening sockets with SO_REUSEPORT, so that worker processes
+ * can each bind sockets of their own to the same addresses, over which the
+ * kernel spreads the queries.  Returns 0 when not supported.
+ */
+int stubby_server_set_reuseport(int on);
+int stubby_server_reuseport(void);
+
+/* Take over bound sockets from a previous stubby.  activated is set when
+ * they were passed to it by the service manager.  Sockets that are not a
+ * datagram or stream socket are closed.  Returns the number adopted.
+ */
+int stubby_server_adopt(const int *fds, size_t n, int activated);
+
+/* Copy up to max listening sockets to fds, and return how many */
+size_t stubby_server_listen_fds(int *fds, size_t max);
+
+/**
+ * Answer queries in wire format as they are received, before they are
+ * made into a dict for the request handler.
+ * @param query    the query as received
+ * @param client   the address it came from
+ * @param buf      receives the response (of at most buf_len bytes)
+ * @param max_udp  to be set to the UDP payload size of the client, beyond
+ *                 which the response is truncated for UDP
+ * @return the length of the response, or 0 to give the query to the
+ *         request handler
+ */
+typedef size_t (*stubby_server_fast_func)(const uint8_t *query, size_t len,
+    const struct sockaddr *client, size_t client_len,
+    uint8_t *buf, size_t buf_len, size_t *max_udp);
+
+void stubby_server_set_fast_path(stubby_server_fast_func func);
+
+/* The address of the client of a request that was given to the request
+ * handler with userarg, until it is answered.  tcp (when not NULL) is set
+ * when it came over TCP.  NULL for requests from getdns's own listeners.
+ */
+const struct sockaddr *stubby_server_client_addr(const void *userarg,
+    size_t *addr_len, int *tcp);
+
+/* Serve the sockets on the context's event loop.  Requests are given to
+ * handler with a non-NULL userarg, and must be answered with
+ * stubby_server_reply().
+ */
+getdns_return_t stubby_server_start(getdns_context *context,
+    getdns_request_handler_t handler);
+void stubby_server_stop(void);
+
+/* Stop listening and stop reading from TCP connections.  Queries already
+ * received are still answered, after which their connections are closed.
+ */
+void stubby_server_drain(void);
+
+/* Number of received queries that are not answered yet */
+size_t stubby_server_pending(void);
+
+/* Answer request_id with response, or drop it when response is NULL */
+getdns_return_t stubby_server_reply(void *userarg,
+    getdns_transaction_t request_id, const getdns_dict *response);
+
+/* Send state (e.g. "READY=1") to the service manager, if it asked for it
+ * with NOTIFY_SOCKET (see sd_notify(3)).
+ */
+void stubby_server_notify(const char *state);
+
+#endif /* _STUBBY_SERVER_H */
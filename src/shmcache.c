@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shmcache.h"
+
+#if defined(HAVE_STUBBY_THREADS) \
+ && !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SHM_LINE 64
+
+typedef struct shm_meta {
+	uint64_t hash;         /* 0 when the slot is empty */
+	int64_t  stored;
+	int64_t  expires;
+	uint16_t qtype;
+	uint16_t qclass;
+	uint8_t  flags;
+	uint8_t  qname_len;
+	uint16_t response_len;
+} shm_meta;
+
+#define SHM_DATA (STUBBY_SHMCACHE_SLOT - 8 - sizeof(shm_meta))
+
+typedef struct shm_slot {
+	atomic_uint seq;       /* Odd while the slot is written */
+	atomic_int  owner;     /* The pid of the writer, or 0 */
+	shm_meta    meta;
+	uint8_t     data[SHM_DATA]; /* The qname, then the response */
+} shm_slot;
+
+/* The counters that all workers update are on lines of their own */
+typedef struct shm_header {
+	_Alignas(SHM_LINE) atomic_uint_fast64_t hits;
+	_Alignas(SHM_LINE) atomic_uint_fast64_t misses;
+	_Alignas(SHM_LINE) atomic_uint_fast64_t evictions;
+} shm_header;
+
+static uint8_t *segment = NULL;
+static size_t segment_len = 0;
+static shm_header *header = NULL;
+static shm_slot *slots = NULL;
+static size_t slot_mask = 0;
+
+int stubby_shmcache_create(size_t bytes)
+{
+	atomic_uint_fast64_t counter;
+	atomic_uint seq;
+	atomic_int owner;
+	size_t n_slots;
+
+	if (segment)
+		return 0;
+	/* An atomic that is implemented with a lock would only be atomic
+	 * within one process.
+	 */
+	if (!atomic_is_lock_free(&counter) || !atomic_is_lock_free(&seq)
+	||  !atomic_is_lock_free(&owner))
+		return -1;
+
+	for ( n_slots = 64
+	    ; sizeof(shm_header) + 2 * n_slots * sizeof(shm_slot) <= bytes
+	    ; n_slots *= 2)
+		; /* pass */
+	segment_len = sizeof(shm_header) + n_slots * sizeof(shm_slot);
+	if ((segment = mmap(NULL, segment_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		segment = NULL;
+		return -1;
+	}
+	/* Zeroed: all slots are empty and not being written */
+	header = (shm_header *)segment;
+	slots = (shm_slot *)(segment + sizeof(shm_header));
+	slot_mask = n_slots - 1;
+	return 0;
+}
+
+void stubby_shmcache_destroy(void)
+{
+	if (!segment)
+		return;
+	(void) munmap(segment, segment_len);
+	segment = NULL;
+	header = NULL;
+	slots = NULL;
+}
+
+static inline shm_slot *slot_at(uint64_t hash, size_t probe)
+{
+	return &slots[(size_t)(hash + probe) & slot_mask];
+}
+
+/* Copy the description of the answer in s.  Fails when it is being
+ * written.
+ */
+static inline int slot_read(shm_slot *s, shm_meta *m, unsigned *seq)
+{
+	if ((*seq = atomic_load_explicit(&s->seq, memory_order_acquire)) & 1)
+		return -1;
+	(void) memcpy(m, &s->meta, sizeof(*m));
+	return 0;
+}
+
+/* Whether what was copied from s since slot_read() is consistent */
+static inline int slot_unchanged(shm_slot *s, unsigned seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&s->seq, memory_order_relaxed) == seq;
+}
+
+/* Take s for writing.  A slot owned by a process that does not exist
+ * anymore is taken over.
+ */
+static int slot_claim(shm_slot *s, int self)
+{
+	int owner = 0;
+
+	if (atomic_compare_exchange_strong_explicit(&s->owner, &owner, self,
+	    memory_order_acquire, memory_order_relaxed))
+		return 1;
+	if (kill((pid_t)owner, 0) == 0 || errno != ESRCH)
+		return 0;
+	return atomic_compare_exchange_strong_explicit(&s->owner, &owner, self,
+	    memory_order_acquire, memory_order_relaxed);
+}
+
+static unsigned slot_begin(shm_slot *s)
+{
+	unsigned seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+	/* Odd already when its previous writer died */
+	if (!(seq & 1))
+		atomic_store_explicit(&s->seq, ++seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	return seq;
+}
+
+static void slot_end(shm_slot *s, unsigned seq)
+{
+	atomic_store_explicit(&s->seq, seq + 1, memory_order_release);
+	atomic_store_explicit(&s->owner, 0, memory_order_release);
+}
+
+static inline int same_question(const shm_meta *m,
+    const stubby_shmcache_answer *a, uint64_t hash)
+{
+	return m->hash == hash && m->qtype == a->qtype
+	    && m->qclass == a->qclass && m->flags == a->flags
+	    && m->qname_len == a->qname_len;
+}
+
+size_t stubby_shmcache_lookup(uint64_t hash, const uint8_t *qname,
+    size_t qname_len, uint16_t qtype, uint16_t qclass, uint8_t flags,
+    int64_t now, uint8_t *buf, size_t buf_len, int64_t *stored)
+{
+	shm_slot *s;
+	shm_meta m;
+	unsigned seq;
+	size_t i;
+
+	if (!slots)
+		return 0;
+	if (!hash)
+		hash = 1;
+	for (i = 0; i < STUBBY_SHMCACHE_PROBES; i++) {
+		s = slot_at(hash, i);
+		if (slot_read(s, &m, &seq)
+		||  m.hash != hash || m.qtype != qtype || m.qclass != qclass
+		||  m.flags != flags || m.qname_len != qname_len
+		||  m.expires <= now || m.response_len > buf_len
+		||  qname_len + m.response_len > SHM_DATA
+		||  memcmp(s->data, qname, qname_len))
+			continue;
+		(void) memcpy(buf, s->data + qname_len, m.response_len);
+		if (!slot_unchanged(s, seq))
+			continue;
+		*stored = m.stored;
+		(void) atomic_fetch_add_explicit(
+		    &header->hits, 1, memory_order_relaxed);
+		return m.response_len;
+	}
+	(void) atomic_fetch_add_explicit(
+	    &header->misses, 1, memory_order_relaxed);
+	return 0;
+}
+
+int stubby_shmcache_store(const stubby_shmcache_answer *a, int64_t now)
+{
+	uint64_t hash = a->hash ? a->hash : 1;
+	int64_t expires, victim_expires = INT64_MAX;
+	shm_slot *s, *victim = NULL;
+	shm_meta m;
+	unsigned seq;
+	size_t i;
+
+	if (!slots || (size_t)a->qname_len + a->response_len > SHM_DATA)
+		return -1;
+
+	/* Without looking at the sequence numbers: this is only a choice */
+	for (i = 0; i < STUBBY_SHMCACHE_PROBES; i++) {
+		s = slot_at(hash, i);
+		(void) memcpy(&m, &s->meta, sizeof(m));
+		if (same_question(&m, a, hash)) {
+			victim = s;
+			break;
+		}
+		expires = !m.hash || m.expires <= now ? INT64_MIN : m.expires;
+		if (!victim || expires < victim_expires) {
+			victim = s;
+			victim_expires = expires;
+		}
+	}
+	if (!slot_claim(victim, (int)getpid()))
+		return -1;
+	seq = slot_begin(victim);
+	if (victim->meta.hash && victim->meta.expires > now
+	&&  !same_question(&victim->meta, a, hash))
+		(void) atomic_fetch_add_explicit(
+		    &header->evictions, 1, memory_order_relaxed);
+	victim->meta.hash = hash;
+	victim->meta.stored = a->stored;
+	victim->meta.expires = a->expires;
+	victim->meta.qtype = a->qtype;
+	victim->meta.qclass = a->qclass;
+	victim->meta.flags = a->flags;
+	victim->meta.qname_len = a->qname_len;
+	victim->meta.response_len = a->response_len;
+	(void) memcpy(victim->data, a->qname, a->qname_len);
+	(void) memcpy(victim->data + a->qname_len,
+	    a->response, a->response_len);
+	slot_end(victim, seq);
+	return 0;
+}
+
+size_t stubby_shmcache_walk(stubby_shmcache_walk_func func, void *arg)
+{
+	uint8_t data[SHM_DATA];
+	stubby_shmcache_answer a;
+	int self = (int)getpid();
+	size_t i, n = 0;
+	unsigned seq;
+	shm_slot *s;
+	shm_meta m;
+
+	for (i = 0; slots && i <= slot_mask; i++) {
+		s = &slots[i];
+		if (slot_read(s, &m, &seq) || !m.hash
+		||  (size_t)m.qname_len + m.response_len > SHM_DATA)
+			continue;
+		(void) memcpy(data, s->data, m.qname_len + m.response_len);
+		if (!slot_unchanged(s, seq))
+			continue;
+
+		a.hash = m.hash;
+		a.stored = m.stored;
+		a.expires = m.expires;
+		a.qtype = m.qtype;
+		a.qclass = m.qclass;
+		a.flags = m.flags;
+		a.qname_len = m.qname_len;
+		a.response_len = m.response_len;
+		a.qname = data;
+		a.response = data + m.qname_len;
+		if (!func(&a, arg) || !slot_claim(s, self))
+			continue;
+
+		/* Unless it was written in the meantime */
+		if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) {
+			atomic_store_explicit(&s->owner, 0, memory_order_release);
+			continue;
+		}
+		seq = slot_begin(s);
+		s->meta.hash = 0;
+		slot_end(s, seq);
+		n++;
+	}
+	return n;
+}
+
+void stubby_shmcache_release(int pid)
+{
+	int self = (int)getpid(), owner;
+	unsigned seq;
+	size_t i;
+
+	for (i = 0; slots && i <= slot_mask; i++) {
+		owner = pid;
+		if (atomic_load_explicit(&slots[i].owner,
+		    memory_order_relaxed) != pid
+		||  !atomic_compare_exchange_strong_explicit(&slots[i].owner,
+		    &owner, self, memory_order_acquire, memory_order_relaxed))
+			continue;
+		/* What it was writing is incomplete */
+		seq = slot_begin(&slots[i]);
+		slots[i].meta.hash = 0;
+		slot_end(&slots[i], seq);
+	}
+}
+
+void stubby_shmcache_counters(uint64_t *hits, uint64_t *misses,
+    uint64_t *evictions)
+{
+	*hits = header ? atomic_load(&header->hits) : 0;
+	*misses = header ? atomic_load(&header->misses) : 0;
+	*evictions = header ? atomic_load(&header->evictions) : 0;
+}
+
+#else /* Without atomics or shared memory */
+
+int stubby_shmcache_create(size_t bytes)
+{
+	(void)bytes;
+	return -1;
+}
+
+void stubby_shmcache_destroy(void)
+{
+}
+
+size_t stubby_shmcache_lookup(uint64_t hash, const uint8_t *qname,
+    size_t qname_len, uint16_t qtype, uint16_t qclass, uint8_t flags,
+    int64_t now, uint8_t *buf, size_t buf_len, int64_t *stored)
+{
+	(void)hash; (void)qname; (void)qname_len; (void)qtype; (void)qclass;
+	(void)flags; (void)now; (void)buf; (void)buf_len; (void)stored;
+	return 0;
+}
+
+int stubby_shmcache_store(const stubby_shmcache_answer *answer, int64_t now)
+{
+	(void)answer; (void)now;
+	return -1;
+}
+
+size_t stubby_shmcache_walk(stubby_shmcache_walk_func func, void *arg)
+{
+	(void)func; (void)arg;
+	return 0;
+}
+
+void stubby_shmcache_release(int pid)
+{
+	(void)pid;
+}
+
+void stubby_shmcache_counters(uint64_t *hits, uint64_t *misses,
+    uint64_t *evictions)
+{
+	*hits = *misses = *evictions = 0;
+}
+
+#endif
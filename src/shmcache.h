@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_SHMCACHE_H
+#define _STUBBY_SHMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Answer cache shared by worker processes (see prefork.h).
+ *
+ * A shared anonymous mapping, made before the workers are forked, with a
+ * table of fixed size slots.  An answer goes into one of
+ * STUBBY_SHMCACHE_PROBES consecutive slots from its hash (open
+ * addressing): the one with the same question, an empty or expired one,
+ * or else the one that expires first.  Answers that do not fit in a slot
+ * are not cached.
+ *
+ * Lookups take no lock.  A slot has a sequence number that is odd while it
+ * is written, and a lookup only uses the answer it copied when the
+ * sequence number was even before and unchanged after.  A writer claims a
+ * slot by setting its owner to its pid, and gives up when another writer
+ * owns it.  A worker that dies while writing leaves the slot odd, so that
+ * it is skipped, until the master releases the slots of the worker (or a
+ * writer finds that the owner does not exist anymore): a crash costs the
+ * answer that was written and never corrupts the table.
+ */
+#define STUBBY_SHMCACHE_SLOT   512
+#define STUBBY_SHMCACHE_PROBES 8
+
+typedef struct stubby_shmcache_answer {
+	uint64_t       hash;
+	int64_t        stored;     /* UNIX time */
+	int64_t        expires;
+	uint16_t       qtype;
+	uint16_t       qclass;
+	uint8_t        flags;
+	uint8_t        qname_len;  /* The lower case qname */
+	uint16_t       response_len;
+	const uint8_t *qname;
+	const uint8_t *response;
+} stubby_shmcache_answer;
+
+/* Map a table of at most bytes.  Returns 0 on success, or -1 when shared
+ * memory (or atomics that work on it) is not available.
+ */
+int stubby_shmcache_create(size_t bytes);
+void stubby_shmcache_destroy(void);
+
+/**
+ * Look up the answer with key.  Counts a hit or a miss.
+ * @param buf     receives the response
+ * @param stored  receives the time the response was stored
+ * @return the length of the response, or 0 when none was found
+ */
+size_t stubby_shmcache_lookup(uint64_t hash, const uint8_t *qname,
+    size_t qname_len, uint16_t qtype, uint16_t qclass, uint8_t flags,
+    int64_t now, uint8_t *buf, size_t buf_len, int64_t *stored);
+
+/* Store answer.  Returns -1 when it was not (too large, or the slot for it
+ * is being written).
+ */
+int stubby_shmcache_store(const stubby_shmcache_answer *answer, int64_t now);
+
+/* Called for the answers that are in the table (also expired ones).
+ * Answers for which it returns nonzero are removed.
+ */
+typedef int (*stubby_shmcache_walk_func)(
+    const stubby_shmcache_answer *answer, void *arg);
+
+/* Returns the number of answers removed */
+size_t stubby_shmcache_walk(stubby_shmcache_walk_func func, void *arg);
+
+/* Release the slots that the (dead) process pid was writing */
+void stubby_shmcache_release(int pid);
+
+void stubby_shmcache_counters(uint64_t *hits, uint64_t *misses,
+    uint64_t *evictions);
+
+#endif /* _STUBBY_SHMCACHE_H */
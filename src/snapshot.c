@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "snapshot.h"
+
+#define SNAPSHOT_HEADER_LEN 32
+#define SNAPSHOT_MAX_DEPTH  64
+#define SNAPSHOT_MAX_NAME   255
+
+#define SNAPSHOT_INT     'i'
+#define SNAPSHOT_BINDATA 'b'
+#define SNAPSHOT_LIST    'l'
+#define SNAPSHOT_DICT    'd'
+
+static uint64_t snapshot_checksum(const uint8_t *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= *data++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void put_u32(gldns_buffer *buf, uint32_t n)
+{
+	if (gldns_buffer_reserve(buf, 4))
+		gldns_buffer_write_u32(buf, n);
+}
+
+static void put_data(gldns_buffer *buf, const void *data, size_t len)
+{
+	if (gldns_buffer_reserve(buf, len))
+		gldns_buffer_write(buf, data, len);
+}
+
+static void put_type(gldns_buffer *buf, uint8_t type)
+{
+	put_data(buf, &type, 1);
+}
+
+static int encode_dict(gldns_buffer *buf, const getdns_dict *dict);
+
+static int encode_list(gldns_buffer *buf, const getdns_list *list)
+{
+	getdns_data_type type;
+	getdns_bindata *bindata;
+	getdns_dict *dict;
+	getdns_list *child;
+	size_t i, n = 0;
+	uint32_t value;
+
+	(void) getdns_list_get_length(list, &n);
+	put_type(buf, SNAPSHOT_LIST);
+	put_u32(buf, (uint32_t)n);
+	for (i = 0; i < n; i++) {
+		if (getdns_list_get_data_type(list, i, &type))
+			type = t_int; /* Not reached */
+		switch (type) {
+		case t_dict:
+			if (getdns_list_get_dict(list, i, &dict)
+			||  encode_dict(buf, dict))
+				return -1;
+			break;
+		case t_list:
+			if (getdns_list_get_list(list, i, &child)
+			||  encode_list(buf, child))
+				return -1;
+			break;
+		case t_bindata:
+			(void) getdns_list_get_bindata(list, i, &bindata);
+			put_type(buf, SNAPSHOT_BINDATA);
+			put_u32(buf, (uint32_t)bindata->size);
+			put_data(buf, bindata->data, bindata->size);
+			break;
+		default:
+			value = 0;
+			(void) getdns_list_get_int(list, i, &value);
+			put_type(buf, SNAPSHOT_INT);
+			put_u32(buf, value);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int encode_dict_value(gldns_buffer *buf, const getdns_dict *dict,
+    const char *key)
+{
+	getdns_data_type type;
+	getdns_bindata *bindata;
+	getdns_dict *child;
+	getdns_list *list;
+	uint32_t value;
+
+	if (getdns_dict_get_data_type(dict, key, &type))
+		return -1;
+	switch (type) {
+	case t_dict:
+		if (getdns_dict_get_dict(dict, key, &child))
+			return -1;
+		return encode_dict(buf, child);
+	case t_list:
+		if (getdns_dict_get_list(dict, key, &list))
+			return -1;
+		return encode_list(buf, list);
+	case t_bindata:
+		(void) getdns_dict_get_bindata(dict, key, &bindata);
+		put_type(buf, SNAPSHOT_BINDATA);
+		put_u32(buf, (uint32_t)bindata->size);
+		put_data(buf, bindata->data, bindata->size);
+		return 0;
+	default:
+		value = 0;
+		(void) getdns_dict_get_int(dict, key, &value);
+		put_type(buf, SNAPSHOT_INT);
+		put_u32(buf, value);
+		return 0;
+	}
+}
+
+static int encode_dict(gldns_buffer *buf, const getdns_dict *dict)
+{
+	getdns_list *names = NULL;
+	getdns_bindata *name;
+	size_t i, n = 0;
+	char key[SNAPSHOT_MAX_NAME + 1];
+	int r = -1;
+
+	if (getdns_dict_get_names(dict, &names))
+		return -1;
+	(void) getdns_list_get_length(names, &n);
+	put_type(buf, SNAPSHOT_DICT);
+	put_u32(buf, (uint32_t)n);
+	for (i = 0; i < n; i++) {
+		if (getdns_list_get_bindata(names, i, &name)
+		||  name->size > SNAPSHOT_MAX_NAME)
+			goto error;
+		(void) memcpy(key, name->data, name->size);
+		key[name->size] = 0;
+
+		if (gldns_buffer_reserve(buf, 2))
+			gldns_buffer_write_u16(buf, (uint16_t)name->size);
+		put_data(buf, name->data, name->size);
+
+		if (encode_dict_value(buf, dict, key))
+			goto error;
+	}
+	r = 0;
+error:
+	getdns_list_destroy(names);
+	return r;
+}
+
+getdns_return_t stubby_snapshot_encode(const getdns_dict *config,
+    gldns_buffer *buf)
+{
+	uint64_t len, checksum;
+
+	gldns_buffer_clear(buf);
+	put_data(buf, STUBBY_SNAPSHOT_MAGIC, STUBBY_SNAPSHOT_MAGIC_LEN);
+	put_u32(buf, STUBBY_SNAPSHOT_VERSION);
+	put_u32(buf, 0);
+	put_u32(buf, 0); /* Length and checksum are filled in below */
+	put_u32(buf, 0);
+	put_u32(buf, 0);
+	put_u32(buf, 0);
+	if (encode_dict(buf, config))
+		return GETDNS_RETURN_GENERIC_ERROR;
+	if (!gldns_buffer_status_ok(buf))
+		return GETDNS_RETURN_MEMORY_ERROR;
+
+	len = gldns_buffer_position(buf) - SNAPSHOT_HEADER_LEN;
+	checksum = snapshot_checksum(
+	    gldns_buffer_at(buf, SNAPSHOT_HEADER_LEN), (size_t)len);
+	gldns_buffer_write_u32_at(buf, 16, (uint32_t)(len >> 32));
+	gldns_buffer_write_u32_at(buf, 20, (uint32_t)len);
+	gldns_buffer_write_u32_at(buf, 24, (uint32_t)(checksum >> 32));
+	gldns_buffer_write_u32_at(buf, 28, (uint32_t)checksum);
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t stubby_snapshot_encode_value(const getdns_dict *dict,
+    const char *name, gldns_buffer *buf)
+{
+	gldns_buffer_clear(buf);
+	if (encode_dict_value(buf, dict, name))
+		return GETDNS_RETURN_NO_SUCH_DICT_NAME;
+	return gldns_buffer_status_ok(buf)
+	    ? GETDNS_RETURN_GOOD : GETDNS_RETURN_MEMORY_ERROR;
+}
+
+/* Sync the directory of fn, so that a rename into it is on disk too */
+static void snapshot_sync_dir(const char *fn)
+{
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	const char *slash = strrchr(fn, '/');
+	size_t dir_len = !slash ? 0 : slash == fn ? 1 : (size_t)(slash - fn);
+	char *dir;
+	int fd;
+
+	if (!(dir = malloc(dir_len + 2)))
+		return;
+	if (dir_len)
+		(void) memcpy(dir, fn, dir_len);
+	else
+		dir[dir_len++] = '.';
+	dir[dir_len] = 0;
+	if ((fd = open(dir, O_RDONLY)) >= 0) {
+		(void) fsync(fd);
+		(void) close(fd);
+	}
+	free(dir);
+#else
+	(void)fn;
+#endif
+}
+
+getdns_return_t stubby_snapshot_write(const char *fn, gldns_buffer *buf)
+{
+	size_t tmp_len = strlen(fn) + 5;
+	char *tmp_fn;
+	FILE *fh;
+	int err;
+
+	if (!(tmp_fn = malloc(tmp_len)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	(void) snprintf(tmp_fn, tmp_len, "%s.tmp", fn);
+	if (!(fh = fopen(tmp_fn, "wb"))) {
+		free(tmp_fn);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	if (fwrite(gldns_buffer_begin(buf), 1, gldns_buffer_position(buf), fh)
+	    != gldns_buffer_position(buf)) {
+		err = errno;
+		(void) fclose(fh);
+		(void) remove(tmp_fn);
+		free(tmp_fn);
+		errno = err;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	/* Make sure the data is on disk before the rename makes it the
+	 * snapshot, so that a crash leaves either the old or the new one.
+	 */
+	if (fflush(fh) != 0
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	||  fsync(fileno(fh)) != 0
+#endif
+	    ) {
+		err = errno;
+		(void) fclose(fh);
+		(void) remove(tmp_fn);
+		free(tmp_fn);
+		errno = err;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	if (fclose(fh) != 0 || rename(tmp_fn, fn) != 0) {
+		err = errno;
+		(void) remove(tmp_fn);
+		free(tmp_fn);
+		errno = err;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	free(tmp_fn);
+	snapshot_sync_dir(fn);
+	return GETDNS_RETURN_GOOD;
+}
+
+typedef struct snapshot_reader {
+	const uint8_t *pos;
+	const uint8_t *end;
+} snapshot_reader;
+
+static int get_u8(snapshot_reader *r, uint8_t *n)
+{
+	if (r->end - r->pos < 1)
+		return -1;
+	*n = *r->pos++;
+	return 0;
+}
+
+static int get_u16(snapshot_reader *r, uint16_t *n)
+{
+	if (r->end - r->pos < 2)
+		return -1;
+	*n = gldns_read_uint16(r->pos);
+	r->pos += 2;
+	return 0;
+}
+
+static int get_u32(snapshot_reader *r, uint32_t *n)
+{
+	if (r->end - r->pos < 4)
+		return -1;
+	*n = gldns_read_uint32(r->pos);
+	r->pos += 4;
+	return 0;
+}
+
+/* Where a decoded item goes: under key in dict, or at index in list */
+typedef struct snapshot_target {
+	getdns_dict *dict;
+	const char  *key;
+	getdns_list *list;
+	size_t       index;
+} snapshot_target;
+
+static int decode_dict(snapshot_reader *r, getdns_dict *dict, int depth);
+static int decode_list(snapshot_reader *r, getdns_list *list, int depth);
+
+/* Containers are put in their parent empty and filled in place, so that
+ * nothing is copied more than once.
+ */
+static int decode_item(snapshot_reader *r, snapshot_target *t, int depth)
+{
+	static getdns_dict *empty_dict = NULL;
+	static getdns_list *empty_list = NULL;
+	getdns_bindata bindata;
+	getdns_dict *dict;
+	getdns_list *list;
+	uint32_t n;
+	uint8_t type;
+
+	if (depth > SNAPSHOT_MAX_DEPTH || get_u8(r, &type))
+		return -1;
+	switch (type) {
+	case SNAPSHOT_INT:
+		if (get_u32(r, &n))
+			return -1;
+		return (t->dict ? getdns_dict_set_int(t->dict, t->key, n)
+		                : getdns_list_set_int(t->list, t->index, n))
+		    ? -1 : 0;
+	case SNAPSHOT_BINDATA:
+		if (get_u32(r, &n) || (size_t)(r->end - r->pos) < n)
+			return -1;
+		bindata.size = n;
+		bindata.data = (uint8_t *)r->pos;
+		r->pos += n;
+		return (t->dict ? getdns_dict_set_bindata(t->dict, t->key, &bindata)
+		                : getdns_list_set_bindata(t->list, t->index, &bindata))
+		    ? -1 : 0;
+	case SNAPSHOT_DICT:
+		if ((!empty_dict && !(empty_dict = getdns_dict_create()))
+		||  (t->dict ? getdns_dict_set_dict(t->dict, t->key, empty_dict)
+		              || getdns_dict_get_dict(t->dict, t->key, &dict)
+		             : getdns_list_set_dict(t->list, t->index, empty_dict)
+		              || getdns_list_get_dict(t->list, t->index, &dict)))
+			return -1;
+		return decode_dict(r, dict, depth + 1);
+	case SNAPSHOT_LIST:
+		if ((!empty_list && !(empty_list = getdns_list_create()))
+		||  (t->dict ? getdns_dict_set_list(t->dict, t->key, empty_list)
+		              || getdns_dict_get_list(t->dict, t->key, &list)
+		             : getdns_list_set_list(t->list, t->index, empty_list)
+		              || getdns_list_get_list(t->list, t->index, &list)))
+			return -1;
+		return decode_list(r, list, depth + 1);
+	default:
+		return -1;
+	}
+}
+
+static int decode_list(snapshot_reader *r, getdns_list *list, int depth)
+{
+	snapshot_target t;
+	uint32_t n;
+
+	if (get_u32(r, &n))
+		return -1;
+	(void) memset(&t, 0, sizeof(t));
+	t.list = list;
+	for (t.index = 0; t.index < n; t.index++)
+		if (decode_item(r, &t, depth))
+			return -1;
+	return 0;
+}
+
+static int decode_dict(snapshot_reader *r, getdns_dict *dict, int depth)
+{
+	snapshot_target t;
+	char key[SNAPSHOT_MAX_NAME + 1];
+	uint32_t i, n;
+	uint16_t key_len;
+
+	if (get_u32(r, &n))
+		return -1;
+	(void) memset(&t, 0, sizeof(t));
+	t.dict = dict;
+	t.key = key;
+	for (i = 0; i < n; i++) {
+		if (get_u16(r, &key_len) || key_len > SNAPSHOT_MAX_NAME
+		||  r->end - r->pos < key_len)
+			return -1;
+		(void) memcpy(key, r->pos, key_len);
+		key[key_len] = 0;
+		r->pos += key_len;
+		if (decode_item(r, &t, depth))
+			return -1;
+	}
+	return 0;
+}
+
+/* Decode the snapshot of len bytes at data into *config */
+static getdns_return_t snapshot_decode(const uint8_t *data, size_t len,
+    getdns_dict **config)
+{
+	snapshot_reader r;
+	uint64_t payload_len, checksum;
+	uint8_t type;
+
+	if (len < SNAPSHOT_HEADER_LEN
+	||  memcmp(data, STUBBY_SNAPSHOT_MAGIC, STUBBY_SNAPSHOT_MAGIC_LEN)
+	||  gldns_read_uint32(data + 8) != STUBBY_SNAPSHOT_VERSION)
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	payload_len = (uint64_t)gldns_read_uint32(data + 16) << 32
+	            | gldns_read_uint32(data + 20);
+	checksum = (uint64_t)gldns_read_uint32(data + 24) << 32
+	         | gldns_read_uint32(data + 28);
+	if (payload_len != len - SNAPSHOT_HEADER_LEN
+	||  checksum != snapshot_checksum(
+	    data + SNAPSHOT_HEADER_LEN, (size_t)payload_len))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	r.pos = data + SNAPSHOT_HEADER_LEN;
+	r.end = data + len;
+	if (get_u8(&r, &type) || type != SNAPSHOT_DICT
+	||  !(*config = getdns_dict_create()))
+		return GETDNS_RETURN_GENERIC_ERROR;
+
+	if (decode_dict(&r, *config, 0) || r.pos != r.end) {
+		getdns_dict_destroy(*config);
+		*config = NULL;
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+getdns_return_t stubby_snapshot_read(const char *fn, getdns_dict **config)
+{
+	struct stat st;
+	getdns_return_t r;
+	void *data;
+	int fd;
+
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return GETDNS_RETURN_IO_ERROR;
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		(void) close(fd);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (data == MAP_FAILED)
+		return GETDNS_RETURN_IO_ERROR;
+
+	r = snapshot_decode(data, (size_t)st.st_size, config);
+	(void) munmap(data, (size_t)st.st_size);
+	return r;
+}
+#else
+getdns_return_t stubby_snapshot_read(const char *fn, getdns_dict **config)
+{
+	getdns_return_t r;
+	uint8_t *data;
+	long len;
+	FILE *fh;
+
+	if (!(fh = fopen(fn, "rb")))
+		return GETDNS_RETURN_IO_ERROR;
+	if (fseek(fh, 0, SEEK_END) == -1 || (len = ftell(fh)) <= 0
+	||  !(data = malloc(len))) {
+		fclose(fh);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	rewind(fh);
+	if (fread(data, 1, len, fh) != (size_t)len) {
+		free(data);
+		fclose(fh);
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	fclose(fh);
+	r = snapshot_decode(data, (size_t)len, config);
+	free(data);
+	return r;
+}
+#endif
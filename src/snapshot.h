@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_SNAPSHOT_H
+#define _STUBBY_SNAPSHOT_H
+
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Binary configuration snapshots.
+ *
+ * "stubby -C stubby.yml -o stubby.snapshot" parses and validates the
+ * configuration and writes the resulting config dict to a snapshot.
+ * Given to -C, a snapshot is recognised by its magic and the config dict
+ * is rebuilt directly from the (memory mapped) file, without parsing YAML
+ * or JSON.
+ *
+ * A snapshot is a 32 byte header followed by the encoded dict:
+ *
+ *   magic "STUBBYCS" | version (4) | reserved (4) | length (8) | checksum (8)
+ *
+ * with the 64 bit FNV-1a checksum of the length bytes that follow.  Items
+ * are encoded as a type byte: 'i' followed by a 32 bit integer, 'b' by a
+ * 32 bit length and the data, 'l' by a 32 bit count and the items, and
+ * 'd' by a 32 bit count and for each member a 16 bit name length, the
+ * name and the item.  All integers are in network byte order.
+ */
+#define STUBBY_SNAPSHOT_MAGIC     "STUBBYCS"
+#define STUBBY_SNAPSHOT_MAGIC_LEN 8
+#define STUBBY_SNAPSHOT_VERSION   1
+
+/* Encode config as a snapshot into buf */
+getdns_return_t stubby_snapshot_encode(const getdns_dict *config,
+    gldns_buffer *buf);
+
+/* Encode just the value of name in dict into buf, without a header.
+ * Equal values have equal encodings, which is used to find the settings
+ * that changed when the configuration is reloaded.
+ */
+getdns_return_t stubby_snapshot_encode_value(const getdns_dict *dict,
+    const char *name, gldns_buffer *buf);
+
+/* Write an encoded snapshot to fn, replacing fn only when complete */
+getdns_return_t stubby_snapshot_write(const char *fn, gldns_buffer *buf);
+
+/**
+ * Read the config dict from the snapshot in fn.
+ * @return GETDNS_RETURN_GOOD, GETDNS_RETURN_IO_ERROR when the file could
+ *         not be read or GETDNS_RETURN_GENERIC_ERROR when it is not a
+ *         valid snapshot (of this version).
+ */
+getdns_return_t stubby_snapshot_read(const char *fn, getdns_dict **config);
+
+#endif /* _STUBBY_SNAPSHOT_H */
@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_STUBBY_THREADS
+#include <stdatomic.h>
+#endif
+
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include "memory.h"
+#include "prefork.h"
+
+#define STATS_WORKER_UPSTREAMS 64
+
+#ifdef HAVE_STUBBY_THREADS
+typedef atomic_size_t stats_size;
+#define STATS_GET(c)    atomic_load_explicit(&(c), memory_order_acquire)
+#define STATS_SET(c, v) atomic_store_explicit(&(c), v, memory_order_release)
+#else
+typedef size_t stats_size;
+#define STATS_GET(c)    (c)
+#define STATS_SET(c, v) ((c) = (v))
+#endif
+
+static int                    stats_enabled = 0;
+static getdns_context        *stats_context = NULL;
+static int                    stats_known = 0;
+static int                    stats_log_version = -1;
+static stubby_upstream_stats *upstreams = NULL;
+static size_t                 n_upstreams = 0;
+static size_t                 upstreams_sz = 0;
+
+/* With workers, every worker keeps its upstreams in a table of its own in
+ * memory shared by all workers, and what is shown are their totals.  A
+ * worker started again counts on in the table of the one it replaces.
+ */
+typedef struct stats_table {
+	stats_size            n;  /* Set once an upstream is filled in */
+	stubby_upstream_stats upstreams[STATS_WORKER_UPSTREAMS];
+} stats_table;
+
+typedef struct stats_shared {
+	stats_size  enabled;
+	stats_table tables[];
+} stats_shared;
+
+static stats_shared          *shared = NULL;
+static size_t                 n_tables = 0;
+static stats_table           *table = NULL;  /* Of this worker */
+static stubby_upstream_stats *totals = NULL;
+static size_t                 n_totals = 0;
+static size_t                 totals_sz = 0;
+
+static char                  *stats_file = NULL;
+static uint32_t               stats_interval = 60;
+static getdns_eventloop      *stats_loop = NULL;
+static getdns_eventloop_event stats_event;
+
+/* Upstream statistics need all upstream events from getdns */
+static void stats_set_logfunc(void)
+{
+	(void) getdns_context_set_logfunc(stats_context, NULL,
+	    GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_DEBUG, stubby_stats_logfunc);
+}
+
+void stubby_stats_enable(void)
+{
+	if (!stats_enabled && stats_context)
+		stats_set_logfunc();
+	stats_enabled = 1;
+	if (shared)
+		STATS_SET(shared->enabled, 1);
+}
+
+getdns_return_t stubby_stats_share(void)
+{
+	size_t n = stubby_prefork_workers();
+
+	if (!(shared = stubby_prefork_share(
+	    sizeof(stats_shared) + n * sizeof(stats_table))))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	n_tables = n;
+	STATS_SET(shared->enabled, (size_t)stats_enabled);
+	return GETDNS_RETURN_GOOD;
+}
+
+/* In a worker, keep the upstreams in its table from now on */
+static void stats_attach(void)
+{
+	if (stubby_prefork_worker() < 0)
+		return;
+	table = &shared->tables[stubby_prefork_worker()];
+	stubby_mem_free(STUBBY_MEM_STATS, upstreams);
+	upstreams = table->upstreams;
+	n_upstreams = STATS_GET(table->n);
+	upstreams_sz = STATS_WORKER_UPSTREAMS;
+}
+
+/* The last new upstream is filled in */
+static void stats_publish(void)
+{
+	if (table)
+		STATS_SET(table->n, n_upstreams);
+}
+
+void stubby_stats_set_context(getdns_context *context)
+{
+	stats_context = context;
+	if (stats_enabled)
+		stats_set_logfunc();
+}
+
+void stubby_stats_set_log_level(getdns_loglevel_type level)
+{
+	/* With statistics getdns passes all upstream events already, and
+	 * stubby_stats_logfunc() hands them to stubby_log(), which logs
+	 * them up to the log level.
+	 */
+	if (stats_context && !stats_enabled)
+		(void) getdns_context_set_logfunc(stats_context, NULL,
+		    GETDNS_LOG_UPSTREAM_STATS, level, stubby_log);
+}
+
+int stubby_stats_enabled(void)
+{
+	return stats_enabled;
+}
+
+getdns_return_t stubby_stats_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+	uint32_t n;
+
+	if (!getdns_dict_get_bindata(config, "upstream_stats_file", &bindata)) {
+		free(stats_file);
+		if (!(stats_file = malloc(bindata->size + 1)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		(void) memcpy(stats_file, bindata->data, bindata->size);
+		stats_file[bindata->size] = 0;
+		stubby_stats_enable();
+	}
+	if (!getdns_dict_get_int(config, "upstream_stats_interval", &n)) {
+		if (n == 0) {
+			fprintf(stderr, "upstream_stats_interval must be "
+			        "at least 1 second\n");
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		stats_interval = n;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+static stubby_upstream_stats *upstream_new(void)
+{
+	stubby_upstream_stats *upstream;
+
+	if (n_upstreams == upstreams_sz) {
+		if (table)
+			return NULL; /* Not grown in shared memory */
+		size_t new_sz = upstreams_sz ? upstreams_sz * 2 : 8;
+
+		if (!(upstream = stubby_mem_realloc(STUBBY_MEM_STATS,
+		    upstreams, new_sz * sizeof(stubby_upstream_stats))))
+			return NULL;
+		upstreams = upstream;
+		upstreams_sz = new_sz;
+	}
+	upstream = &upstreams[n_upstreams++];
+	(void) memset(upstream, 0, sizeof(stubby_upstream_stats));
+	return upstream;
+}
+
+/* Name the upstream the way getdns does in its log messages */
+static void upstream_set_name(stubby_upstream_stats *upstream)
+{
+	char addr_str[INET6_ADDRSTRLEN];
+
+	if (!inet_ntop(upstream->addr_len == 4 ? AF_INET : AF_INET6,
+	    upstream->addr, addr_str, sizeof(addr_str)))
+		(void) strcpy(addr_str, "?");
+	(void) snprintf(upstream->name, sizeof(upstream->name), "%s#%d",
+	    addr_str, (int)upstream->port);
+}
+
+static stubby_upstream_stats *upstream_by_addr(
+    const getdns_bindata *addr, uint32_t port, uint32_t transport)
+{
+	stubby_upstream_stats *upstream;
+	size_t i;
+
+	if (shared && !table)
+		stats_attach();
+	for (i = 0; i < n_upstreams; i++) {
+		upstream = &upstreams[i];
+		if (upstream->port == port && upstream->addr_len == addr->size
+		&&  !memcmp(upstream->addr, addr->data, addr->size))
+			return upstream;
+	}
+	if ((addr->size != 4 && addr->size != 16)
+	||  !(upstream = upstream_new()))
+		return NULL;
+	(void) memcpy(upstream->addr, addr->data, addr->size);
+	upstream->addr_len = addr->size;
+	upstream->port = port;
+	upstream->transport = transport;
+	upstream_set_name(upstream);
+	stats_publish();
+	return upstream;
+}
+
+/* Only used for log events, which are not on the query path.
+ * getdns names upstreams "<numeric address>#<port>".
+ */
+static stubby_upstream_stats *upstream_by_name(const char *name)
+{
+	stubby_upstream_stats *upstream;
+	const char *sep;
+	char addr_str[INET6_ADDRSTRLEN];
+	size_t i;
+
+	if (shared && !table)
+		stats_attach();
+	for (i = 0; i < n_upstreams; i++)
+		if (!strcmp(upstreams[i].name, name))
+			return &upstreams[i];
+
+	if (!(sep = strrchr(name, '#')))
+		return NULL;
+	if ((size_t)(sep - name) >= sizeof(addr_str))
+		return NULL;
+	(void) memcpy(addr_str, name, sep - name);
+	addr_str[sep - name] = 0;
+
+	if (!(upstream = upstream_new()))
+		return NULL;
+	if (inet_pton(AF_INET, addr_str, upstream->addr) == 1)
+		upstream->addr_len = 4;
+	else if (inet_pton(AF_INET6, addr_str, upstream->addr) == 1)
+		upstream->addr_len = 16;
+	else {
+		n_upstreams--;
+		return NULL;
+	}
+	upstream->port = (uint32_t)atoi(sep + 1);
+	upstream->transport = upstream->port == 853
+	    ? GETDNS_TRANSPORT_TLS : GETDNS_TRANSPORT_UDP;
+	upstream_set_name(upstream);
+	stats_publish();
+	return upstream;
+}
+
+static void upstream_rtt(stubby_upstream_stats *upstream, uint32_t rtt_ms)
+{
+	size_t bucket = 0;
+	uint32_t bound = 1;
+
+	while (bucket < STUBBY_RTT_BUCKETS - 1 && rtt_ms > bound) {
+		bound <<= 1;
+		bucket++;
+	}
+	upstream->rtt_buckets[bucket]++;
+	upstream->rtt_sum_ms += rtt_ms;
+}
+
+void stubby_stats_query_extensions(getdns_dict *extensions)
+{
+	/* Enabled by another worker */
+	if (!stats_enabled && shared && STATS_GET(shared->enabled))
+		stubby_stats_enable();
+	if (stats_enabled)
+		(void) getdns_dict_set_int(extensions,
+		    "return_call_reporting", GETDNS_EXTENSION_TRUE);
+}
+
+const stubby_upstream_stats *stubby_stats_response(
+    getdns_callback_type_t callback_type, const getdns_dict *response,
+    uint32_t *rtt_ms)
+{
+	getdns_list *call_reporting;
+	getdns_dict *call;
+	getdns_bindata *addr;
+	uint32_t port, transport, rtt;
+	stubby_upstream_stats *upstream, *answered = NULL;
+	size_t i, n;
+
+	if (rtt_ms)
+		*rtt_ms = 0;
+	if (!stats_enabled || !response
+	||  getdns_dict_get_list(response, "call_reporting", &call_reporting)
+	||  getdns_list_get_length(call_reporting, &n))
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		if (getdns_list_get_dict(call_reporting, i, &call)
+		||  getdns_dict_get_bindata(call, "/query_to/address_data", &addr))
+			continue;
+		if (getdns_dict_get_int(call, "transport", &transport))
+			transport = GETDNS_TRANSPORT_UDP;
+		if (getdns_dict_get_int(call, "/query_to/port", &port))
+			port = transport == GETDNS_TRANSPORT_TLS ? 853 : 53;
+		if (!(upstream = upstream_by_addr(addr, port, transport)))
+			continue;
+
+		upstream->queries++;
+		if (i < n - 1)
+			continue; /* Only the last upstream asked answered */
+
+		if (callback_type == GETDNS_CALLBACK_TIMEOUT)
+			upstream->timeouts++;
+
+		else if (callback_type == GETDNS_CALLBACK_COMPLETE) {
+			upstream->responses++;
+			answered = upstream;
+			if (!getdns_dict_get_int(call, "run_time/ms", &rtt)) {
+				upstream_rtt(upstream, rtt);
+				if (rtt_ms)
+					*rtt_ms = rtt;
+			}
+		}
+	}
+	/* Valid until the next new upstream is seen */
+	return answered;
+}
+
+/* The getdns versions whose GETDNS_LOG_UPSTREAM_STATS messages are known
+ * (those of the getdns 1.5, 1.6 and 1.7 releases, see src/stub.c in getdns).
+ * The messages are matched on their exact format string and arguments are
+ * taken by position, so any other version is not listened to at all.
+ */
+#define STATS_GETDNS_MIN 0x01050000
+#define STATS_GETDNS_MAX 0x0107ffff
+
+typedef enum stats_log_event {
+	STATS_CONN_OPENED,  /* addr_str, "TLS" or "TCP", profile */
+	STATS_CONN_CLOSED   /* addr_str, ... */
+} stats_log_event;
+
+static const struct {
+	const char *fmt;
+	stats_log_event event;
+} stats_log_events[] = {
+	{ "%-40s : Conn opened: %s - %s Profile\n", STATS_CONN_OPENED },
+	{ "%-40s : Conn closed: %s - Resps=%6d, Timeouts =%6d, "
+	  "Curr_auth =%7s, Keepalive(ms)=%6d\n", STATS_CONN_CLOSED }
+};
+
+static int stats_log_version_ok(void)
+{
+	uint32_t version;
+
+	if (stats_log_version < 0) {
+		version = getdns_get_version_number();
+		stats_log_version = version >= STATS_GETDNS_MIN
+		                 && version <= STATS_GETDNS_MAX;
+		if (!stats_log_version)
+			stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+			    GETDNS_LOG_NOTICE, "Connection statistics are not "
+			    "available with getdns %s\n", getdns_get_version());
+	}
+	return stats_log_version;
+}
+
+/* The connection event fmt is the format string of, or -1 */
+static int stats_log_event_of(const char *fmt)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(stats_log_events)
+	                / sizeof(*stats_log_events); i++)
+		if (!strcmp(fmt, stats_log_events[i].fmt))
+			return (int)stats_log_events[i].event;
+	return -1;
+}
+
+void stubby_stats_logfunc(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, va_list ap)
+{
+	stubby_upstream_stats *upstream;
+	const char *name, *transport;
+	va_list aq;
+	int event;
+
+	if (stats_enabled && (system & GETDNS_LOG_UPSTREAM_STATS)
+	&&  stats_log_version_ok() && (event = stats_log_event_of(fmt)) >= 0) {
+		va_copy(aq, ap);
+		name = va_arg(aq, const char *);
+		stats_known |= STUBBY_STATS_CONNS;
+
+		if (event == STATS_CONN_OPENED) {
+			transport = va_arg(aq, const char *);
+			if ((upstream = upstream_by_name(name))) {
+				upstream->conns_opened++;
+				upstream->last_conn_opened_ns =
+				    stubby_trace_now();
+				if (!strcmp(transport, "TLS"))
+					upstream->tls_handshakes++;
+			}
+		} else if ((upstream = upstream_by_name(name)))
+			upstream->conns_closed++;
+		va_end(aq);
+	}
+	stubby_log(userarg, system, level, fmt, ap);
+}
+
+int stubby_stats_known(int counters)
+{
+	return (stats_known & counters) == counters;
+}
+
+static void upstream_add(stubby_upstream_stats *total,
+    const stubby_upstream_stats *upstream)
+{
+	size_t i;
+
+	total->queries += upstream->queries;
+	total->responses += upstream->responses;
+	total->timeouts += upstream->timeouts;
+	total->conns_opened += upstream->conns_opened;
+	total->conns_closed += upstream->conns_closed;
+	total->tls_handshakes += upstream->tls_handshakes;
+	total->tls_resumed += upstream->tls_resumed;
+	for (i = 0; i < STUBBY_RTT_BUCKETS; i++)
+		total->rtt_buckets[i] += upstream->rtt_buckets[i];
+	total->rtt_sum_ms += upstream->rtt_sum_ms;
+}
+
+void stubby_stats_collect(void)
+{
+	const stubby_upstream_stats *upstream;
+	stubby_upstream_stats *total;
+	size_t i, j, k, n;
+
+	if (!shared)
+		return;
+	n_totals = 0;
+	for (i = 0; i < n_tables; i++) {
+		n = STATS_GET(shared->tables[i].n);
+		for (j = 0; j < n; j++) {
+			upstream = &shared->tables[i].upstreams[j];
+			for (k = 0; k < n_totals; k++)
+				if (totals[k].port == upstream->port
+				&&  totals[k].addr_len == upstream->addr_len
+				&&  !memcmp(totals[k].addr, upstream->addr,
+				    upstream->addr_len))
+					break;
+			if (k < n_totals) {
+				upstream_add(&totals[k], upstream);
+				continue;
+			}
+			if (n_totals == totals_sz) {
+				size_t new_sz = totals_sz ? totals_sz * 2 : 8;
+
+				if (!(total = stubby_mem_realloc(
+				    STUBBY_MEM_STATS, totals,
+				    new_sz * sizeof(stubby_upstream_stats))))
+					return;
+				totals = total;
+				totals_sz = new_sz;
+			}
+			(void) memcpy(&totals[n_totals++], upstream,
+			    sizeof(stubby_upstream_stats));
+		}
+	}
+}
+
+size_t stubby_stats_n_upstreams(void)
+{
+	return shared ? n_totals : n_upstreams;
+}
+
+const stubby_upstream_stats *stubby_stats_upstream(size_t i)
+{
+	if (shared)
+		return i < n_totals ? &totals[i] : NULL;
+	return i < n_upstreams ? &upstreams[i] : NULL;
+}
+
+static const char *transport_str(uint32_t transport)
+{
+	switch (transport) {
+	case GETDNS_TRANSPORT_UDP: return "UDP";
+	case GETDNS_TRANSPORT_TCP: return "TCP";
+	case GETDNS_TRANSPORT_TLS: return "TLS";
+	default                  : return "Unknown";
+	}
+}
+
+/* A counter, or null when it is not known */
+static void json_counter(gldns_buffer *buf, const char *name, int known,
+    uint64_t value)
+{
+	if (known)
+		(void) gldns_buffer_printf(buf, "\"%s\": %"PRIu64, name, value);
+	else
+		(void) gldns_buffer_printf(buf, "\"%s\": null", name);
+}
+
+void stubby_stats_upstreams_json(gldns_buffer *buf)
+{
+	const stubby_upstream_stats *upstream;
+	char addr_str[INET6_ADDRSTRLEN];
+	int conns = stubby_stats_known(STUBBY_STATS_CONNS);
+	int resumed = stubby_stats_known(STUBBY_STATS_TLS_RESUMED);
+	size_t i, j;
+
+	stubby_stats_collect();
+	(void) gldns_buffer_printf(buf, "{ \"upstreams\":\n  [");
+	for (i = 0; (upstream = stubby_stats_upstream(i)); i++) {
+		if (!inet_ntop(upstream->addr_len == 4 ? AF_INET : AF_INET6,
+		    upstream->addr, addr_str, sizeof(addr_str)))
+			(void) strcpy(addr_str, "?");
+
+		(void) gldns_buffer_printf(buf, "%s { \"address\": \"%s\""
+		    ", \"port\": %d, \"transport\": \"%s\"\n"
+		    "    , \"queries\": %"PRIu64", \"responses\": %"PRIu64
+		    ", \"timeouts\": %"PRIu64"\n    , ",
+		    i ? "\n  ," : "", addr_str, (int)upstream->port,
+		    transport_str(upstream->transport),
+		    upstream->queries, upstream->responses, upstream->timeouts);
+		json_counter(buf, "connections_opened", conns,
+		    upstream->conns_opened);
+		(void) gldns_buffer_printf(buf, ", ");
+		json_counter(buf, "connections_closed", conns,
+		    upstream->conns_closed);
+		(void) gldns_buffer_printf(buf, "\n    , ");
+		json_counter(buf, "tls_handshakes", conns,
+		    upstream->tls_handshakes);
+		(void) gldns_buffer_printf(buf, ", ");
+		json_counter(buf, "tls_resumed", resumed,
+		    upstream->tls_resumed);
+		if (!conns)
+			(void) gldns_buffer_printf(buf,
+			    "\n    , \"connection_reuse\": null");
+		else
+			(void) gldns_buffer_printf(buf,
+			    "\n    , \"connection_reuse\": %.3f",
+			    upstream->queries
+			    && upstream->conns_opened < upstream->queries
+			    ? 1.0 - (double)upstream->conns_opened
+			      / upstream->queries : 0.0);
+		(void) gldns_buffer_printf(buf, "\n    , \"rtt_ms\": "
+		    "{ \"sum\": %"PRIu64", \"buckets\": [ ",
+		    upstream->rtt_sum_ms);
+
+		for (j = 0; j < STUBBY_RTT_BUCKETS; j++) {
+			if (j < STUBBY_RTT_BUCKETS - 1)
+				(void) gldns_buffer_printf(buf, "%s[ %d, %"PRIu64" ]",
+				    j ? ", " : "", 1 << j, upstream->rtt_buckets[j]);
+			else
+				(void) gldns_buffer_printf(buf,
+				    ", [ \"+Inf\", %"PRIu64" ]",
+				    upstream->rtt_buckets[j]);
+		}
+		(void) gldns_buffer_printf(buf, " ] }\n    }");
+	}
+	(void) gldns_buffer_printf(buf, "%s]\n}\n", i ? "\n  " : "");
+}
+
+static void stats_write_file(void)
+{
+	gldns_buffer *buf;
+	char tmp_fn[1024];
+	FILE *fh;
+
+	if (!stats_file || !(buf = gldns_buffer_new(4096)))
+		return;
+
+	stubby_stats_upstreams_json(buf);
+	(void) snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", stats_file);
+	if (!gldns_buffer_status_ok(buf))
+		; /* Out of memory, try again next time */
+
+	else if (!(fh = fopen(tmp_fn, "w")))
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not open \"%s\": %s\n", tmp_fn, strerror(errno));
+	else {
+		(void) fwrite(gldns_buffer_begin(buf), 1,
+		    gldns_buffer_position(buf), fh);
+		if (fclose(fh) || rename(tmp_fn, stats_file))
+			stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+			    "Could not write \"%s\": %s\n", stats_file,
+			    strerror(errno));
+	}
+	gldns_buffer_free(buf);
+}
+
+static void stats_timeout_cb(void *userarg)
+{
+	(void)userarg;
+	(void) stats_loop->vmt->clear(stats_loop, &stats_event);
+	stats_write_file();
+	(void) stats_loop->vmt->schedule(stats_loop, -1,
+	    (uint64_t)stats_interval * 1000, &stats_event);
+}
+
+void stubby_stats_start(getdns_context *context)
+{
+	if (!stats_file || stats_loop
+	||  getdns_context_get_eventloop(context, &stats_loop))
+		return;
+
+	(void) memset(&stats_event, 0, sizeof(stats_event));
+	stats_event.timeout_cb = stats_timeout_cb;
+	(void) stats_loop->vmt->schedule(stats_loop, -1,
+	    (uint64_t)stats_interval * 1000, &stats_event);
+}
+
+void stubby_stats_stop(void)
+{
+	if (!stats_loop)
+		return;
+	(void) stats_loop->vmt->clear(stats_loop, &stats_event);
+	stats_loop = NULL;
+	stats_write_file();
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_STATS_H
+#define _STUBBY_STATS_H
+
+#include <stdarg.h>
+#include <getdns/getdns_extra.h>
+#include "sldns/sbuffer.h"
+
+/**
+ * Per upstream statistics.
+ *
+ * Query, response, timeout and round trip time counters are taken from
+ * the call_reporting information getdns returns with each response.
+ * Connection and TLS session counters are taken from the events getdns
+ * reports with GETDNS_LOG_UPSTREAM_STATS, which are matched on their
+ * exact format string, so no message is ever formatted for this.  This
+ * depends on the messages of the getdns version; only those of getdns 1.5
+ * up to 1.7 are known.  Until a matching event has been seen, the counters
+ * it feeds are unknown (see stubby_stats_known()) rather than 0.
+ */
+
+/* Round trip time histogram buckets have upper bounds of 1, 2, 4, ...
+ * STUBBY_RTT_MAX_MS milliseconds plus one for everything above.
+ */
+#define STUBBY_RTT_BUCKETS 14
+#define STUBBY_RTT_MAX_MS  4096
+
+typedef struct stubby_upstream_stats {
+	uint8_t   addr[16];
+	size_t    addr_len;
+	uint32_t  port;
+	uint32_t  transport;
+	char      name[64];    /* "<address>#<port>", as getdns names it */
+
+	uint64_t  queries;
+	uint64_t  responses;
+	uint64_t  timeouts;
+	uint64_t  conns_opened;
+	uint64_t  conns_closed;
+	uint64_t  tls_handshakes;
+	uint64_t  tls_resumed;
+
+	uint64_t  rtt_buckets[STUBBY_RTT_BUCKETS];
+	uint64_t  rtt_sum_ms;
+
+	/* stubby_trace_now() of the last connection opened and TLS session
+	 * resumed, to tell whether a query needed a new connection.  Only
+	 * meaningful when the counters are known.
+	 */
+	uint64_t  last_conn_opened_ns;
+	uint64_t  last_tls_resumed_ns;
+} stubby_upstream_stats;
+
+/**
+ * Read the upstream_stats_file and upstream_stats_interval settings.
+ * Writing statistics to a file is optional; statistics are kept as soon as
+ * stubby_stats_enable() has been called (by this or by another consumer).
+ */
+getdns_return_t stubby_stats_config(const getdns_dict *config);
+
+/* Start keeping upstream statistics, from now on */
+void stubby_stats_enable(void);
+int stubby_stats_enabled(void);
+
+/* Before the workers are forked: keep the upstream statistics of all
+ * workers in shared memory, so that the totals are shown.
+ */
+getdns_return_t stubby_stats_share(void);
+
+/**
+ * The context whose upstream events feed the statistics.  The log function
+ * is set on it once statistics are enabled, which may be after this.
+ */
+void stubby_stats_set_context(getdns_context *context);
+
+/* Have getdns pass the upstream events up to level to the log, on the
+ * context given with stubby_stats_set_context().
+ */
+void stubby_stats_set_log_level(getdns_loglevel_type level);
+
+/* Schedule the periodic writing of the statistics file on the context */
+void stubby_stats_start(getdns_context *context);
+void stubby_stats_stop(void);
+
+/* Add the extensions needed for statistics to a query's extensions */
+void stubby_stats_query_extensions(getdns_dict *extensions);
+
+/**
+ * Account the response (or the lack thereof) of a completed query.
+ * @param rtt_ms  set to the run time of the query to the upstream that
+ *                answered, or 0 when not known.  May be NULL.
+ * @return the upstream that answered, or NULL
+ */
+const stubby_upstream_stats *stubby_stats_response(
+    getdns_callback_type_t callback_type, const getdns_dict *response,
+    uint32_t *rtt_ms);
+
+/**
+ * getdns log function that feeds the upstream statistics before passing
+ * the message on to stubby_log().
+ */
+void stubby_stats_logfunc(void *userarg, uint64_t system,
+    getdns_loglevel_type level, const char *fmt, va_list ap);
+
+/* Counters fed by getdns log events */
+#define STUBBY_STATS_CONNS       1  /* conns_opened, conns_closed and
+                                     * tls_handshakes */
+#define STUBBY_STATS_TLS_RESUMED 2  /* tls_resumed; no getdns version in
+                                     * the known range reports this */
+
+/* Whether getdns reported an event that feeds all of the counters */
+int stubby_stats_known(int counters);
+
+/* With workers: add up the upstreams of all of them, for iterating */
+void stubby_stats_collect(void);
+
+/* Iterate over the upstreams seen so far */
+size_t stubby_stats_n_upstreams(void);
+const stubby_upstream_stats *stubby_stats_upstream(size_t i);
+
+/* Append the upstream statistics as a JSON object to buf */
+void stubby_stats_upstreams_json(gldns_buffer *buf);
+
+#endif /* _STUBBY_STATS_H */
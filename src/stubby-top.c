@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * stubby-top: show what a running stubby is doing, once a second.
+ *
+ * The statistics are taken with the "stats" command over stubby's control
+ * socket (see control.h), which returns the same OpenMetrics text as the
+ * metrics endpoint.  Rates and latency percentiles are computed from the
+ * difference between two consecutive samples.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TOP_DEFAULT_SOCKET "/run/stubby/control.sock"
+#define TOP_TIMEOUT_MS     5000
+#define TOP_MAX_BUCKETS    64
+#define TOP_MAX_UPSTREAMS  32
+
+typedef struct top_sample {
+	const char *key;   /* metric name with its labels */
+	double      value;
+} top_sample;
+
+typedef struct top_snapshot {
+	char       *text;
+	top_sample *samples;
+	size_t      n_samples;
+	double      time;
+} top_snapshot;
+
+static void print_usage(FILE *out)
+{
+	fprintf(out, "usage: stubby-top [<option> ...]\n");
+	fprintf(out, "\t-s\t<path>\n");
+	fprintf(out, "\t\tstubby's control_socket (default \"%s\")\n",
+	    TOP_DEFAULT_SOCKET);
+	fprintf(out, "\t-d\t<seconds>\n");
+	fprintf(out, "\t\tSeconds between updates (default 1)\n");
+	fprintf(out, "\t-n\t<count>\n");
+	fprintf(out, "\t\tExit after <count> updates, printing them one after "
+	    "another\n\t\tinstead of redrawing the screen\n");
+	fprintf(out, "\t-h\tPrint this help\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int control_connect(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	(void) memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	(void) strcpy(sun.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		(void) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Read exactly len bytes */
+static int control_read(int fd, char *buf, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (len > 0) {
+		if (poll(&pfd, 1, TOP_TIMEOUT_MS) <= 0)
+			return -1;
+		if ((n = read(fd, buf, len)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Send cmd and return the output of a successful reply */
+static char *control_command(int fd, const char *cmd)
+{
+	char line[256], *output;
+	size_t i, len;
+
+	if (write(fd, cmd, strlen(cmd)) < 0)
+		return NULL;
+	for (i = 0; i < sizeof(line) - 1; i++) {
+		if (control_read(fd, line + i, 1) < 0)
+			return NULL;
+		if (line[i] == '\n')
+			break;
+	}
+	line[i] = 0;
+	if (strncmp(line, "OK ", 3)) {
+		fprintf(stderr, "stubby: %s\n", line);
+		return NULL;
+	}
+	len = strtoul(line + 3, NULL, 10);
+	if (!(output = malloc(len + 1)))
+		return NULL;
+	if (control_read(fd, output, len) < 0) {
+		free(output);
+		return NULL;
+	}
+	output[len] = 0;
+	return output;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	return strcmp(((const top_sample *)a)->key,
+	    ((const top_sample *)b)->key);
+}
+
+static void snapshot_clear(top_snapshot *snap)
+{
+	free(snap->text);
+	free(snap->samples);
+	(void) memset(snap, 0, sizeof(*snap));
+}
+
+/* Split the OpenMetrics text in place into samples sorted by key */
+static int snapshot_parse(top_snapshot *snap)
+{
+	char *line, *next, *space;
+	size_t n_lines = 1;
+
+	for (line = snap->text; (line = strchr(line, '\n')); line++)
+		n_lines++;
+	if (!(snap->samples = calloc(n_lines, sizeof(top_sample))))
+		return -1;
+
+	for (line = snap->text; *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = 0;
+		else
+			next = line + strlen(line);
+		if (*line == '#' || !(space = strrchr(line, ' ')))
+			continue;
+		*space = 0;
+		snap->samples[snap->n_samples].key = line;
+		snap->samples[snap->n_samples++].value = strtod(space + 1, NULL);
+	}
+	qsort(snap->samples, snap->n_samples, sizeof(top_sample), sample_cmp);
+	return 0;
+}
+
+static const top_sample *lookup(const top_snapshot *snap, const char *key)
+{
+	top_sample k;
+
+	k.key = key;
+	return bsearch(&k, snap->samples, snap->n_samples,
+	    sizeof(top_sample), sample_cmp);
+}
+
+static double value(const top_snapshot *snap, const char *key)
+{
+	const top_sample *s = lookup(snap, key);
+
+	return s ? s->value : NAN;
+}
+
+/* Increase of a counter between two snapshots */
+static double delta(const top_snapshot *prev, const top_sample *s)
+{
+	const top_sample *p = lookup(prev, s->key);
+
+	return p && p->value <= s->value ? s->value - p->value : s->value;
+}
+
+/* Summed increase per second of all samples whose key starts with prefix */
+static double rate(const top_snapshot *cur, const top_snapshot *prev,
+    const char *prefix)
+{
+	size_t i, len = strlen(prefix);
+	double sum = 0;
+
+	for (i = 0; i < cur->n_samples; i++)
+		if (!strncmp(cur->samples[i].key, prefix, len))
+			sum += delta(prev, &cur->samples[i]);
+	return sum / (cur->time - prev->time);
+}
+
+typedef struct top_bucket {
+	double le;
+	double count;
+} top_bucket;
+
+static int bucket_cmp(const void *a, const void *b)
+{
+	double x = ((const top_bucket *)a)->le, y = ((const top_bucket *)b)->le;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * The q quantile of the observations of a histogram in between two
+ * snapshots, interpolated linearly within the bucket it falls in.
+ * @param labels  the labels of the histogram, without le, or ""
+ * @return the quantile in seconds, or NAN when nothing was observed
+ */
+static double quantile(const top_snapshot *cur, const top_snapshot *prev,
+    const char *name, const char *labels, double q)
+{
+	top_bucket buckets[TOP_MAX_BUCKETS];
+	size_t i, n = 0, len;
+	char prefix[256];
+	double target, lower = 0, below = 0;
+
+	(void) snprintf(prefix, sizeof(prefix), "%s_bucket{%s%sle=\"",
+	    name, labels, *labels ? "," : "");
+	len = strlen(prefix);
+	for (i = 0; i < cur->n_samples && n < TOP_MAX_BUCKETS; i++) {
+		if (strncmp(cur->samples[i].key, prefix, len))
+			continue;
+		buckets[n].le = strncmp(cur->samples[i].key + len, "+Inf", 4)
+		    ? strtod(cur->samples[i].key + len, NULL) : INFINITY;
+		buckets[n++].count = delta(prev, &cur->samples[i]);
+	}
+	if (n == 0)
+		return NAN;
+	qsort(buckets, n, sizeof(top_bucket), bucket_cmp);
+	if (buckets[n - 1].count <= 0)
+		return NAN;
+
+	target = q * buckets[n - 1].count;
+	for (i = 0; i < n; i++) {
+		if (buckets[i].count >= target && buckets[i].count > below) {
+			if (isinf(buckets[i].le))
+				return lower;
+			return lower + (buckets[i].le - lower)
+			    * (target - below) / (buckets[i].count - below);
+		}
+		lower = buckets[i].le;
+		below = buckets[i].count;
+	}
+	return lower;
+}
+
+static const char *fmt_bytes(double b, char *buf, size_t len)
+{
+	if (isnan(b))
+		(void) snprintf(buf, len, "-");
+	else if (b < 1024.0)
+		(void) snprintf(buf, len, "%.0fB", b);
+	else if (b < 1024.0 * 1024.0)
+		(void) snprintf(buf, len, "%.1fK", b / 1024.0);
+	else if (b < 1024.0 * 1024.0 * 1024.0)
+		(void) snprintf(buf, len, "%.1fM", b / (1024.0 * 1024.0));
+	else
+		(void) snprintf(buf, len, "%.2fG", b / (1024.0 * 1024.0 * 1024.0));
+	return buf;
+}
+
+/* Live bytes (and the high-water mark) of each memory subsystem */
+static void display_memory(const top_snapshot *cur)
+{
+	static const char prefix[] = "stubby_memory_bytes{subsystem=\"";
+	char bytes[16], max_bytes[16], key[128];
+	const char *subsystem;
+	size_t i, len;
+
+	printf("memory   ");
+	for (i = 0; i < cur->n_samples; i++) {
+		if (strncmp(cur->samples[i].key, prefix, sizeof(prefix) - 1))
+			continue;
+		subsystem = cur->samples[i].key + sizeof(prefix) - 1;
+		len = strcspn(subsystem, "\"");
+		(void) snprintf(key, sizeof(key),
+		    "stubby_memory_max_bytes{subsystem=\"%.*s\"}",
+		    (int)len, subsystem);
+		printf(" %.*s %s (%s)", (int)len, subsystem,
+		    fmt_bytes(cur->samples[i].value, bytes, sizeof(bytes)),
+		    fmt_bytes(value(cur, key), max_bytes, sizeof(max_bytes)));
+	}
+	printf("\n");
+}
+
+static const char *fmt_seconds(double s, char *buf, size_t len)
+{
+	if (isnan(s))
+		(void) snprintf(buf, len, "-");
+	else if (s < 0.001)
+		(void) snprintf(buf, len, "%.0fus", s * 1e6);
+	else if (s < 1.0)
+		(void) snprintf(buf, len, "%.1fms", s * 1e3);
+	else
+		(void) snprintf(buf, len, "%.2fs", s);
+	return buf;
+}
+
+/* The upstream label values of the upstream query counters */
+static size_t upstream_names(const top_snapshot *cur,
+    char names[][64], size_t max)
+{
+	static const char prefix[] = "stubby_upstream_queries_total{upstream=\"";
+	size_t i, n = 0, len;
+	const char *name;
+
+	for (i = 0; i < cur->n_samples && n < max; i++) {
+		if (strncmp(cur->samples[i].key, prefix, sizeof(prefix) - 1))
+			continue;
+		name = cur->samples[i].key + sizeof(prefix) - 1;
+		if ((len = strcspn(name, "\"")) >= 64)
+			continue;
+		(void) memcpy(names[n], name, len);
+		names[n++][len] = 0;
+	}
+	return n;
+}
+
+static void display(const char *path, const top_snapshot *cur,
+    const top_snapshot *prev)
+{
+	char names[TOP_MAX_UPSTREAMS][64], key[256], labels[96];
+	char p50[16], p90[16], p99[16];
+	double hits, misses, queries, timeouts, responses;
+	const char *state;
+	size_t i, n;
+
+	printf("stubby-top  %s  (%.1fs)\n\n", path, cur->time - prev->time);
+
+	printf("queries   %9.1f/s   answers %9.1f/s   SERVFAIL %7.1f/s   "
+	    "in flight %.0f\n",
+	    rate(cur, prev, "stubby_queries_total"),
+	    rate(cur, prev, "stubby_responses_total"),
+	    rate(cur, prev, "stubby_responses_total{rcode=\"SERVFAIL\"}"),
+	    value(cur, "stubby_in_flight_queries"));
+
+	printf("latency   p50 %8s   p90 %8s   p99 %8s\n",
+	    fmt_seconds(quantile(cur, prev, "stubby_query_stage_seconds",
+	        "stage=\"total\"", 0.50), p50, sizeof(p50)),
+	    fmt_seconds(quantile(cur, prev, "stubby_query_stage_seconds",
+	        "stage=\"total\"", 0.90), p90, sizeof(p90)),
+	    fmt_seconds(quantile(cur, prev, "stubby_query_stage_seconds",
+	        "stage=\"total\"", 0.99), p99, sizeof(p99)));
+
+	if (isnan(value(cur, "stubby_cache_hits_total")))
+		printf("cache     -\n");
+	else {
+		hits = rate(cur, prev, "stubby_cache_hits_total");
+		misses = rate(cur, prev, "stubby_cache_misses_total");
+		if (hits + misses > 0)
+			printf("cache     hit rate %5.1f%%\n",
+			    100.0 * hits / (hits + misses));
+		else
+			printf("cache     hit rate     -\n");
+	}
+	display_memory(cur);
+
+	printf("\n%-40s %9s %8s %8s %10s %8s  %s\n", "upstream", "queries/s",
+	    "rtt p50", "rtt p99", "timeouts/s", "conns/s", "state");
+	n = upstream_names(cur, names, TOP_MAX_UPSTREAMS);
+	for (i = 0; i < n; i++) {
+		(void) snprintf(labels, sizeof(labels),
+		    "upstream=\"%.63s\"", names[i]);
+		(void) snprintf(key, sizeof(key),
+		    "stubby_upstream_queries_total{%s}", labels);
+		queries = rate(cur, prev, key);
+		(void) snprintf(key, sizeof(key),
+		    "stubby_upstream_responses_total{%s}", labels);
+		responses = rate(cur, prev, key);
+		(void) snprintf(key, sizeof(key),
+		    "stubby_upstream_timeouts_total{%s}", labels);
+		timeouts = rate(cur, prev, key);
+
+		state = timeouts > 0 && responses == 0 ? "failing"
+		      : timeouts > 0                   ? "degraded"
+		      : queries == 0                   ? "idle" : "ok";
+
+		(void) snprintf(key, sizeof(key),
+		    "stubby_upstream_connections_total{%s}", labels);
+		printf("%-40s %9.1f %8s %8s %10.1f %8.1f  %s\n", names[i],
+		    queries,
+		    fmt_seconds(quantile(cur, prev, "stubby_upstream_rtt_seconds",
+		        labels, 0.50), p50, sizeof(p50)),
+		    fmt_seconds(quantile(cur, prev, "stubby_upstream_rtt_seconds",
+		        labels, 0.99), p99, sizeof(p99)),
+		    timeouts, rate(cur, prev, key), state);
+	}
+	(void) fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = TOP_DEFAULT_SOCKET;
+	top_snapshot snaps[2], *cur = &snaps[0], *prev = &snaps[1], *tmp;
+	struct timespec ts;
+	double delay = 1.0;
+	long count = -1;
+	int fd, opt, redraw = isatty(STDOUT_FILENO);
+	char *ep;
+
+	while ((opt = getopt(argc, argv, "s:d:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'd':
+			delay = strtod(optarg, &ep);
+			if (*ep || !(delay >= 0.1)) {
+				fprintf(stderr, "Invalid delay: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			count = strtol(optarg, &ep, 10);
+			if (*ep || count <= 0) {
+				fprintf(stderr, "Invalid count: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			redraw = 0;
+			break;
+		case 'h':
+			print_usage(stdout);
+			exit(EXIT_SUCCESS);
+		default:
+			print_usage(stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((fd = control_connect(path)) < 0) {
+		fprintf(stderr, "Could not connect to \"%s\": %s\n",
+		    path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	(void) memset(snaps, 0, sizeof(snaps));
+	for (;;) {
+		if (!(cur->text = control_command(fd, "stats\n"))
+		||  snapshot_parse(cur) < 0) {
+			fprintf(stderr, "Could not get statistics from stubby\n");
+			break;
+		}
+		cur->time = now();
+		if (prev->text) {
+			if (redraw)
+				printf("\033[H\033[2J");
+			else if (count >= 0)
+				printf("\n");
+			display(path, cur, prev);
+			if (count > 0 && --count == 0)
+				break;
+		}
+		snapshot_clear(prev);
+		tmp = prev; prev = cur; cur = tmp;
+		ts.tv_sec = (time_t)delay;
+		ts.tv_nsec = (long)((delay - (double)ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			; /* pass */
+	}
+	snapshot_clear(cur);
+	snapshot_clear(prev);
+	(void) close(fd);
+	return count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -36,33 +36,32 @@
 #include <shlobj.h>
 #else
 #include <pwd.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 #include <signal.h>
 #include <limits.h>
-
-#ifdef HAVE_GETDNS_YAML2DICT
-getdns_return_t getdns_yaml2dict(const char *str, getdns_dict **dict);
+#include "log.h"
+#include "dnstap.h"
+#include "stats.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "loopmon.h"
+#include "hitters.h"
+#include "control.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "server.h"
+#include "upgrade.h"
+#include "cache.h"
+#include "warmup.h"
+#include "prefork.h"
+
+#ifdef USE_YAML_CONFIG
+# include "yaml/convert_yaml_to_dict.h"
 #else
-# include "yaml/convert_yaml_to_json.h"
-# define getdns_yaml2dict stubby_yaml2dict
-getdns_return_t
-getdns_yaml2dict(const char *str, getdns_dict **dict)
-{
-	char *jsonstr;
-	
-	if (!str || !dict)
-		return GETDNS_RETURN_INVALID_PARAMETER;
-
-	jsonstr = yaml_string_to_json_string(str);
-	if (jsonstr) {
-		getdns_return_t res = getdns_str2dict(jsonstr, dict);
-		free(jsonstr);
-		return res;
-	} else {
-		return GETDNS_RETURN_GENERIC_ERROR;
-	}       
-}
+getdns_return_t getdns_yaml2dict(const char *str, getdns_dict **dict);
 #endif
 
 static char *make_config_file_path(const char *dir, const char *fname)
@@ -169,10 +168,13 @@ static getdns_list *listen_list = NULL;
 static size_t listen_count = 0;
 static int run_in_foreground = 1;
 static int dnssec_validation = 0;
-
-static void stubby_local_log(void *userarg, uint64_t system,
-	getdns_loglevel_type level, const char *fmt, ...);
-
+static const char *snapshot_fn = NULL;
+static int snapshot_written = 0;
+/* The config file in use and a copy of what was read from it, to find the
+ * settings that changed when the configuration is reloaded.
+ */
+static char *config_fn = NULL;
+static getdns_dict *running_dict = NULL;
 
 void
 print_usage(FILE *out)
@@ -199,6 +201,10 @@ print_usage(FILE *out)
 	fprintf(out, "\t-i\tValidate and print the configuration only. Useful to validate config file\n");
 	fprintf(out, "\t\tcontents. Note: does not attempt to bind to the listen addresses.\n");
 	fprintf(out, "\t-l\tEnable logging of all logs (same as -v 7)\n");
+	fprintf(out, "\t-o\t<filename>\n");
+	fprintf(out, "\t\tValidate the configuration and write it as a binary snapshot\n");
+	fprintf(out, "\t\tto <filename>, then exit.  A snapshot given with -C is loaded\n");
+	fprintf(out, "\t\twithout parsing YAML or JSON.\n");
 	fprintf(out, "\t-v\tSpecify logging level (overrides -l option). Values are\n");
 	fprintf(out, "\t\t\t0: EMERG  - %s\n", GETDNS_LOG_EMERG_TEXT);
 	fprintf(out, "\t\t\t1: ALERT  - %s\n", GETDNS_LOG_ALERT_TEXT);
@@ -229,14 +235,16 @@ static const char *_getdns_strerror(getdns_return_t r)
 	                                   : getdns_get_errorstr_by_id(r);
 }
 
-static getdns_return_t parse_config(const char *config_str, int yaml_config)
+static getdns_return_t config_str2dict(const char *config_str,
+    int yaml_config, getdns_dict **config_dict)
 {
-	getdns_dict *config_dict;
-	getdns_list *list;
 	getdns_return_t r;
 
 	if (yaml_config) {
-		r = getdns_yaml2dict(config_str, &config_dict);
+#ifdef USE_YAML_CONFIG
+		r = yaml_string_to_dict(config_str, config_dict);
+#else
+		r = getdns_yaml2dict(config_str, config_dict);
 		if (r == GETDNS_RETURN_NOT_IMPLEMENTED) {
 			/* If this fails then YAML is really not supported. Check this at 
 			   runtime because it could change under us..... */
@@ -247,42 +255,164 @@ static getdns_return_t parse_config(const char *config_str, int yaml_config)
 				return GETDNS_RETURN_NOT_IMPLEMENTED;
 			}
 		}
+#endif
 	} else {
-		r = getdns_str2dict(config_str, &config_dict);
+		r = getdns_str2dict(config_str, config_dict);
 	}
-	if (r) {
+	if (r)
 		fprintf(stderr, "Could not parse config file %s, \"%s\"\n",
 		    config_str, _getdns_strerror(r));
+	return r;
+}
+
+static getdns_return_t parse_config_dict(getdns_dict *config_dict);
+
+static getdns_return_t parse_config(const char *config_str, int yaml_config)
+{
+	getdns_dict *config_dict;
+	getdns_return_t r;
+
+	if ((r = config_str2dict(config_str, yaml_config, &config_dict)))
 		return r;
+	return parse_config_dict(config_dict);
+}
+
+static getdns_return_t set_listen_list(const getdns_list *list)
+{
+	getdns_return_t r = GETDNS_RETURN_GOOD;
+
+	if (listen_list && !listen_dict) {
+		getdns_list_destroy(listen_list);
+		listen_list = NULL;
 	}
-	if (!(r = getdns_dict_get_list(
-	    config_dict, "listen_addresses", &list))) {
-		if (listen_list && !listen_dict) {
-			getdns_list_destroy(listen_list);
-			listen_list = NULL;
-		}
-		/* Strange construction to copy the list.
-		 * Needs to be done, because config dict
-		 * will get destroyed.
-		 */
-		if (!listen_dict &&
-		    !(listen_dict = getdns_dict_create())) {
-			fprintf(stderr, "Could not create "
-					"listen_dict");
-			r = GETDNS_RETURN_MEMORY_ERROR;
+	/* Strange construction to copy the list.
+	 * Needs to be done, because config dict
+	 * will get destroyed.
+	 */
+	if (!listen_dict &&
+	    !(listen_dict = getdns_dict_create())) {
+		fprintf(stderr, "Could not create "
+				"listen_dict");
+		r = GETDNS_RETURN_MEMORY_ERROR;
+
+	} else if ((r = getdns_dict_set_list(
+	    listen_dict, "listen_list", list)))
+		fprintf(stderr, "Could not set listen_list");
+
+	else if ((r = getdns_dict_get_list(
+	    listen_dict, "listen_list", &listen_list)))
+		fprintf(stderr, "Could not get listen_list");
 
-		} else if ((r = getdns_dict_set_list(
-		    listen_dict, "listen_list", list)))
-			fprintf(stderr, "Could not set listen_list");
+	else if ((r = getdns_list_get_length(
+	    listen_list, &listen_count)))
+		fprintf(stderr, "Could not get listen_count");
 
-		else if ((r = getdns_dict_get_list(
-		    listen_dict, "listen_list", &listen_list)))
-			fprintf(stderr, "Could not get listen_list");
+	return r;
+}
 
-		else if ((r = getdns_list_get_length(
-		    listen_list, &listen_count)))
-			fprintf(stderr, "Could not get listen_count");
+/* Configure stubby and the context from config_dict, which is destroyed */
+static getdns_return_t parse_config_dict(getdns_dict *config_dict)
+{
+	getdns_dict *dict;
+	getdns_list *list;
+	getdns_return_t r;
+	uint32_t n;
 
+	if (!getdns_dict_get_dict(config_dict, "dnstap", &dict)) {
+		if ((r = stubby_dnstap_config(dict))) {
+			fprintf(stderr, "Could not configure dnstap: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "dnstap");
+	}
+	if ((r = stubby_stats_config(config_dict))) {
+		getdns_dict_destroy(config_dict);
+		return r;
+	}
+	(void) getdns_dict_remove_name(config_dict, "upstream_stats_file");
+	(void) getdns_dict_remove_name(config_dict, "upstream_stats_interval");
+	if (!getdns_dict_get_dict(config_dict, "metrics", &dict)) {
+		if ((r = stubby_metrics_config(dict))) {
+			fprintf(stderr, "Could not configure metrics: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "metrics");
+	}
+	if (!getdns_dict_get_dict(config_dict, "query_trace", &dict)) {
+		if ((r = stubby_trace_config(dict))) {
+			fprintf(stderr, "Could not configure query_trace: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "query_trace");
+	}
+	if (!getdns_dict_get_dict(config_dict, "event_loop_monitor", &dict)) {
+		if ((r = stubby_loopmon_config(dict))) {
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict,
+		    "event_loop_monitor");
+	}
+	if (!getdns_dict_get_dict(config_dict, "heavy_hitters", &dict)) {
+		if ((r = stubby_hitters_config(dict))) {
+			fprintf(stderr, "Could not configure heavy_hitters: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "heavy_hitters");
+	}
+	if (!getdns_dict_get_dict(config_dict, "cache", &dict)) {
+		if ((r = stubby_cache_config(dict))) {
+			fprintf(stderr, "Could not configure cache: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "cache");
+	}
+	if (!getdns_dict_get_dict(config_dict, "cache_warmup", &dict)) {
+		if ((r = stubby_warmup_config(dict))) {
+			fprintf(stderr, "Could not configure cache_warmup: %s\n",
+			    _getdns_strerror(r));
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "cache_warmup");
+	}
+	if ((r = stubby_cache_ttl_config(config_dict))) {
+		getdns_dict_destroy(config_dict);
+		return r;
+	}
+	(void) getdns_dict_remove_name(config_dict, "min_cache_ttl");
+	(void) getdns_dict_remove_name(config_dict, "max_cache_ttl");
+	(void) getdns_dict_remove_name(config_dict, "cache_ttl_overrides");
+	if ((r = stubby_control_config(config_dict))) {
+		getdns_dict_destroy(config_dict);
+		return r;
+	}
+	(void) getdns_dict_remove_name(config_dict, "control_socket");
+	if (!getdns_dict_get_int(config_dict, "workers", &n)) {
+		if ((r = stubby_prefork_config(n))) {
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+		(void) getdns_dict_remove_name(config_dict, "workers");
+	}
+	if (!getdns_dict_get_int(config_dict, "slow_query_threshold", &n)) {
+		stubby_trace_set_slow_threshold(n);
+		(void) getdns_dict_remove_name(config_dict,
+		    "slow_query_threshold");
+	}
+	if (!(r = getdns_dict_get_list(
+	    config_dict, "listen_addresses", &list))) {
+		r = set_listen_list(list);
 		(void) getdns_dict_remove_name(
 		    config_dict, "listen_addresses");
 	}
@@ -294,17 +424,32 @@ static getdns_return_t parse_config(const char *config_str, int yaml_config)
 	return r;
 }
 
-static getdns_return_t parse_config_file(const char *fn)
+/* Read config file fn, which may be a snapshot, into config_dict */
+static getdns_return_t read_config_file(const char *fn,
+    getdns_dict **config_dict)
 {
 	FILE *fh;
 	char *config_file = NULL;
 	long config_file_sz;
 	size_t read_sz;
 	getdns_return_t r;
+	char magic[STUBBY_SNAPSHOT_MAGIC_LEN];
 
 	if (!(fh = fopen(fn, "r")))
 		return GETDNS_RETURN_IO_ERROR;
 
+	if (fread(magic, 1, sizeof(magic), fh) == sizeof(magic)
+	&&  !memcmp(magic, STUBBY_SNAPSHOT_MAGIC, sizeof(magic))) {
+		/* A snapshot written with -o */
+		fclose(fh);
+		if ((r = stubby_snapshot_read(fn, config_dict))) {
+			fprintf(stderr, "Could not read snapshot %s, \"%s\"\n",
+			    fn, r == GETDNS_RETURN_GENERIC_ERROR
+			      ? "Corrupt snapshot or snapshot of other version"
+			      : _getdns_strerror(r));
+		}
+		return r;
+	}
 	if (fseek(fh, 0,SEEK_END) == -1) {
 		perror("fseek");
 		fclose(fh);
@@ -316,6 +461,19 @@ static getdns_return_t parse_config_file(const char *fn)
 		fclose(fh);
 		return GETDNS_RETURN_IO_ERROR;
 	}
+#ifdef USE_YAML_CONFIG
+	if (strstr(fn, ".yml") != NULL || strstr(fn, ".yaml") != NULL) {
+		/* Build the dict straight from the file, without a copy */
+		rewind(fh);
+		r = yaml_file_to_dict(fh, config_dict);
+		fclose(fh);
+		if (r) {
+			fprintf(stderr, "Could not parse config file %s, \"%s\"\n",
+			    fn, _getdns_strerror(r));
+		}
+		return r;
+	}
+#endif
 	if (!(config_file = malloc(config_file_sz + 1))){
 		fclose(fh);
 		fprintf(stderr, "Could not allocate memory for \"%s\"\n", fn);
@@ -332,33 +490,127 @@ static getdns_return_t parse_config_file(const char *fn)
 	}
 	config_file[read_sz] = 0;
 	fclose(fh);
-	r = parse_config(config_file, strstr(fn, ".yml") != NULL
-	                           || strstr(fn, ".yaml") != NULL);
+	r = config_str2dict(config_file, strstr(fn, ".yml") != NULL
+	                              || strstr(fn, ".yaml") != NULL,
+	    config_dict);
 	free(config_file);
-	if (r == GETDNS_RETURN_GOOD)
+	return r;
+}
+
+/* Keep a copy of the config read from fn, to diff against on reload */
+static getdns_return_t remember_config(const char *fn,
+    const getdns_dict *config_dict)
+{
+	char *fn_copy;
+	getdns_return_t r;
+
+	if (!running_dict && !(running_dict = getdns_dict_create()))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	if ((r = getdns_dict_set_dict(running_dict, "config", config_dict)))
+		return r;
+	if (!(fn_copy = strdup(fn)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	free(config_fn);
+	config_fn = fn_copy;
+	return GETDNS_RETURN_GOOD;
+}
+
+/* Apply the config read from file fn, and snapshot it when asked for */
+static getdns_return_t parse_config_file(const char *fn)
+{
+	gldns_buffer *snapshot = NULL;
+	getdns_dict *config_dict;
+	getdns_return_t r;
+
+	if ((r = read_config_file(fn, &config_dict)))
+		return r;
+
+	if (snapshot_fn) {
+		if (!(snapshot = gldns_buffer_new(65536))) {
+			getdns_dict_destroy(config_dict);
+			return GETDNS_RETURN_MEMORY_ERROR;
+		}
+		if ((r = stubby_snapshot_encode(config_dict, snapshot))) {
+			fprintf(stderr, "Could not encode a snapshot of \"%s\": "
+			    "%s\n", fn, _getdns_strerror(r));
+			gldns_buffer_free(snapshot);
+			getdns_dict_destroy(config_dict);
+			return r;
+		}
+	} else if ((r = remember_config(fn, config_dict))) {
+		getdns_dict_destroy(config_dict);
+		return r;
+	}
+	/* Validates the config before a snapshot of it is written */
+	if ((r = parse_config_dict(config_dict)) == GETDNS_RETURN_GOOD)
 		stubby_local_log(NULL,GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_DEBUG,
 			       "Read config from file %s\n", fn);
+
+	if (!r && snapshot) {
+		if ((r = stubby_snapshot_write(snapshot_fn, snapshot)))
+			fprintf(stderr, "Could not write snapshot \"%s\": %s\n",
+			    snapshot_fn, _getdns_strerror(r));
+		else
+			snapshot_written = 1;
+	}
+	gldns_buffer_free(snapshot);
 	return r;
 }
 
 typedef struct dns_msg {
 	getdns_transaction_t  request_id;
+	void                 *listener;
 	getdns_dict          *request;
 	uint32_t              rt;
 	uint32_t              ad_bit;
 	uint32_t              do_bit;
 	uint32_t              cd_bit;
 	int                   has_edns0;
+	int                   dnstap;
+	int                   warmup;
+	int                   in_flight;   /* counted in the in flight gauge */
+	struct timespec       query_time;
+	stubby_trace          trace;
 } dns_msg;
 
+STUBBY_PROBE_SEMAPHORE(query__receive);
+STUBBY_PROBE_SEMAPHORE(upstream__schedule);
+STUBBY_PROBE_SEMAPHORE(query__reply);
+STUBBY_PROBE_SEMAPHORE(query__servfail);
+
+/* Metrics may be enabled (by the control socket) while queries are waiting,
+ * so only the queries that were counted as in flight are discounted.
+ */
+static void query_in_flight(dns_msg *msg, int in_flight)
+{
+	if (in_flight && stubby_metrics_enabled()) {
+		msg->in_flight = 1;
+		stubby_metrics_in_flight(1);
+	} else if (!in_flight && msg->in_flight) {
+		msg->in_flight = 0;
+		stubby_metrics_in_flight(-1);
+	}
+}
+
+/* The query being scheduled, to detect whether it was answered
+ * synchronously from within getdns_general()
+ */
+static dns_msg *scheduling = NULL;
+
 #if defined(SERVER_DEBUG) && SERVER_DEBUG
-#define SERVFAIL(error,r,msg,resp_p) do { \
+#define SERVFAIL(error,r,msg,resp_p,reason) do { \
 	if (r)	DEBUG_SERVER("%s: %s\n", error, _getdns_strerror(r)); \
 	else	DEBUG_SERVER("%s\n", error); \
+	stubby_metrics_servfail(STUBBY_SERVFAIL_ ## reason); \
+	STUBBY_PROBE3(query__servfail, msg, error, (int)r); \
 	servfail(msg, resp_p); \
 	} while (0)
 #else
-#define SERVFAIL(error,r,msg,resp_p) servfail(msg, resp_p)
+#define SERVFAIL(error,r,msg,resp_p,reason) do { \
+	stubby_metrics_servfail(STUBBY_SERVFAIL_ ## reason); \
+	STUBBY_PROBE3(query__servfail, msg, error, (int)r); \
+	servfail(msg, resp_p); \
+	} while (0)
 #endif
 
 void servfail(dns_msg *msg, getdns_dict **resp_p)
@@ -383,6 +635,75 @@ void servfail(dns_msg *msg, getdns_dict **resp_p)
 	(void) getdns_dict_set_int(*resp_p, "/header/ad", 0);
 }
 
+/* Queue the dnstap messages for msg, with its client when it is known */
+static void dnstap_query(dns_msg *msg)
+{
+	const struct sockaddr *client;
+	size_t client_len = 0;
+	int tcp = 0;
+
+	client = stubby_server_client_addr(msg->listener, &client_len, &tcp);
+	stubby_dnstap_client_query(msg->request, client, client_len, tcp,
+	    &msg->query_time);
+}
+
+static void dnstap_response(const dns_msg *msg, const getdns_dict *response)
+{
+	const struct sockaddr *client;
+	size_t client_len = 0;
+	int tcp = 0;
+
+	client = stubby_server_client_addr(msg->listener, &client_len, &tcp);
+	stubby_dnstap_client_response(response, client, client_len, tcp,
+	    &msg->query_time);
+}
+
+/* Answer through the listener the request came in on: stubby's own
+ * (listener is set), or getdns's.
+ */
+static getdns_return_t send_reply(getdns_context *context,
+    getdns_dict *response, void *listener, getdns_transaction_t request_id)
+{
+	if (listener)
+		return stubby_server_reply(listener, request_id, response);
+	return getdns_reply(context, response, request_id);
+}
+
+static uint32_t response_rcode(const getdns_dict *response)
+{
+	uint32_t rcode;
+
+	if (!stubby_metrics_enabled() && !stubby_trace_enabled()
+	&&  !stubby_hitters_enabled() && !STUBBY_PROBE_ENABLED(query__reply))
+		return GETDNS_RCODE_NOERROR;
+	if (getdns_dict_get_int(response, "/replies_tree/0/header/rcode", &rcode)
+	&&  getdns_dict_get_int(response, "/header/rcode", &rcode))
+		rcode = GETDNS_RCODE_SERVFAIL;
+	stubby_metrics_response(rcode);
+	return rcode;
+}
+
+/* Only called when a tracer is attached to the query__reply probe */
+static void probe_query_reply(const dns_msg *msg, uint32_t rcode)
+{
+#ifdef HAVE_STUBBY_USDT
+	getdns_bindata *qname;
+	char *qname_str = NULL;
+	uint32_t qtype = 0;
+	uint64_t received = msg->trace.ns[STUBBY_TRACE_RECEIVED];
+
+	(void) getdns_dict_get_int(msg->request, "/question/qtype", &qtype);
+	if (getdns_dict_get_bindata(msg->request, "/question/qname", &qname)
+	||  getdns_convert_dns_name_to_fqdn(qname, &qname_str))
+		qname_str = NULL;
+	STUBBY_PROBE5(query__reply, msg, qname_str ? qname_str : "",
+	    qtype, rcode, received ? (stubby_trace_now() - received) / 1000 : 0);
+	free(qname_str);
+#else
+	(void)msg; (void)rcode;
+#endif
+}
+
 static getdns_return_t _handle_edns0(
     getdns_dict *response, int has_edns0)
 {
@@ -420,6 +741,190 @@ static getdns_return_t _handle_edns0(
 	return GETDNS_RETURN_GOOD;
 }
 
+/* The request bits a cached answer depends on */
+static uint8_t cache_flags(const dns_msg *msg)
+{
+	return (msg->do_bit    ? STUBBY_CACHE_DO    : 0)
+	     | (msg->cd_bit    ? STUBBY_CACHE_CD    : 0)
+	     | (msg->ad_bit    ? STUBBY_CACHE_AD    : 0)
+	     | (msg->has_edns0 ? STUBBY_CACHE_EDNS0 : 0);
+}
+
+static uint8_t cache_wire[65535];
+
+/* Keep the TTLs of the records in the response within the bounds for the
+ * query name
+ */
+static void clamp_ttls(const dns_msg *msg, getdns_dict *response)
+{
+	static const char *sections[] = {
+	    "/replies_tree/0/answer", "/replies_tree/0/authority",
+	    "/replies_tree/0/additional" };
+	uint32_t min_ttl, max_ttl, type, ttl;
+	getdns_bindata *qname;
+	getdns_list *rrs;
+	getdns_dict *rr;
+	size_t i, j;
+
+	if (getdns_dict_get_bindata(msg->request, "/question/qname", &qname))
+		return;
+	stubby_cache_ttl_bounds(qname->data, qname->size, &min_ttl, &max_ttl);
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		if (getdns_dict_get_list(response, sections[i], &rrs))
+			continue;
+		for (j = 0; !getdns_list_get_dict(rrs, j, &rr); j++) {
+			if (getdns_dict_get_int(rr, "type", &type)
+			||  type == GETDNS_RRTYPE_OPT
+			||  getdns_dict_get_int(rr, "ttl", &ttl))
+				continue;
+			if (ttl < min_ttl)
+				(void) getdns_dict_set_int(rr, "ttl", min_ttl);
+			else if (ttl > max_ttl)
+				(void) getdns_dict_set_int(rr, "ttl", max_ttl);
+		}
+	}
+}
+
+static void cache_response(const dns_msg *msg, const getdns_dict *response)
+{
+	getdns_bindata *qname;
+	getdns_dict *reply;
+	uint32_t qtype, qclass;
+	size_t len = sizeof(cache_wire);
+
+	if (getdns_dict_get_bindata(msg->request, "/question/qname", &qname)
+	||  getdns_dict_get_int(msg->request, "/question/qtype", &qtype)
+	||  getdns_dict_get_int(msg->request, "/question/qclass", &qclass)
+	||  getdns_dict_get_dict(response, "/replies_tree/0", &reply)
+	||  getdns_msg_dict2wire_buf(reply, cache_wire, &len))
+		return;
+	stubby_cache_store(qname->data, qname->size, (uint16_t)qtype,
+	    (uint16_t)qclass, cache_flags(msg), cache_wire, len);
+}
+
+/* Answer msg from the cache.  Returns 0 when there was no cached answer */
+static int answer_from_cache(getdns_context *context, dns_msg *msg,
+    const getdns_bindata *qname, uint32_t qtype, uint32_t qclass)
+{
+	getdns_dict *response = NULL;
+	uint32_t qid = 0, rd = 0, rcode;
+	getdns_bindata *nxname;
+	getdns_return_t r;
+	size_t len;
+
+	if (!(len = stubby_cache_lookup(qname->data, qname->size,
+	    (uint16_t)qtype, (uint16_t)qclass, cache_flags(msg),
+	    cache_wire, sizeof(cache_wire))))
+		return 0;
+
+	(void) getdns_dict_get_int(msg->request, "/header/id", &qid);
+	(void) getdns_dict_get_int(msg->request, "/header/rd", &rd);
+	gldns_write_uint16(cache_wire, (uint16_t)qid);
+	cache_wire[2] = (cache_wire[2] & 0xFE) | (rd ? 0x01 : 0x00);
+	if (getdns_wire2msg_dict(cache_wire, len, &response))
+		return 0;
+
+	stubby_trace_mark(&msg->trace, STUBBY_TRACE_CALLBACK);
+	if (msg->dnstap)
+		dnstap_response(msg, response);
+	rcode = response_rcode(response);
+	if (rcode == GETDNS_RCODE_NXDOMAIN && stubby_hitters_enabled()
+	&&  !getdns_dict_get_bindata(msg->request, "/question/qname", &nxname))
+		stubby_hitters_nxdomain(nxname->data, nxname->size);
+	if ((r = send_reply(context, response, msg->listener,
+	    msg->request_id))) {
+		fprintf(stderr, "Could not reply: %s\n", _getdns_strerror(r));
+		/* Cancel reply */
+		(void) send_reply(context, NULL, msg->listener,
+		    msg->request_id);
+	}
+	if (STUBBY_PROBE_ENABLED(query__reply))
+		probe_query_reply(msg, rcode);
+	stubby_trace_end(&msg->trace, msg->request, rcode, NULL);
+	getdns_dict_destroy(msg->request);
+	stubby_mem_free(STUBBY_MEM_QUERIES, msg);
+	getdns_dict_destroy(response);
+	return 1;
+}
+
+/* Answer a query from the cache as it is received, without a dict for it
+ * or for the answer: the cached answer is copied, its ID and RD bit set
+ * and its TTLs counted down.  Only for queries that answer_from_cache()
+ * would answer the same way, and not while queries are traced or logged
+ * with dnstap, which work on the dicts.  Returns the length of the answer,
+ * or 0 to leave the query to incoming_request_handler().
+ */
+static size_t fast_answer(const uint8_t *query, size_t len,
+    const struct sockaddr *client, size_t client_len,
+    uint8_t *buf, size_t buf_len, size_t *max_udp)
+{
+	size_t pos = 12, qname_len, answer_len;
+	uint16_t qtype, qclass;
+	uint8_t flags = 0, rcode;
+	uint64_t received;
+
+	/* Queries that are sampled for the trace file, logged with dnstap
+	 * or traced with the probes need the getdns dicts.
+	 */
+	if (stubby_trace_sample_next() || stubby_dnstap_running()
+	||  STUBBY_PROBE_ENABLED(query__receive)
+	||  STUBBY_PROBE_ENABLED(query__reply))
+		return 0;
+	received = stubby_trace_enabled() ? stubby_trace_now() : 0;
+
+	/* A standard query with one question, and nothing but an OPT */
+	if (len < 12 || (query[2] & 0xF8)
+	||  gldns_read_uint16(query + 4) != 1
+	||  gldns_read_uint16(query + 6) || gldns_read_uint16(query + 8)
+	||  gldns_read_uint16(query + 10) > 1)
+		return 0;
+	while (pos < len && query[pos] && !(query[pos] & 0xC0))
+		pos += query[pos] + 1;
+	if (pos >= len || query[pos] || (pos += 5) > len)
+		return 0;
+	qname_len = pos - 4 - 12;
+	qtype = gldns_read_uint16(query + pos - 4);
+	qclass = gldns_read_uint16(query + pos - 2);
+
+	if (query[11]) {
+		/* root | type | UDP size | ext. rcode | version | flags |
+		 * rdlength | options
+		 */
+		if (pos + 11 > len || query[pos]
+		||  gldns_read_uint16(query + pos + 1) != GETDNS_RRTYPE_OPT
+		||  pos + 11 + gldns_read_uint16(query + pos + 9) != len)
+			return 0;
+		if ((*max_udp = gldns_read_uint16(query + pos + 3)) < 512)
+			*max_udp = 512;
+		flags |= STUBBY_CACHE_EDNS0;
+		if (query[pos + 7] & 0x80)
+			flags |= STUBBY_CACHE_DO;
+	} else if (pos != len)
+		return 0;
+	if (query[3] & 0x10)
+		flags |= STUBBY_CACHE_CD;
+	if (query[3] & 0x20)
+		flags |= STUBBY_CACHE_AD;
+
+	if (!(answer_len = stubby_cache_lookup(query + 12, qname_len,
+	    qtype, qclass, flags, buf, buf_len)))
+		return 0;
+	buf[0] = query[0];
+	buf[1] = query[1];
+	buf[2] = (buf[2] & 0xFE) | (query[2] & 0x01);
+
+	rcode = buf[3] & 0x0F;
+	stubby_metrics_query(qtype);
+	stubby_metrics_response(rcode);
+	stubby_metrics_fast_answer();
+	stubby_hitters_query(query + 12, qname_len);
+	stubby_hitters_client(client, client_len);
+	if (rcode == GETDNS_RCODE_NXDOMAIN)
+		stubby_hitters_nxdomain(query + 12, qname_len);
+	stubby_trace_fast(received, query + 12, qname_len, qtype, rcode);
+	return answer_len;
+}
+
 static void request_cb(
     getdns_context *context, getdns_callback_type_t callback_type,
     getdns_dict *response, void *userarg, getdns_transaction_t transaction_id)
@@ -432,6 +937,9 @@ static void request_cb(
 	size_t n_options;
 	uint32_t arcount;
 	char i_as_jptr[80];
+	const stubby_upstream_stats *upstream;
+	uint32_t rtt_ms;
+	getdns_bindata *nxname;
 
 #if defined(SERVER_DEBUG) && SERVER_DEBUG
 	getdns_bindata *qname;
@@ -452,29 +960,39 @@ static void request_cb(
 #endif
 	assert(msg);
 
+	stubby_trace_mark(&msg->trace, STUBBY_TRACE_CALLBACK);
+	if (msg == scheduling)
+		scheduling = NULL; /* Answered from within getdns_general() */
+	upstream = stubby_stats_response(callback_type, response, &rtt_ms);
+	stubby_trace_upstream(&msg->trace, rtt_ms);
+	query_in_flight(msg, 0);
+
 	if (callback_type != GETDNS_CALLBACK_COMPLETE)
 		SERVFAIL("Callback type not complete",
-		    (int)callback_type, msg, &response);
+		    (int)callback_type, msg, &response, NOT_COMPLETE);
 
 	else if (!response)
-		SERVFAIL("Missing response", 0, msg, &response);
+		SERVFAIL("Missing response", 0, msg, &response, MISSING_RESPONSE);
 
 	else if ((r = getdns_dict_get_int(msg->request, "/header/id", &qid)) ||
 	    (r=getdns_dict_set_int(response,"/replies_tree/0/header/id",qid)))
-		SERVFAIL("Could not copy QID", r, msg, &response);
+		SERVFAIL("Could not copy QID", r, msg, &response, COPY_QID);
 
 	else if (getdns_dict_get_int(
 	    response, "/replies_tree/0/header/rcode", &rcode))
-		SERVFAIL("No reply in replies tree", 0, msg, &response);
+		SERVFAIL("No reply in replies tree", 0, msg, &response, NO_REPLY);
 
 	/* answers when CD or not BOGUS */
 	else if (!msg->cd_bit && !getdns_dict_get_int(
 	    response, "/replies_tree/0/dnssec_status", &dnssec_status)
 	    && dnssec_status == GETDNS_DNSSEC_BOGUS)
-		SERVFAIL("DNSSEC status was bogus", 0, msg, &response);
+		SERVFAIL("DNSSEC status was bogus", 0, msg, &response, DNSSEC_BOGUS);
 
-	else if (rcode == GETDNS_RCODE_SERVFAIL)
+	else if (rcode == GETDNS_RCODE_SERVFAIL) {
+		stubby_metrics_servfail(STUBBY_SERVFAIL_UPSTREAM);
+		STUBBY_PROBE3(query__servfail, msg, "Upstream SERVFAIL", 0);
 		servfail(msg, &response);
+	}
 
 	/* RRsigs when DO and (CD or not BOGUS) 
 	 * Implemented in conversion to wireformat function by checking for DO
@@ -483,7 +1001,7 @@ static void request_cb(
 	 */
 	else if (msg->rt == GETDNS_RESOLUTION_RECURSING && !msg->do_bit &&
 	    (r = _handle_edns0(response, msg->has_edns0)))
-		SERVFAIL("Could not handle EDNS0", r, msg, &response);
+		SERVFAIL("Could not handle EDNS0", r, msg, &response, HANDLE_EDNS0);
 
 	/* AD when (DO or AD) and SECURE (But only when we perform validation natively) */
 	else if (dnssec_validation &&
@@ -493,22 +1011,22 @@ static void request_cb(
 	       || ( msg->cd_bit && !getdns_dict_get_int(response,
 	            "/replies_tree/0/dnssec_status", &dnssec_status)
 	          && dnssec_status == GETDNS_DNSSEC_SECURE ))) ? 1 : 0)))
-		SERVFAIL("Could not set AD bit", r, msg, &response);
+		SERVFAIL("Could not set AD bit", r, msg, &response, SET_AD_BIT);
 
 	else if ((dnssec_validation || msg->rt == GETDNS_RESOLUTION_RECURSING)
 	    && (r =  getdns_dict_set_int(
 	    response, "/replies_tree/0/header/cd", msg->cd_bit)))
-		SERVFAIL("Could not copy CD bit", r, msg, &response);
+		SERVFAIL("Could not copy CD bit", r, msg, &response, COPY_CD_BIT);
 
 	else if (msg->rt == GETDNS_RESOLUTION_STUB)
 		; /* following checks are for RESOLUTION_RECURSING only */
 	
 	else if ((r = getdns_dict_get_int(
 	    response, "/replies_tree/0/header/ra", &n)))
-		SERVFAIL("Could not get RA bit from reply", r, msg, &response);
+		SERVFAIL("Could not get RA bit from reply", r, msg, &response, GET_RA_BIT);
 
 	else if (n == 0)
-		SERVFAIL("Recursion not available", 0, msg, &response);
+		SERVFAIL("Recursion not available", 0, msg, &response, NO_RECURSION);
 
 	if (!getdns_dict_get_int(response, "/replies_tree/0/header/arcount", &arcount)
 	&&  arcount > 0
@@ -563,23 +1081,116 @@ static void request_cb(
 			(void) getdns_dict_remove_name(response, i_as_jptr);
 		}
 	}
-	if ((r = getdns_reply(context, response, msg->request_id))) {
+	if (stubby_cache_ttl_clamped())
+		clamp_ttls(msg, response);
+
+	if (msg->dnstap)
+		dnstap_response(msg, response);
+
+	if (stubby_cache_enabled())
+		cache_response(msg, response);
+
+	if (msg->warmup) {
+		/* What is cached does not depend on whether the query had
+		 * EDNS0 in stub resolution, so serve both kinds of clients.
+		 */
+		if (stubby_cache_enabled()
+		&&  msg->rt == GETDNS_RESOLUTION_STUB) {
+			msg->has_edns0 = 1;
+			cache_response(msg, response);
+		}
+		stubby_warmup_done();
+		getdns_dict_destroy(msg->request);
+		stubby_mem_free(STUBBY_MEM_QUERIES, msg);
+		if (response)
+			getdns_dict_destroy(response);
+		return;
+	}
+
+	rcode = response_rcode(response);
+	if (rcode == GETDNS_RCODE_NXDOMAIN && stubby_hitters_enabled()
+	&&  !getdns_dict_get_bindata(msg->request, "/question/qname", &nxname))
+		stubby_hitters_nxdomain(nxname->data, nxname->size);
+	if ((r = send_reply(context, response, msg->listener,
+	    msg->request_id))) {
 		fprintf(stderr, "Could not reply: %s\n", _getdns_strerror(r));
 		/* Cancel reply */
-		(void) getdns_reply(context, NULL, msg->request_id);
+		(void) send_reply(context, NULL, msg->listener,
+		    msg->request_id);
 	}
+	if (STUBBY_PROBE_ENABLED(query__reply))
+		probe_query_reply(msg, rcode);
+	stubby_trace_end(&msg->trace, msg->request, rcode, upstream);
 	if (msg) {
 		getdns_dict_destroy(msg->request);
-		free(msg);
+		stubby_mem_free(STUBBY_MEM_QUERIES, msg);
 	}
 	if (response)
 		getdns_dict_destroy(response);
 }	
 
+/* Resolve a name from the cache warm-up list, like a query from a client
+ * without EDNS0, to cache its answer.  No reply is sent.
+ */
+static getdns_return_t warmup_query(const char *qname_str, uint16_t qtype)
+{
+	getdns_transaction_t transaction_id = 0;
+	getdns_bindata *qname = NULL;
+	getdns_dict *qext = NULL, *header;
+	dns_msg *msg = NULL;
+	getdns_return_t r;
+
+	if ((r = getdns_convert_fqdn_to_dns_name(qname_str, &qname)))
+		return r;
+	if (!(qext = getdns_dict_create_with_context(context))
+	||  !(msg = stubby_mem_calloc(STUBBY_MEM_QUERIES, 1, sizeof(dns_msg)))
+	||  !(msg->request = getdns_dict_create()))
+		r = GETDNS_RETURN_MEMORY_ERROR;
+
+	else if ((r = getdns_dict_set_int(msg->request, "/header/id", 0))
+	     ||  (r = getdns_dict_set_int(msg->request, "/header/rd", 1))
+	     ||  (r = getdns_dict_set_bindata(msg->request,
+	         "/question/qname", qname))
+	     ||  (r = getdns_dict_set_int(msg->request,
+	         "/question/qtype", qtype))
+	     ||  (r = getdns_dict_set_int(msg->request,
+	         "/question/qclass", GETDNS_RRCLASS_IN)))
+		; /* pass */
+
+	else {
+		stubby_trace_begin(&msg->trace);
+		msg->warmup = 1;
+		msg->rt = GETDNS_RESOLUTION_RECURSING;
+		(void) getdns_context_get_resolution_type(context, &msg->rt);
+		if (msg->rt == GETDNS_RESOLUTION_STUB
+		&&  !getdns_dict_get_dict(msg->request, "header", &header))
+			(void) getdns_dict_set_dict(qext, "header", header);
+		stubby_stats_query_extensions(qext);
+		query_in_flight(msg, 1);
+		if ((r = getdns_general(context, qname_str, qtype,
+		    qext, msg, &transaction_id, request_cb)))
+			query_in_flight(msg, 0);
+		else
+			msg = NULL; /* Freed by request_cb */
+	}
+	if (msg) {
+		if (msg->request)
+			getdns_dict_destroy(msg->request);
+		stubby_mem_free(STUBBY_MEM_QUERIES, msg);
+	}
+	if (qext)
+		getdns_dict_destroy(qext);
+	free(qname->data);
+	free(qname);
+	return r;
+}
+
 static void incoming_request_handler(getdns_context *context,
     getdns_callback_type_t callback_type, getdns_dict *request,
     void *userarg, getdns_transaction_t request_id)
 {
+	const struct sockaddr *client;
+	size_t client_len;
 	getdns_bindata *qname;
 	char *qname_str = NULL;
 	uint32_t qtype;
@@ -596,20 +1207,29 @@ static void incoming_request_handler(getdns_context *context,
 	getdns_list *additional;
 	getdns_dict *rr;
 	uint32_t rr_type;
+	uint32_t rcode;
 
 	(void)callback_type;
-	(void)userarg;
 
 	if (!(qext = getdns_dict_create_with_context(context)) ||
-	    !(msg = malloc(sizeof(dns_msg))))
+	    !(msg = stubby_mem_malloc(STUBBY_MEM_QUERIES, sizeof(dns_msg))))
 		goto error;
 
+	stubby_trace_begin(&msg->trace);
+	if (STUBBY_PROBE_ENABLED(query__reply)
+	&&  !msg->trace.ns[STUBBY_TRACE_RECEIVED])
+		msg->trace.ns[STUBBY_TRACE_RECEIVED] = stubby_trace_now();
+
 	/* pass through the header and the OPT record */
 	n = 0;
 	msg->request_id = request_id;
+	msg->listener = userarg;
 	msg->request = request;
 	msg->ad_bit = msg->do_bit = msg->cd_bit = 0;
 	msg->has_edns0 = 0;
+	msg->dnstap = 0;
+	msg->warmup = 0;
+	msg->in_flight = 0;
 	msg->rt = GETDNS_RESOLUTION_RECURSING;
 	(void) getdns_dict_get_int(request, "/header/ad", &msg->ad_bit);
 	(void) getdns_dict_get_int(request, "/header/cd", &msg->cd_bit);
@@ -643,6 +1263,8 @@ static void incoming_request_handler(getdns_context *context,
 		getdns_dict_set_int(qext, "dnssec_return_all_statuses",
 		    GETDNS_EXTENSION_TRUE);
 
+	stubby_stats_query_extensions(qext);
+
 	if (!getdns_dict_get_int(request, "/additional/0/extended_rcode",&n))
 		(void)getdns_dict_set_int(
 		    qext, "/add_opt_parameters/extended_rcode", n);
@@ -681,22 +1303,56 @@ static void incoming_request_handler(getdns_context *context,
 		fprintf(stderr, "Could set class from query: %s\n",
 		    _getdns_strerror(r));
 
-	else if ((r = getdns_general(context, qname_str, qtype,
-	    qext, msg, &transaction_id, request_cb)))
-		fprintf(stderr, "Could not schedule query: %s\n",
-		    _getdns_strerror(r));
 	else {
-		DEBUG_SERVER("scheduled: %p %"PRIu64" for %s %d\n",
-		    (void *)msg, transaction_id, qname_str, (int)qtype);
-		getdns_dict_destroy(qext);
-		free(qname_str);
-		return;
+		/* Before scheduling, because request_cb may be called
+		 * (and msg freed) from within getdns_general().
+		 */
+		STUBBY_PROBE3(query__receive, msg, qname_str, qtype);
+		if ((msg->dnstap = stubby_dnstap_sample(qtype)))
+			dnstap_query(msg);
+		stubby_metrics_query(qtype);
+		stubby_hitters_query(qname->data, qname->size);
+		if (stubby_hitters_enabled()
+		&&  (client = stubby_server_client_addr(msg->listener,
+		    &client_len, NULL)))
+			stubby_hitters_client(client, client_len);
+		if (answer_from_cache(context, msg, qname, qtype, qclass)) {
+			getdns_dict_destroy(qext);
+			free(qname_str);
+			return;
+		}
+		query_in_flight(msg, 1);
+
+		scheduling = msg;
+		if ((r = getdns_general(context, qname_str, qtype,
+		    qext, msg, &transaction_id, request_cb))) {
+			scheduling = NULL;
+			fprintf(stderr, "Could not schedule query: %s\n",
+			    _getdns_strerror(r));
+			query_in_flight(msg, 0);
+		} else {
+			if (scheduling) {
+				/* Not answered synchronously */
+				stubby_trace_mark(&msg->trace,
+				    STUBBY_TRACE_SCHEDULED);
+				scheduling = NULL;
+			}
+			STUBBY_PROBE4(upstream__schedule, msg, qname_str,
+			    qtype, transaction_id);
+			DEBUG_SERVER("scheduled: %p %"PRIu64" for %s %d\n",
+			    (void *)msg, transaction_id, qname_str, (int)qtype);
+			getdns_dict_destroy(qext);
+			free(qname_str);
+			return;
+		}
 	}
 error:
 	if (qname_str)
 		free(qname_str);
 	if (qext)
 		getdns_dict_destroy(qext);
+	stubby_metrics_servfail(STUBBY_SERVFAIL_REQUEST_ERROR);
+	STUBBY_PROBE3(query__servfail, msg, "Request error", (int)r);
 	servfail(msg, &response);
 #if defined(SERVER_DEBUG) && SERVER_DEBUG
 	do {
@@ -708,52 +1364,566 @@ error:
 		free(request_str);
 	} while(0);
 #endif
-	if ((r = getdns_reply(context, response, request_id))) {
+	if (msg && msg->dnstap)
+		dnstap_response(msg, response);
+
+	rcode = response_rcode(response);
+	if ((r = send_reply(context, response, userarg, request_id))) {
 		fprintf(stderr, "Could not reply: %s\n",
 		    _getdns_strerror(r));
 		/* Cancel reply */
-		getdns_reply(context, NULL, request_id);
+		(void) send_reply(context, NULL, userarg, request_id);
 	}
 	if (msg) {
+		if (STUBBY_PROBE_ENABLED(query__reply))
+			probe_query_reply(msg, rcode);
+		stubby_trace_end(&msg->trace, request, rcode, NULL);
 		if (msg->request)
 			getdns_dict_destroy(msg->request);
-		free(msg);
+		stubby_mem_free(STUBBY_MEM_QUERIES, msg);
 	}
 	if (response)
 		getdns_dict_destroy(response);
 }
 
-static void stubby_log(void *userarg, uint64_t system,
-    getdns_loglevel_type level, const char *fmt, va_list ap)
+/* Whether the context described by api_information validates DNSSEC */
+static int api_dnssec_validation(getdns_dict *api_information)
 {
-	struct timeval tv;
-	struct tm tm;
-	char buf[10];
-#if defined(STUBBY_ON_WINDOWS) || defined(GETDNS_ON_WINDOWS)
-	time_t tsec;
+	getdns_list *api_info_keys = NULL;
+	getdns_bindata *api_info_key = NULL;
+	getdns_dict *all_context;
+	int validating = 0;
+	uint32_t value;
+	size_t i;
+
+	if (getdns_dict_get_names(api_information, &api_info_keys))
+		return 0;
+	for ( i = 0
+	    ; !validating &&
+	      !getdns_list_get_bindata(api_info_keys, i, &api_info_key)
+	    ; i++) {
+		if ((  !strncmp((const char *)api_info_key->data, "dnssec_", 7)
+		    || !strcmp ((const char *)api_info_key->data, "dnssec"))
+		   && !getdns_dict_get_int(api_information, (const char *)api_info_key->data, &value)
+		   && value == GETDNS_EXTENSION_TRUE)
+			validating = 1;
+	}
+	getdns_list_destroy(api_info_keys);
+	api_info_keys = NULL;
+	if (   !validating
+	    && !getdns_dict_get_dict(api_information, "all_context"
+	                                            , &all_context)
+	    && !getdns_dict_get_names(all_context, &api_info_keys)) {
+		for ( i = 0
+		    ; !validating &&
+		      !getdns_list_get_bindata(api_info_keys, i, &api_info_key)
+		    ; i++) {
+			if ((  !strncmp((const char *)api_info_key->data, "dnssec_", 7)
+			    || !strcmp ((const char *)api_info_key->data, "dnssec"))
+			   && !getdns_dict_get_int(all_context, (const char *)api_info_key->data, &value)
+			   && value == GETDNS_EXTENSION_TRUE)
+				validating = 1;
+		}
+		getdns_list_destroy(api_info_keys);
+	}
+	return validating;
+}
+
+/* Settings stubby only reads at startup.  A change to one of them is
+ * reported on reload, but takes a restart to take effect.
+ */
+static const char *restart_settings[] = {
+	"dnstap", "upstream_stats_file", "upstream_stats_interval", "metrics",
+	"query_trace", "event_loop_monitor", "heavy_hitters", "control_socket",
+	"cache", "cache_warmup", "min_cache_ttl", "max_cache_ttl",
+	"cache_ttl_overrides", "workers", NULL
+};
+
+static int is_restart_setting(const char *name)
+{
+	const char **setting;
 
-	gettimeofday(&tv, NULL);
-	tsec = (time_t) tv.tv_sec;
-	gmtime_s(&tm, (const time_t *) &tsec);
+	for (setting = restart_settings; *setting; setting++)
+		if (!strcmp(*setting, name))
+			return 1;
+	return 0;
+}
+
+/* Copy the value of name from src to dst, or remove it from dst when src
+ * does not have it.
+ */
+static getdns_return_t copy_config_value(getdns_dict *dst,
+    const getdns_dict *src, const char *name)
+{
+	getdns_data_type type;
+	getdns_dict *dict;
+	getdns_list *list;
+	getdns_bindata *bindata;
+	uint32_t n = 0;
+
+	if (!src || getdns_dict_get_data_type(src, name, &type)) {
+		(void) getdns_dict_remove_name(dst, name);
+		return GETDNS_RETURN_GOOD;
+	}
+	switch (type) {
+	case t_dict:
+		(void) getdns_dict_get_dict(src, name, &dict);
+		return getdns_dict_set_dict(dst, name, dict);
+	case t_list:
+		(void) getdns_dict_get_list(src, name, &list);
+		return getdns_dict_set_list(dst, name, list);
+	case t_bindata:
+		(void) getdns_dict_get_bindata(src, name, &bindata);
+		return getdns_dict_set_bindata(dst, name, bindata);
+	default:
+		(void) getdns_dict_get_int(src, name, &n);
+		return getdns_dict_set_int(dst, name, n);
+	}
+}
+
+static int config_value_changed(const getdns_dict *a, const getdns_dict *b,
+    const char *name, gldns_buffer *buf_a, gldns_buffer *buf_b)
+{
+	getdns_return_t r_a = stubby_snapshot_encode_value(a, name, buf_a);
+	getdns_return_t r_b = stubby_snapshot_encode_value(b, name, buf_b);
+
+	if (r_a || r_b)
+		return r_a != r_b;
+	return gldns_buffer_position(buf_a) != gldns_buffer_position(buf_b)
+	    || memcmp(gldns_buffer_begin(buf_a), gldns_buffer_begin(buf_b),
+	              gldns_buffer_position(buf_a));
+}
+
+/* stubby serves its own listeners, so that they can be handed over on
+ * upgrade.  On Windows getdns serves them.
+ */
+static getdns_return_t set_listen_addresses(getdns_list *list)
+{
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+	return stubby_server_listen(list);
 #else
-	gettimeofday(&tv, NULL);
-	gmtime_r(&tv.tv_sec, &tm);
+	return getdns_context_set_listen_addresses(
+	    context, list, NULL, incoming_request_handler);
 #endif
-	strftime(buf, 10, "%H:%M:%S", &tm);
-	(void)userarg; (void)system; (void)level;
-	(void) fprintf(stderr, "[%s.%.6d] STUBBY: ", buf, (int)tv.tv_usec);
-	(void) vfprintf(stderr, fmt, ap);
 }
 
-void stubby_local_log(void *userarg, uint64_t system,
-    getdns_loglevel_type level, const char *fmt, ...)
+/* Read the config file again and apply the settings that changed.
+ *
+ * Only the changed getdns settings are given to the context, so upstreams
+ * keep their connections unless upstream_recursive_servers changed, and
+ * listen addresses are only rebound when listen_addresses changed.
+ * Everything is validated before anything is applied; when the new
+ * configuration is not valid the running one is kept as it is.
+ */
+static getdns_return_t reload_config(gldns_buffer *report)
+{
+	getdns_dict *new_config = NULL, *old_config;
+	getdns_dict *defaults = NULL, *changes = NULL, *api_information;
+	getdns_list *names[2] = { NULL, NULL }, *new_listen = NULL;
+	getdns_context *scratch = NULL;
+	gldns_buffer *buf_a = NULL, *buf_b = NULL;
+	getdns_bindata *name_bd;
+	const getdns_dict *src;
+	const char *name;
+	size_t i, j, n_changed = 0, n_changes = 0;
+	uint32_t slow_threshold = 0;
+	int slow_changed = 0;
+	getdns_return_t r;
+
+	if (!config_fn || !running_dict
+	||  getdns_dict_get_dict(running_dict, "config", &old_config)) {
+		fprintf(stderr, "No config file to reload\n");
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	if ((r = read_config_file(config_fn, &new_config))) {
+		fprintf(stderr, "Could not reload config file \"%s\": %s\n",
+		    config_fn, _getdns_strerror(r));
+		return r;
+	}
+	if ((r = config_str2dict(default_config, 0, &defaults)))
+		goto error;
+	if (!(changes = getdns_dict_create())
+	||  !(buf_a = gldns_buffer_new(1024))
+	||  !(buf_b = gldns_buffer_new(1024))) {
+		r = GETDNS_RETURN_MEMORY_ERROR;
+		goto error;
+	}
+	if ((r = getdns_dict_get_names(new_config, &names[0]))
+	||  (r = getdns_dict_get_names(old_config, &names[1])))
+		goto error;
+
+	/* The names in the new config, followed by the removed ones */
+	for (j = 0; j < 2; j++) {
+		for (i = 0; !getdns_list_get_bindata(names[j], i, &name_bd); i++) {
+			getdns_data_type type;
+
+			name = (const char *)name_bd->data;
+			if (j == 1 && !getdns_dict_get_data_type(
+			    new_config, name, &type))
+				continue;
+			if (!config_value_changed(old_config, new_config, name,
+			    buf_a, buf_b))
+				continue;
+
+			n_changed++;
+			src = j == 0 ? new_config : defaults;
+			if (is_restart_setting(name)) {
+				(void) gldns_buffer_printf(report,
+				    "%s: changed, takes effect on restart\n",
+				    name);
+				/* Remember what is running, not what was read */
+				if ((r = copy_config_value(
+				    new_config, old_config, name)))
+					goto error;
+				continue;
+			}
+			if (j == 1 && getdns_dict_get_data_type(
+			    defaults, name, &type)
+			&&  strcmp(name, "slow_query_threshold")) {
+				(void) gldns_buffer_printf(report,
+				    "%s: removed, keeps its value until "
+				    "restart\n", name);
+				continue;
+			}
+			if (!strcmp(name, "slow_query_threshold")) {
+				if (j == 0 && (r = getdns_dict_get_int(
+				    new_config, name, &slow_threshold)))
+					goto error;
+				slow_changed = 1;
+
+			} else if (!strcmp(name, "listen_addresses")
+			       && stubby_server_socket_activated()) {
+				(void) gldns_buffer_printf(report,
+				    "%s: changed, but the sockets passed by "
+				    "the service manager are used\n", name);
+				continue;
+
+			} else if (!strcmp(name, "listen_addresses")) {
+				if ((r = getdns_dict_get_list(
+				    src, name, &new_listen)))
+					goto error;
+
+			} else if ((r = copy_config_value(changes, src, name)))
+				goto error;
+			else
+				n_changes++;
+
+			(void) gldns_buffer_printf(report, "%s: %s\n", name,
+			    j == 0 ? "changed" : "removed, back to default");
+		}
+	}
+	if (n_changes) {
+		/* Validate on a context that is not in use */
+		if ((r = getdns_context_create(&scratch, 0)))
+			goto error;
+		r = getdns_context_config(scratch, changes);
+		getdns_context_destroy(scratch);
+		if (r) {
+			fprintf(stderr, "Could not reload config file \"%s\": "
+			    "%s\n", config_fn, _getdns_strerror(r));
+			goto error;
+		}
+	}
+	if (new_listen) {
+		if ((r = set_listen_addresses(new_listen))) {
+			fprintf(stderr, "Could not bind on the reloaded listen "
+			    "addresses: %s\n", _getdns_strerror(r));
+			goto error;
+		}
+		(void) set_listen_list(new_listen);
+	}
+	if (n_changes) {
+		if ((r = getdns_context_config(context, changes)))
+			fprintf(stderr, "Could not configure context with "
+			    "reloaded config: %s\n", _getdns_strerror(r));
+		(void) getdns_context_set_resolution_type(
+		    context, GETDNS_RESOLUTION_STUB);
+		if ((api_information =
+		    getdns_context_get_api_information(context))) {
+			dnssec_validation =
+			    api_dnssec_validation(api_information);
+			getdns_dict_destroy(api_information);
+		}
+	}
+	if (slow_changed)
+		stubby_trace_set_slow_threshold(slow_threshold);
+	if (!n_changed)
+		(void) gldns_buffer_printf(report, "no changes\n");
+
+	(void) getdns_dict_set_dict(running_dict, "config", new_config);
+error:
+	gldns_buffer_free(buf_b);
+	gldns_buffer_free(buf_a);
+	getdns_list_destroy(names[1]);
+	getdns_list_destroy(names[0]);
+	getdns_dict_destroy(changes);
+	getdns_dict_destroy(defaults);
+	getdns_dict_destroy(new_config);
+	return r;
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+/* SIGHUP and SIGUSR2 (and in workers SIGUSR1, for the log level) are
+ * handed to the event loop over a pipe, so that the reload or upgrade is
+ * done in between queries and not from within the signal handler.
+ */
+static int reload_pipe[2] = { -1, -1 };
+static getdns_eventloop *reload_loop = NULL;
+static getdns_eventloop_event reload_event;
+
+static void signal_handler(int sig)
 {
-	va_list args;
-	va_start(args, fmt);
-	stubby_log(userarg, system, level, fmt, args);
-	va_end(args);
+	int saved_errno = errno;
+	char c = (char)sig;
+
+	if (write(reload_pipe[1], &c, 1) < 0) {
+		/* The pipe is full with pending signals already */
+	}
+	errno = saved_errno;
 }
 
+static void reload_read_cb(void *userarg)
+{
+	char buf[64];
+	gldns_buffer *report;
+	getdns_return_t r;
+	int reload = 0, upgrade = 0, log_level = 0;
+	ssize_t n, i;
+
+	(void)userarg;
+	while ((n = read(reload_pipe[0], buf, sizeof(buf))) > 0) {
+		/* Several signals make one reload */
+		for (i = 0; i < n; i++) {
+			if (buf[i] == (char)SIGHUP)
+				reload = 1;
+			else if (buf[i] == (char)SIGUSR2)
+				upgrade = 1;
+			else if (buf[i] == (char)SIGUSR1)
+				log_level = 1;
+		}
+	}
+	if (log_level && stubby_prefork_log_level() >= 0)
+		stubby_control_log_level(
+		    (getdns_loglevel_type)stubby_prefork_log_level());
+	if (upgrade && (r = stubby_upgrade_request()))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_ERR,
+		    "Could not start the upgrade: %s\n", _getdns_strerror(r));
+	if (!reload)
+		return;
+	if (!(report = gldns_buffer_new(1024)))
+		return;
+	if ((r = reload_config(report)))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_ERR,
+		    "Reload of \"%s\" failed, configuration unchanged: %s\n",
+		    config_fn ? config_fn : "(none)", _getdns_strerror(r));
+	else
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_NOTICE, "Reloaded \"%s\":\n%.*s", config_fn,
+		    (int)gldns_buffer_position(report),
+		    (char *)gldns_buffer_begin(report));
+	gldns_buffer_free(report);
+}
+
+static void reload_start(getdns_context *context)
+{
+	struct sigaction sa;
+
+	stubby_control_set_reload(reload_config);
+	if (reload_loop)
+		return;
+	if (pipe(reload_pipe) < 0) {
+		perror("Could not create pipe for signals");
+		return;
+	}
+	(void) fcntl(reload_pipe[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+	(void) fcntl(reload_pipe[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(reload_pipe[1], F_SETFD, FD_CLOEXEC);
+	if (getdns_context_get_eventloop(context, &reload_loop)) {
+		reload_loop = NULL;
+		return;
+	}
+	(void) memset(&reload_event, 0, sizeof(reload_event));
+	reload_event.read_cb = reload_read_cb;
+	(void) reload_loop->vmt->schedule(reload_loop, reload_pipe[0],
+	    (uint64_t)0xFFFFFFFFFFFFFFFF, &reload_event);
+
+	(void) memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sa.sa_flags = SA_RESTART;
+	(void) sigemptyset(&sa.sa_mask);
+	(void) sigaction(SIGHUP, &sa, NULL);
+	(void) sigaction(SIGUSR2, &sa, NULL);
+	if (stubby_prefork_worker() >= 0)
+		(void) sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void reload_stop(void)
+{
+	if (!reload_loop)
+		return;
+	(void) signal(SIGHUP, SIG_DFL);
+	(void) signal(SIGUSR2, SIG_DFL);
+	if (stubby_prefork_worker() >= 0)
+		(void) signal(SIGUSR1, SIG_IGN);
+	(void) reload_loop->vmt->clear(reload_loop, &reload_event);
+	(void) close(reload_pipe[0]);
+	(void) close(reload_pipe[1]);
+	reload_pipe[0] = reload_pipe[1] = -1;
+	reload_loop = NULL;
+}
+#else
+static void reload_start(getdns_context *context)
+{
+	(void)context;
+	stubby_control_set_reload(reload_config);
+}
+
+static void reload_stop(void)
+{
+}
+#endif
+
+static void run_services(void)
+{
+	/* With workers, the services with a single socket or file are run
+	 * by the first one, showing the counters of all workers.  Each
+	 * worker writes dnstap messages of its own.
+	 */
+	int first = stubby_prefork_worker() <= 0;
+
+#ifdef SIGPIPE
+	(void)signal(SIGPIPE, SIG_IGN);
+#endif
+	stubby_log_start();
+	stubby_dnstap_start();
+	if (first) {
+		stubby_trace_start();
+		stubby_stats_start(context);
+		stubby_cache_start(context);
+	}
+	reload_start(context);
+	stubby_server_set_fast_path(fast_answer);
+	(void) stubby_server_start(context, incoming_request_handler);
+	stubby_prefork_ready();
+	if (first)
+		stubby_warmup_start(context, warmup_query);
+	/* The stubby we upgrade from has the metrics and control sockets
+	 * until it stopped.
+	 */
+	stubby_upgrade_ready();
+	if (first) {
+		(void) stubby_metrics_start(context);
+		(void) stubby_control_start(context);
+	}
+	stubby_loopmon_run(context);
+}
+
+static void stop_services(void)
+{
+	stubby_control_stop();
+	reload_stop();
+	stubby_server_stop();
+	stubby_warmup_stop();
+	stubby_cache_stop();
+	stubby_metrics_stop();
+	stubby_stats_stop();
+	stubby_trace_stop();
+	stubby_dnstap_stop();
+	stubby_log_stop();
+}
+
+static void run_worker(void)
+{
+	gldns_buffer *report;
+	getdns_return_t r;
+
+	/* Sockets of its own, bound with SO_REUSEPORT, in place of the ones
+	 * of the master.
+	 */
+	if (stubby_server_reuseport()) {
+		(void) stubby_server_listen(NULL);
+		if (listen_count && (r = set_listen_addresses(listen_list))) {
+			stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+			    GETDNS_LOG_ERR, "Worker %d could not bind on "
+			    "listen_addresses: %s\n", stubby_prefork_worker(),
+			    _getdns_strerror(r));
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* The master is still at the configuration stubby started with */
+	if (stubby_prefork_reloaded() && (report = gldns_buffer_new(1024))) {
+		if ((r = reload_config(report)))
+			stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+			    GETDNS_LOG_ERR, "Reload of \"%s\" failed: %s\n",
+			    config_fn ? config_fn : "(none)",
+			    _getdns_strerror(r));
+		gldns_buffer_free(report);
+	}
+	/* And a log level set with the control socket since */
+	if (stubby_prefork_log_level() >= 0)
+		stubby_control_log_level(
+		    (getdns_loglevel_type)stubby_prefork_log_level());
+	run_services();
+	stop_services();
+}
+
+/* Before listen_addresses are bound: the workers need SO_REUSEPORT on
+ * the master's sockets to bind their own, and the cache must be shared
+ * before they are forked.
+ */
+static void prepare_workers(void)
+{
+	getdns_return_t r;
+
+	if (!stubby_server_socket_activated()
+	&&  !stubby_server_set_reuseport(1))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "SO_REUSEPORT is not available, "
+		    "the workers share the listening sockets\n");
+	if ((r = stubby_cache_share()))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "Could not share the cache, each "
+		    "worker has a cache of its own: %s\n",
+		    _getdns_strerror(r));
+	if ((r = stubby_metrics_share()) || (r = stubby_stats_share())
+	||  (r = stubby_trace_share()))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "Could not share the counters, "
+		    "some show those of the first worker only: %s\n",
+		    _getdns_strerror(r));
+}
+
+/* With workers this process becomes their master */
+static void serve(void)
+{
+	getdns_return_t r;
+
+	if (!stubby_prefork_enabled() || stubby_upgrade_receiving())
+		run_services();
+	else if ((r = stubby_prefork_run(run_worker)))
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_ERR, "Could not start workers: %s\n",
+		    _getdns_strerror(r));
+}
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+static void write_pid_file(pid_t pid)
+{
+	FILE *fh = fopen(STUBBYPIDFILE, "w");
+
+	if (fh) {
+		fprintf(fh, "%d", (int)pid);
+		fclose(fh);
+	} else {
+		fprintf(stderr, "Could not write pid to "
+		        "\"%s\": %s\n", STUBBYPIDFILE,
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -767,10 +1937,8 @@ main(int argc, char **argv)
 	long log_level = 7; 
 	char *ep;
 	getdns_dict *api_information = NULL;
-	getdns_list *api_info_keys = NULL;
-	getdns_bindata *api_info_key = NULL;
 
-	while ((opt = getopt(argc, argv, "C:ighlv:V")) != -1) {
+	while ((opt = getopt(argc, argv, "C:ighlo:v:V")) != -1) {
 		switch (opt) {
 		case 'C':
 			custom_config_fn = optarg;
@@ -787,6 +1955,9 @@ main(int argc, char **argv)
 		case 'l':
 			log_connections = 1;
 			break;
+		case 'o':
+			snapshot_fn = optarg;
+			break;
 		case 'v':
 			log_connections = 1;
 			errno = 0;
@@ -807,11 +1978,17 @@ main(int argc, char **argv)
 		}
 	}
 
-	if ((r = getdns_context_create(&context, 1))) {
+	if ((r = getdns_context_create_with_extended_memory_functions(
+	    &context, 1, (void *)(intptr_t)STUBBY_MEM_GETDNS,
+	    stubby_mem_getdns_malloc, stubby_mem_getdns_realloc,
+	    stubby_mem_getdns_free))) {
 		fprintf(stderr, "Create context failed: %s\n",
 		        _getdns_strerror(r));
 		return r;
 	}
+	stubby_upgrade_init(context, argv, stop_services);
+	stubby_set_log_level((getdns_loglevel_type)log_level);
+	stubby_set_getdns_logging(log_connections);
 	if (log_connections) {
 		(void) getdns_context_set_logfunc(context, NULL,
 	    	GETDNS_LOG_UPSTREAM_STATS, (int)log_level, stubby_log);
@@ -857,48 +2034,41 @@ main(int argc, char **argv)
 		if (!found_conf)
 			fprintf(stderr, "WARNING: No Stubby config file found... using minimal default config (Opportunistic Usage)\n");
 	}
+	if (snapshot_fn) {
+		if (!snapshot_written) {
+			fprintf(stderr, "No config file to write a snapshot of\n");
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+	if (!print_api_info && stubby_upgrade_receive() < 0)
+		exit(EXIT_FAILURE);
+	if (!print_api_info && stubby_server_socket_activation())
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_INFO,
+		    "Using the sockets passed by the service manager instead "
+		    "of listen_addresses\n");
+	if (!print_api_info && stubby_prefork_enabled()) {
+		if (stubby_upgrade_receiving())
+			stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+			    GETDNS_LOG_WARNING, "Not starting workers when "
+			    "upgrading, restart stubby to start them\n");
+		else
+			prepare_workers();
+	}
+	stubby_stats_set_context(context);
+	/* Before anything is scheduled on the event loop */
+	if ((r = stubby_loopmon_start(context)))
+		fprintf(stderr, "Could not monitor the event loop: %s\n",
+		    _getdns_strerror(r));
 	if ((r = getdns_context_set_resolution_type(context, GETDNS_RESOLUTION_STUB))) {
 		fprintf( stderr, "Error while trying to configure stubby for "
 		                 "stub resolution only: %s\n", _getdns_strerror(r));
 		exit(EXIT_FAILURE);
 	}
 	if ((api_information = getdns_context_get_api_information(context))
-	    && !dnssec_validation
-	    && !getdns_dict_get_names(api_information, &api_info_keys)) {
-		size_t i;
-		uint32_t value;
-		getdns_dict *all_context;
+	    && !dnssec_validation)
+		dnssec_validation = api_dnssec_validation(api_information);
 
-		for ( i = 0
-		    ; !dnssec_validation &&
-		      !getdns_list_get_bindata(api_info_keys, i, &api_info_key)
-		    ; i++) {
-			if ((  !strncmp((const char *)api_info_key->data, "dnssec_", 7)
-			    || !strcmp ((const char *)api_info_key->data, "dnssec"))
-			   && !getdns_dict_get_int(api_information, (const char *)api_info_key->data, &value)
-			   && value == GETDNS_EXTENSION_TRUE)
-				dnssec_validation = 1;
-		}
-		getdns_list_destroy(api_info_keys);
-		api_info_keys = NULL;
-		if (   !dnssec_validation
-		    && !getdns_dict_get_dict(api_information, "all_context"
-		                                            , &all_context)
-		    && !getdns_dict_get_names(all_context, &api_info_keys)) {
-			for ( i = 0
-			    ; !dnssec_validation &&
-			      !getdns_list_get_bindata(api_info_keys, i, &api_info_key)
-			    ; i++) {
-				if ((  !strncmp((const char *)api_info_key->data, "dnssec_", 7)
-				    || !strcmp ((const char *)api_info_key->data, "dnssec"))
-				   && !getdns_dict_get_int(all_context, (const char *)api_info_key->data, &value)
-				   && value == GETDNS_EXTENSION_TRUE)
-					dnssec_validation = 1;
-			}
-			getdns_list_destroy(api_info_keys);
-			api_info_keys = NULL;
-		}
-	}
 	if (print_api_info) {
 		char *api_information_str;
 	       
@@ -922,12 +2092,17 @@ main(int argc, char **argv)
 		fprintf(stdout, "%s\n", api_information_str);
 		free(api_information_str);
 		fprintf(stderr, "Result: Config file syntax is valid.\n");
-	} else if (listen_count && (r = getdns_context_set_listen_addresses(
-	    context, listen_list, NULL, incoming_request_handler)))
+	} else if (listen_count && !stubby_server_socket_activated()
+	    && (r = set_listen_addresses(listen_list)))
 		perror("error: Could not bind on given addresses");
 	else
 #if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
-	     if (!run_in_foreground) {
+	     if (!run_in_foreground && stubby_upgrade_receiving()) {
+		/* Forked off already by the stubby we upgrade from */
+		write_pid_file(getpid());
+		run_services();
+
+	} else if (!run_in_foreground) {
 		pid_t pid;
 		char pid_str[1024], *endptr;
 		FILE *fh = fopen(STUBBYPIDFILE, "r");
@@ -956,23 +2131,10 @@ main(int argc, char **argv)
 			perror("Could not fork of stubby daemon\n");
 			r = GETDNS_RETURN_GENERIC_ERROR;
 
-		} else if (pid) {
-			fh = fopen(STUBBYPIDFILE, "w");
-			if (fh) {
-				fprintf(fh, "%d", (int)pid);
-				fclose(fh);
-			} else {
-				fprintf(stderr, "Could not write pid to "
-				        "\"%s\": %s\n", STUBBYPIDFILE,
-				        strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-		} else {
-#ifdef SIGPIPE
-			(void)signal(SIGPIPE, SIG_IGN);
-#endif
-			getdns_context_run(context);
-		}
+		} else if (pid)
+			write_pid_file(pid);
+		else
+			serve();
 	} else
 #endif
 	{
@@ -1015,14 +2177,10 @@ main(int argc, char **argv)
 			            "(NOTE a Strict Profile only applies when TLS is the ONLY transport!!)\n");
 		stubby_local_log(NULL,GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_DEBUG,
 			       "Starting DAEMON....\n");
-#ifdef SIGPIPE
-		(void)signal(SIGPIPE, SIG_IGN);
-#endif
-		getdns_context_run(context);
+		serve();
 	}
+	stop_services();
 
-	if (api_info_keys)
-		getdns_list_destroy(api_info_keys);
 	getdns_dict_destroy(api_information);
 	getdns_context_destroy(context);
 
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_STUBBY_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#include "trace.h"
+#include "histogram.h"
+#include "stats.h"
+#include "log.h"
+#include "prefork.h"
+#include "ring.h"
+
+#define TRACE_RING_SLOTS   1024
+#define TRACE_MAX_IDLE_USEC 50000
+
+static const char *stage_names[STUBBY_TRACE_STAGES] = {
+	"schedule", "wait", "upstream", "reply", "total"
+};
+
+/* From which to which stamp each stage runs */
+static const stubby_trace_stamp stage_stamps[STUBBY_TRACE_STAGES][2] = {
+	{ STUBBY_TRACE_RECEIVED     , STUBBY_TRACE_SCHEDULED      },
+	{ STUBBY_TRACE_SCHEDULED    , STUBBY_TRACE_UPSTREAM_SENT  },
+	{ STUBBY_TRACE_UPSTREAM_SENT, STUBBY_TRACE_UPSTREAM_REPLY },
+	{ STUBBY_TRACE_CALLBACK     , STUBBY_TRACE_REPLIED        },
+	{ STUBBY_TRACE_RECEIVED     , STUBBY_TRACE_REPLIED        }
+};
+
+static int      trace_enabled = 0;
+static char    *trace_file = NULL;
+static uint32_t trace_sample_rate = 1;
+static uint32_t trace_sample_count = 0;
+static uint64_t slow_threshold_ns = 0;
+
+/* Only updated and read from the event loop.  With workers, those of
+ * every worker are in memory shared by all of them, and are added up for
+ * the metrics.
+ */
+typedef struct trace_histograms {
+	stubby_histogram stages[STUBBY_TRACE_STAGES];
+	stubby_histogram fast;
+} trace_histograms;
+
+static trace_histograms  local_histograms;
+static trace_histograms *histograms = &local_histograms;
+static trace_histograms *shared_histograms = NULL;
+static size_t            n_shared = 0;
+
+typedef struct trace_record {
+	uint64_t ns[STUBBY_TRACE_STAMPS];
+	uint64_t id;
+	uint32_t qtype;
+	uint32_t rcode;
+	char     upstream[64];
+	char     qname[256];
+} trace_record;
+
+#ifdef HAVE_STUBBY_THREADS
+static stubby_ring *trace_ring = NULL;
+static pthread_t    trace_thread;
+static atomic_int   trace_running = 0;
+static uint64_t     trace_id = 0;
+#endif
+
+void stubby_trace_enable(void)
+{
+	trace_enabled = 1;
+	/* For the upstream round trip times */
+	stubby_stats_enable();
+}
+
+int stubby_trace_enabled(void)
+{
+	return trace_enabled;
+}
+
+getdns_return_t stubby_trace_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+	uint32_t n;
+
+	if (!getdns_dict_get_int(config, "sample_rate", &n))
+		trace_sample_rate = n ? n : 1;
+
+	if (!getdns_dict_get_bindata(config, "file", &bindata)) {
+#ifndef HAVE_STUBBY_THREADS
+		fprintf(stderr, "query_trace file needs thread support\n");
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+#else
+		free(trace_file);
+		if (!(trace_file = malloc(bindata->size + 1)))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		(void) memcpy(trace_file, bindata->data, bindata->size);
+		trace_file[bindata->size] = 0;
+#endif
+	}
+	stubby_trace_enable();
+	return GETDNS_RETURN_GOOD;
+}
+
+void stubby_trace_set_slow_threshold(uint32_t threshold_ms)
+{
+	slow_threshold_ns = (uint64_t)threshold_ms * 1000000;
+	if (threshold_ms)
+		stubby_trace_enable();
+}
+
+getdns_return_t stubby_trace_share(void)
+{
+	size_t n = stubby_prefork_workers();
+
+	if (!(shared_histograms = stubby_prefork_share(
+	    n * sizeof(trace_histograms))))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	n_shared = n;
+	return GETDNS_RETURN_GOOD;
+}
+
+/* Those of this worker, once it is one */
+static trace_histograms *trace_histograms_get(void)
+{
+	if (shared_histograms && histograms == &local_histograms
+	&&  stubby_prefork_worker() >= 0)
+		histograms = &shared_histograms[stubby_prefork_worker()];
+	return histograms;
+}
+
+uint64_t stubby_trace_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void stubby_trace_begin(stubby_trace *trace)
+{
+	(void) memset(trace, 0, sizeof(stubby_trace));
+	if (!trace_enabled)
+		return;
+	trace->ns[STUBBY_TRACE_RECEIVED] = stubby_trace_now();
+#ifdef HAVE_STUBBY_THREADS
+	if (atomic_load_explicit(&trace_running, memory_order_relaxed)
+	&&  ++trace_sample_count >= trace_sample_rate) {
+		trace_sample_count = 0;
+		trace->sampled = 1;
+	}
+#endif
+}
+
+int stubby_trace_sample_next(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	return trace_enabled
+	    && atomic_load_explicit(&trace_running, memory_order_relaxed)
+	    && trace_sample_count + 1 >= trace_sample_rate;
+#else
+	return 0;
+#endif
+}
+
+void stubby_trace_mark(stubby_trace *trace, stubby_trace_stamp stamp)
+{
+	if (trace_enabled)
+		trace->ns[stamp] = stubby_trace_now();
+}
+
+void stubby_trace_upstream(stubby_trace *trace, uint32_t rtt_ms)
+{
+	uint64_t rtt_ns = (uint64_t)rtt_ms * 1000000;
+	uint64_t reply = trace->ns[STUBBY_TRACE_CALLBACK];
+
+	if (!trace_enabled || !reply)
+		return;
+	trace->ns[STUBBY_TRACE_UPSTREAM_REPLY] = reply;
+	/* run_time has millisecond granularity */
+	trace->ns[STUBBY_TRACE_UPSTREAM_SENT] =
+	    rtt_ns < reply && reply - rtt_ns > trace->ns[STUBBY_TRACE_SCHEDULED]
+	    ? reply - rtt_ns
+	                      : trace->ns[STUBBY_TRACE_SCHEDULED];
+}
+
+uint64_t stubby_trace_stage_ns(
+    const stubby_trace *trace, stubby_trace_stage stage)
+{
+	uint64_t from = trace->ns[stage_stamps[stage][0]];
+	uint64_t to   = trace->ns[stage_stamps[stage][1]];
+
+	return from && to > from ? to - from : 0;
+}
+
+#ifdef HAVE_STUBBY_THREADS
+/* Copy a string that will be written as a JSON string without escaping */
+static void json_safe_copy(char *dst, size_t dst_sz, const char *src)
+{
+	size_t i;
+
+	for (i = 0; src[i] && i < dst_sz - 1; i++)
+		dst[i] = src[i] == '"' || src[i] == '\\'
+		      || (unsigned char)src[i] < 0x20 ? '?' : src[i];
+	dst[i] = 0;
+}
+
+static void trace_queue(const stubby_trace *trace,
+    const getdns_dict *request, uint32_t rcode, const char *upstream)
+{
+	trace_record rec;
+	getdns_bindata *qname;
+	char *qname_str = NULL;
+
+	(void) memcpy(rec.ns, trace->ns, sizeof(rec.ns));
+	rec.id = ++trace_id;
+	rec.rcode = rcode;
+	if (getdns_dict_get_int(request, "/question/qtype", &rec.qtype))
+		rec.qtype = 0;
+	if (!getdns_dict_get_bindata(request, "/question/qname", &qname)
+	&&  !getdns_convert_dns_name_to_fqdn(qname, &qname_str)) {
+		json_safe_copy(rec.qname, sizeof(rec.qname), qname_str);
+		free(qname_str);
+	} else
+		(void) strcpy(rec.qname, "?");
+	json_safe_copy(rec.upstream, sizeof(rec.upstream),
+	    upstream ? upstream : "");
+
+	(void) stubby_ring_push(trace_ring, &rec, sizeof(rec));
+}
+#endif
+
+static double stage_ms(const stubby_trace *trace, stubby_trace_stage stage)
+{
+	return (double)stubby_trace_stage_ns(trace, stage) / 1e6;
+}
+
+static void trace_log_slow(const stubby_trace *trace,
+    const getdns_bindata *qname, uint32_t qtype, uint32_t rcode,
+    const stubby_upstream_stats *upstream)
+{
+	char *qname_str = NULL;
+	const char *conn = "none";
+
+	if (!qname || getdns_convert_dns_name_to_fqdn(qname, &qname_str))
+		qname_str = NULL;
+
+	/* A connection to the upstream opened while the query was waiting
+	 * is assumed to have been opened for it.  Without the getdns
+	 * connection events there is no telling.
+	 */
+	if (!upstream)
+		; /* conn = "none" */
+	else if (!stubby_stats_known(STUBBY_STATS_CONNS))
+		conn = "unknown";
+	else if (upstream->last_conn_opened_ns
+	    < trace->ns[STUBBY_TRACE_RECEIVED])
+		conn = "reused";
+	else if (upstream->transport != GETDNS_TRANSPORT_TLS)
+		conn = "new";
+	else if (!stubby_stats_known(STUBBY_STATS_TLS_RESUMED))
+		conn = "new-tls";
+	else if (upstream->last_tls_resumed_ns
+	    >= trace->ns[STUBBY_TRACE_RECEIVED])
+		conn = "new-tls-resumed";
+	else
+		conn = "new-tls-handshake";
+	stubby_log_always("Slow query: qname=%s "
+	    "qtype=%d rcode=%d upstream=%s conn=%s total=%.1fms "
+	    "schedule=%.1fms wait=%.1fms rtt=%.1fms reply=%.1fms\n",
+	    qname_str ? qname_str : "?", (int)qtype, (int)rcode,
+	    upstream ? upstream->name : "none", conn,
+	    stage_ms(trace, STUBBY_STAGE_TOTAL),
+	    stage_ms(trace, STUBBY_STAGE_SCHEDULE),
+	    stage_ms(trace, STUBBY_STAGE_WAIT),
+	    stage_ms(trace, STUBBY_STAGE_UPSTREAM),
+	    stage_ms(trace, STUBBY_STAGE_REPLY));
+	free(qname_str);
+}
+
+void stubby_trace_end(stubby_trace *trace, const getdns_dict *request,
+    uint32_t rcode, const stubby_upstream_stats *upstream)
+{
+	trace_histograms *h;
+	size_t i;
+
+	if (!trace_enabled || !trace->ns[STUBBY_TRACE_RECEIVED])
+		return;
+	trace->ns[STUBBY_TRACE_REPLIED] = stubby_trace_now();
+	h = trace_histograms_get();
+	for (i = 0; i < STUBBY_TRACE_STAGES; i++)
+		if (trace->ns[stage_stamps[i][0]]
+		&&  trace->ns[stage_stamps[i][1]])
+			stubby_histogram_observe(&h->stages[i],
+			    stubby_trace_stage_ns(trace, i));
+
+	if (slow_threshold_ns && stubby_trace_stage_ns(
+	    trace, STUBBY_STAGE_TOTAL) >= slow_threshold_ns) {
+		getdns_bindata *qname = NULL;
+		uint32_t qtype = 0;
+
+		(void) getdns_dict_get_int(request, "/question/qtype", &qtype);
+		if (getdns_dict_get_bindata(request, "/question/qname", &qname))
+			qname = NULL;
+		trace_log_slow(trace, qname, qtype, rcode, upstream);
+	}
+#ifdef HAVE_STUBBY_THREADS
+	if (trace->sampled)
+		trace_queue(trace, request, rcode,
+		    upstream ? upstream->name : NULL);
+#else
+	(void)request; (void)rcode; (void)upstream;
+#endif
+}
+
+void stubby_trace_fast(uint64_t received_ns, const uint8_t *qname,
+    size_t qname_len, uint32_t qtype, uint32_t rcode)
+{
+	stubby_trace trace;
+	getdns_bindata qname_bd;
+	trace_histograms *h;
+	uint64_t ns;
+
+	if (!trace_enabled || !received_ns)
+		return;
+	ns = stubby_trace_now() - received_ns;
+	h = trace_histograms_get();
+	stubby_histogram_observe(&h->stages[STUBBY_STAGE_TOTAL], ns);
+	stubby_histogram_observe(&h->fast, ns);
+#ifdef HAVE_STUBBY_THREADS
+	/* Not sampled, see stubby_trace_sample_next() */
+	if (atomic_load_explicit(&trace_running, memory_order_relaxed))
+		++trace_sample_count;
+#endif
+	if (!slow_threshold_ns || ns < slow_threshold_ns)
+		return;
+	(void) memset(&trace, 0, sizeof(trace));
+	trace.ns[STUBBY_TRACE_RECEIVED] = received_ns;
+	trace.ns[STUBBY_TRACE_REPLIED] = received_ns + ns;
+	qname_bd.size = qname_len;
+	qname_bd.data = (uint8_t *)qname;
+	trace_log_slow(&trace, &qname_bd, qtype, rcode, NULL);
+}
+
+void stubby_trace_metrics(gldns_buffer *buf)
+{
+	trace_histograms total, *h = histograms;
+	char labels[32];
+	size_t i, j;
+
+	if (!trace_enabled)
+		return;
+	if (shared_histograms) {
+		(void) memset(&total, 0, sizeof(total));
+		for (i = 0; i < n_shared; i++) {
+			for (j = 0; j < STUBBY_TRACE_STAGES; j++)
+				stubby_histogram_add(&total.stages[j],
+				    &shared_histograms[i].stages[j]);
+			stubby_histogram_add(&total.fast,
+			    &shared_histograms[i].fast);
+		}
+		h = &total;
+	}
+	(void) gldns_buffer_printf(buf,
+	    "# TYPE stubby_query_stage_seconds histogram\n"
+	    "# HELP stubby_query_stage_seconds Time spent by queries "
+	    "in each stage.\n");
+	for (i = 0; i < STUBBY_TRACE_STAGES; i++) {
+		(void) snprintf(labels, sizeof(labels),
+		    "stage=\"%s\"", stage_names[i]);
+		stubby_histogram_openmetrics(buf, "stubby_query_stage_seconds",
+		    labels, &h->stages[i]);
+	}
+	/* Queries answered on the fast path, also in the total */
+	stubby_histogram_openmetrics(buf, "stubby_query_stage_seconds",
+	    "stage=\"fast\"", &h->fast);
+}
+
+#ifdef HAVE_STUBBY_THREADS
+/* Chrome trace event format "complete" event, timestamps in microseconds */
+static void trace_write_event(FILE *fh, int *first, const char *name,
+    uint64_t id, uint64_t from_ns, uint64_t to_ns, const trace_record *rec)
+{
+	(void) fprintf(fh, "%s{\"name\":\"%s\",\"cat\":\"query\",\"ph\":\"X\","
+	    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%"PRIu64,
+	    *first ? "" : ",\n", name, (double)from_ns / 1000.0,
+	    (double)(to_ns - from_ns) / 1000.0, (int)getpid(), id);
+	if (rec)
+		(void) fprintf(fh, ",\"args\":{\"qname\":\"%s\",\"qtype\":%d,"
+		    "\"rcode\":%d,\"upstream\":\"%s\"}", rec->qname,
+		    (int)rec->qtype, (int)rec->rcode, rec->upstream);
+	(void) fputc('}', fh);
+	*first = 0;
+}
+
+static void trace_write(FILE *fh, int *first, const trace_record *rec)
+{
+	size_t i;
+
+	trace_write_event(fh, first, rec->qname, rec->id,
+	    rec->ns[STUBBY_TRACE_RECEIVED], rec->ns[STUBBY_TRACE_REPLIED], rec);
+	for (i = 0; i < STUBBY_TRACE_STAGES; i++) {
+		if (i == STUBBY_STAGE_TOTAL
+		||  !rec->ns[stage_stamps[i][0]]
+		||  rec->ns[stage_stamps[i][1]] < rec->ns[stage_stamps[i][0]])
+			continue;
+		trace_write_event(fh, first, stage_names[i], rec->id,
+		    rec->ns[stage_stamps[i][0]], rec->ns[stage_stamps[i][1]],
+		    NULL);
+	}
+}
+
+static void *trace_writer(void *arg)
+{
+	FILE *fh = (FILE *)arg;
+	trace_record rec;
+	uint64_t reported = 0, dropped;
+	long idle_usec = 0;
+	int first = 1;
+
+	(void) fputs("[\n", fh);
+	for (;;) {
+		if (stubby_ring_pop(trace_ring, &rec)) {
+			trace_write(fh, &first, &rec);
+			idle_usec = 0;
+			continue;
+		}
+		if ((dropped = stubby_ring_dropped(trace_ring)) != reported) {
+			stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+			    "%"PRIu64" query traces dropped\n",
+			    dropped - reported);
+			reported = dropped;
+		}
+		(void) fflush(fh);
+		if (!atomic_load_explicit(&trace_running, memory_order_acquire)) {
+			while (stubby_ring_pop(trace_ring, &rec))
+				trace_write(fh, &first, &rec);
+			break;
+		}
+		idle_usec = idle_usec ? idle_usec * 2 : 1000;
+		if (idle_usec > TRACE_MAX_IDLE_USEC)
+			idle_usec = TRACE_MAX_IDLE_USEC;
+		{
+			struct timespec ts = { 0, idle_usec * 1000 };
+			(void) nanosleep(&ts, NULL);
+		}
+	}
+	(void) fputs("\n]\n", fh);
+	(void) fclose(fh);
+	return NULL;
+}
+#endif
+
+void stubby_trace_start(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	FILE *fh;
+
+	if (!trace_file || atomic_load(&trace_running))
+		return;
+	if (!trace_ring && !(trace_ring = stubby_ring_create(
+	    TRACE_RING_SLOTS, sizeof(trace_record)))) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not allocate query trace ring\n");
+		return;
+	}
+	if (!(fh = fopen(trace_file, "w"))) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not open query trace file \"%s\": %s\n",
+		    trace_file, strerror(errno));
+		return;
+	}
+	atomic_store(&trace_running, 1);
+	if (pthread_create(&trace_thread, NULL, trace_writer, fh)) {
+		atomic_store(&trace_running, 0);
+		(void) fclose(fh);
+		stubby_local_log(NULL, 0, GETDNS_LOG_ERR,
+		    "Could not start query trace writer\n");
+	}
+#endif
+}
+
+void stubby_trace_stop(void)
+{
+#ifdef HAVE_STUBBY_THREADS
+	if (!atomic_load(&trace_running))
+		return;
+	atomic_store_explicit(&trace_running, 0, memory_order_release);
+	(void) pthread_join(trace_thread, NULL);
+#endif
+}
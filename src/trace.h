@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_TRACE_H
+#define _STUBBY_TRACE_H
+
+#include <stdint.h>
+#include <getdns/getdns.h>
+#include "sldns/sbuffer.h"
+#include "stats.h"
+
+/**
+ * Per query stage timing.
+ *
+ * Every query carries monotonic timestamps for the stages it goes
+ * through.  The durations in between are aggregated in per stage
+ * histograms (exported with the metrics) and, for a sampled fraction of
+ * the queries, written as Chrome trace events (chrome://tracing or
+ * https://ui.perfetto.dev) to a file by a separate thread:
+ *
+ *   query_trace:
+ *     file: "/var/log/stubby/trace.json"
+ *     sample_rate: 1000                  # trace 1 in every 1000 queries
+ *
+ * Queries taking longer than slow_query_threshold milliseconds are logged
+ * with their stage durations, through the (asynchronous) log.
+ */
+typedef enum stubby_trace_stamp {
+	/* The request is handed to incoming_request_handler() by getdns
+	 * directly after it was received, so this is also the receive time.
+	 */
+	STUBBY_TRACE_RECEIVED = 0,
+	STUBBY_TRACE_SCHEDULED,       /* getdns_general() returned        */
+	STUBBY_TRACE_UPSTREAM_SENT,   /* From the call_reporting run_time */
+	STUBBY_TRACE_UPSTREAM_REPLY,
+	STUBBY_TRACE_CALLBACK,        /* request_cb() entry               */
+	STUBBY_TRACE_REPLIED,         /* getdns_reply() returned          */
+	STUBBY_TRACE_STAMPS
+} stubby_trace_stamp;
+
+/* The durations between the stamps that are aggregated */
+typedef enum stubby_trace_stage {
+	STUBBY_STAGE_SCHEDULE = 0,    /* RECEIVED       - SCHEDULED       */
+	STUBBY_STAGE_WAIT,            /* SCHEDULED      - UPSTREAM_SENT   */
+	STUBBY_STAGE_UPSTREAM,        /* UPSTREAM_SENT  - UPSTREAM_REPLY  */
+	STUBBY_STAGE_REPLY,           /* CALLBACK       - REPLIED         */
+	STUBBY_STAGE_TOTAL,           /* RECEIVED       - REPLIED         */
+	STUBBY_TRACE_STAGES
+} stubby_trace_stage;
+
+typedef struct stubby_trace {
+	uint64_t ns[STUBBY_TRACE_STAMPS]; /* 0 when the stage was skipped */
+	int      sampled;
+} stubby_trace;
+
+getdns_return_t stubby_trace_config(const getdns_dict *config);
+
+/* 0 disables the slow query log */
+void stubby_trace_set_slow_threshold(uint32_t threshold_ms);
+
+/* Keep the stage histograms (also without a trace file) */
+void stubby_trace_enable(void);
+int stubby_trace_enabled(void);
+
+/* Before the workers are forked: keep the stage histograms of all workers
+ * in shared memory, so that the totals are shown.
+ */
+getdns_return_t stubby_trace_share(void);
+
+/* Start and stop the trace file writer thread */
+void stubby_trace_start(void);
+void stubby_trace_stop(void);
+
+/* Monotonic clock in nanoseconds */
+uint64_t stubby_trace_now(void);
+
+/* Start timing a query, decides whether it is sampled */
+void stubby_trace_begin(stubby_trace *trace);
+
+/* Whether the next query will be sampled for the trace file.  Sampled
+ * queries are traced through all stages, so the fast path leaves them.
+ */
+int stubby_trace_sample_next(void);
+
+/**
+ * Account a query answered on the fast path, received at received_ns
+ * (stubby_trace_now()) and answered now.  Its latency is added to the
+ * total and the fast stage histograms, it counts towards the trace
+ * sample rate and it is logged when it was slow.
+ * @param qname  the question name in wire format, not compressed
+ */
+void stubby_trace_fast(uint64_t received_ns, const uint8_t *qname,
+    size_t qname_len, uint32_t qtype, uint32_t rcode);
+
+void stubby_trace_mark(stubby_trace *trace, stubby_trace_stamp stamp);
+
+/**
+ * Set the upstream stamps from the run time getdns reported with the
+ * call_reporting extension.  getdns does not report the individual
+ * moments, so the upstream reply is taken to be the callback time and the
+ * upstream stage (which includes connection and TLS setup) to have
+ * started rtt_ms before that.
+ */
+void stubby_trace_upstream(stubby_trace *trace, uint32_t rtt_ms);
+
+/* Duration of a stage in nanoseconds, 0 when it was skipped */
+uint64_t stubby_trace_stage_ns(
+    const stubby_trace *trace, stubby_trace_stage stage);
+
+/**
+ * Stamp REPLIED, add the stage durations to the histograms, queue the
+ * trace events when the query was sampled and log the query when it was
+ * slow.
+ * @param upstream  the upstream that answered, or NULL
+ */
+void stubby_trace_end(stubby_trace *trace, const getdns_dict *request,
+    uint32_t rcode, const stubby_upstream_stats *upstream);
+
+/* Append the stage histograms in OpenMetrics text format */
+void stubby_trace_metrics(gldns_buffer *buf);
+
+#endif /* _STUBBY_TRACE_H */
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* For memfd_create() */
+#endif
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "upgrade.h"
+#include "server.h"
+#include "control.h"
+#include "metrics.h"
+#include "cache.h"
+#include "prefork.h"
+#include "log.h"
+#include "sldns/sbuffer.h"
+
+#if !defined(STUBBY_ON_WINDOWS) && !defined(GETDNS_ON_WINDOWS)
+
+/* The handoff from the old to the new stubby is a header:
+ *
+ *   "STUBBYUP" | version | flags | number of sockets | state length
+ *
+ * (all 32 bit, in network byte order) with the listening sockets attached.
+ * With UPGRADE_FLAG_STATE, one more descriptor is attached after them: an
+ * unnamed file with state length bytes of state, the answer cache encoded
+ * as a cache snapshot (see cache.h).  The state is not sent over the
+ * socket, so that the old stubby never waits for the new one to read it
+ * (which it only does once it parsed its configuration).  The new stubby
+ * then writes 'R' when it serves queries, and the old one answers 'D'
+ * when it stopped listening and closed its control and metrics sockets.
+ */
+#define UPGRADE_ENV            "STUBBY_UPGRADE_FD"
+#define UPGRADE_MAGIC          "STUBBYUP"
+#define UPGRADE_MAGIC_LEN      8
+#define UPGRADE_VERSION        2
+#define UPGRADE_HEADER_LEN     24
+#define UPGRADE_FLAG_ACTIVATED 1
+#define UPGRADE_FLAG_STATE     2
+#define UPGRADE_MAX_FDS        64 /* including the state */
+#define UPGRADE_READY_TIMEOUT  30000 /* for the new stubby to be ready */
+#define UPGRADE_DONE_TIMEOUT   5000  /* for the old stubby to stop */
+#define UPGRADE_DRAIN_POLL     100
+#define UPGRADE_DRAIN_TIMEOUT  10000 /* for queries in flight */
+
+static getdns_context *upgrade_context = NULL;
+static char **upgrade_argv = NULL;
+static stubby_upgrade_shutdown_func upgrade_shutdown = NULL;
+static getdns_eventloop *loop = NULL;
+static getdns_eventloop_event upgrade_event;
+static int upgrade_fd = -1;
+static pid_t upgrade_pid = 0;
+static int drain_polls = 0;
+
+void stubby_upgrade_init(getdns_context *context, char **argv,
+    stubby_upgrade_shutdown_func shutdown)
+{
+	upgrade_context = context;
+	upgrade_argv = argv;
+	upgrade_shutdown = shutdown;
+}
+
+/* The upgrade failed or was given up on; the old stubby carries on */
+static void upgrade_abort(const char *reason)
+{
+	int status;
+
+	stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_ERR,
+	    "Upgrade failed, continuing with the running stubby: %s\n",
+	    reason);
+	(void) loop->vmt->clear(loop, &upgrade_event);
+	(void) close(upgrade_fd);
+	upgrade_fd = -1;
+	if (upgrade_pid > 0 && waitpid(upgrade_pid, &status, WNOHANG) == 0)
+		(void) kill(upgrade_pid, SIGTERM);
+	upgrade_pid = 0;
+	loop = NULL;
+}
+
+static void drain_timeout_cb(void *userarg)
+{
+	size_t pending = stubby_server_pending();
+
+	(void)userarg;
+	if (pending && ++drain_polls < UPGRADE_DRAIN_TIMEOUT / UPGRADE_DRAIN_POLL)
+		return;
+
+	if (pending)
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "Exiting for the upgrade with %d "
+		    "queries unanswered\n", (int)pending);
+	else
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_NOTICE, "Handed over to stubby on pid %d, "
+		    "exiting\n", (int)upgrade_pid);
+	(void) loop->vmt->clear(loop, &upgrade_event);
+	(void) close(upgrade_fd);
+	upgrade_fd = -1;
+	if (upgrade_shutdown)
+		upgrade_shutdown();
+	exit(EXIT_SUCCESS);
+}
+
+static void upgrade_timeout_cb(void *userarg)
+{
+	(void)userarg;
+	upgrade_abort("the new stubby did not get ready in time");
+}
+
+static void upgrade_read_cb(void *userarg)
+{
+	char c;
+	ssize_t n;
+
+	(void)userarg;
+	if ((n = read(upgrade_fd, &c, 1)) < 0
+	&&  (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		upgrade_abort("the new stubby exited");
+		return;
+	}
+	if (c != 'R') {
+		upgrade_abort("unexpected message from the new stubby");
+		return;
+	}
+	/* The new stubby serves queries from now on */
+	stubby_server_drain();
+	stubby_metrics_stop();
+	stubby_control_stop();
+	if (write(upgrade_fd, "D", 1) != 1)
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "Could not tell the new stubby we "
+		    "stopped: %s\n", strerror(errno));
+
+	(void) loop->vmt->clear(loop, &upgrade_event);
+	(void) memset(&upgrade_event, 0, sizeof(upgrade_event));
+	upgrade_event.timeout_cb = drain_timeout_cb;
+	drain_polls = 0;
+	(void) loop->vmt->schedule(loop, -1, UPGRADE_DRAIN_POLL,
+	    &upgrade_event);
+}
+
+/* An unnamed file with the len bytes at state, or -1 */
+static int upgrade_state_fd(const uint8_t *state, size_t len)
+{
+	size_t pos;
+	ssize_t n;
+	FILE *fh;
+	int fd = -1;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("stubby-upgrade", MFD_CLOEXEC);
+#endif
+	if (fd < 0) {
+		if (!(fh = tmpfile()))
+			return -1;
+		fd = dup(fileno(fh));
+		(void) fclose(fh);
+		if (fd < 0)
+			return -1;
+		(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	for (pos = 0; pos < len; pos += (size_t)n) {
+		if ((n = write(fd, state + pos, len - pos)) < 0
+		&&  errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			(void) close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/* Send the handoff header in buf, with the descriptors attached.  It is
+ * small enough to never block on the new socketpair.
+ */
+static int upgrade_send(int fd, gldns_buffer *buf, const int *fds,
+    size_t n_fds)
+{
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	} cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t len = gldns_buffer_position(buf);
+	ssize_t n;
+
+	(void) memset(&msg, 0, sizeof(msg));
+	(void) memset(&cmsg, 0, sizeof(cmsg));
+	iov.iov_base = gldns_buffer_begin(buf);
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n_fds) {
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+		(void) memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof(int) * n_fds);
+	}
+	while ((n = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+		; /* pass */
+	if (n >= 0 && (size_t)n != len)
+		errno = EMSGSIZE;
+	return (size_t)n == len ? 0 : -1;
+}
+
+getdns_return_t stubby_upgrade_request(void)
+{
+	int fds[UPGRADE_MAX_FDS], sv[2], state_fd = -1;
+	size_t n_fds;
+	char fd_str[16];
+	gldns_buffer *buf;
+	getdns_return_t r;
+	size_t state_len = 0;
+
+	if (!upgrade_context || !upgrade_argv || !upgrade_argv[0])
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+	if (stubby_prefork_worker() >= 0) {
+		fprintf(stderr, "Upgrades are not done with workers\n");
+		return GETDNS_RETURN_NOT_IMPLEMENTED;
+	}
+	if (loop) {
+		fprintf(stderr, "An upgrade is in progress already\n");
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	if ((r = getdns_context_get_eventloop(upgrade_context, &loop)))
+		return r;
+
+	n_fds = stubby_server_listen_fds(fds, UPGRADE_MAX_FDS - 1);
+	if (!(buf = gldns_buffer_new(1024))) {
+		loop = NULL;
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	gldns_buffer_write(buf, UPGRADE_MAGIC, UPGRADE_MAGIC_LEN);
+	gldns_buffer_write_u32(buf, UPGRADE_VERSION);
+	gldns_buffer_write_u32(buf, stubby_server_socket_activated()
+	    ? UPGRADE_FLAG_ACTIVATED : 0);
+	gldns_buffer_write_u32(buf, (uint32_t)n_fds);
+	gldns_buffer_write_u32(buf, 0); /* State length, filled in below */
+	if (stubby_cache_enabled()) {
+		if ((r = stubby_cache_encode(buf))) {
+			gldns_buffer_free(buf);
+			loop = NULL;
+			return r;
+		}
+		state_len = gldns_buffer_position(buf) - UPGRADE_HEADER_LEN;
+		if ((state_fd = upgrade_state_fd(
+		    gldns_buffer_at(buf, UPGRADE_HEADER_LEN), state_len)) < 0)
+			stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+			    GETDNS_LOG_WARNING, "Not handing over the cache: "
+			    "%s\n", strerror(errno));
+		else {
+			fds[n_fds] = state_fd;
+			gldns_buffer_write_u32_at(buf, 12,
+			    gldns_buffer_read_u32_at(buf, 12)
+			    | UPGRADE_FLAG_STATE);
+			gldns_buffer_write_u32_at(buf, 20, (uint32_t)state_len);
+		}
+		gldns_buffer_set_position(buf, UPGRADE_HEADER_LEN);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		fprintf(stderr, "Could not create upgrade socket: %s\n",
+		    strerror(errno));
+		if (state_fd >= 0)
+			(void) close(state_fd);
+		gldns_buffer_free(buf);
+		loop = NULL;
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	(void) fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	if ((upgrade_pid = fork()) < 0) {
+		fprintf(stderr, "Could not fork for upgrade: %s\n",
+		    strerror(errno));
+		(void) close(sv[0]);
+		(void) close(sv[1]);
+		if (state_fd >= 0)
+			(void) close(state_fd);
+		gldns_buffer_free(buf);
+		loop = NULL;
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	if (upgrade_pid == 0) {
+		(void) snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+		(void) setenv(UPGRADE_ENV, fd_str, 1);
+		(void) signal(SIGHUP, SIG_DFL);
+		(void) signal(SIGUSR2, SIG_DFL);
+		(void) execvp(upgrade_argv[0], upgrade_argv);
+		fprintf(stderr, "Could not execute \"%s\" for upgrade: %s\n",
+		    upgrade_argv[0], strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	(void) close(sv[1]);
+	upgrade_fd = sv[0];
+	if (upgrade_send(upgrade_fd, buf,
+	    fds, n_fds + (state_fd >= 0)) < 0) {
+		if (state_fd >= 0)
+			(void) close(state_fd);
+		gldns_buffer_free(buf);
+		upgrade_abort(strerror(errno));
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	/* The new stubby has its own reference now */
+	if (state_fd >= 0)
+		(void) close(state_fd);
+	gldns_buffer_free(buf);
+	(void) fcntl(upgrade_fd, F_SETFL, O_NONBLOCK);
+
+	(void) memset(&upgrade_event, 0, sizeof(upgrade_event));
+	upgrade_event.read_cb = upgrade_read_cb;
+	upgrade_event.timeout_cb = upgrade_timeout_cb;
+	(void) loop->vmt->schedule(loop, upgrade_fd, UPGRADE_READY_TIMEOUT,
+	    &upgrade_event);
+	stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS, GETDNS_LOG_NOTICE,
+	    "Upgrading to a new stubby on pid %d, handing over %d "
+	    "socket(s)\n", (int)upgrade_pid, (int)n_fds);
+	return GETDNS_RETURN_GOOD;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t pos;
+	ssize_t n;
+
+	for (pos = 0; pos < len; pos += (size_t)n) {
+		if ((n = read(fd, (uint8_t *)buf + pos, len - pos)) < 0
+		&&  errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+int stubby_upgrade_receive(void)
+{
+	union {
+		struct cmsghdr hdr;
+		char           buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	} cmsg;
+	uint8_t header[UPGRADE_HEADER_LEN];
+	void *state;
+	int fds[UPGRADE_MAX_FDS], state_fd = -1;
+	struct cmsghdr *c;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t n_fds = 0, state_len, i;
+	uint32_t flags;
+	getdns_return_t r;
+	const char *e;
+	char *ep;
+	long fd;
+	ssize_t n;
+
+	if (!(e = getenv(UPGRADE_ENV)))
+		return 0;
+	fd = strtol(e, &ep, 10);
+	(void) unsetenv(UPGRADE_ENV);
+	if (*ep || fd < 0 || fd > 65535) {
+		fprintf(stderr, "Invalid %s: \"%s\"\n", UPGRADE_ENV, e);
+		return -1;
+	}
+	upgrade_fd = (int)fd;
+	(void) fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+
+	(void) memset(&msg, 0, sizeof(msg));
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	while ((n = recvmsg(upgrade_fd, &msg, 0)) < 0 && errno == EINTR)
+		; /* pass */
+	if (n <= 0)
+		goto error;
+
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		n_fds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n_fds > UPGRADE_MAX_FDS)
+			n_fds = UPGRADE_MAX_FDS;
+		(void) memcpy(fds, CMSG_DATA(c), sizeof(int) * n_fds);
+	}
+	if ((size_t)n < sizeof(header)
+	&&  read_full(upgrade_fd, header + n, sizeof(header) - n) < 0)
+		goto error;
+
+	flags = gldns_read_uint32(header + 12);
+	if (memcmp(header, UPGRADE_MAGIC, UPGRADE_MAGIC_LEN)
+	||  gldns_read_uint32(header + 8) != UPGRADE_VERSION
+	||  gldns_read_uint32(header + 16)
+	    + !!(flags & UPGRADE_FLAG_STATE) != n_fds) {
+		fprintf(stderr, "Incompatible upgrade from the running "
+		    "stubby\n");
+		for (i = 0; i < n_fds; i++)
+			(void) close(fds[i]);
+		goto error;
+	}
+	if (flags & UPGRADE_FLAG_STATE)
+		state_fd = fds[--n_fds];
+	(void) stubby_server_adopt(fds, n_fds, flags & UPGRADE_FLAG_ACTIVATED);
+
+	if (state_fd >= 0 && (state_len = gldns_read_uint32(header + 20))) {
+		if ((state = mmap(NULL, state_len, PROT_READ, MAP_PRIVATE,
+		    state_fd, 0)) == MAP_FAILED)
+			fprintf(stderr, "Could not take over the cache: %s\n",
+			    strerror(errno));
+		else {
+			if ((r = stubby_cache_decode(state, state_len)))
+				fprintf(stderr, "Could not take over the "
+				    "cache: %s\n", getdns_get_errorstr_by_id(r));
+			(void) munmap(state, state_len);
+		}
+	}
+	if (state_fd >= 0)
+		(void) close(state_fd);
+	return 1;
+
+error:
+	fprintf(stderr, "Could not receive the upgrade from the running "
+	    "stubby\n");
+	(void) close(upgrade_fd);
+	upgrade_fd = -1;
+	return -1;
+}
+
+int stubby_upgrade_receiving(void)
+{
+	return upgrade_fd >= 0 && !loop;
+}
+
+void stubby_upgrade_ready(void)
+{
+	struct pollfd pfd;
+	char state[64], c;
+
+	if (upgrade_fd < 0 || loop) {
+		stubby_server_notify("READY=1");
+		return;
+	}
+	pfd.fd = upgrade_fd;
+	pfd.events = POLLIN;
+	if (write(upgrade_fd, "R", 1) != 1
+	||  poll(&pfd, 1, UPGRADE_DONE_TIMEOUT) <= 0
+	||  read(upgrade_fd, &c, 1) != 1 || c != 'D')
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_WARNING, "The previous stubby did not "
+		    "confirm it stopped\n");
+	else
+		stubby_local_log(NULL, GETDNS_LOG_UPSTREAM_STATS,
+		    GETDNS_LOG_NOTICE, "Took over from the previous stubby\n");
+	(void) close(upgrade_fd);
+	upgrade_fd = -1;
+
+	(void) snprintf(state, sizeof(state), "MAINPID=%d\nREADY=1",
+	    (int)getpid());
+	stubby_server_notify(state);
+}
+
+#else /* STUBBY_ON_WINDOWS */
+
+void stubby_upgrade_init(getdns_context *context, char **argv,
+    stubby_upgrade_shutdown_func shutdown)
+{
+	(void)context; (void)argv; (void)shutdown;
+}
+
+getdns_return_t stubby_upgrade_request(void)
+{
+	return GETDNS_RETURN_NOT_IMPLEMENTED;
+}
+
+int stubby_upgrade_receive(void)
+{
+	return 0;
+}
+
+int stubby_upgrade_receiving(void)
+{
+	return 0;
+}
+
+void stubby_upgrade_ready(void)
+{
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_UPGRADE_H
+#define _STUBBY_UPGRADE_H
+
+#include <getdns/getdns.h>
+
+/**
+ * Zero-downtime upgrade to a new stubby binary.
+ *
+ * On SIGUSR2 or the "upgrade" control command the running stubby starts
+ * the stubby binary again, with the same arguments, and hands its listening
+ * sockets (SCM_RIGHTS) over a unix socketpair, together with an unnamed
+ * file holding its answer cache.  The new stubby reads its configuration,
+ * adopts the sockets and the cache and serves queries.  When
+ * it is ready it tells the old stubby, which stops listening, answers the
+ * queries it already received and exits.  Queries keep arriving in the
+ * socket buffers the whole time, so none are refused.
+ *
+ * When the new stubby fails before it is ready, the old one keeps running
+ * as if nothing happened.
+ */
+
+/* Function that stops all of stubby's services, before the old stubby
+ * exits.
+ */
+typedef void (*stubby_upgrade_shutdown_func)(void);
+
+/* Remember the arguments to start the new stubby with.  The upgrade is
+ * done on the context's event loop.
+ */
+void stubby_upgrade_init(getdns_context *context, char **argv,
+    stubby_upgrade_shutdown_func shutdown);
+
+/* Start the new stubby */
+getdns_return_t stubby_upgrade_request(void);
+
+/* In the new stubby: receive and adopt the sockets handed over.  Returns
+ * 1 when started for an upgrade, 0 when not, and -1 on failure, in which
+ * case the new stubby should exit and leave the old one running.
+ */
+int stubby_upgrade_receive(void);
+int stubby_upgrade_receiving(void);
+
+/* In the new stubby: tell the old stubby to stop and wait until it did.
+ * Must be called once queries are served, and before services that bind
+ * something the old stubby still has (metrics and control sockets) are
+ * started.  Tells the service manager about the new main process too.
+ */
+void stubby_upgrade_ready(void);
+
+#endif /* _STUBBY_UPGRADE_H */
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <getdns/getdns.h>
+#include <getdns/getdns_extra.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "log.h"
+#include "warmup.h"
+
+#define WARMUP_TICK_MS         100
+#define WARMUP_DEFAULT_QPS     100
+#define WARMUP_MAX_QPS         100000
+#define WARMUP_DEFAULT_FLIGHT  20
+#define WARMUP_MAX_FLIGHT      10000
+#define WARMUP_MAX_LINE        1024
+
+typedef struct warmup_query {
+	char     *name;
+	uint16_t  qtype;
+} warmup_query;
+
+static warmup_query *queries = NULL;
+static size_t n_queries = 0;
+static size_t queries_size = 0;
+static size_t next_query = 0;
+static size_t in_flight = 0;
+static size_t failed = 0;
+static uint32_t qps = WARMUP_DEFAULT_QPS;
+static uint32_t max_in_flight = WARMUP_DEFAULT_FLIGHT;
+static uint64_t ticks = 0;
+
+static stubby_warmup_query_func send_query = NULL;
+static getdns_eventloop *loop = NULL;
+static getdns_eventloop_event tick_event;
+
+static const struct {
+	const char *name;
+	uint16_t    qtype;
+} qtypes[] = {
+	{ "A",      GETDNS_RRTYPE_A      }, { "NS",     GETDNS_RRTYPE_NS     },
+	{ "CNAME",  GETDNS_RRTYPE_CNAME  }, { "SOA",    GETDNS_RRTYPE_SOA    },
+	{ "PTR",    GETDNS_RRTYPE_PTR    }, { "MX",     GETDNS_RRTYPE_MX     },
+	{ "TXT",    GETDNS_RRTYPE_TXT    }, { "AAAA",   GETDNS_RRTYPE_AAAA   },
+	{ "SRV",    GETDNS_RRTYPE_SRV    }, { "NAPTR",  GETDNS_RRTYPE_NAPTR  },
+	{ "DS",     GETDNS_RRTYPE_DS     }, { "DNSKEY", GETDNS_RRTYPE_DNSKEY },
+	{ "TLSA",   GETDNS_RRTYPE_TLSA   }, { "SVCB",   64                   },
+	{ "HTTPS",  65                   }, { "CAA",    GETDNS_RRTYPE_CAA    },
+	{ NULL, 0 }
+};
+
+static int prefix_is(const char *str, size_t len, const char *prefix)
+{
+	for (; *prefix; prefix++, str++, len--)
+		if (!len || toupper((unsigned char)*str) != *prefix)
+			return 0;
+	return 1;
+}
+
+static int parse_qtype(const char *str, size_t len, uint16_t *qtype)
+{
+	char *end;
+	unsigned long n;
+	size_t i;
+
+	for (i = 0; qtypes[i].name; i++) {
+		if (strlen(qtypes[i].name) == len
+		&&  prefix_is(str, len, qtypes[i].name)) {
+			*qtype = qtypes[i].qtype;
+			return 0;
+		}
+	}
+	if (len <= 4 || !prefix_is(str, len, "TYPE")
+	||  !isdigit((unsigned char)str[4]))
+		return -1;
+	n = strtoul(str + 4, &end, 10);
+	if (end != str + len || n == 0 || n > 65535)
+		return -1;
+	*qtype = (uint16_t)n;
+	return 0;
+}
+
+static getdns_return_t add_query(const char *name, size_t len, uint16_t qtype)
+{
+	warmup_query *q;
+
+	if (n_queries == queries_size) {
+		size_t size = queries_size ? queries_size * 2 : 64;
+
+		if (!(q = realloc(queries, size * sizeof(warmup_query))))
+			return GETDNS_RETURN_MEMORY_ERROR;
+		queries = q;
+		queries_size = size;
+	}
+	q = &queries[n_queries];
+	if (!(q->name = malloc(len + 1)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	(void) memcpy(q->name, name, len);
+	q->name[len] = 0;
+	q->qtype = qtype;
+	n_queries++;
+	return GETDNS_RETURN_GOOD;
+}
+
+static void free_queries(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_queries; i++)
+		free(queries[i].name);
+	free(queries);
+	queries = NULL;
+	n_queries = queries_size = next_query = 0;
+}
+
+#define WHITESPACE " \t\r\n"
+
+static getdns_return_t read_file(const char *fn)
+{
+	char line[WARMUP_MAX_LINE], *pos, *name;
+	size_t name_len, len;
+	unsigned line_nr = 0;
+	getdns_return_t r = GETDNS_RETURN_GOOD;
+	uint16_t qtype;
+	int n_qtypes;
+	FILE *fh;
+
+	if (!(fh = fopen(fn, "r"))) {
+		fprintf(stderr, "Could not open cache_warmup file "
+		    "\"%s\": %s\n", fn, strerror(errno));
+		return GETDNS_RETURN_IO_ERROR;
+	}
+	while (!r && fgets(line, sizeof(line), fh)) {
+		line_nr++;
+		if ((pos = strchr(line, '#')))
+			*pos = 0;
+		pos = line + strspn(line, WHITESPACE);
+		if (!(name_len = strcspn(pos, WHITESPACE)))
+			continue;
+		name = pos;
+		pos += name_len;
+		for (n_qtypes = 0; !r; n_qtypes++) {
+			pos += strspn(pos, WHITESPACE);
+			if (!(len = strcspn(pos, WHITESPACE)))
+				break;
+			if (parse_qtype(pos, len, &qtype)) {
+				fprintf(stderr, "Unknown query type "
+				    "\"%.*s\" on line %u of cache_warmup "
+				    "file \"%s\"\n",
+				    (int)len, pos, line_nr, fn);
+				r = GETDNS_RETURN_INVALID_PARAMETER;
+			} else
+				r = add_query(name, name_len, qtype);
+			pos += len;
+		}
+		if (!r && n_qtypes == 0
+		&&  !(r = add_query(name, name_len, GETDNS_RRTYPE_A)))
+			r = add_query(name, name_len, GETDNS_RRTYPE_AAAA);
+	}
+	(void) fclose(fh);
+	return r;
+}
+
+getdns_return_t stubby_warmup_config(const getdns_dict *config)
+{
+	getdns_bindata *bindata;
+	getdns_return_t r;
+	char *fn;
+	uint32_t n;
+
+	if (!getdns_dict_get_int(config, "queries_per_second", &n)) {
+		if (n == 0 || n > WARMUP_MAX_QPS) {
+			fprintf(stderr, "cache_warmup queries_per_second must "
+			        "be between 1 and %d\n", WARMUP_MAX_QPS);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		qps = n;
+	}
+	if (!getdns_dict_get_int(config, "max_in_flight", &n)) {
+		if (n == 0 || n > WARMUP_MAX_FLIGHT) {
+			fprintf(stderr, "cache_warmup max_in_flight must be "
+			        "between 1 and %d\n", WARMUP_MAX_FLIGHT);
+			return GETDNS_RETURN_INVALID_PARAMETER;
+		}
+		max_in_flight = n;
+	}
+	if (getdns_dict_get_bindata(config, "file", &bindata)) {
+		fprintf(stderr, "cache_warmup needs a file\n");
+		return GETDNS_RETURN_INVALID_PARAMETER;
+	}
+	if (!(fn = malloc(bindata->size + 1)))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	(void) memcpy(fn, bindata->data, bindata->size);
+	fn[bindata->size] = 0;
+
+	free_queries();
+	if ((r = read_file(fn)))
+		free_queries();
+	free(fn);
+	return r;
+}
+
+static void warmup_finish(void)
+{
+	stubby_local_log(NULL, 0, GETDNS_LOG_INFO,
+	    "Cache warm-up sent %d queries in %d ms\n",
+	    (int)(n_queries - failed), (int)(ticks * WARMUP_TICK_MS));
+	(void) loop->vmt->clear(loop, &tick_event);
+	loop = NULL;
+	free_queries();
+}
+
+static void tick_timeout_cb(void *userarg)
+{
+	/* The number of queries that may have been sent by the end of this
+	 * tick, so that rates below one query per tick work too.
+	 */
+	uint64_t allowed = (ticks + 1) * qps * WARMUP_TICK_MS / 1000;
+
+	(void)userarg;
+	(void) loop->vmt->clear(loop, &tick_event);
+	ticks++;
+	while (next_query < n_queries && next_query < allowed
+	&&     in_flight < max_in_flight) {
+		warmup_query *q = &queries[next_query++];
+
+		/* Counted first, because it may be answered from within */
+		in_flight++;
+		if (send_query(q->name, q->qtype)) {
+			in_flight--;
+			failed++;
+		}
+		if (!loop)
+			return; /* Finished from within */
+	}
+	if (next_query == n_queries && !in_flight)
+		warmup_finish();
+	else
+		(void) loop->vmt->schedule(loop, -1, WARMUP_TICK_MS,
+		    &tick_event);
+}
+
+void stubby_warmup_start(getdns_context *context,
+    stubby_warmup_query_func query)
+{
+	if (!n_queries || loop)
+		return;
+	if (!stubby_cache_enabled()) {
+		stubby_local_log(NULL, 0, GETDNS_LOG_WARNING,
+		    "Not warming up the cache, because there is no cache\n");
+		free_queries();
+		return;
+	}
+	if (getdns_context_get_eventloop(context, &loop)) {
+		loop = NULL;
+		return;
+	}
+	send_query = query;
+	ticks = 0;
+	failed = 0;
+	(void) memset(&tick_event, 0, sizeof(tick_event));
+	tick_event.timeout_cb = tick_timeout_cb;
+	(void) loop->vmt->schedule(loop, -1, 0, &tick_event);
+}
+
+void stubby_warmup_done(void)
+{
+	if (in_flight)
+		in_flight--;
+	if (loop && !in_flight && next_query == n_queries)
+		warmup_finish();
+}
+
+void stubby_warmup_stop(void)
+{
+	if (!loop)
+		return;
+	(void) loop->vmt->clear(loop, &tick_event);
+	loop = NULL;
+	free_queries();
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019, NLNet Labs, Sinodun Internet Technologies Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the names of the copyright holders nor the
+ *   names of its contributors may be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL Verisign, Inc. BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STUBBY_WARMUP_H
+#define _STUBBY_WARMUP_H
+
+#include <stdint.h>
+#include <getdns/getdns.h>
+
+/**
+ * Cache warm-up: resolve a list of names when stubby starts, so that the
+ * answers to a well known set of hot names are cached from the start.
+ *
+ *   cache_warmup:
+ *     file: "/etc/stubby/warmup.list"
+ *     queries_per_second: 100
+ *     max_in_flight: 20
+ *
+ * The file has a name per line, optionally followed by the query types to
+ * resolve it for (A and AAAA when none are given), as mnemonics or as
+ * TYPEnnn.  Empty lines and everything after a '#' are ignored:
+ *
+ *   example.com  A AAAA HTTPS
+ *   _ldap._tcp.example.com SRV
+ *
+ * The queries are sent alongside the traffic from clients, in batches
+ * every 100 milliseconds, at no more than queries_per_second and with no
+ * more than max_in_flight outstanding.  Warm-up needs the cache.
+ */
+getdns_return_t stubby_warmup_config(const getdns_dict *config);
+
+/* Send a warm-up query for qname, whose answer is to be cached */
+typedef getdns_return_t (*stubby_warmup_query_func)(
+    const char *qname, uint16_t qtype);
+
+void stubby_warmup_start(getdns_context *context,
+    stubby_warmup_query_func query);
+
+/* A query sent with the query func was answered */
+void stubby_warmup_done(void);
+
+void stubby_warmup_stop(void);
+
+#endif /* _STUBBY_WARMUP_H */
@@ -27,30 +27,37 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "config.h"
 
 #include <yaml.h>
+#include <getdns/getdns_extra.h>
 
-#ifndef yaml_string_to_json_string
-#include "gldns/gbuffer.h"
-#else
-#include "sldns/sbuffer.h"
-#endif
-#include "convert_yaml_to_json.h"
+#include "convert_yaml_to_dict.h"
 
-static int process_yaml_stream(yaml_parser_t *, yaml_event_t *, gldns_buffer *);
+/* Where a value is stored: under key in dict, or at index in list */
+typedef struct yaml_target {
+	getdns_dict *dict;
+	const char  *key;
+	getdns_list *list;
+	size_t       index;
+} yaml_target;
 
-static int process_yaml_document(yaml_parser_t *, yaml_event_t *, gldns_buffer *);
+static int yaml_parse_to_dict(yaml_parser_t *, getdns_dict *);
 
-static int process_yaml_mapping(yaml_parser_t *, yaml_event_t *, gldns_buffer *);
+static int process_yaml_stream(yaml_parser_t *, yaml_event_t *, getdns_dict *);
 
-static int process_yaml_sequence(yaml_parser_t *, yaml_event_t *, gldns_buffer *);
+static int process_yaml_document(yaml_parser_t *, yaml_event_t *, getdns_dict *);
 
-static int process_yaml_value(yaml_parser_t *, yaml_event_t *, gldns_buffer *);
+static int process_yaml_mapping(yaml_parser_t *, yaml_event_t *, getdns_dict *);
 
-static int output_scalar(yaml_event_t *, gldns_buffer *);
+static int process_yaml_sequence(yaml_parser_t *, yaml_event_t *, getdns_list *);
+
+static int process_yaml_value(yaml_parser_t *, yaml_event_t *, yaml_target *);
+
+static int set_scalar(yaml_event_t *, yaml_target *);
 
 static void report_parser_error(yaml_parser_t *);
 
@@ -58,82 +65,168 @@ static char* event_type_string(yaml_event_type_t);
 
 /* public functions */
 
-char *
-yaml_string_to_json_string(const char *instr)
+getdns_return_t
+yaml_string_to_dict(const char *instr, getdns_dict **dict)
 {
-	assert(instr);
+	yaml_parser_t parser;
+	int res;
 
-	gldns_buffer *buf;
-	char* json = NULL;
+	if (!instr || !dict)
+		return GETDNS_RETURN_INVALID_PARAMETER;
 
-	buf = gldns_buffer_new(8192);
-	if (!buf) {
-		fprintf(stderr, "Could not assign buffer for json output");
-		return NULL;
+	memset(&parser, 0, sizeof(parser));
+	if (!yaml_parser_initialize(&parser)) {
+		fprintf(stderr, "Could not initialize the parser object\n");
+		return GETDNS_RETURN_MEMORY_ERROR;
 	}
-	
+	yaml_parser_set_input_string(&parser, (const unsigned char *) instr, strlen(instr));
+
+	if (!(*dict = getdns_dict_create())) {
+		yaml_parser_delete(&parser);
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	res = yaml_parse_to_dict(&parser, *dict);
+	yaml_parser_delete(&parser);
+	if (res != 0) {
+		getdns_dict_destroy(*dict);
+		*dict = NULL;
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+getdns_return_t
+yaml_file_to_dict(FILE *fh, getdns_dict **dict)
+{
 	yaml_parser_t parser;
-	yaml_event_t event;
+	int res;
 
-	memset(&parser, 0, sizeof(parser));
-	memset(&event, 0, sizeof(event));
+	if (!fh || !dict)
+		return GETDNS_RETURN_INVALID_PARAMETER;
 
+	memset(&parser, 0, sizeof(parser));
 	if (!yaml_parser_initialize(&parser)) {
 		fprintf(stderr, "Could not initialize the parser object\n");
-		goto return_error;
+		return GETDNS_RETURN_MEMORY_ERROR;
 	}
+	/* libyaml reads the file in blocks, it is never held in memory */
+	yaml_parser_set_input_file(&parser, fh);
 
-	/* Set the parser parameters. */
-	yaml_parser_set_input_string(&parser, (const unsigned char *) instr, strlen(instr));
+	if (!(*dict = getdns_dict_create())) {
+		yaml_parser_delete(&parser);
+		return GETDNS_RETURN_MEMORY_ERROR;
+	}
+	res = yaml_parse_to_dict(&parser, *dict);
+	yaml_parser_delete(&parser);
+	if (res != 0) {
+		getdns_dict_destroy(*dict);
+		*dict = NULL;
+		return GETDNS_RETURN_GENERIC_ERROR;
+	}
+	return GETDNS_RETURN_GOOD;
+}
+
+/* local functions */
+
+static int
+yaml_parse_to_dict(yaml_parser_t *parser, getdns_dict *dict)
+{
+	yaml_event_t event;
+	int res = -1;
+
+	memset(&event, 0, sizeof(event));
 
 	/* Get the first event. */
-	if (!yaml_parser_parse(&parser, &event)) {
-		report_parser_error(&parser);
-		goto return_error;
+	if (!yaml_parser_parse(parser, &event)) {
+		report_parser_error(parser);
+		return -1;
 	}
 
 	/* First event should be stream start. */
 	if (event.type != YAML_STREAM_START_EVENT) {
 		fprintf(stderr, "Event error: wrong type of event: %d\n", event.type);
-		goto return_error;
-	}
-
-	if (process_yaml_stream(&parser, &event, buf) != 0) {
-		goto return_error;
-	}
+	} else
+		res = process_yaml_stream(parser, &event, dict);
 
 	yaml_event_delete(&event);
-	yaml_parser_delete(&parser);
-	
-	/*
-	 * gldns_buffer_export() returns a pointer to the data and
-	 * sets a flag to prevent it from being deleted by
-	 * gldns_buffer_free()
-	 */
-	json = (char *) gldns_buffer_export(buf);
-	gldns_buffer_free(buf);
+	return res;
+}
 
-	return json;
+/* Values are stored in place: an empty dict or list is put in the parent
+ * first and then filled through the pointer the parent returns, so nested
+ * data is never copied.
+ */
+static getdns_return_t
+target_set_int(yaml_target *target, uint32_t value)
+{
+	return target->dict
+	    ? getdns_dict_set_int(target->dict, target->key, value)
+	    : getdns_list_set_int(target->list, target->index, value);
+}
 
-return_error:
+static getdns_return_t
+target_set_bindata(yaml_target *target, const getdns_bindata *value)
+{
+	return target->dict
+	    ? getdns_dict_set_bindata(target->dict, target->key, value)
+	    : getdns_list_set_bindata(target->list, target->index, value);
+}
 
-	yaml_event_delete(&event);
-	yaml_parser_delete(&parser);
-	gldns_buffer_free(buf);
+static getdns_return_t
+target_set_dict(yaml_target *target, const getdns_dict *value)
+{
+	return target->dict
+	    ? getdns_dict_set_dict(target->dict, target->key, value)
+	    : getdns_list_set_dict(target->list, target->index, value);
+}
 
-	return NULL;
+static getdns_return_t
+target_set_list(yaml_target *target, const getdns_list *value)
+{
+	return target->dict
+	    ? getdns_dict_set_list(target->dict, target->key, value)
+	    : getdns_list_set_list(target->list, target->index, value);
 }
 
-/* local functions */
+static getdns_return_t
+target_new_dict(yaml_target *target, getdns_dict **child)
+{
+	static getdns_dict *empty = NULL;
+	getdns_return_t r;
+
+	if (!empty && !(empty = getdns_dict_create()))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	if ((r = target_set_dict(target, empty)))
+		return r;
+	return target->dict
+	    ? getdns_dict_get_dict(target->dict, target->key, child)
+	    : getdns_list_get_dict(target->list, target->index, child);
+}
+
+static getdns_return_t
+target_new_list(yaml_target *target, getdns_list **child)
+{
+	static getdns_list *empty = NULL;
+	getdns_return_t r;
+
+	if (!empty && !(empty = getdns_list_create()))
+		return GETDNS_RETURN_MEMORY_ERROR;
+	if ((r = target_set_list(target, empty)))
+		return r;
+	return target->dict
+	    ? getdns_dict_get_list(target->dict, target->key, child)
+	    : getdns_list_get_list(target->list, target->index, child);
+}
 
 int
-process_yaml_stream(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf)
+process_yaml_stream(yaml_parser_t *parser, yaml_event_t *event, getdns_dict *dict)
 {
 	assert(parser);
 	assert(event);
-	assert(buf);
+	assert(dict);
 
 	int done = 0;
+	int documents = 0;
 
 	while (!done)
 	{
@@ -154,7 +247,11 @@ process_yaml_stream(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *bu
 
 		case YAML_DOCUMENT_START_EVENT:
 
-			if (process_yaml_document(parser, event, buf) != 0) {
+			if (documents++) {
+				fprintf(stderr, "Document error: only a single document is supported\n");
+				return -1;
+			}
+			if (process_yaml_document(parser, event, dict) != 0) {
 				return -1;   
 			}
 			break;
@@ -178,15 +275,19 @@ process_yaml_stream(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *bu
 			break;
 		}
 	}
+	if (!documents) {
+		fprintf(stderr, "Document error: no document\n");
+		return -1;
+	}
 	return 0;
 }
 
 int
-process_yaml_document(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf)
+process_yaml_document(yaml_parser_t *parser, yaml_event_t *event, getdns_dict *dict)
 {
 	assert(parser);
 	assert(event);
-	assert(buf);
+	assert(dict);
 
 	int done = 0;
 
@@ -209,22 +310,7 @@ process_yaml_document(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *
 
 		case YAML_MAPPING_START_EVENT:
 			
-			if (process_yaml_mapping(parser, event, buf) != 0) {
-				return -1;
-			}
-			break;
-
-		case YAML_SEQUENCE_START_EVENT:
-			
-			if (process_yaml_sequence(parser, event, buf) != 0) {
-				return -1;   
-			}
-			break;
-
-		case YAML_SCALAR_EVENT:
-			
-			if (output_scalar(event, buf) != 0) {
-				fprintf(stderr, "Value error: Error outputting scalar\n");
+			if (process_yaml_mapping(parser, event, dict) != 0) {
 				return -1;
 			}
 			break;
@@ -233,6 +319,8 @@ process_yaml_document(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *
 		case YAML_STREAM_END_EVENT:
 		case YAML_DOCUMENT_START_EVENT:
 		case YAML_ALIAS_EVENT:
+		case YAML_SCALAR_EVENT:
+		case YAML_SEQUENCE_START_EVENT:
 		case YAML_SEQUENCE_END_EVENT:
 		case YAML_MAPPING_END_EVENT:
 
@@ -250,18 +338,20 @@ process_yaml_document(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *
 }
 
 int
-process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf)
+process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, getdns_dict *dict)
 {
 	assert(parser);
 	assert(event);
-	assert(buf);
+	assert(dict);
 	
 	int done = 0;
-	int members = 0;
+	yaml_event_t key_event;
+	yaml_target target;
+
+	memset(&key_event, 0, sizeof(key_event));
+	memset(&target, 0, sizeof(target));
+	target.dict = dict;
 
-	if ( gldns_buffer_printf(buf, "{ ") == -1 )
-		return -1;
-	
 	while (!done)
 	{
 		/* Delete the event that brought us here */
@@ -274,21 +364,11 @@ process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *b
 		}
 
 		if (event->type == YAML_SCALAR_EVENT) {
-			if (members)
-				if (gldns_buffer_printf(buf, ", ") == -1)
-					return -1;
-			
-			if (output_scalar(event, buf) != 0) {
-				fprintf(stderr, "Mapping error: Error outputting key\n");
-				return -1;
-			}
-			if (gldns_buffer_printf(buf, ": ") == -1)
-				return -1;
-			
-			members = 1;
+			/* Keep the key until the value is stored */
+			key_event = *event;
+			memset(event, 0, sizeof(*event));
+			target.key = (const char *) key_event.data.scalar.value;
 		} else if (event->type == YAML_MAPPING_END_EVENT) {
-			if (gldns_buffer_printf(buf, " }") == -1)
-				return -1;
 			done = 1;
 			continue;
 		} else {
@@ -298,12 +378,10 @@ process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *b
 			return -1;
 		}
 		
-		/* Delete the event that brought us here */
-		yaml_event_delete(event);
-
 		/* Get the next event. */
 		if (!yaml_parser_parse(parser, event)) {
 			report_parser_error(parser);
+			yaml_event_delete(&key_event);
 			return -1;
 		}
 
@@ -311,7 +389,8 @@ process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *b
 		case YAML_SCALAR_EVENT:
 		case YAML_SEQUENCE_START_EVENT:
 		case YAML_MAPPING_START_EVENT:
-			if (process_yaml_value(parser, event, buf) != 0) {
+			if (process_yaml_value(parser, event, &target) != 0) {
+				yaml_event_delete(&key_event);
 				return -1;   
 			}
 			break;
@@ -326,28 +405,30 @@ process_yaml_mapping(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *b
 			fprintf(stderr,
 				"Event error: %s. Expected YAML_MAPPING_START_EVENT, YAML_SEQUENCE_START_EVENT or YAML_SCALAR_EVENT.\n",
 				event_type_string(event->type));
+			yaml_event_delete(&key_event);
 			return -1;
 
 		default:
 			/* NOTREACHED */
 			break;
 		}
+		yaml_event_delete(&key_event);
 	}
 	return 0;
 }
 
 int
-process_yaml_sequence(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf)
+process_yaml_sequence(yaml_parser_t *parser, yaml_event_t *event, getdns_list *list)
 {	
 	assert(parser);
 	assert(event);
-	assert(buf);
+	assert(list);
 	
 	int done = 0;
-	int elements = 0;
+	yaml_target target;
 
-	if ( gldns_buffer_printf(buf, "[ ") == -1 )
-		return -1;
+	memset(&target, 0, sizeof(target));
+	target.list = list;
    
 	while (!done)
 	{
@@ -365,19 +446,13 @@ process_yaml_sequence(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *
 		case YAML_SEQUENCE_START_EVENT:
 		case YAML_MAPPING_START_EVENT:
 
-			if (elements)
-				if (gldns_buffer_printf(buf, ", ") == -1)
-					return -1;
-
-			if (process_yaml_value(parser, event, buf) != 0)
+			if (process_yaml_value(parser, event, &target) != 0)
 				return -1;   
 
-			elements = 1;
+			target.index++;
 			break;
 
 		case YAML_SEQUENCE_END_EVENT:
-			if (gldns_buffer_printf(buf, " ]") == -1)
-				return -1;
 			done = 1;
 			break;
 
@@ -401,28 +476,34 @@ process_yaml_sequence(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *
 }
 
 int
-process_yaml_value(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf)
+process_yaml_value(yaml_parser_t *parser, yaml_event_t *event, yaml_target *target)
 {	
 	assert(parser);
 	assert(event);
-	assert(buf);
+	assert(target);
+
+	getdns_dict *dict;
+	getdns_list *list;
 	
 	switch (event->type) {
 	case YAML_SCALAR_EVENT:
-		if (output_scalar(event, buf) != 0) {
-			fprintf(stderr, "Value error: Error outputting scalar\n");
+		if (set_scalar(event, target) != 0) {
+			fprintf(stderr, "Value error: Error setting scalar \"%s\"\n",
+				(const char *) event->data.scalar.value);
 			return -1;
 		}
 		break;
 
 	case YAML_SEQUENCE_START_EVENT:
-		if (process_yaml_sequence(parser, event, buf) != 0) {
+		if (target_new_list(target, &list) != GETDNS_RETURN_GOOD
+		||  process_yaml_sequence(parser, event, list) != 0) {
 			return -1;   
 		}
 		break;
 
 	case YAML_MAPPING_START_EVENT:
-		if (process_yaml_mapping(parser, event, buf) != 0) {
+		if (target_new_dict(target, &dict) != GETDNS_RETURN_GOOD
+		||  process_yaml_mapping(parser, event, dict) != 0) {
 			return -1;   
 		}
 		break;
@@ -434,23 +515,83 @@ process_yaml_value(yaml_parser_t *parser, yaml_event_t *event, gldns_buffer *buf
 	return 0;
 }
 
+/*
+ * Plain scalars are interpreted by getdns' own json parser, as a single
+ * element list, so they mean exactly what they would in a json config.
+ * The common cases, numbers and quoted strings, are handled directly.
+ */
 int
-output_scalar(yaml_event_t *event, gldns_buffer *buf)
+set_scalar(yaml_event_t *event, yaml_target *target)
 {
-	const char *fmt = "%s";
+	const char *value = (const char *) event->data.scalar.value;
+	size_t length = event->data.scalar.length;
+	getdns_bindata bindata;
+	getdns_list *list = NULL;
+	getdns_data_type type;
+	char buf[256], *list_str = buf;
+	getdns_return_t r;
+	size_t i;
+	uint64_t n = 0;
 	
 	assert(event);
-	assert(buf);
-	assert(event->data.scalar.length > 0);
-	
-	if (event->data.scalar.style != YAML_PLAIN_SCALAR_STYLE)
-		fmt = "\"%s\"";
+	assert(target);
+
+	if (event->data.scalar.style != YAML_PLAIN_SCALAR_STYLE) {
+		bindata.size = length;
+		bindata.data = (uint8_t *) value;
+		return target_set_bindata(target, &bindata) ? -1 : 0;
+	}
+	for (i = 0; i < length && i < 10 && value[i] >= '0' && value[i] <= '9'; i++)
+		n = n * 10 + (value[i] - '0');
+	if (i > 0 && i == length && n <= UINT32_MAX)
+		return target_set_int(target, (uint32_t) n) ? -1 : 0;
 
-	if ( gldns_buffer_printf(buf, fmt, event->data.scalar.value) == -1 )
+	if (length + 3 > sizeof(buf) && !(list_str = malloc(length + 3)))
 		return -1;
-	return 0;
-}
+	(void) snprintf(list_str, length + 3, "[%s]", value);
+	r = getdns_str2list(list_str, &list);
+	if (list_str != buf)
+		free(list_str);
+	if (r || (r = getdns_list_get_data_type(list, 0, &type))) {
+		getdns_list_destroy(list);
+		return -1;
+	}
+	switch (type) {
+	case t_int: {
+		uint32_t int_value;
+
+		if (!(r = getdns_list_get_int(list, 0, &int_value)))
+			r = target_set_int(target, int_value);
+		break;
+	}
+	case t_bindata: {
+		getdns_bindata *bindata_value;
+
+		if (!(r = getdns_list_get_bindata(list, 0, &bindata_value)))
+			r = target_set_bindata(target, bindata_value);
+		break;
+	}
+	case t_dict: {
+		getdns_dict *dict_value;
+
+		if (!(r = getdns_list_get_dict(list, 0, &dict_value)))
+			r = target_set_dict(target, dict_value);
+		break;
+	}
+	case t_list: {
+		getdns_list *list_value;
 
+		if (!(r = getdns_list_get_list(list, 0, &list_value)))
+			r = target_set_list(target, list_value);
+		break;
+	}
+	default:
+		r = GETDNS_RETURN_WRONG_TYPE_REQUESTED;
+		break;
+	}
+	getdns_list_destroy(list);
+	return r ? -1 : 0;
+}
 void report_parser_error(yaml_parser_t *parser)
 {
 	assert(parser);
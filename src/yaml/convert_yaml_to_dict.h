@@ -25,25 +25,33 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef _CONVERT_YAML_TO_JSON_H
-#define _CONVERT_YAML_TO_JSON_H
+#ifndef _CONVERT_YAML_TO_DICT_H
+#define _CONVERT_YAML_TO_DICT_H
+
+#include <stdio.h>
+#include <getdns/getdns.h>
 
 /**
- * read yaml-syntax data from the string and convert to json-syntax
+ * read yaml-syntax data and build a getdns_dict from it directly, without
+ * going through an intermediate json string.
  * yaml syntax restrictions imposed for getdns:
  *    the outer-most data structure must be a yaml mapping
  *    mapping keys must be yaml scalars
- *    plain scalars are output to the json string unchanged
- *    non-plain scalars (quoted, double-quoted, wrapped) are output double-quoted
+ *    non-plain scalars (quoted, double-quoted, wrapped) become bindata
+ *    plain scalars are interpreted as they would be in json-syntax, i.e.
+ *      numbers become integers and GETDNS_ constants their value,
+ *      ip addresses become address dicts and domain names wire format
  * TODO Test on yaml data containing yaml tags (these are ignored at present)
- *      The code has only been tested on yaml data using indentation style, so it
- *        should be tested on other styles as well.
  * @param instr the string carrying data in yaml syntax
- * @return a string of data in json syntax on success
- * @return NULL if there is a yaml syntax violation
+ * @param fh the file to read the yaml data from
+ * @param dict returns the dict on success, to be destroyed by the caller
+ * @return GETDNS_RETURN_GOOD on success
+ * @return GETDNS_RETURN_GENERIC_ERROR if there is a yaml syntax violation
  *                 the outer-most structure in not a mapping
  *                 a mapping key is complex (a mapping or sequence)
+ *                 a plain scalar could not be interpreted
  */
-char * yaml_string_to_json_string(const char *instr);
+getdns_return_t yaml_string_to_dict(const char *instr, getdns_dict **dict);
+getdns_return_t yaml_file_to_dict(FILE *fh, getdns_dict **dict);
 
-#endif //_CONVERT_YAML_TO_JSON_H
+#endif //_CONVERT_YAML_TO_DICT_H